@@ -0,0 +1,237 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+#define ARENA_POOL_MAX 256
+
+typedef struct arena_chunk {
+  struct arena_chunk *ac_next;
+  size_t ac_size;
+  size_t ac_used;
+  size_t ac_pad;
+  char ac_data[0];
+} arena_chunk_t;
+
+#define CHUNK_PAYLOAD (ARENA_CHUNK_SIZE - sizeof(arena_chunk_t))
+
+static pthread_mutex_t arena_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static arena_chunk_t *arena_pool;
+static int arena_pool_size;
+
+
+/**
+ *
+ */
+static arena_chunk_t *
+arena_chunk_get(void)
+{
+  arena_chunk_t *ac;
+
+  pthread_mutex_lock(&arena_pool_mutex);
+  ac = arena_pool;
+  if(ac != NULL) {
+    arena_pool = ac->ac_next;
+    arena_pool_size--;
+  }
+  pthread_mutex_unlock(&arena_pool_mutex);
+
+  if(ac == NULL) {
+    ac = malloc(ARENA_CHUNK_SIZE);
+    ac->ac_size = CHUNK_PAYLOAD;
+  }
+  ac->ac_used = 0;
+  return ac;
+}
+
+
+/**
+ *
+ */
+void
+arena_init(arena_t *a)
+{
+  a->a_chunks = NULL;
+  a->a_last = NULL;
+}
+
+
+/**
+ *
+ */
+void
+arena_clear(arena_t *a)
+{
+  arena_chunk_t *ac, *next;
+
+  for(ac = a->a_chunks; ac != NULL; ac = next) {
+    next = ac->ac_next;
+
+    if(ac->ac_size == CHUNK_PAYLOAD) {
+      pthread_mutex_lock(&arena_pool_mutex);
+      if(arena_pool_size < ARENA_POOL_MAX) {
+        ac->ac_next = arena_pool;
+        arena_pool = ac;
+        arena_pool_size++;
+        ac = NULL;
+      }
+      pthread_mutex_unlock(&arena_pool_mutex);
+    }
+    free(ac);
+  }
+  arena_init(a);
+}
+
+
+/**
+ *
+ */
+void *
+arena_alloc(arena_t *a, size_t size)
+{
+  arena_chunk_t *ac = a->a_chunks;
+  char *r;
+
+  if(ac != NULL) {
+    const size_t off = (ac->ac_used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    if(off + size <= ac->ac_size) {
+      r = ac->ac_data + off;
+      ac->ac_used = off + size;
+      a->a_last = r;
+      return r;
+    }
+  }
+
+  if(size > CHUNK_PAYLOAD / 4) {
+    // Large allocations get a chunk of their own which is kept behind
+    // the current one so we can continue to fill that
+    arena_chunk_t *big = malloc(sizeof(arena_chunk_t) + size);
+    big->ac_size = size;
+    big->ac_used = size;
+    if(ac != NULL) {
+      big->ac_next = ac->ac_next;
+      ac->ac_next = big;
+    } else {
+      big->ac_next = NULL;
+      a->a_chunks = big;
+    }
+    a->a_last = big->ac_data;
+    return big->ac_data;
+  }
+
+  ac = arena_chunk_get();
+  ac->ac_next = a->a_chunks;
+  a->a_chunks = ac;
+  ac->ac_used = size;
+  a->a_last = ac->ac_data;
+  return ac->ac_data;
+}
+
+
+/**
+ *
+ */
+void *
+arena_zalloc(arena_t *a, size_t size)
+{
+  void *r = arena_alloc(a, size);
+  memset(r, 0, size);
+  return r;
+}
+
+
+/**
+ *
+ */
+char *
+arena_strndup(arena_t *a, const char *str, size_t len)
+{
+  char *r = arena_alloc(a, len + 1);
+  memcpy(r, str, len);
+  r[len] = 0;
+  return r;
+}
+
+
+/**
+ *
+ */
+char *
+arena_strdup(arena_t *a, const char *str)
+{
+  return arena_strndup(a, str, strlen(str));
+}
+
+
+/**
+ *
+ */
+void
+arena_append(arena_t *a, char **dst, const char *src, size_t len)
+{
+  char *s = *dst;
+  if(s == NULL) {
+    *dst = arena_strndup(a, src, len);
+    return;
+  }
+
+  const size_t curlen = strlen(s);
+  arena_chunk_t *ac = a->a_chunks;
+
+  if(s == a->a_last && ac != NULL &&
+     s + curlen + 1 == ac->ac_data + ac->ac_used &&
+     ac->ac_used + len <= ac->ac_size) {
+    memcpy(s + curlen, src, len);
+    s[curlen + len] = 0;
+    ac->ac_used += len;
+    return;
+  }
+
+  char *r = arena_alloc(a, curlen + len + 1);
+  memcpy(r, s, curlen);
+  memcpy(r + curlen, src, len);
+  r[curlen + len] = 0;
+  *dst = r;
+}
+
+
+/**
+ *
+ */
+int
+arena_contains(const arena_t *a, const void *p)
+{
+  const char *c = p;
+  for(const arena_chunk_t *ac = a->a_chunks; ac != NULL; ac = ac->ac_next) {
+    if(c >= ac->ac_data && c < ac->ac_data + ac->ac_size)
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,70 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Bump allocator
+ *
+ * Memory is carved out of chunks that are recycled via a global pool.
+ * Individual allocations can not be freed, everything is released at
+ * once with arena_clear()
+ *
+ * An arena may be moved (struct copied) as long as the old copy is
+ * not used anymore.
+ */
+
+#define ARENA_CHUNK_SIZE 4096
+
+struct arena_chunk;
+
+typedef struct arena {
+  struct arena_chunk *a_chunks;
+  char *a_last;  // Last allocation, can be extended by arena_append()
+} arena_t;
+
+void arena_init(arena_t *a);
+
+void arena_clear(arena_t *a);
+
+void *arena_alloc(arena_t *a, size_t size);
+
+void *arena_zalloc(arena_t *a, size_t size);
+
+char *arena_strdup(arena_t *a, const char *str);
+
+char *arena_strndup(arena_t *a, const char *str, size_t len);
+
+/**
+ * Append 'len' bytes of 'src' to the zero terminated string at *dst
+ * (which may be NULL). The string is extended in place if it's the most
+ * recent allocation in the arena
+ */
+void arena_append(arena_t *a, char **dst, const char *src, size_t len);
+
+/**
+ * Returns non-zero if 'p' points into memory allocated from 'a'
+ */
+int arena_contains(const arena_t *a, const void *p);
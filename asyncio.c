@@ -22,6 +22,7 @@
 ******************************************************************************/
 #include <fcntl.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/param.h>
 #include <netdb.h>
 #include <assert.h>
@@ -34,8 +35,11 @@
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #ifdef __linux__
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #elif defined(__APPLE__)
 #include <sys/event.h>
 #else
@@ -362,8 +366,10 @@ async_fd_release(async_fd_t *af)
   assert(af->af_timer.at_expire == 0);
   assert(af->af_fd == -1);
 
-  if(af->af_flags & AF_SENDQ_MUTEX)
+  if(af->af_flags & AF_SENDQ_MUTEX) {
     pthread_mutex_destroy(&af->af_sendq_mutex);
+    pthread_cond_destroy(&af->af_sendq_cond);
+  }
 
   mbuf_clear(&af->af_sendq);
   mbuf_clear(&af->af_recvq);
@@ -373,17 +379,39 @@ async_fd_release(async_fd_t *af)
 
 
 
+#define ASYNCIO_MAX_IOV 64
+
+/**
+ * Send file segment (see mbuf_append_file())
+ */
+static ssize_t
+send_file_segment(async_fd_t *af, const mbuf_data_t *md)
+{
+  const size_t len = md->md_data_len - md->md_data_off;
+#ifdef __linux__
+  off_t off = md->md_data_off;
+  return sendfile(af->af_fd, md->md_fd, &off, len);
+#else
+  off_t sent = len;
+  if(sendfile(md->md_fd, af->af_fd, md->md_data_off, &sent, NULL, 0) &&
+     sent == 0)
+    return -1;
+  return sent;
+#endif
+}
+
+
 /**
  *
  */
 static void
 do_write(async_fd_t *af)
 {
-  char tmp[1024];
+  struct iovec iov[ASYNCIO_MAX_IOV];
 
   while(1) {
-    int avail = mbuf_peek(&af->af_sendq, tmp, sizeof(tmp));
-    if(avail == 0) {
+    mbuf_data_t *md = TAILQ_FIRST(&af->af_sendq.mq_buffers);
+    if(md == NULL) {
       if(af->af_pending_shutdown) {
         shutdown(af->af_fd, 2);
       }
@@ -392,7 +420,38 @@ do_write(async_fd_t *af)
       return;
     }
 
-    int r = send(af->af_fd, tmp, avail, MSG_NOSIGNAL);
+    if(md->md_data_off == md->md_data_len) {
+      mbuf_data_free(&af->af_sendq, md);
+      continue;
+    }
+
+    size_t avail = 0;
+    ssize_t r;
+
+    if(md->md_data == NULL) {
+      avail = md->md_data_len - md->md_data_off;
+      r = send_file_segment(af, md);
+      if(r == 0) {
+        // File was truncated under our feet, we can't complete the
+        // message so the connection is useless
+        shutdown(af->af_fd, 2);
+        mod_poll_flags(af, 0, EPOLLOUT);
+        return;
+      }
+    } else {
+      // Gather as many memory buffers as possible into one send
+      struct msghdr msg = {.msg_iov = iov};
+      for(; md != NULL && md->md_data != NULL &&
+            msg.msg_iovlen < ASYNCIO_MAX_IOV;
+          md = TAILQ_NEXT(md, md_link)) {
+        iov[msg.msg_iovlen].iov_base = md->md_data + md->md_data_off;
+        iov[msg.msg_iovlen].iov_len  = md->md_data_len - md->md_data_off;
+        avail += iov[msg.msg_iovlen].iov_len;
+        msg.msg_iovlen++;
+      }
+      r = sendmsg(af->af_fd, &msg, MSG_NOSIGNAL);
+    }
+
     if(r == 0)
       break;
 
@@ -405,6 +464,10 @@ do_write(async_fd_t *af)
     }
 
     mbuf_drop(&af->af_sendq, r);
+
+    if(af->af_sendq_waiters && af->af_sendq.mq_size <= af->af_sendq_low)
+      pthread_cond_broadcast(&af->af_sendq_cond);
+
     if(r != avail)
       break;
   }
@@ -426,13 +489,17 @@ do_write_lock(async_fd_t *af)
 
 
 /**
- *
+ * Polling is level triggered so we don't have to drain the socket. Stop
+ * after a while so a fast sender can't starve everyone else and so
+ * consumers get a chance to push back (disable read) in time
  */
+#define ASYNCIO_READ_MAX 65536
+
 static void
 do_read(async_fd_t *af)
 {
   char tmp[1024];
-  while(1) {
+  for(int total = 0; total < ASYNCIO_READ_MAX;) {
     int r = read(af->af_fd, tmp, sizeof(tmp));
     if(r == 0) {
       af->af_error(af->af_opaque, ECONNRESET);
@@ -448,6 +515,7 @@ do_read(async_fd_t *af)
     }
 
     mbuf_append(&af->af_recvq, tmp, r);
+    total += r;
   }
 
   af->af_bytes_avail(af->af_opaque, &af->af_recvq);
@@ -671,6 +739,9 @@ asyncio_close(async_fd_t *af)
     af->af_fd = -1;
   }
 
+  if(af->af_sendq_waiters)
+    pthread_cond_broadcast(&af->af_sendq_cond);
+
   if(af->af_flags & AF_SENDQ_MUTEX)
     pthread_mutex_unlock(&af->af_sendq_mutex);
   else
@@ -805,6 +876,62 @@ asyncio_sendq(async_fd_t *af, mbuf_t *q, int cork)
 }
 
 
+/**
+ *
+ */
+int
+asyncio_sendq_wait(async_fd_t *af, size_t high, size_t low, int timeout)
+{
+  int rval = 0;
+
+  assert(af->af_flags & AF_SENDQ_MUTEX);
+  assert(pthread_self() != asyncio_tid);
+
+  pthread_mutex_lock(&af->af_sendq_mutex);
+
+  if(af->af_sendq.mq_size > high) {
+    af->af_sendq_low = low;
+    af->af_sendq_waiters++;
+
+    while(af->af_fd != -1 && af->af_sendq.mq_size > low) {
+      const size_t before = af->af_sendq.mq_size;
+      struct timespec ts;
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_sec += timeout;
+
+      if(pthread_cond_timedwait(&af->af_sendq_cond, &af->af_sendq_mutex,
+                                &ts) == ETIMEDOUT &&
+         af->af_sendq.mq_size == before) {
+        rval = -1;
+        break;
+      }
+    }
+    af->af_sendq_waiters--;
+  }
+
+  if(af->af_fd == -1)
+    rval = -1;
+
+  pthread_mutex_unlock(&af->af_sendq_mutex);
+  return rval;
+}
+
+
+/**
+ *
+ */
+size_t
+asyncio_sendq_size(async_fd_t *af)
+{
+  if(af->af_flags & AF_SENDQ_MUTEX)
+    pthread_mutex_lock(&af->af_sendq_mutex);
+  const size_t size = af->af_fd != -1 ? af->af_sendq.mq_size : 0;
+  if(af->af_flags & AF_SENDQ_MUTEX)
+    pthread_mutex_unlock(&af->af_sendq_mutex);
+  return size;
+}
+
+
 /**
  *
  */
@@ -960,6 +1087,7 @@ asyncio_stream_mt(int fd,
 
   af->af_flags = AF_SENDQ_MUTEX;
   pthread_mutex_init(&af->af_sendq_mutex, NULL);
+  pthread_cond_init(&af->af_sendq_cond, NULL);
 
   af->af_pollin  = &do_read;
   af->af_pollout = &do_write_lock;
@@ -991,6 +1119,43 @@ asyncio_enable_read(async_fd_t *af)
 }
 
 
+/**
+ *
+ */
+void
+asyncio_detach(async_fd_t *af)
+{
+  assert(pthread_self() == asyncio_tid);
+  af->af_opaque = NULL;
+}
+
+
+/**
+ *
+ */
+void
+asyncio_redeliver(async_fd_t *af)
+{
+  assert(pthread_self() == asyncio_tid);
+
+  if(af->af_opaque != NULL && af->af_recvq.mq_size)
+    af->af_bytes_avail(af->af_opaque, &af->af_recvq);
+}
+
+
+/**
+ *
+ */
+int
+asyncio_is_connected(async_fd_t *af)
+{
+  struct sockaddr_storage ss;
+  socklen_t len = sizeof(ss);
+  return af->af_fd != -1 &&
+    !getpeername(af->af_fd, (struct sockaddr *)&ss, &len);
+}
+
+
 /**
  *
  */
@@ -94,6 +94,9 @@ typedef struct async_fd {
   asyncio_timer_t af_timer;
 
   pthread_mutex_t af_sendq_mutex;
+  pthread_cond_t af_sendq_cond;  // Signalled when send queue drains
+  size_t af_sendq_low;
+  int af_sendq_waiters;
 
   atomic_t af_refcount;
   int af_fd;
@@ -146,6 +149,19 @@ int asyncio_sendq(async_fd_t *af, mbuf_t *hq, int cork);
 int asyncio_sendq_with_hdr(async_fd_t *af, const void *hdr_buf, size_t hdr_len,
                            mbuf_t *q, int cork);
 
+/**
+ * Flow control for producers. If more than 'high' bytes are queued for
+ * sending, block until it's down to 'low'. Only for sockets created with
+ * asyncio_stream_mt() and must not be called from the asyncio thread.
+ *
+ * Returns -1 if the socket is closed or if nothing could be sent for
+ * 'timeout' seconds
+ */
+int asyncio_sendq_wait(async_fd_t *af, size_t high, size_t low, int timeout);
+
+// Bytes queued but not yet written to the socket, 0 once it's closed
+size_t asyncio_sendq_size(async_fd_t *af);
+
 void asyncio_send_lock(async_fd_t *af);
 
 void asyncio_send_unlock(async_fd_t *af);
@@ -161,6 +177,15 @@ void asyncio_disable_read(async_fd_t *fd);
 
 void asyncio_shutdown(async_fd_t *fd);
 
+// Callbacks still pending for the socket are invoked with a NULL opaque
+void asyncio_detach(async_fd_t *af);
+
+// Hand received but unconsumed bytes to the read callback again
+void asyncio_redeliver(async_fd_t *af);
+
+// Non-zero once a non-blocking connect has completed
+int asyncio_is_connected(async_fd_t *af);
+
 void async_fd_retain(async_fd_t *af);
 
 void async_fd_release(async_fd_t *af);
@@ -37,6 +37,12 @@ atomic_set(atomic_t *a, int v)
   return a->v = v;
 }
 
+static inline int
+atomic_cas(atomic_t *a, int oldval, int newval)
+{
+  return __sync_bool_compare_and_swap(&a->v, oldval, newval);
+}
+
 
 #else
 #error Missing atomic ops
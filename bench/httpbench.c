@@ -0,0 +1,1082 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+/**
+ * HTTP server benchmark
+ *
+ * Forks a server process with a set of synthetic routes and drives it
+ * over loopback from an asyncio based load generator in the parent.
+ * Each scenario runs for a warmup period followed by a measurement
+ * window. Results are written as JSON so runs can be compared across
+ * releases.
+ *
+ *  httpbench [-c connections] [-p pipeline] [-d seconds] [-w seconds]
+ *            [-t tiny,echo,large,cached,mix,websocket] [-s large-size]
+ *            [-f server-config] [-o output]
+ */
+
+#define _GNU_SOURCE
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <errno.h>
+
+#include "libsvc.h"
+#include "asyncio.h"
+#include "cfg.h"
+#include "http.h"
+#include "ntv.h"
+#include "misc.h"
+#include "sock.h"
+
+#define BENCH_MAX_PIPELINE  64
+#define BENCH_HDR_MAX       8192
+#define BENCH_MIX_KEEPALIVE 50  // Requests per connection in the mix scenario
+#define BENCH_WS_PAYLOAD    32
+
+static void *large_response;
+static int large_response_size = 256 * 1024;
+
+
+/**************************************************************************
+ * Server side
+ **************************************************************************/
+
+/**
+ *
+ */
+static int
+bench_tiny(http_request_t *hr, int argc, char **argv, int flags)
+{
+  mbuf_append(&hr->hr_reply, "ok\n", 3);
+  return http_send_reply(hr, 200, "text/plain", NULL, NULL, 0);
+}
+
+
+/**
+ *
+ */
+static int
+bench_echo(http_request_t *hr, int argc, char **argv, int flags)
+{
+  if(hr->hr_post_message == NULL)
+    return 400;
+  ntv_json_serialize(hr->hr_post_message, &hr->hr_reply, 0);
+  return http_send_reply(hr, 200, "application/json", NULL, NULL, 0);
+}
+
+
+/**
+ *
+ */
+static int
+bench_large(http_request_t *hr, int argc, char **argv, int flags)
+{
+  int size = http_arg_get_int(&hr->hr_query_args, "size",
+                              large_response_size);
+  size = MIN(MAX(size, 0), large_response_size);
+  mbuf_append(&hr->hr_reply, large_response, size);
+  return http_send_reply(hr, 200, "application/octet-stream", NULL, NULL, 0);
+}
+
+
+/**
+ * Same document each time, served from the micro-cache
+ */
+static int
+bench_cached(http_request_t *hr, int argc, char **argv, int flags)
+{
+  ntv_t *doc = ntv_create_map();
+  ntv_t *items = ntv_create_list();
+  for(int i = 0; i < 50; i++) {
+    ntv_t *item = ntv_create_map();
+    ntv_set_int(item, "id", i);
+    ntv_set_strf(item, "name", "item %d", i);
+    ntv_set_ntv(items, NULL, item);
+  }
+  ntv_set_ntv(doc, "items", items);
+  ntv_json_serialize(doc, &hr->hr_reply, 0);
+  ntv_release(doc);
+  return http_send_reply(hr, 200, "application/json", NULL, NULL, 0);
+}
+
+
+/**
+ *
+ */
+static int
+bench_ws_connected(http_request_t *hr)
+{
+  return websocket_session_start(hr, hr->hr_connection, NULL, 0);
+}
+
+
+/**
+ *
+ */
+static void
+bench_ws_receive(void *opaque, int opcode, const uint8_t *data, size_t len)
+{
+  websocket_send(opaque, opcode, data, len);
+}
+
+
+/**
+ *
+ */
+static void
+bench_ws_disconnected(void *opaque, int error)
+{
+}
+
+
+/**
+ * Runs in the forked child, reports readiness on 'readyfd'
+ */
+static void
+bench_server(int readyfd)
+{
+  prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+  libsvc_init();
+
+  http_route_add("/tiny$", bench_tiny, 0);
+  http_route_add_method("/echo$", HTTP_POST, bench_echo, 0);
+  http_route_add("/large$", bench_large, 0);
+  http_route_add_cached("/cached$", bench_cached, 0, 1000, NULL);
+  websocket_route_add("/ws", bench_ws_connected, bench_ws_receive,
+                      bench_ws_disconnected);
+
+  char ok = http_server_init(NULL) != NULL;
+  if(write(readyfd, &ok, 1) != 1 || !ok)
+    exit(1);
+  close(readyfd);
+
+  while(1)
+    pause();
+}
+
+
+/**************************************************************************
+ * Load generator
+ **************************************************************************/
+
+struct bench_conn;
+
+typedef struct bench_scenario {
+  const char *bs_name;
+  // Append one request to 'out', return 1 if it is the last one
+  // to be sent on the connection
+  int (*bs_request)(struct bench_conn *bc, mbuf_t *out);
+  int bs_websocket;
+} bench_scenario_t;
+
+
+LIST_HEAD(bench_conn_list, bench_conn);
+
+typedef struct bench {
+  const bench_scenario_t *b_scenario;
+  struct bench_conn_list b_conns;
+  pid_t b_server_pid;
+  int b_port;
+  int b_connections;
+  int b_pipeline;
+  int b_running;
+  int b_measuring;
+
+  int64_t b_requests;
+  int64_t b_errors;
+  int64_t b_bytes;
+  int64_t b_connects;
+
+  uint32_t *b_latency;
+  size_t b_latency_count;
+  size_t b_latency_capacity;
+
+  int64_t b_start;
+  int64_t b_stop;
+  int64_t b_server_cpu;
+  int64_t b_client_cpu;
+} bench_t;
+
+
+typedef struct bench_conn {
+  LIST_ENTRY(bench_conn) bc_link;
+  bench_t *bc_bench;
+  async_fd_t *bc_af;
+  int64_t bc_sent[BENCH_MAX_PIPELINE];
+  unsigned int bc_rd;
+  unsigned int bc_wr;
+  int bc_issued;
+  int bc_status;
+  int64_t bc_body;   // Body bytes left of current response, -1 for header
+  int bc_last;       // Last request on this connection has been sent
+  int bc_upgraded;
+} bench_conn_t;
+
+
+static const char bench_echo_body[] =
+  "{\"id\":1234,\"name\":\"benchmark\",\"tags\":[\"a\",\"b\",\"c\"],"
+  "\"active\":true,\"score\":12.5}";
+
+#define BENCH_REQ_TINY \
+  "GET /tiny HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+#define BENCH_REQ_TINY_CLOSE \
+  "GET /tiny HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n"
+
+#define BENCH_REQ_MEDIUM \
+  "GET /large?size=16384 HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+#define BENCH_REQ_LARGE \
+  "GET /large HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+#define BENCH_REQ_CACHED \
+  "GET /cached HTTP/1.1\r\nHost: localhost\r\n\r\n"
+
+static char bench_req_echo_buf[512];
+static int bench_req_echo_len;
+
+static uint8_t bench_ws_frame[2 + 4 + BENCH_WS_PAYLOAD];
+
+
+/**
+ *
+ */
+static int
+bench_req_tiny(bench_conn_t *bc, mbuf_t *out)
+{
+  mbuf_append(out, BENCH_REQ_TINY, strlen(BENCH_REQ_TINY));
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+bench_req_echo(bench_conn_t *bc, mbuf_t *out)
+{
+  mbuf_append(out, bench_req_echo_buf, bench_req_echo_len);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+bench_req_large(bench_conn_t *bc, mbuf_t *out)
+{
+  mbuf_append(out, BENCH_REQ_LARGE, strlen(BENCH_REQ_LARGE));
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+bench_req_cached(bench_conn_t *bc, mbuf_t *out)
+{
+  mbuf_append(out, BENCH_REQ_CACHED, strlen(BENCH_REQ_CACHED));
+  return 0;
+}
+
+
+/**
+ * Mostly small requests over long lived connections, every connection
+ * is closed by the server after BENCH_MIX_KEEPALIVE requests
+ */
+static int
+bench_req_mix(bench_conn_t *bc, mbuf_t *out)
+{
+  int n = bc->bc_issued++;
+
+  if(n + 1 == BENCH_MIX_KEEPALIVE) {
+    mbuf_append(out, BENCH_REQ_TINY_CLOSE, strlen(BENCH_REQ_TINY_CLOSE));
+    return 1;
+  }
+
+  switch(n & 7) {
+  case 2:
+  case 6:
+    return bench_req_echo(bc, out);
+  case 4:
+    mbuf_append(out, BENCH_REQ_MEDIUM, strlen(BENCH_REQ_MEDIUM));
+    return 0;
+  default:
+    return bench_req_tiny(bc, out);
+  }
+}
+
+
+/**
+ *
+ */
+static int
+bench_req_websocket(bench_conn_t *bc, mbuf_t *out)
+{
+  mbuf_append(out, bench_ws_frame, sizeof(bench_ws_frame));
+  return 0;
+}
+
+
+static const bench_scenario_t bench_scenarios[] = {
+  { "tiny",      bench_req_tiny },
+  { "echo",      bench_req_echo },
+  { "large",     bench_req_large },
+  { "cached",    bench_req_cached },
+  { "mix",       bench_req_mix },
+  { "websocket", bench_req_websocket, 1 },
+};
+
+
+/**
+ *
+ */
+static void
+bench_requests_init(void)
+{
+  bench_req_echo_len =
+    snprintf(bench_req_echo_buf, sizeof(bench_req_echo_buf),
+             "POST /echo HTTP/1.1\r\n"
+             "Host: localhost\r\n"
+             "Content-Type: application/json\r\n"
+             "Content-Length: %zd\r\n"
+             "\r\n%s",
+             strlen(bench_echo_body), bench_echo_body);
+
+  const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+  bench_ws_frame[0] = 0x81; // FIN + text
+  bench_ws_frame[1] = 0x80 | BENCH_WS_PAYLOAD;
+  memcpy(bench_ws_frame + 2, mask, 4);
+  for(int i = 0; i < BENCH_WS_PAYLOAD; i++)
+    bench_ws_frame[6 + i] = ('a' + i % 26) ^ mask[i & 3];
+}
+
+
+/**
+ * CPU time consumed by a process in µs
+ */
+static int64_t
+bench_server_cpu(pid_t pid)
+{
+  char path[64];
+  char buf[1024];
+  unsigned long long utime, stime;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  FILE *fp = fopen(path, "r");
+  if(fp == NULL)
+    return 0;
+  char *s = fgets(buf, sizeof(buf), fp);
+  fclose(fp);
+  if(s == NULL || (s = strrchr(buf, ')')) == NULL)
+    return 0;
+
+  if(sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+            &utime, &stime) != 2)
+    return 0;
+
+  return (utime + stime) * 1000000LL / sysconf(_SC_CLK_TCK);
+}
+
+
+/**
+ *
+ */
+static int64_t
+bench_client_cpu(void)
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return
+    ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec +
+    ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+}
+
+
+static int bench_conn_open(bench_conn_t *bc);
+
+
+/**
+ *
+ */
+static void
+bench_record(bench_t *b, int64_t latency, int ok)
+{
+  if(!b->b_measuring)
+    return;
+
+  b->b_requests++;
+  if(!ok)
+    b->b_errors++;
+
+  if(b->b_latency_count == b->b_latency_capacity) {
+    b->b_latency_capacity = MAX(b->b_latency_capacity * 2, 65536);
+    b->b_latency = realloc(b->b_latency,
+                           b->b_latency_capacity * sizeof(uint32_t));
+  }
+  b->b_latency[b->b_latency_count++] = MIN(latency, UINT32_MAX);
+}
+
+
+/**
+ * Returns 0 if more data is needed, 1 when a response is complete and
+ * -1 on protocol errors
+ */
+static int
+bench_parse_http(bench_conn_t *bc, mbuf_t *mq)
+{
+  char hdr[BENCH_HDR_MAX + 1];
+
+  if(bc->bc_body == -1) {
+    size_t len = mbuf_peek(mq, hdr, 512);
+    hdr[len] = 0;
+    char *end = strstr(hdr, "\r\n\r\n");
+    if(end == NULL && len == 512) {
+      len = mbuf_peek(mq, hdr, BENCH_HDR_MAX);
+      hdr[len] = 0;
+      end = strstr(hdr, "\r\n\r\n");
+    }
+    if(end == NULL)
+      return len == BENCH_HDR_MAX ? -1 : 0;
+    end[2] = 0;
+
+    if(strncmp(hdr, "HTTP/1.", 7) || strlen(hdr) < 12)
+      return -1;
+    bc->bc_status = atoi(hdr + 9);
+
+    if(strcasestr(hdr, "\r\ntransfer-encoding:") != NULL)
+      return -1;
+
+    const char *cl = strcasestr(hdr, "\r\ncontent-length:");
+    bc->bc_body = cl != NULL ? strtoll(cl + 17, NULL, 10) : 0;
+    mbuf_drop(mq, end + 4 - hdr);
+  }
+
+  bc->bc_body -= mbuf_drop(mq, bc->bc_body);
+  if(bc->bc_body > 0)
+    return 0;
+  bc->bc_body = -1;
+  return 1;
+}
+
+
+/**
+ *
+ */
+static int
+bench_parse_websocket(bench_conn_t *bc, mbuf_t *mq)
+{
+  uint8_t h[10];
+  size_t len = mbuf_peek(mq, h, sizeof(h));
+  int hlen = 2;
+
+  if(len < 2)
+    return 0;
+
+  if(h[1] & 0x80)
+    return -1; // Server must not mask
+
+  uint64_t plen = h[1] & 0x7f;
+  if(plen == 126) {
+    if(len < 4)
+      return 0;
+    plen = h[2] << 8 | h[3];
+    hlen = 4;
+  } else if(plen == 127) {
+    if(len < 10)
+      return 0;
+    plen = 0;
+    for(int i = 0; i < 8; i++)
+      plen = plen << 8 | h[2 + i];
+    hlen = 10;
+  }
+
+  if(mq->mq_size < hlen + plen)
+    return 0;
+  mbuf_drop(mq, hlen + plen);
+  return (h[0] & 0xf) == 1 ? 1 : -1;
+}
+
+
+/**
+ * Consume complete responses, returns -1 on protocol error
+ */
+static int
+bench_conn_input(bench_conn_t *bc, mbuf_t *mq)
+{
+  bench_t *b = bc->bc_bench;
+  size_t size = mq->mq_size;
+  int r = 0;
+
+  while(1) {
+    if(bc->bc_upgraded) {
+      r = bench_parse_websocket(bc, mq);
+    } else {
+      r = bench_parse_http(bc, mq);
+      if(r == 1 && b->b_scenario->bs_websocket) {
+        // Handshake reply
+        if(bc->bc_status != 101) {
+          r = -1;
+          break;
+        }
+        bc->bc_upgraded = 1;
+        continue;
+      }
+    }
+
+    if(r != 1)
+      break;
+
+    if(bc->bc_rd == bc->bc_wr) {
+      r = -1;
+      break;
+    }
+
+    int64_t sent = bc->bc_sent[bc->bc_rd++ % BENCH_MAX_PIPELINE];
+    int ok = bc->bc_upgraded || (bc->bc_status >= 200 && bc->bc_status < 300);
+    bench_record(b, asyncio_now() - sent, ok);
+  }
+
+  if(b->b_measuring)
+    b->b_bytes += size - mq->mq_size;
+  return r < 0 ? -1 : 0;
+}
+
+
+/**
+ * Keep the pipeline full
+ */
+static void
+bench_conn_fill(bench_conn_t *bc)
+{
+  bench_t *b = bc->bc_bench;
+  mbuf_t out;
+
+  if(b->b_scenario->bs_websocket && !bc->bc_upgraded)
+    return;
+
+  mbuf_init(&out);
+  while(b->b_running && !bc->bc_last &&
+        bc->bc_wr - bc->bc_rd < b->b_pipeline) {
+    bc->bc_sent[bc->bc_wr++ % BENCH_MAX_PIPELINE] = asyncio_now();
+    bc->bc_last = b->b_scenario->bs_request(bc, &out);
+  }
+
+  if(out.mq_size)
+    asyncio_sendq(bc->bc_af, &out, 0);
+  else
+    mbuf_clear(&out);
+}
+
+
+/**
+ *
+ */
+static void
+bench_conn_close(bench_conn_t *bc, int error)
+{
+  bench_t *b = bc->bc_bench;
+
+  if(error && b->b_measuring)
+    b->b_errors++;
+
+  asyncio_close(bc->bc_af);
+  bc->bc_af = NULL;
+
+  if(b->b_running && bench_conn_open(bc))
+    b->b_running = 0;
+}
+
+
+/**
+ *
+ */
+static void
+bench_conn_read(void *opaque, mbuf_t *mq)
+{
+  bench_conn_t *bc = opaque;
+
+  if(bc->bc_af == NULL)
+    return;
+
+  if(bench_conn_input(bc, mq)) {
+    bench_conn_close(bc, 1);
+    return;
+  }
+
+  if(bc->bc_last && bc->bc_rd == bc->bc_wr) {
+    bench_conn_close(bc, 0);
+    return;
+  }
+
+  bench_conn_fill(bc);
+}
+
+
+/**
+ *
+ */
+static void
+bench_conn_error(void *opaque, int error)
+{
+  bench_conn_t *bc = opaque;
+
+  if(bc->bc_af == NULL)
+    return;
+
+  // Responses that arrived together with the FIN are still queued
+  int err = bench_conn_input(bc, &bc->bc_af->af_recvq);
+
+  bench_conn_close(bc, err || !bc->bc_last || bc->bc_rd != bc->bc_wr);
+}
+
+
+/**
+ * Loopback connects complete right away so a blocking connect is fine
+ */
+static int
+bench_conn_open(bench_conn_t *bc)
+{
+  bench_t *b = bc->bc_bench;
+  struct sockaddr_in sin = {
+    .sin_family = AF_INET,
+    .sin_port = htons(b->b_port),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+
+  int fd = libsvc_socket(AF_INET, SOCK_STREAM, 0);
+  if(fd == -1)
+    return -1;
+
+  if(connect(fd, (struct sockaddr *)&sin, sizeof(sin))) {
+    fprintf(stderr, "httpbench: connect: %s\n", strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  bc->bc_rd = bc->bc_wr = 0;
+  bc->bc_issued = 0;
+  bc->bc_body = -1;
+  bc->bc_last = 0;
+  bc->bc_upgraded = 0;
+  bc->bc_af = asyncio_stream(fd, bench_conn_read, bench_conn_error, bc);
+  b->b_connects++;
+
+  if(b->b_scenario->bs_websocket) {
+    const char *req =
+      "GET /ws HTTP/1.1\r\n"
+      "Host: localhost\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: websocket\r\n"
+      "Sec-WebSocket-Version: 13\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+      "\r\n";
+    asyncio_send(bc->bc_af, req, strlen(req), 0);
+  }
+
+  bench_conn_fill(bc);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+bench_conns_free(bench_t *b)
+{
+  bench_conn_t *bc;
+  while((bc = LIST_FIRST(&b->b_conns)) != NULL) {
+    LIST_REMOVE(bc, bc_link);
+    free(bc);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+bench_start(void *aux)
+{
+  bench_t *b = aux;
+
+  bench_conns_free(b);
+  b->b_running = 1;
+  for(int i = 0; i < b->b_connections && b->b_running; i++) {
+    bench_conn_t *bc = calloc(1, sizeof(bench_conn_t));
+    bc->bc_bench = b;
+    LIST_INSERT_HEAD(&b->b_conns, bc, bc_link);
+    if(bench_conn_open(bc))
+      b->b_running = 0;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+bench_measure_begin(void *aux)
+{
+  bench_t *b = aux;
+  b->b_measuring = 1;
+  b->b_server_cpu = bench_server_cpu(b->b_server_pid);
+  b->b_client_cpu = bench_client_cpu();
+  b->b_start = asyncio_now();
+}
+
+
+/**
+ *
+ */
+static void
+bench_measure_end(void *aux)
+{
+  bench_t *b = aux;
+  b->b_stop = asyncio_now();
+  b->b_server_cpu = bench_server_cpu(b->b_server_pid) - b->b_server_cpu;
+  b->b_client_cpu = bench_client_cpu() - b->b_client_cpu;
+  b->b_measuring = 0;
+}
+
+
+/**
+ * Connections are kept around until the next run as events for
+ * the closed fds may already be pending in this loop iteration
+ */
+static void
+bench_stop(void *aux)
+{
+  bench_t *b = aux;
+  bench_conn_t *bc;
+
+  b->b_running = 0;
+  LIST_FOREACH(bc, &b->b_conns, bc_link) {
+    if(bc->bc_af != NULL)
+      asyncio_close(bc->bc_af);
+    bc->bc_af = NULL;
+  }
+}
+
+
+/**
+ *
+ */
+static int
+latency_cmp(const void *A, const void *B)
+{
+  uint32_t a = *(const uint32_t *)A;
+  uint32_t b = *(const uint32_t *)B;
+  return a < b ? -1 : a > b;
+}
+
+
+/**
+ *
+ */
+static ntv_t *
+bench_result(const bench_t *b)
+{
+  ntv_t *r = ntv_create_map();
+  ntv_t *lat = ntv_create_map();
+  double seconds = (b->b_stop - b->b_start) / 1000000.0;
+  size_t n = b->b_latency_count;
+
+  ntv_set_str(r, "scenario", b->b_scenario->bs_name);
+  ntv_set_int64(r, "requests", b->b_requests);
+  ntv_set_int64(r, "errors", b->b_errors);
+  ntv_set_int64(r, "connects", b->b_connects);
+  ntv_set_int64(r, "bytes", b->b_bytes);
+  ntv_set_double(r, "seconds", seconds);
+  ntv_set_double(r, "requestsPerSecond", b->b_requests / seconds);
+  ntv_set_double(r, "megabytesPerSecond", b->b_bytes / seconds / 1e6);
+
+  if(n > 0) {
+    uint64_t sum = 0;
+    qsort(b->b_latency, n, sizeof(uint32_t), latency_cmp);
+    for(size_t i = 0; i < n; i++)
+      sum += b->b_latency[i];
+    ntv_set_double(lat, "mean", (double)sum / n);
+    ntv_set_int64(lat, "p50",  b->b_latency[(size_t)((n - 1) * 0.50)]);
+    ntv_set_int64(lat, "p90",  b->b_latency[(size_t)((n - 1) * 0.90)]);
+    ntv_set_int64(lat, "p99",  b->b_latency[(size_t)((n - 1) * 0.99)]);
+    ntv_set_int64(lat, "p999", b->b_latency[(size_t)((n - 1) * 0.999)]);
+    ntv_set_int64(lat, "max",  b->b_latency[n - 1]);
+  }
+  ntv_set_ntv(r, "latencyUs", lat);
+
+  if(b->b_requests > 0) {
+    ntv_set_double(r, "serverCpuUsPerRequest",
+                   (double)b->b_server_cpu / b->b_requests);
+    ntv_set_double(r, "clientCpuUsPerRequest",
+                   (double)b->b_client_cpu / b->b_requests);
+  }
+  return r;
+}
+
+
+/**
+ *
+ */
+static ntv_t *
+bench_run(bench_t *b, const bench_scenario_t *bs, int warmup, int duration)
+{
+  b->b_scenario = bs;
+  b->b_requests = 0;
+  b->b_errors = 0;
+  b->b_bytes = 0;
+  b->b_connects = 0;
+  b->b_latency_count = 0;
+
+  asyncio_run_task_blocking(bench_start, b);
+  usleep(warmup * 1000000);
+  asyncio_run_task_blocking(bench_measure_begin, b);
+  usleep(duration * 1000000);
+  asyncio_run_task_blocking(bench_measure_end, b);
+  asyncio_run_task_blocking(bench_stop, b);
+
+  // Let the server finish tearing down the connections
+  usleep(100000);
+  return bench_result(b);
+}
+
+
+/**
+ *
+ */
+static int
+bench_free_port(void)
+{
+  struct sockaddr_in sin = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+  };
+  socklen_t slen = sizeof(sin);
+  int port = -1;
+
+  int fd = libsvc_socket(AF_INET, SOCK_STREAM, 0);
+  if(fd == -1)
+    return -1;
+
+  if(!bind(fd, (struct sockaddr *)&sin, sizeof(sin)) &&
+     !getsockname(fd, (struct sockaddr *)&sin, &slen))
+    port = ntohs(sin.sin_port);
+  close(fd);
+  return port;
+}
+
+
+/**
+ *
+ */
+static void
+usage(void)
+{
+  fprintf(stderr,
+          "Usage: httpbench [options]\n"
+          "  -c <num>     Concurrent connections (64)\n"
+          "  -p <num>     Requests pipelined per connection (1, max %d)\n"
+          "  -d <sec>     Measurement duration per scenario (5)\n"
+          "  -w <sec>     Warmup per scenario (1)\n"
+          "  -t <list>    Comma separated scenarios "
+          "(tiny,echo,large,cached,mix,websocket)\n"
+          "  -s <bytes>   Size of the large response (262144)\n"
+          "  -f <file>    Server config, 'http.port' is used\n"
+          "  -o <file>    Write JSON result to file instead of stdout\n",
+          BENCH_MAX_PIPELINE);
+  exit(1);
+}
+
+
+/**
+ *
+ */
+int
+main(int argc, char **argv)
+{
+  char errbuf[512];
+  const char *scenarios = "tiny,echo,large,cached,mix,websocket";
+  const char *cfgfile = NULL;
+  const char *output = NULL;
+  int warmup = 1;
+  int duration = 5;
+  int c;
+  bench_t b = {
+    .b_connections = 64,
+    .b_pipeline = 1,
+  };
+
+  while((c = getopt(argc, argv, "c:p:d:w:t:s:f:o:h")) != -1) {
+    switch(c) {
+    case 'c':
+      b.b_connections = atoi(optarg);
+      break;
+    case 'p':
+      b.b_pipeline = atoi(optarg);
+      break;
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 'w':
+      warmup = atoi(optarg);
+      break;
+    case 't':
+      scenarios = optarg;
+      break;
+    case 's':
+      large_response_size = atoi(optarg);
+      break;
+    case 'f':
+      cfgfile = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(b.b_connections < 1 || duration < 1 || warmup < 0 ||
+     b.b_pipeline < 1 || b.b_pipeline > BENCH_MAX_PIPELINE ||
+     large_response_size < 0)
+    usage();
+
+  if(cfgfile != NULL) {
+    if(cfg_load(cfgfile, errbuf, sizeof(errbuf))) {
+      fprintf(stderr, "httpbench: %s\n", errbuf);
+      exit(1);
+    }
+    cfg_root(cr);
+    b.b_port = cfg_get_int(cr, CFG("http", "port"), 9000);
+  } else {
+    char path[] = "/tmp/httpbench-XXXXXX";
+    int fd = mkstemp(path);
+    b.b_port = bench_free_port();
+    if(fd == -1 || b.b_port == -1) {
+      fprintf(stderr, "httpbench: Unable to setup server config\n");
+      exit(1);
+    }
+    dprintf(fd, "{\"http\":{\"port\":%d,\"bindAddress\":\"127.0.0.1\"}}\n",
+            b.b_port);
+    close(fd);
+    int err = cfg_load(path, errbuf, sizeof(errbuf));
+    unlink(path);
+    if(err) {
+      fprintf(stderr, "httpbench: %s\n", errbuf);
+      exit(1);
+    }
+  }
+
+  large_response = malloc(large_response_size ?: 1);
+  for(int i = 0; i < large_response_size; i++)
+    ((char *)large_response)[i] = 'A' + i % 26;
+  bench_requests_init();
+
+  signal(SIGPIPE, SIG_IGN);
+
+  int pfd[2];
+  char ready = 0;
+  if(pipe(pfd)) {
+    perror("pipe");
+    exit(1);
+  }
+
+  b.b_server_pid = fork();
+  if(b.b_server_pid == -1) {
+    perror("fork");
+    exit(1);
+  }
+
+  if(b.b_server_pid == 0) {
+    close(pfd[0]);
+    bench_server(pfd[1]);
+  }
+
+  close(pfd[1]);
+  if(read(pfd[0], &ready, 1) != 1 || !ready) {
+    fprintf(stderr, "httpbench: Server failed to start\n");
+    exit(1);
+  }
+  close(pfd[0]);
+
+  libsvc_init();
+
+  ntv_t *result = ntv_create_map();
+  ntv_t *list = ntv_create_list();
+  ntv_set_int(result, "connections", b.b_connections);
+  ntv_set_int(result, "pipeline", b.b_pipeline);
+  ntv_set_int(result, "duration", duration);
+  ntv_set_int(result, "warmup", warmup);
+  ntv_set_int(result, "largeSize", large_response_size);
+
+  char *names = mystrdupa(scenarios);
+  char *name, *saveptr;
+  for(name = strtok_r(names, ",", &saveptr); name != NULL;
+      name = strtok_r(NULL, ",", &saveptr)) {
+    const bench_scenario_t *bs = NULL;
+    for(int i = 0; i < ARRAYSIZE(bench_scenarios); i++)
+      if(!strcmp(bench_scenarios[i].bs_name, name))
+        bs = &bench_scenarios[i];
+    if(bs == NULL) {
+      fprintf(stderr, "httpbench: Unknown scenario %s\n", name);
+      continue;
+    }
+    fprintf(stderr, "httpbench: Running %s\n", name);
+    ntv_set_ntv(list, NULL, bench_run(&b, bs, warmup, duration));
+  }
+  ntv_set_ntv(result, "results", list);
+
+  kill(b.b_server_pid, SIGTERM);
+  waitpid(b.b_server_pid, NULL, 0);
+
+  char *json = ntv_json_serialize_to_str(result, 1);
+  FILE *fp = output ? fopen(output, "w") : stdout;
+  if(fp == NULL) {
+    perror(output);
+    exit(1);
+  }
+  fprintf(fp, "%s\n", json);
+  if(fp != stdout)
+    fclose(fp);
+  free(json);
+  ntv_release(result);
+  bench_conns_free(&b);
+  free(b.b_latency);
+  return 0;
+}
@@ -0,0 +1,631 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+/**
+ * Self-checks for the HTTP parsers that take untrusted input
+ *
+ * Valid input is fed in every possible split (and one byte at a time)
+ * and must give the same result as when it's fed in one piece.
+ * Malformed input must be rejected no matter how it's split. Exits
+ * with an error message on the first failure.
+ *
+ *  httpcheck
+ */
+
+#define _GNU_SOURCE
+#include <sys/param.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbuf.h"
+#include "http2.h"
+#include "http_head.h"
+#include "http_multipart.h"
+
+
+/**
+ *
+ */
+static void __attribute__((noreturn, format(printf, 1, 2)))
+check_fail(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "httpcheck: ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+
+/**************************************************************************
+ * HPACK
+ **************************************************************************/
+
+/**
+ * RFC 7541 C.3 and C.4, the same three requests without and with
+ * Huffman coding. Decoded with one table they exercise indexing of
+ * both the static and the dynamic table
+ */
+static const struct {
+  const char *block;
+  int len;
+  const char *expected;
+} hpack_requests[2][3] = {
+  {
+    { "\x82\x86\x84\x41\x0f" "www.example.com", 20,
+      ":method: GET\n:scheme: http\n:path: /\n"
+      ":authority: www.example.com\n" },
+    { "\x82\x86\x84\xbe\x58\x08" "no-cache", 14,
+      ":method: GET\n:scheme: http\n:path: /\n"
+      ":authority: www.example.com\ncache-control: no-cache\n" },
+    { "\x82\x87\x85\xbf\x40\x0a" "custom-key" "\x0c" "custom-value", 29,
+      ":method: GET\n:scheme: https\n:path: /index.html\n"
+      ":authority: www.example.com\ncustom-key: custom-value\n" },
+  }, {
+    { "\x82\x86\x84\x41\x8c\xf1\xe3\xc2\xe5\xf2\x3a\x6b\xa0\xab\x90"
+      "\xf4\xff", 17,
+      ":method: GET\n:scheme: http\n:path: /\n"
+      ":authority: www.example.com\n" },
+    { "\x82\x86\x84\xbe\x58\x86\xa8\xeb\x10\x64\x9c\xbf", 12,
+      ":method: GET\n:scheme: http\n:path: /\n"
+      ":authority: www.example.com\ncache-control: no-cache\n" },
+    { "\x82\x87\x85\xbf\x40\x88\x25\xa8\x49\xe9\x5b\xa9\x7d\x7f\x89"
+      "\x25\xa8\x49\xe9\x5b\xb8\xe8\xb4\xbf", 24,
+      ":method: GET\n:scheme: https\n:path: /index.html\n"
+      ":authority: www.example.com\ncustom-key: custom-value\n" },
+  }
+};
+
+#define HPACK_RFC_TABLE_SIZE 164  // After the third request
+
+
+static int
+hpack_header(void *opaque, const char *name, size_t namelen,
+             const char *value, size_t valuelen)
+{
+  mbuf_t *out = opaque;
+  mbuf_qprintf(out, "%.*s: %.*s\n", (int)namelen, name,
+               (int)valuelen, value);
+  return 0;
+}
+
+
+/**
+ * Decode from an exactly sized copy. The result is returned in 'out'
+ */
+static int
+hpack_parse(hpack_table_t *ht, const char *block, size_t len,
+            char *out, size_t outsize)
+{
+  mbuf_t mq;
+  mbuf_init(&mq);
+  uint8_t *buf = malloc(MAX(len, 1));
+  memcpy(buf, block, len);
+  const int r = hpack_decode(ht, buf, len, hpack_header, &mq);
+  free(buf);
+  out[mbuf_read(&mq, out, outsize - 1)] = 0;
+  mbuf_clear(&mq);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+check_hpack(void)
+{
+  hpack_table_t ht;
+  char out[1024];
+
+  for(int h = 0; h < 2; h++) {
+    hpack_table_init(&ht, 4096);
+    for(int i = 0; i < 3; i++) {
+      const char *block = hpack_requests[h][i].block;
+      const int len = hpack_requests[h][i].len;
+      const char *expected = hpack_requests[h][i].expected;
+
+      // Truncated blocks either fail or yield the complete fields. The
+      // table is only changed by complete fields so use a scratch one
+      for(int l = 0; l < len; l++) {
+        hpack_table_t tmp;
+        hpack_table_init(&tmp, 4096);
+        for(int j = 0; j < i; j++)
+          hpack_parse(&tmp, hpack_requests[h][j].block,
+                      hpack_requests[h][j].len, out, sizeof(out));
+        const int r = hpack_parse(&tmp, block, l, out, sizeof(out));
+        if(r != 0 && r != -1)
+          check_fail("hpack: C.%d.%d: Returned %d for %d of %d bytes",
+                     h + 3, i + 1, r, l, len);
+        if(strncmp(out, expected, strlen(out)) ||
+           (l == len - 1 && r != -1))
+          check_fail("hpack: C.%d.%d: %d of %d bytes %s, gave\n%s",
+                     h + 3, i + 1, l, len, r ? "failed" : "accepted", out);
+        hpack_table_free(&tmp);
+      }
+
+      if(hpack_parse(&ht, block, len, out, sizeof(out)) ||
+         strcmp(out, expected))
+        check_fail("hpack: C.%d.%d: Decoded as\n%s--- expected ---\n%s",
+                   h + 3, i + 1, out, expected);
+    }
+    if(ht.ht_size != HPACK_RFC_TABLE_SIZE)
+      check_fail("hpack: C.%d: Dynamic table size is %zd, expected %d",
+                 h + 3, ht.ht_size, HPACK_RFC_TABLE_SIZE);
+
+    // Shrinking the table to nothing must evict everything
+    if(hpack_parse(&ht, "\x20", 1, out, sizeof(out)) ||
+       hpack_parse(&ht, "\xbe", 1, out, sizeof(out)) != -1)
+      check_fail("hpack: C.%d: Dynamic table not cleared", h + 3);
+    hpack_table_free(&ht);
+  }
+
+  // Literal field without indexing, new name "a" coded as 0x1f
+  static const struct {
+    const char *what;
+    const char *block;
+    int len;
+    const char *expected;   // NULL if it must fail
+  } cases[] = {
+    { "Huffman",           "\x00\x81\x1f\x00", 4, "a: \n" },
+    { "empty Huffman",     "\x00\x81\x1f\x80", 4, "a: \n" },
+    { "EOS in string",     "\x00\x84\xff\xff\xff\xff\x00", 7, NULL },
+    { "padding too long",  "\x00\x82\x1f\xff\x00", 5, NULL },
+    { "padding not ones",  "\x00\x81\x18\x00", 4, NULL },
+    { "partial code",      "\x00\x81\xfe\x00", 4, NULL },
+    { "string past end",   "\x00\x05" "a", 3, NULL },
+    { "index 0",           "\x80", 1, NULL },
+    { "unused index",      "\xbe", 1, NULL },
+    { "indexed name",      "\x01\x00", 2, ":authority: \n" },
+    { "name past table",   "\x0f\x30\x00", 3, NULL },
+    { "integer overflow",  "\xff\xff\xff\xff\xff\xff\x0f", 7, NULL },
+    { "truncated integer", "\xff\xff", 2, NULL },
+    { "table over limit",  "\x3f\xe2\x1f", 3, NULL },
+    { "table at limit",    "\x3f\xe1\x1f", 3, "" },
+    { "updates at start",  "\x20\x3f\xe1\x1f\x82", 5, ":method: GET\n" },
+    { "update after field", "\x82\x20", 2, NULL },
+  };
+
+  for(int i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    hpack_table_init(&ht, 4096);
+    const int r = hpack_parse(&ht, cases[i].block, cases[i].len,
+                              out, sizeof(out));
+    if(cases[i].expected == NULL ? r != -1 :
+       r != 0 || strcmp(out, cases[i].expected))
+      check_fail("hpack: %s: Returned %d, gave \"%s\"",
+                 cases[i].what, r, out);
+    hpack_table_free(&ht);
+  }
+}
+
+
+/**************************************************************************
+ * HTTP/1.x request heads
+ **************************************************************************/
+
+/**
+ * Parse the first 'len' bytes of 'head' from a buffer of exactly that
+ * size, so reading past the end is caught by ASAN/valgrind. The result
+ * is rendered into 'out' as "METHOD target minor" and "name:value" lines
+ */
+static int
+head_parse(const char *head, size_t len, char *out, size_t outsize)
+{
+  http_head_t hh;
+  char *buf = malloc(MAX(len, 1));
+  memcpy(buf, head, len);
+  const int r = http_head_parse(buf, len, &hh);
+
+  if(r > 0) {
+    int o = snprintf(out, outsize, "%.*s %.*s %d\n",
+                     (int)hh.hh_method_len, hh.hh_method,
+                     (int)hh.hh_target_len, hh.hh_target, hh.hh_minor);
+    for(int i = 0; i < hh.hh_num_fields; i++) {
+      const http_head_field_t *hhf = &hh.hh_fields[i];
+      o += snprintf(out + o, outsize - o, "%.*s:%.*s\n",
+                    (int)hhf->hhf_name_len, hhf->hhf_name,
+                    (int)hhf->hhf_value_len, hhf->hhf_value);
+    }
+  }
+  free(buf);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+check_head(void)
+{
+  static const struct {
+    const char *head;
+    const char *expected;
+  } good[] = {
+    { "GET / HTTP/1.1\r\nHost: a\r\n\r\n",
+      "GET / 1\nHost:a\n" },
+    { "\r\n\nPOST /x?y=1 HTTP/1.0\nContent-Length:  12 \t\n\n",
+      "POST /x?y=1 0\nContent-Length:12\n" },
+    { "GET /a/very/long/target/to/get/past/the/vector/loops?"
+      "and=some&more=args HTTP/1.1\r\n"
+      "User-Agent: Mozilla/5.0 (X11; Linux x86_64) with\ttabs\tinside\r\n"
+      "X-Empty:\r\n"
+      "X-Blank:   \r\n"
+      "X-Obs: caf\xc3\xa9 \xff\r\n"
+      "!#$%&'*+-.^_`|~09azAZ: token\r\n\r\n",
+      "GET /a/very/long/target/to/get/past/the/vector/loops?"
+      "and=some&more=args 1\n"
+      "User-Agent:Mozilla/5.0 (X11; Linux x86_64) with\ttabs\tinside\n"
+      "X-Empty:\nX-Blank:\nX-Obs:caf\xc3\xa9 \xff\n"
+      "!#$%&'*+-.^_`|~09azAZ:token\n" },
+    { "OPTIONS * HTTP/1.1\r\n\r\n",
+      "OPTIONS * 1\n" },
+  };
+
+  static const char *bad[] = {
+    "GET  / HTTP/1.1\r\n\r\n",
+    " GET / HTTP/1.1\r\n\r\n",
+    "G@T / HTTP/1.1\r\n\r\n",
+    "GET / HTTP/2.0\r\n\r\n",
+    "GET / HTTP/1.x\r\n\r\n",
+    "GET / HTTP/1.1 \r\n\r\n",
+    "GET /\x01 HTTP/1.1\r\n\r\n",
+    "GET /\x7f HTTP/1.1\r\n\r\n",
+    "GET /\r\n\r\n",
+    "GET / HTTP/1.1\rX\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost : a\r\n\r\n",
+    "GET / HTTP/1.1\r\n: a\r\n\r\n",
+    "GET / HTTP/1.1\r\nHost\r\n\r\n",
+    "GET / HTTP/1.1\r\nA: b\r\n folded\r\n\r\n",
+    "GET / HTTP/1.1\r\nA: b\x7f\r\n\r\n",
+    "GET / HTTP/1.1\r\nA: b\rc\r\n\r\n",
+    "GET / HTTP/1.1\r\nA: b\r\r\n\r\n",
+  };
+
+  char out[4096], ref[4096];
+
+  for(int i = 0; i < sizeof(good) / sizeof(good[0]); i++) {
+    const char *h = good[i].head;
+    const int len = strlen(h);
+
+    // Nothing is returned until the head is complete, then the same
+    // with anything following it (pipelined requests)
+    for(int l = 0; l < len; l++) {
+      const int r = head_parse(h, l, out, sizeof(out));
+      if(r != 0)
+        check_fail("head: Good #%d: Returned %d for %d of %d bytes",
+                   i, r, l, len);
+    }
+
+    static const char next[] = "GET / HTTP/1.1\r\n\r\n";
+    char *more = malloc(len + sizeof(next));
+    memcpy(more, h, len);
+    memcpy(more + len, next, sizeof(next));
+    for(int extra = 0; extra <= sizeof(next); extra++) {
+      const int r = head_parse(more, len + extra, out, sizeof(out));
+      if(r != len)
+        check_fail("head: Good #%d: Returned %d with %d bytes following, "
+                   "expected %d", i, r, extra, len);
+      if(strcmp(out, good[i].expected))
+        check_fail("head: Good #%d: Parsed as\n%s--- expected ---\n%s",
+                   i, out, good[i].expected);
+    }
+    free(more);
+  }
+
+  for(int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+    const char *h = bad[i];
+    const int len = strlen(h);
+    int failed = 0;
+    for(int l = 1; l <= len; l++) {
+      const int r = head_parse(h, l, out, sizeof(out));
+      if(r > 0 || (failed && r != -1))
+        check_fail("head: Bad #%d: Returned %d for %d of %d bytes",
+                   i, r, l, len);
+      failed |= r == -1;
+    }
+    if(!failed)
+      check_fail("head: Bad #%d: Not rejected", i);
+  }
+
+  // Field limit, also with all the fields in a single long buffer
+  mbuf_t mq;
+  for(int n = HTTP_HEAD_MAX_FIELDS; n <= HTTP_HEAD_MAX_FIELDS + 1; n++) {
+    mbuf_init(&mq);
+    mbuf_qprintf(&mq, "GET / HTTP/1.1\r\n");
+    for(int i = 0; i < n; i++)
+      mbuf_qprintf(&mq, "X-Field-%d: value %d\r\n", i, i);
+    mbuf_qprintf(&mq, "\r\n");
+    const size_t len = mq.mq_size;
+    char *h = malloc(len);
+    mbuf_read(&mq, h, len);
+    const int r = head_parse(h, len, ref, sizeof(ref));
+    if(n == HTTP_HEAD_MAX_FIELDS ? r != len : r != -1)
+      check_fail("head: Returned %d for %d fields", r, n);
+    free(h);
+  }
+}
+
+
+/**************************************************************************
+ * multipart/form-data
+ **************************************************************************/
+
+#define MP_BOUNDARY "XyZ-0123456789abcdef"
+#define MP_DELIM    "\r\n--" MP_BOUNDARY
+
+/**
+ * Parts are logged as <name|filename|content-type> payload </>
+ */
+typedef struct mp_log {
+  mbuf_t ml_out;
+  int ml_reject;
+} mp_log_t;
+
+
+static int
+mp_part_begin(void *opaque, const http_multipart_part_t *hmp)
+{
+  mp_log_t *ml = opaque;
+  if(ml->ml_reject && !strcmp(hmp->hmp_name, "reject"))
+    return 413;
+  mbuf_qprintf(&ml->ml_out, "<%s|%s|%s>", hmp->hmp_name,
+               hmp->hmp_filename ?: "", hmp->hmp_content_type ?: "");
+  return 0;
+}
+
+static int
+mp_part_data(void *opaque, const void *data, size_t len)
+{
+  mp_log_t *ml = opaque;
+  if(len == 0)
+    check_fail("multipart: Empty part_data() callback");
+  mbuf_append(&ml->ml_out, data, len);
+  return 0;
+}
+
+static int
+mp_part_end(void *opaque)
+{
+  mp_log_t *ml = opaque;
+  mbuf_append(&ml->ml_out, "</>", 3);
+  return 0;
+}
+
+static const http_multipart_callbacks_t mp_callbacks = {
+  .part_begin = mp_part_begin,
+  .part_data  = mp_part_data,
+  .part_end   = mp_part_end,
+};
+
+
+/**
+ * Feed 'body' in pieces ending at the offsets in 'splits'. Returns the
+ * log or NULL if the parser reported an error (with the error in *errp)
+ */
+static char *
+mp_parse(const char *body, size_t len, const size_t *splits, int nsplits,
+         size_t *loglen, int *errp)
+{
+  mp_log_t ml = {.ml_reject = 1};
+  mbuf_init(&ml.ml_out);
+
+  http_multipart_t *hm =
+    http_multipart_create("multipart/form-data; boundary=\"" MP_BOUNDARY
+                          "\"", &mp_callbacks, &ml);
+  if(hm == NULL)
+    check_fail("multipart: http_multipart_create() failed");
+
+  // Copy every piece so reads outside of it are caught by ASAN/valgrind
+  size_t off = 0;
+  int err = 0;
+  for(int i = 0; i <= nsplits && !err; i++) {
+    const size_t end = i < nsplits ? splits[i] : len;
+    char *piece = malloc(MAX(end - off, 1));
+    memcpy(piece, body + off, end - off);
+    err = http_multipart_feed(hm, piece, end - off);
+    free(piece);
+    off = end;
+  }
+  if(!err)
+    err = http_multipart_finish(hm);
+  http_multipart_destroy(hm);
+
+  *errp = err;
+  if(err) {
+    mbuf_clear(&ml.ml_out);
+    return NULL;
+  }
+  *loglen = ml.ml_out.mq_size;
+  char *r = malloc(*loglen + 1);
+  mbuf_read(&ml.ml_out, r, *loglen);
+  return r;
+}
+
+
+/**
+ * Feed 'body' split in two at every offset, in chunks of all sizes up
+ * to a few times the delimiter length and one byte at a time. All must
+ * give 'expected' or fail with 'experr'
+ */
+static void
+mp_sweep(const char *what, const char *body, size_t len,
+         const char *expected, size_t explen, int experr)
+{
+  size_t *splits = malloc(sizeof(size_t) * (len + 1));
+  size_t loglen;
+  int err;
+
+  for(int mode = 0; mode < 3; mode++) {
+    const int maxparam = mode == 0 ? len : mode == 1 ? 3 * strlen(MP_DELIM) : 1;
+    for(int param = mode == 0 ? 0 : 1; param <= maxparam; param++) {
+      int n = 0;
+      if(mode == 0) {
+        splits[n++] = param;
+      } else {
+        for(size_t o = param; o < len; o += param)
+          splits[n++] = o;
+      }
+
+      char *log = mp_parse(body, len, splits, n, &loglen, &err);
+      if(err != experr)
+        check_fail("multipart: %s: Returned %d, expected %d (%s %d)",
+                   what, err, experr, mode ? "chunks of" : "split at",
+                   param);
+      if(log != NULL && (loglen != explen || memcmp(log, expected, explen)))
+        check_fail("multipart: %s: Parts differ (%s %d)\n%.*s\n--- vs "
+                   "expected ---\n%.*s", what,
+                   mode ? "chunks of" : "split at", param,
+                   (int)loglen, log, (int)explen, expected);
+      free(log);
+    }
+  }
+  free(splits);
+}
+
+
+/**
+ *
+ */
+static void
+check_multipart(void)
+{
+  mbuf_t body, exp;
+  mbuf_init(&body);
+  mbuf_init(&exp);
+
+  // Payload with partial delimiters, CRs and NULs in it
+  char payload[3000];
+  for(int i = 0; i < sizeof(payload); i++)
+    payload[i] = "\r\n-\0x"[i % 5];
+  static const char near[] = MP_DELIM;
+  for(int i = 1; i < sizeof(near) - 1; i++)
+    memcpy(payload + i * 37, near, i);
+
+  mbuf_qprintf(&body, "preamble\r\n--%s\r\n", MP_BOUNDARY);
+  mbuf_qprintf(&body, "Content-Disposition: form-data; name=\"a\"\r\n\r\n");
+  mbuf_qprintf(&body, "hello" MP_DELIM " \t\r\n");
+  mbuf_qprintf(&body, "content-disposition: form-data; name=\"f\"; "
+               "filename=\"x \\\"y\\\".bin\"\r\n"
+               "Content-Type: application/octet-stream\r\n\r\n");
+  mbuf_append(&body, payload, sizeof(payload));
+  mbuf_qprintf(&body, MP_DELIM "\r\n");
+  mbuf_qprintf(&body, "Content-Disposition: form-data; name=empty\r\n\r\n");
+  mbuf_qprintf(&body, MP_DELIM "--\r\nepilogue " MP_DELIM "\r\n");
+
+  mbuf_qprintf(&exp, "<a||>hello</>");
+  mbuf_qprintf(&exp, "<f|x \"y\".bin|application/octet-stream>");
+  mbuf_append(&exp, payload, sizeof(payload));
+  mbuf_qprintf(&exp, "</><empty||></>");
+
+  const size_t len = body.mq_size;
+  const size_t explen = exp.mq_size;
+  char *b = malloc(len);
+  char *e = malloc(explen);
+  mbuf_read(&body, b, len);
+  mbuf_read(&exp, e, explen);
+
+  mp_sweep("valid", b, len, e, explen, 0);
+
+  // Missing close delimiter
+  const char *t = memmem(b, len, MP_DELIM "--", strlen(MP_DELIM "--"));
+  mp_sweep("truncated", b, t - b, NULL, 0, -1);
+  free(b);
+  free(e);
+
+  static const struct {
+    const char *what;
+    const char *body;
+    int err;
+  } bad[] = {
+    { "no name",
+      "--" MP_BOUNDARY "\r\nContent-Disposition: form-data\r\n\r\nx"
+      MP_DELIM "--", -1 },
+    { "not form-data",
+      "--" MP_BOUNDARY "\r\nContent-Disposition: attachment; name=a\r\n\r\nx"
+      MP_DELIM "--", -1 },
+    { "no colon",
+      "--" MP_BOUNDARY "\r\nContent-Disposition form-data; name=a\r\n\r\nx"
+      MP_DELIM "--", -1 },
+    { "no headers",
+      "--" MP_BOUNDARY "\r\n\r\nx" MP_DELIM "--", -1 },
+    { "junk after delimiter",
+      "--" MP_BOUNDARY "x\r\nContent-Disposition: form-data; name=a\r\n\r\nx"
+      MP_DELIM "--", -1 },
+    { "no final delimiter",
+      "--" MP_BOUNDARY "\r\nContent-Disposition: form-data; name=a\r\n\r\nx"
+      MP_DELIM, -1 },
+    { "rejected",
+      "--" MP_BOUNDARY "\r\nContent-Disposition: form-data; name=reject"
+      "\r\n\r\nx" MP_DELIM "--", 413 },
+  };
+
+  for(int i = 0; i < sizeof(bad) / sizeof(bad[0]); i++)
+    mp_sweep(bad[i].what, bad[i].body, strlen(bad[i].body), NULL, 0,
+             bad[i].err);
+
+  // NUL in headers and endless headers
+  char hdrs[10000];
+  int hl = snprintf(hdrs, sizeof(hdrs), "--%s\r\nContent-Disposition: "
+                    "form-data; name=a\r\nX: \r\n\r\nx" MP_DELIM "--",
+                    MP_BOUNDARY);
+  strstr(hdrs, "X: ")[2] = 0;
+  mp_sweep("NUL in headers", hdrs, hl, NULL, 0, -1);
+
+  hl = snprintf(hdrs, sizeof(hdrs), "--%s\r\nContent-Disposition: "
+                "form-data; name=a\r\nX: ", MP_BOUNDARY);
+  memset(hdrs + hl, 'x', sizeof(hdrs) - hl);
+  mp_parse(hdrs, sizeof(hdrs), NULL, 0, &(size_t){0}, &hl);
+  if(hl != -1)
+    check_fail("multipart: Oversized headers accepted");
+
+  static const char *bad_ct[] = {
+    "multipart/form-data",
+    "multipart/form-data; boundary=",
+    "multipart/mixed; boundary=x",
+    "multipart/form-data; boundary="
+    "12345678901234567890123456789012345678901234567890123456789012345678901",
+  };
+  for(int i = 0; i < sizeof(bad_ct) / sizeof(bad_ct[0]); i++) {
+    if(http_multipart_create(bad_ct[i], &mp_callbacks, NULL) != NULL)
+      check_fail("multipart: Accepted Content-Type: %s", bad_ct[i]);
+  }
+}
+
+
+/**
+ *
+ */
+int
+main(int argc, char **argv)
+{
+  check_hpack();
+  check_head();
+  check_multipart();
+  fprintf(stderr, "httpcheck: All checks passed\n");
+  return 0;
+}
@@ -0,0 +1,337 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+/**
+ * WebSocket frame unmasking benchmark
+ *
+ * Measures, for a range of payload sizes, the throughput of
+ *
+ *  scalar  The byte-at-a-time loop websocket_parse() used to have
+ *  unmask  websocket_unmask() in place
+ *  parse   websocket_parse() of masked binary frames queued in an mbuf
+ *          (header parsing, payload copy and unmask, callback)
+ *
+ * Results are written as JSON, same as httpbench.
+ *
+ *  wsbench [-d milliseconds] [-s sizes] [-o output]
+ */
+
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <inttypes.h>
+
+#include "mbuf.h"
+#include "misc.h"
+#include "ntv.h"
+#include "websocket.h"
+
+// Each timed round processes at least this much so small frames are
+// not dominated by reading the clock
+#define WSBENCH_ROUND_SIZE (1024 * 1024)
+
+// Socket reads are appended to the mbuf in pieces of this size
+#define WSBENCH_READ_SIZE 65536
+
+typedef struct wsbench_result {
+  double wr_mbps;
+  double wr_frames;  // Per second
+} wsbench_result_t;
+
+static const uint8_t wsbench_mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+
+
+/**
+ * What websocket_parse() did before websocket_unmask()
+ */
+static void __attribute__((noinline))
+wsbench_unmask_scalar(uint8_t *d, int64_t len, const uint8_t *m)
+{
+  for(int i = 0; i < len; i++) d[i] ^= m[i&3];
+}
+
+
+/**
+ *
+ */
+static void
+wsbench_result(wsbench_result_t *wr, int64_t bytes, int64_t frames,
+               int64_t elapsed)
+{
+  wr->wr_mbps = bytes / (double)elapsed;
+  wr->wr_frames = frames * 1000000.0 / elapsed;
+}
+
+
+/**
+ *
+ */
+static void
+wsbench_unmask(wsbench_result_t *scalar, wsbench_result_t *vector,
+               int size, int duration)
+{
+  uint8_t *buf = malloc(size);
+  uint32_t mask;
+  int64_t bytes, frames, elapsed;
+  const int per_round = MAX(WSBENCH_ROUND_SIZE / MAX(size, 1), 1);
+
+  memset(buf, 0x55, size);
+  memcpy(&mask, wsbench_mask, sizeof(mask));
+
+  for(bytes = frames = elapsed = 0; elapsed < duration;) {
+    const int64_t ts = get_ts();
+    for(int i = 0; i < per_round; i++)
+      wsbench_unmask_scalar(buf, size, wsbench_mask);
+    elapsed += get_ts() - ts;
+    frames += per_round;
+    bytes += (int64_t)per_round * size;
+  }
+  wsbench_result(scalar, bytes, frames, elapsed);
+
+  for(bytes = frames = elapsed = 0; elapsed < duration;) {
+    const int64_t ts = get_ts();
+    for(int i = 0; i < per_round; i++)
+      websocket_unmask(buf, buf, size, mask);
+    elapsed += get_ts() - ts;
+    frames += per_round;
+    bytes += (int64_t)per_round * size;
+  }
+  wsbench_result(vector, bytes, frames, elapsed);
+
+  free(buf);
+}
+
+
+/**
+ *
+ */
+static int
+wsbench_frame_cb(void *opaque, int opcode, uint8_t **data, int len,
+                 int flags)
+{
+  int64_t *received = opaque;
+  *received += len;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+wsbench_parse(wsbench_result_t *wr, int size, int duration)
+{
+  const int per_round = MAX(WSBENCH_ROUND_SIZE / MAX(size, 1), 1);
+  uint8_t hdr[WEBSOCKET_MAX_HDR_LEN + 4];
+  mbuf_t round, q;
+  websocket_state_t ws = {};
+  int64_t bytes, frames, elapsed, received = 0;
+
+  // One round worth of masked frames, as a client would send them
+  uint8_t *payload = malloc(size);
+  memset(payload, 0x55, size);
+  uint32_t mask;
+  memcpy(&mask, wsbench_mask, sizeof(mask));
+  websocket_unmask(payload, payload, size, mask);
+
+  const int hlen = websocket_build_hdr(hdr, 2, size, 0);
+  hdr[1] |= 0x80;
+  memcpy(hdr + hlen, wsbench_mask, 4);
+
+  mbuf_init(&round);
+  for(int i = 0; i < per_round; i++) {
+    mbuf_append(&round, hdr, hlen + 4);
+    mbuf_append(&round, payload, size);
+  }
+  const size_t round_size = round.mq_size;
+  uint8_t *raw = malloc(round_size);
+  mbuf_read(&round, raw, round_size);
+  free(payload);
+
+  mbuf_init(&q);
+  for(bytes = frames = elapsed = 0; elapsed < duration;) {
+    for(size_t off = 0; off < round_size; off += WSBENCH_READ_SIZE)
+      mbuf_append(&q, raw + off, MIN(WSBENCH_READ_SIZE, round_size - off));
+
+    const int64_t ts = get_ts();
+    if(websocket_parse(&q, wsbench_frame_cb, &received, &ws)) {
+      fprintf(stderr, "wsbench: Parse failed\n");
+      exit(1);
+    }
+    elapsed += get_ts() - ts;
+    frames += per_round;
+    bytes += (int64_t)per_round * size;
+  }
+  wsbench_result(wr, bytes, frames, elapsed);
+
+  if(received != bytes) {
+    fprintf(stderr, "wsbench: Received %"PRId64" bytes, expected %"PRId64
+            "\n", received, bytes);
+    exit(1);
+  }
+
+  mbuf_clear(&q);
+  websocket_free(&ws);
+  free(raw);
+}
+
+
+/**
+ *
+ */
+static ntv_t *
+wsbench_result_ntv(const wsbench_result_t *wr)
+{
+  ntv_t *m = ntv_create_map();
+  ntv_set_double(m, "MBps", wr->wr_mbps);
+  ntv_set_double(m, "framesPerSec", wr->wr_frames);
+  return m;
+}
+
+
+/**
+ * Make sure the vector paths (and the mask realignment between pieces)
+ * agree with the byte loop before timing anything
+ */
+static void
+wsbench_verify(void)
+{
+  uint8_t src[300], ref[300], out[300];
+  uint32_t mask;
+  memcpy(&mask, wsbench_mask, sizeof(mask));
+
+  for(int i = 0; i < sizeof(src); i++)
+    src[i] = i * 7;
+
+  for(int len = 0; len <= sizeof(src); len++) {
+    memcpy(ref, src, len);
+    wsbench_unmask_scalar(ref, len, wsbench_mask);
+
+    for(int split = 0; split <= len; split += 1 + split / 4) {
+      const uint32_t m = websocket_unmask(out, src, split, mask);
+      websocket_unmask(out + split, src + split, len - split, m);
+      if(memcmp(out, ref, len)) {
+        fprintf(stderr, "wsbench: websocket_unmask() mismatch for %d "
+                "bytes split at %d\n", len, split);
+        exit(1);
+      }
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static void
+usage(void)
+{
+  fprintf(stderr,
+          "Usage: wsbench [options]\n"
+          "  -d <ms>      Measurement duration per test (500)\n"
+          "  -s <list>    Comma separated payload sizes "
+          "(16,125,1024,16384,65536,1048576,8388608)\n"
+          "  -o <file>    Write JSON result to file instead of stdout\n");
+  exit(1);
+}
+
+
+/**
+ *
+ */
+int
+main(int argc, char **argv)
+{
+  const char *sizes = "16,125,1024,16384,65536,1048576,8388608";
+  const char *output = NULL;
+  int duration = 500;
+  int c;
+
+  while((c = getopt(argc, argv, "d:s:o:h")) != -1) {
+    switch(c) {
+    case 'd':
+      duration = atoi(optarg);
+      break;
+    case 's':
+      sizes = optarg;
+      break;
+    case 'o':
+      output = optarg;
+      break;
+    default:
+      usage();
+    }
+  }
+
+  if(duration < 1)
+    usage();
+
+  wsbench_verify();
+
+  ntv_t *result = ntv_create_map();
+  ntv_t *list = ntv_create_list();
+  ntv_set_int(result, "duration", duration);
+
+  char *names = mystrdupa(sizes);
+  char *name, *saveptr;
+  for(name = strtok_r(names, ",", &saveptr); name != NULL;
+      name = strtok_r(NULL, ",", &saveptr)) {
+    const int size = atoi(name);
+    if(size < 1) {
+      fprintf(stderr, "wsbench: Invalid size %s\n", name);
+      continue;
+    }
+    wsbench_result_t scalar, unmask, parse;
+    wsbench_unmask(&scalar, &unmask, size, duration * 1000);
+    wsbench_parse(&parse, size, duration * 1000);
+
+    fprintf(stderr, "wsbench: %8d bytes  scalar %8.0f MB/s  "
+            "unmask %8.0f MB/s  parse %8.0f MB/s (%.0f frames/s)\n",
+            size, scalar.wr_mbps, unmask.wr_mbps, parse.wr_mbps,
+            parse.wr_frames);
+
+    ntv_t *r = ntv_create_map();
+    ntv_set_int(r, "size", size);
+    ntv_set_ntv(r, "scalar", wsbench_result_ntv(&scalar));
+    ntv_set_ntv(r, "unmask", wsbench_result_ntv(&unmask));
+    ntv_set_ntv(r, "parse", wsbench_result_ntv(&parse));
+    ntv_set_ntv(list, NULL, r);
+  }
+  ntv_set_ntv(result, "results", list);
+
+  char *json = ntv_json_serialize_to_str(result, 1);
+  FILE *fp = output ? fopen(output, "w") : stdout;
+  if(fp == NULL) {
+    perror(output);
+    exit(1);
+  }
+  fprintf(fp, "%s\n", json);
+  if(fp != stdout)
+    fclose(fp);
+  free(json);
+  ntv_release(result);
+  return 0;
+}
@@ -31,6 +31,7 @@
 
 #include "htsmsg_json.h"
 #include "misc.h"
+#include "strvec.h"
 #include "trace.h"
 
 #include "cfg.h"
@@ -283,6 +284,28 @@ cfg_get_list(cfg_t *c, const char *id)
 }
 
 
+/**
+ *
+ */
+int
+cfg_get_strvec(cfg_t *c, const char *id, strvec_t *out)
+{
+  cfg_t *l = cfg_get_list(c, id);
+  if(l == NULL)
+    return 0;
+
+  int r = 0;
+  for(int i = 0; i < cfg_list_length(l); i++) {
+    const char *str = cfg_get_str(l, CFGI(i), NULL);
+    if(str != NULL) {
+      strvec_insert_sorted(out, str);
+      r++;
+    }
+  }
+  return r;
+}
+
+
 /**
  *
  */
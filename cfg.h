@@ -27,6 +27,8 @@
 
 typedef htsmsg_t cfg_t;
 
+struct strvec;
+
 int cfg_load(const char *filename, char *errbuf, size_t errlen);
 
 cfg_t *cfg_get_root(void);
@@ -55,4 +57,7 @@ cfg_t *cfg_find_map(cfg_t *c, const char *key, const char *value);
 
 int cfg_list_length(cfg_t *c);
 
+// Insert strings from list 'id' sorted into 'out', returns number found
+int cfg_get_strvec(cfg_t *c, const char *id, struct strvec *out);
+
 void cfg_add_reload_cb(void (*fn)(void));
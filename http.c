@@ -32,7 +32,11 @@
 #include <string.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
 #include <errno.h>
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -54,6 +58,20 @@
 #include "asyncio.h"
 #include "websocket.h"
 #include "mbuf.h"
+#include "strvec.h"
+#include "http_router.h"
+#include "arena.h"
+#include "murmur3.h"
+#include "http_accesslog.h"
+#include "http_metrics.h"
+#include "http2.h"
+#include "http_cache.h"
+#include "http_head.h"
+#include "http_pool.h"
+#include "http_limiter.h"
+#include "http_multipart.h"
+#include "http_proxy.h"
+#include "bytestream.h"
 
 LIST_HEAD(http_connection_list, http_connection);
 
@@ -65,6 +83,29 @@ typedef struct http_server {
 
   int hs_secure_cookies;
 
+  int hs_stream_buffer_size;
+  int hs_send_buffer_size;
+  int hs_pipeline_depth;
+  int hs_form_field_max;
+  int hs_form_max_size;
+  int hs_form_max_fields;
+
+  int hs_http2;
+
+  // Response compression
+  strvec_t hs_compress_types;  // Ending with '/' matches all subtypes
+  int hs_compress_min_size;
+  int hs_compress_level;
+
+  // Admission control, see http_server_init_limits()
+  atomic_t hs_connections;
+  int hs_max_connections;
+  int hs_max_connections_per_ip;
+  double hs_request_rate;
+  double hs_request_burst;
+  int hs_retry_after;
+  struct http_limit_shard *hs_limit_shards;
+
   int hs_port;
   char *hs_bind_address;
 
@@ -88,6 +129,40 @@ static struct ws_server_path_list websocket_paths;
 
 
 
+/**
+ * A string being received. Points straight into the receive buffer unless
+ * it spans several buffers in which case it's copied to the arena
+ */
+typedef struct http_slice {
+  char *hs_ptr;
+  size_t hs_len;
+  uint8_t hs_copied : 1;
+  uint8_t hs_at_end : 1;  // Ended at end of data passed to the parser
+} http_slice_t;
+
+
+/**
+ * Request header index
+ *
+ * All request headers are hashed on their case folded name so lookups
+ * don't have to scan the list. Well-known headers are also resolved into
+ * a slot table at parse time.
+ */
+
+#define HTTP_HEADER_HASH_SIZE 32
+
+typedef struct http_header {
+  http_arg_t hh_arg;
+  struct http_header *hh_hash_next;
+  uint32_t hh_hash;
+} http_header_t;
+
+typedef struct http_header_index {
+  const char *hhi_slots[HTTP_HDR_num];
+  http_header_t *hhi_hash[HTTP_HEADER_HASH_SIZE];
+} http_header_index_t;
+
+
 typedef struct http_connection {
   atomic_t hc_refcount;
   int hc_error;
@@ -99,67 +174,128 @@ typedef struct http_connection {
   int hc_read_disabled;
   int hc_closed;
 
+  // Pipelined requests are parsed ahead and queued on hc_task_group,
+  // which runs them (and thus sends the responses) in order
+  atomic_t hc_queued;  // Dispatched but not yet finished
+  int hc_barrier;      // Don't parse ahead until the queue has drained
+  int hc_shutdown;     // A request closed the connection, skip the rest
+
+  LIST_HEAD(, http_deferred) hc_deferred;  // See http_request_defer()
+
   http_parser hc_parser;
+  int hc_in_message;       // http_parser is in the middle of a request
+  uint64_t hc_body_left;   // Body bytes following a head from http_fast_head()
   task_group_t *hc_task_group;
 
+  // Backs everything parsed for the request currently being received,
+  // handed over to the http_request_t once it's complete
+  arena_t hc_arena;
+
+  // Receive buffers referenced by the request being parsed
+  mbuf_t hc_rxbuf;
+  int hc_rxbuf_ref;  // Current buffer is referenced
+  const char *hc_parse_start;
+  const char *hc_parse_end;
+
+  // Completed request waiting for its buffers to be handed over
+  struct http_request *hc_pending_request;
+
+  http_slice_t hc_url;
+  http_slice_t hc_header_field;
+  http_slice_t hc_header_value;
+
   char *hc_path;
   char *hc_remain;
 
-  char *hc_header_field;
-  char *hc_header_value;
-
   const ws_server_path_t *hc_ws_path;
   websocket_state_t hc_ws_state;
   void *hc_ws_opaque;
   int hc_ws_pong_wait;
 
   struct http_arg_list hc_request_headers;
+  http_header_index_t *hc_header_index;
 
   char *hc_peer_addr;
+  struct http_limit_entry *hc_limit;  // Per peer connection count
 
   uint8_t *hc_body;
   size_t hc_body_size;
   uint64_t hc_body_received;
+  int hc_body_chunked;  // Size not known, hc_body grows as needed
+
+  // Request with body streamed to a route's body callback
+  struct http_request *hc_stream_request;
+  mbuf_t hc_stream_buf;          // Received but not yet handed over
+  atomic_t hc_stream_inflight;   // Bytes queued on task group
+  int hc_stream_paused;
+  task_pool_t *hc_stream_pool;   // Route's pool, see http_request_pool()
 
   z_stream *hc_z_out;
   z_stream *hc_z_in;
 
+  // HTTP/2, see h2_input()
+  struct h2_connection *hc_h2;
+  int hc_proto_checked;  // Looked for the HTTP/2 preface
+  int hc_h2_upgrade;     // Request being parsed asks for h2c
+
 } http_connection_t;
 
 
 
 typedef struct http_path {
-  LIST_ENTRY(http_path) hp_link;
   char *hp_path;
   void *hp_opaque;
   http_callback_t *hp_callback;
-  int hp_len;
-  int hp_depth;
+  int hp_metrics_id;
 } http_path_t;
 
 
-static LIST_HEAD(, http_path) http_paths;
+static http_router_t *http_path_tree;
 
 
 typedef struct http_route {
   LIST_ENTRY(http_route) hr_link;
   int hr_flags;
+  int hr_method;
   char *hr_path;
   regex_t hr_reg;
   int hr_depth;
+  strvec_t hr_param_names;
   http_callback2_t *hr_callback;
+  http_body_callback_t *hr_body_callback;
+  http_form_file_callback_t *hr_form_callback;
+  http_proxy_t *hr_proxy;
+  int hr_metrics_id;
+  http_cache_policy_t *hr_cache;
+  http_pool_t *hr_pool;
+  int hr_class;  // See http_limiter.h
+  LIST_ENTRY(http_route) hr_all_link;
 } http_route_t;
 
-
+// Routes that can't be compiled into http_route_tree, matched using regexec()
 static LIST_HEAD(, http_route) http_routes;
 
+static LIST_HEAD(, http_route) http_all_routes;
+
+static http_router_t *http_route_tree;
+
+static int http_metrics_enabled;
+
 
 static void http_parse_query_args(http_request_t *hc, char *args);
 
+static int http_form_finish(http_request_t *hr);
+
+static void http_form_destroy(http_request_t *hr);
+
 static char *generate_session_cookie(http_request_t *hr);
 
 static void get_session_cookie(http_request_t *hr, const char *str);
 
+static int http_session_changed(const http_request_t *hr);
+
+static int http_cache_variant(const http_request_t *hr);
+
 static int websocket_upgrade(http_connection_t *hc);
 
 static int websocket_packet_input(void *opaque, int opcode,
@@ -173,6 +309,25 @@ static void http_connection_release(http_connection_t *hc);
 
 static void http_connection_reenable(void *aux);
 
+static void http_connection_resume(http_connection_t *hc);
+
+static int h2_sendq(http_request_t *hr, mbuf_t *mq);
+
+static int h2_send_headers(http_request_t *hr, int rc, mbuf_t *hdrs,
+                           int cork);
+
+static int h2_stream_wait(http_request_t *hr, size_t high, int timeout);
+
+static size_t h2_stream_queued(http_request_t *hr);
+
+static void h2_request_done(http_request_t *hr);
+
+static void h2_timeout(http_connection_t *hc);
+
+static void h2_connection_closed(http_connection_t *hc);
+
+static void h2_connection_free(struct h2_connection *h2);
+
 /**
  *
  */
@@ -188,23 +343,18 @@ http_server_release(http_server_t *hs)
 static int
 http_resolve_path(http_request_t *hr)
 {
-  http_path_t *hp;
+  const http_path_t *hp;
+  regmatch_t match[1];
   char *v;
   const char *remain = NULL;
 
-  LIST_FOREACH(hp, &http_paths, hp_link) {
-    if(!strncmp(hr->hr_path, hp->hp_path, hp->hp_len)) {
-      if(hr->hr_path[hp->hp_len] == 0 || hr->hr_path[hp->hp_len] == '/' ||
-	 hr->hr_path[hp->hp_len] == '?')
-	break;
-    }
-  }
-
+  hp = http_router_lookup(http_path_tree, hr->hr_path,
+                          HTTP_ROUTER_ANY_METHOD, match, 1, NULL, NULL);
   if(hp == NULL)
     return 404;
 
-  v = hr->hr_path + hp->hp_len;
-
+  v = hr->hr_path + match[0].rm_eo;
+  hr->hr_metrics_id = hp->hp_metrics_id;
 
   switch(*v) {
   case 0:
@@ -226,39 +376,183 @@ http_resolve_path(http_request_t *hr)
 
 #define MAX_ROUTE_MATCHES 32
 
+/**
+ * Route looked up on the asyncio thread before the request is
+ * dispatched, see http_route_peek()
+ */
+typedef struct http_route_peek {
+  const http_route_t *hrp_route;
+  int hrp_status;
+  int hrp_argc;
+  regmatch_t hrp_match[MAX_ROUTE_MATCHES];
+} http_route_peek_t;
+
+/**
+ * Find route for path. If none is found *statusp is set to 404 or 405
+ */
+static const http_route_t *
+http_route_find(const char *path, int method, regmatch_t *match,
+                int *statusp)
+{
+  const http_route_t *hr, *rr;
+  regmatch_t rmatch[MAX_ROUTE_MATCHES];
+  int depth;
+
+  hr = http_router_lookup(http_route_tree, path, method,
+                          match, MAX_ROUTE_MATCHES, &depth, statusp);
+
+  // Regex routes are sorted on depth, any route that is at least as deep
+  // as the tree match takes precedence (same as when all routes were
+  // kept in one sorted list)
+  LIST_FOREACH(rr, &http_routes, hr_link) {
+    if(rr->hr_depth < depth)
+      break;
+    if(!regexec(&rr->hr_reg, path, MAX_ROUTE_MATCHES, rmatch, 0)) {
+      if(rr->hr_method != HTTP_ROUTE_ANY_METHOD && rr->hr_method != method) {
+        *statusp = HTTP_STATUS_METHOD_NOT_ALLOWED;
+        continue;
+      }
+      memcpy(match, rmatch, sizeof(rmatch));
+      return rr;
+    }
+  }
+  return hr;
+}
+
+
+/**
+ * Same as http_route_find() but reuses what http_route_peek() found
+ */
+static const http_route_t *
+http_route_find_req(http_request_t *req, regmatch_t *match, int *statusp)
+{
+  const http_route_peek_t *hrp = req->hr_route_peek;
+  if(hrp == NULL)
+    return http_route_find(req->hr_path, req->hr_method, match, statusp);
+
+  memcpy(match, hrp->hrp_match, sizeof(regmatch_t) * hrp->hrp_argc);
+  if(hrp->hrp_argc < MAX_ROUTE_MATCHES)
+    match[hrp->hrp_argc].rm_so = -1;
+  *statusp = hrp->hrp_status;
+  return hrp->hrp_route;
+}
+
+
 /**
  *
  */
 static int
 http_resolve_route(http_request_t *req, int cont)
 {
-  http_route_t *hr;
+  const http_route_t *hr;
   regmatch_t match[MAX_ROUTE_MATCHES];
   char *argv[MAX_ROUTE_MATCHES];
-  int argc;
+  int argc, status;
+  size_t bufsize = 0;
 
-  LIST_FOREACH(hr, &http_routes, hr_link) {
-    if(!regexec(&hr->hr_reg, req->hr_path, MAX_ROUTE_MATCHES, match, 0)) {
-      break;
-    }
-  }
+  hr = http_route_find_req(req, match, &status);
   if(hr == NULL)
-    return 404;
+    return status;
 
   if(cont && !(hr->hr_flags & HTTP_ROUTE_HANDLE_100_CONTINUE))
     return 100;
 
+  for(argc = 0; argc < MAX_ROUTE_MATCHES; argc++) {
+    if(match[argc].rm_so == -1)
+      break;
+    bufsize += match[argc].rm_eo - match[argc].rm_so + 1;
+  }
+
+  // All arguments are copied into a single buffer on the stack
+  char buf[bufsize];
+  char *s = buf;
+
   for(argc = 0; argc < MAX_ROUTE_MATCHES; argc++) {
     if(match[argc].rm_so == -1)
       break;
     int len = match[argc].rm_eo - match[argc].rm_so;
-    char *s = argv[argc] = alloca(len + 1);
-    s[len] = 0;
+    argv[argc] = s;
     memcpy(s, req->hr_path + match[argc].rm_so, len);
+    s[len] = 0;
+    s += len + 1;
+  }
+
+  req->hr_route = hr;
+  req->hr_route_argc = argc;
+  req->hr_route_argv = argv;
+  req->hr_metrics_id = hr->hr_metrics_id;
+
+  int r = 0;
+  http_cache_entry_t *fill = NULL;
+
+  if(hr->hr_cache != NULL && !cont &&
+     (req->hr_method == HTTP_GET || req->hr_method == HTTP_HEAD) &&
+     http_cache_lookup(hr->hr_cache, req, http_cache_variant(req), &fill))
+    goto done;
+
+  req->hr_cache_fill = fill;
+  r = hr->hr_callback(req, argc, argv,
+                      cont ? HTTP_ROUTE_HANDLE_100_CONTINUE : 0);
+  if(fill != NULL) {
+    req->hr_cache_fill = NULL;
+    http_cache_fill_done(fill);
   }
 
-  return hr->hr_callback(req, argc, argv,
-                         cont ? HTTP_ROUTE_HANDLE_100_CONTINUE : 0);
+ done:
+  req->hr_route_argc = 0;
+  req->hr_route_argv = NULL;
+  return r;
+}
+
+
+/**
+ * Resolve route and keep arguments for the lifetime of the request
+ */
+static int
+http_route_bind(http_request_t *req)
+{
+  regmatch_t match[MAX_ROUTE_MATCHES];
+  const http_route_t *hr;
+  int argc, status;
+
+  hr = http_route_find_req(req, match, &status);
+  if(hr == NULL)
+    return status;
+
+  for(argc = 0; argc < MAX_ROUTE_MATCHES; argc++)
+    if(match[argc].rm_so == -1)
+      break;
+
+  char **argv = arena_alloc(&req->hr_arena, sizeof(char *) * argc);
+  for(int i = 0; i < argc; i++)
+    argv[i] = arena_strndup(&req->hr_arena, req->hr_path + match[i].rm_so,
+                            match[i].rm_eo - match[i].rm_so);
+
+  req->hr_route = hr;
+  req->hr_route_argc = argc;
+  req->hr_route_argv = argv;
+  req->hr_metrics_id = hr->hr_metrics_id;
+  return 0;
+}
+
+
+/**
+ *
+ */
+const char *
+http_route_arg(http_request_t *req, const char *name)
+{
+  const http_route_t *hr = req->hr_route;
+  if(hr == NULL)
+    return NULL;
+
+  for(int i = 0; i < hr->hr_param_names.count; i++) {
+    if(i + 1 >= req->hr_route_argc)
+      break;
+    if(!strcmp(hr->hr_param_names.v[i], name))
+      return req->hr_route_argv[i + 1];
+  }
+  return NULL;
 }
 
 
@@ -291,10 +585,6 @@ http_method2str(int code)
   return val2str(code, HTTP_methodcodes) ?: "???";
 }
 
-static const char *httpdays[7] = {
-  "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
-};
-
 static const char *httpmonths[12] = {
   "Jan", "Feb", "Mar", "Apr", "May", "Jun",
   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
@@ -316,6 +606,12 @@ http_req_ver_str(const http_request_t *hr)
 static void
 http_log(http_request_t *hr, int status, const char *str)
 {
+  hr->hr_status = status;
+
+  // Written when the request is done instead
+  if(http_accesslog_enabled())
+    return;
+
   cfg_root(cr);
   const http_server_t *hs = hr->hr_connection->hc_server;
 
@@ -331,7 +627,7 @@ http_log(http_request_t *hr, int status, const char *str)
     level = LOG_NOTICE;
 
   const char *ua =
-    logua ? http_arg_get(&hr->hr_request_headers, "user-agent") : NULL;
+    logua ? http_req_header_id(hr, HTTP_HDR_USER_AGENT) : NULL;
 
   trace(level, "HTTP %s -- %d (%s) %s T:%"PRId64"+%"PRId64"us%s%s",
         hr->hr_path, status, str, hr->hr_peer_addr, d1, d2,
@@ -346,6 +642,11 @@ int
 http_send_100_continue(http_request_t *hr)
 {
   mbuf_t q;
+
+  // The whole body is always received for HTTP/2
+  if(hr->hr_h2_stream != NULL)
+    return 0;
+
   mbuf_init(&q);
 
   mbuf_qprintf(&q, "%s 100 Continue\r\n\r\n",
@@ -356,30 +657,70 @@ http_send_100_continue(http_request_t *hr)
 }
 
 
+/**
+ * Date string for 'now', only reformatted once per second (and thread)
+ */
+static const char *
+http_date_now(time_t now)
+{
+  static __thread time_t cached_time;
+  static __thread char cached_str[32];
+
+  if(now != cached_time) {
+    fmt_IMF_fixdate(cached_str, now);
+    cached_time = now;
+  }
+  return cached_str;
+}
+
+
 /**
  *
  */
 const char *
 http_mktime(time_t t, int delta)
 {
-  struct tm tm0, *tm;
+  char *r = talloc_malloc(32);
+  fmt_IMF_fixdate(r, t + delta);
+  return r;
+}
 
-  t += delta;
 
-  tm = gmtime_r(&t, &tm0);
 
-  return tsprintf("%s, %02d %s %d %02d:%02d:%02d GMT",
-                  httpdays[tm->tm_wday], tm->tm_year + 1900,
-                  httpmonths[tm->tm_mon], tm->tm_mday,
-                  tm->tm_hour, tm->tm_min, tm->tm_sec);
+/**
+ * Response header block and body data. For HTTP/2 streams these are
+ * translated into frames
+ */
+static int
+http_send_head(http_request_t *hr, int rc, mbuf_t *hdrs)
+{
+  // Hold back the header if the body is queued right after, otherwise
+  // Nagle will delay the body until the header has been ACKed
+  const int cork = hr->hr_cork_head;
+  hr->hr_cork_head = 0;
+
+  if(hr->hr_h2_stream != NULL)
+    return h2_send_headers(hr, rc, hdrs, cork);
+  return asyncio_sendq(hr->hr_connection->hc_af, hdrs, cork);
 }
 
 
+static int
+http_sendq(http_request_t *hr, mbuf_t *mq)
+{
+  if(hr->hr_h2_stream != NULL)
+    return h2_sendq(hr, mq);
+  return asyncio_sendq(hr->hr_connection->hc_af, mq, 0);
+}
+
 
 void
 http_send_raw(http_request_t *hr, const void *data, size_t len)
 {
-  asyncio_send(hr->hr_connection->hc_af, data, len, 0);
+  mbuf_t hq;
+  mbuf_init(&hq);
+  mbuf_append(&hq, data, len);
+  http_sendq(hr, &hq);
 }
 
 
@@ -388,21 +729,136 @@ http_send_chunk(http_request_t *hr, const void *data, size_t len)
 {
   mbuf_t hq;
   mbuf_init(&hq);
-  mbuf_qprintf(&hq, "%zx\r\n", len);
+  if(hr->hr_h2_stream == NULL)
+    mbuf_qprintf(&hq, "%zx\r\n", len);
   mbuf_append(&hq, data, len);
-  mbuf_append(&hq, "\r\n", 2);
-  int r = asyncio_sendq(hr->hr_connection->hc_af, &hq, 0);
+  if(hr->hr_h2_stream == NULL)
+    mbuf_append(&hq, "\r\n", 2);
+  int r = http_sendq(hr, &hq);
   mbuf_clear(&hq);
   return r;
 }
 
 
+/**
+ * Header building helpers. Everything is appended with plain memcpy,
+ * constant lines are rendered at compile time
+ */
+#define hdr_lit(m, str) mbuf_append(m, str, sizeof(str) - 1)
+
+#define hdr_str(m, key, val) \
+  hdr_append_str(m, key ": ", sizeof(key ": ") - 1, val)
+
+// 'prefix' includes the separator
+#define hdr_int(m, prefix, val) \
+  hdr_append_int(m, prefix, sizeof(prefix) - 1, val)
+
+static void
+hdr_append_str(mbuf_t *m, const char *key, size_t keylen, const char *val)
+{
+  mbuf_append(m, key, keylen);
+  mbuf_append(m, val, strlen(val));
+  mbuf_append(m, "\r\n", 2);
+}
+
+
+static void
+hdr_append_int(mbuf_t *m, const char *key, size_t keylen, int64_t val)
+{
+  char buf[24];
+  int len = fmt_s64(buf, val);
+  buf[len++] = '\r';
+  buf[len++] = '\n';
+  mbuf_append(m, key, keylen);
+  mbuf_append(m, buf, len);
+}
+
+
+/**
+ * " 200 OK\r\n", ie. status line without the protocol version
+ */
+static void
+http_append_status(mbuf_t *hdrs, int rc, const char *statustxt)
+{
+  char buf[24];
+  int len = 0;
+  buf[len++] = ' ';
+  len += fmt_u64(buf + len, rc);
+  buf[len++] = ' ';
+  mbuf_append(hdrs, buf, len);
+  hdr_append_str(hdrs, "", 0, statustxt);
+}
+
+
+/**
+ *
+ */
+static void
+http_append_cache_control(mbuf_t *hdrs, int maxage, time_t now)
+{
+  if(maxage < 0)
+    return;  // Caller supplies its own (if any) in hr_response_headers
+
+  if(maxage == 0) {
+    hdr_lit(hdrs, "Cache-Control: no-cache\r\n");
+  } else {
+    if(now)
+      hdr_str(hdrs, "Last-Modified", http_date_now(now));
+
+    if(maxage == INT32_MAX) {
+      hdr_lit(hdrs, "Cache-Control: max-age=365000000, immutable\r\n");
+    } else {
+      hdr_int(hdrs, "Cache-Control: public, max-age=", maxage);
+    }
+  }
+}
+
+
+/**
+ * Content-Length and Connection
+ */
+static void
+http_append_length_and_connection(http_request_t *hr, mbuf_t *hdrs,
+                                  int rc, int64_t contentlen, int chunked)
+{
+  if(rc == HTTP_STATUS_NOT_MODIFIED || chunked) {
+    // No body or self delimiting body, connection can be kept
+  } else if(contentlen > 0) {
+    hdr_int(hdrs, "Content-Length: ", contentlen);
+  } else {
+    hr->hr_keep_alive = 0;
+  }
+
+  if(hr->hr_keep_alive)
+    hdr_lit(hdrs, "Connection: Keep-Alive\r\n");
+  else
+    hdr_lit(hdrs, "Connection: Close\r\n");
+}
+
+
+/**
+ * Headers added with http_arg_set(&hr->hr_response_headers, ...)
+ */
+static void
+http_append_response_headers(http_request_t *hr, mbuf_t *hdrs)
+{
+  http_arg_t *ra;
+  TAILQ_FOREACH(ra, &hr->hr_response_headers, link) {
+    mbuf_append(hdrs, ra->key, strlen(ra->key));
+    hdr_append_str(hdrs, ": ", 2, ra->val);
+  }
+}
+
+
+/**
+ * Date and session cookie
+ */
 static void
 http_send_common_headers(http_request_t *hr, mbuf_t *hdrs, time_t now)
 {
-  mbuf_qprintf(hdrs, "Server: %s\r\n", PROGNAME);
+  hdr_str(hdrs, "Date", http_date_now(now));
 
-  if(ntv_cmp(hr->hr_session, hr->hr_session_received)) {
+  if(http_session_changed(hr)) {
     const char *cookie = generate_session_cookie(hr);
     if(cookie != NULL) {
       mbuf_qprintf(hdrs,
@@ -441,436 +897,467 @@ http_send_header(http_request_t *hr, int rc, const char *statustxt,
   if(statustxt == NULL)
     statustxt = http_rc2str(rc);
 
-  mbuf_qprintf(&hdrs, "%s %d %s\r\n",
-                 http_req_ver_str(hr),
-		 rc, statustxt);
+  mbuf_append(&hdrs, http_req_ver_str(hr), 8);
+  http_append_status(&hdrs, rc, statustxt);
 
+  hdr_lit(&hdrs, "Server: "PROGNAME"\r\n");
 
   http_send_common_headers(hr, &hdrs, now);
 
-  if(maxage == 0) {
-    mbuf_qprintf(&hdrs, "Cache-Control: no-cache\r\n");
-  } else {
-    mbuf_qprintf(&hdrs, "Last-Modified: %s\r\n", http_mktime(now, 0));
-
-    if(maxage == INT32_MAX) {
-      mbuf_qprintf(&hdrs, "Cache-Control: max-age=365000000, immutable\r\n");
-    } else {
-      mbuf_qprintf(&hdrs, "Cache-Control: public, max-age=%d\r\n", maxage);
-    }
-  }
+  http_append_cache_control(&hdrs, maxage, now);
 
   if(rc == HTTP_STATUS_UNAUTHORIZED)
-    mbuf_qprintf(&hdrs, "WWW-Authenticate: Basic realm=\"doozer\"\r\n");
+    hdr_lit(&hdrs, "WWW-Authenticate: Basic realm=\"doozer\"\r\n");
 
-  if(contentlen > 0)
-    mbuf_qprintf(&hdrs, "Content-Length: %"PRId64"\r\n", contentlen);
-  else
-    hr->hr_keep_alive = 0;
+  hr->hr_bytes_sent = hr->hr_no_output ? 0 : contentlen;
 
-  mbuf_qprintf(&hdrs, "Connection: %s\r\n", 
-	      hr->hr_keep_alive ? "Keep-Alive" : "Close");
+  http_append_length_and_connection(hr, &hdrs, rc, contentlen,
+                                    transfer_encoding != NULL &&
+                                    !strcasecmp(transfer_encoding, "chunked"));
 
   if(encoding != NULL)
-    mbuf_qprintf(&hdrs, "Content-Encoding: %s\r\n", encoding);
+    hdr_str(&hdrs, "Content-Encoding", encoding);
+
+  if(hr->hr_vary_encoding)
+    hdr_lit(&hdrs, "Vary: Accept-Encoding\r\n");
 
   if(transfer_encoding != NULL)
-    mbuf_qprintf(&hdrs, "Transfer-Encoding: %s\r\n", transfer_encoding);
+    hdr_str(&hdrs, "Transfer-Encoding", transfer_encoding);
 
   if(location != NULL)
-    mbuf_qprintf(&hdrs, "Location: %s\r\n", location);
+    hdr_str(&hdrs, "Location", location);
 
   if(content != NULL)
-    mbuf_qprintf(&hdrs, "Content-Type: %s\r\n", content);
-
+    hdr_str(&hdrs, "Content-Type", content);
 
   if(range) {
-    mbuf_qprintf(&hdrs, "Accept-Ranges: %s\r\n", "bytes");
-    mbuf_qprintf(&hdrs, "Content-Range: %s\r\n", range);
+    hdr_lit(&hdrs, "Accept-Ranges: bytes\r\n");
+    hdr_str(&hdrs, "Content-Range", range);
   }
 
   if(disposition != NULL)
-    mbuf_qprintf(&hdrs, "Content-Disposition: %s\r\n", disposition);
+    hdr_str(&hdrs, "Content-Disposition", disposition);
 
-  http_arg_t *ra;
-  TAILQ_FOREACH(ra, &hr->hr_response_headers, link)
-    mbuf_qprintf(&hdrs, "%s: %s\r\n", ra->key, ra->val);
+  http_append_response_headers(hr, &hdrs);
 
-  mbuf_qprintf(&hdrs, "\r\n");
+  hdr_lit(&hdrs, "\r\n");
   //  fprintf(stderr, "-- OUTPUT ------------------\n");
   //  mbuf_dump_raw_stderr(&hdrs);
   //  fprintf(stderr, "----------------------------\n");
 
-  asyncio_sendq(hr->hr_connection->hc_af, &hdrs, 0);
+  http_send_head(hr, rc, &hdrs);
   return 0;
 }
 
 
 
 /**
- * Transmit a HTTP reply
+ * Response compression
+ *
+ * z_streams are expensive to set up (~256k of state for deflate) so
+ * they are kept in a pool and reset between uses
  */
-int
-http_send_reply(http_request_t *hr, int rc, const char *content,
-		const char *encoding, const char *location, int maxage)
-{
-  const char *rcstr = http_rc2str(rc);
-  http_log(hr, rc, rcstr);
+#define HTTP_ZPOOL_MAX 32
 
-  if(http_send_header(hr, rc, rcstr, content, hr->hr_reply.mq_size,
-                      encoding, location, maxage, 0, NULL, NULL))
-    return -1;
+typedef enum {
+  HTTP_CODING_IDENTITY,
+  HTTP_CODING_GZIP,
+  HTTP_CODING_DEFLATE,
+} http_coding_t;
 
-  if(hr->hr_no_output)
-    return 0;
+typedef struct http_zstream {
+  z_stream hz_z;
+  struct http_zstream *hz_next;
+  int hz_level;
+} http_zstream_t;
 
-  asyncio_sendq(hr->hr_connection->hc_af, &hr->hr_reply, 0);
-  return 0;
-}
+static pthread_mutex_t http_zpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static http_zstream_t *http_zpool[3];
+static int http_zpool_size[3];
 
 
 /**
- * Send HTTP error back
+ *
  */
-int
-http_err(http_request_t *hr, int error, const char *str)
+static http_zstream_t *
+http_zstream_get(http_coding_t coding, int level)
 {
-  const char *errtxt;
-  if(str != NULL) {
-    char *x = mystrdupa(str);
-    for(int i = 0; x[i]; i++) {
-      if(x[i] < 32)
-        x[i] = 32;
-    }
-    errtxt = x;
-  } else {
-    errtxt = http_rc2str(error);
+  pthread_mutex_lock(&http_zpool_mutex);
+  http_zstream_t *hz = http_zpool[coding];
+  if(hz != NULL) {
+    http_zpool[coding] = hz->hz_next;
+    http_zpool_size[coding]--;
   }
+  pthread_mutex_unlock(&http_zpool_mutex);
 
-  mbuf_clear(&hr->hr_reply);
+  if(hz != NULL) {
+    if(hz->hz_level != level) {
+      deflateParams(&hz->hz_z, level, Z_DEFAULT_STRATEGY);
+      hz->hz_level = level;
+    }
+    return hz;
+  }
 
-  if(error != 304) {
+  hz = calloc(1, sizeof(http_zstream_t));
+  // windowBits + 16 selects gzip framing instead of zlib
+  const int window_bits = coding == HTTP_CODING_GZIP ? 15 + 16 : 15;
+  if(deflateInit2(&hz->hz_z, level, Z_DEFLATED, window_bits,
+                  8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(hz);
+    return NULL;
+  }
+  hz->hz_level = level;
+  return hz;
+}
 
-    mbuf_qprintf(&hr->hr_reply,
-                   "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
-                   "<HTML><HEAD>\r\n"
-                   "<TITLE>%d %s</TITLE>\r\n"
-                   "</HEAD><BODY>\r\n"
-                   "<H1>%d %s</H1>\r\n",
-                   error, errtxt, error, errtxt);
 
-    if(str != NULL)
-      mbuf_qprintf(&hr->hr_reply, "<p>%s</p>\r\n", str);
-
-    mbuf_qprintf(&hr->hr_reply, "</BODY></HTML>\r\n");
+/**
+ *
+ */
+static void
+http_zstream_put(http_zstream_t *hz, http_coding_t coding)
+{
+  deflateReset(&hz->hz_z);
+
+  pthread_mutex_lock(&http_zpool_mutex);
+  if(http_zpool_size[coding] < HTTP_ZPOOL_MAX) {
+    hz->hz_next = http_zpool[coding];
+    http_zpool[coding] = hz;
+    http_zpool_size[coding]++;
+    hz = NULL;
   }
+  pthread_mutex_unlock(&http_zpool_mutex);
 
-  http_log(hr, error, errtxt);
-
-  if(http_send_header(hr, error, str, NULL, hr->hr_reply.mq_size,
-                      NULL, NULL, 0, 0, NULL, NULL))
-    return 0;
-
-  if(!hr->hr_no_output)
-    asyncio_sendq(hr->hr_connection->hc_af, &hr->hr_reply, 0);
-  return 0;
+  if(hz != NULL) {
+    deflateEnd(&hz->hz_z);
+    free(hz);
+  }
 }
 
 
 /**
- * Send HTTP error back
+ * Pick content coding from Accept-Encoding. gzip is preferred. "*"
+ * only covers codings that are not listed explicitly
  */
-void
-http_error(http_request_t *hr, int error)
+static http_coding_t
+http_accepted_coding(const http_request_t *hr)
 {
-  http_err(hr, error, NULL);
+  const char *s = http_req_header_id(hr, HTTP_HDR_ACCEPT_ENCODING);
+  int gzip = -1, deflate = -1, any = 0;  // -1 is not listed
+
+  while(s != NULL && *s) {
+    while(*s == ' ' || *s == '\t' || *s == ',')
+      s++;
+
+    const char *name = s;
+    while(*s && *s != ',' && *s != ';' && *s != ' ' && *s != '\t')
+      s++;
+    const int namelen = s - name;
+
+    // Only parameter we care about is q, "q=0" means not acceptable
+    int ok = 1;
+    while(*s && *s != ',') {
+      if(*s == ';') {
+        s++;
+        while(*s == ' ' || *s == '\t')
+          s++;
+        if((*s == 'q' || *s == 'Q') && s[1] == '=')
+          ok = strtod(s + 2, NULL) > 0;
+      } else {
+        s++;
+      }
+    }
+
+    if(namelen == 4 && !strncasecmp(name, "gzip", 4))
+      gzip = ok;
+    else if(namelen == 7 && !strncasecmp(name, "deflate", 7))
+      deflate = ok;
+    else if(namelen == 1 && *name == '*')
+      any = ok;
+  }
+
+  if(gzip == -1)
+    gzip = any;
+  if(deflate == -1)
+    deflate = any;
+
+  if(gzip)
+    return HTTP_CODING_GZIP;
+  if(deflate)
+    return HTTP_CODING_DEFLATE;
+  return HTTP_CODING_IDENTITY;
 }
 
 
 /**
- * Send an HTTP OK, simple version for text/html
+ * Cached replies are stored as sent, so they differ per accepted coding
  */
-int
-http_output_html(http_request_t *hr)
+static int
+http_cache_variant(const http_request_t *hr)
 {
-  return http_send_reply(hr, HTTP_STATUS_OK, "text/html; charset=UTF-8",
-			 NULL, NULL, 0);
+  return http_accepted_coding(hr);
 }
 
+
 /**
- * Send an HTTP OK, simple version for text/html
+ *
  */
-int
-http_output_content(http_request_t *hr, const char *content)
+static int
+http_is_compressible(const http_server_t *hs, const char *content)
 {
-  return http_send_reply(hr, HTTP_STATUS_OK, content, NULL, NULL, 0);
+  const size_t ctlen = strcspn(content, "; ");
+
+  for(int i = 0; i < hs->hs_compress_types.count; i++) {
+    const char *type = strvec_get(&hs->hs_compress_types, i);
+    const size_t len = strlen(type);
+    if(len > 0 && type[len - 1] == '/') {
+      if(len <= ctlen && !strncasecmp(content, type, len))
+        return 1;
+    } else if(len == ctlen && !strncasecmp(content, type, len)) {
+      return 1;
+    }
+  }
+  return 0;
 }
 
 
-
 /**
- * Send an HTTP REDIRECT
+ * Compress 'mq' in place, one buffer at a time
  */
-void
-http_redirect(http_request_t *hr, const char *location, int status)
+static int
+http_compress_mbuf(mbuf_t *mq, http_coding_t coding, int level)
 {
-  mbuf_clear(&hr->hr_reply);
+  http_zstream_t *hz = http_zstream_get(coding, level);
+  if(hz == NULL)
+    return -1;
 
-  mbuf_qprintf(&hr->hr_reply,
-		 "<!DOCTYPE html>\r\n"
-		 "<HTML><HEAD>\r\n"
-		 "<TITLE>Redirect</TITLE>\r\n"
-		 "</HEAD><BODY>\r\n"
-		 "Please follow <a href=\"%s\">%s</a>\r\n"
-		 "</BODY></HTML>\r\n",
-		 location, location);
+  z_stream *z = &hz->hz_z;
+  mbuf_data_t *md;
 
-  http_send_reply(hr, status, "text/html", NULL, location, 0);
-}
+  // Everything fits in a single buffer of this size
+  size_t bufsize = deflateBound(z, mq->mq_size);
+  uint8_t *buf = malloc(bufsize);
+  z->next_out = buf;
+  z->avail_out = bufsize;
 
+  while((md = TAILQ_FIRST(&mq->mq_buffers)) != NULL) {
+    z->next_in  = md->md_data     + md->md_data_off;
+    z->avail_in = md->md_data_len - md->md_data_off;
+    const int flush = TAILQ_NEXT(md, md_link) ? Z_NO_FLUSH : Z_FINISH;
+    int ret;
 
-/**
- * Resolve URL and invoke handler
- *
- * If 'cont' is set we are pre-resolving for a 'Expect: 100-continue'
- * request
- *
- * If this function returns non-zero the conncetion will be terminated
- *
- * Normal errors are supposed to be handled without having to disconnection
- * the connection and thus they are sent inside here using http_error()
- *
- */
-static void
-http_resolve(http_request_t *hr)
-{
-  int err;
+    while(1) {
+      ret = deflate(z, flush);
+      assert(ret != Z_STREAM_ERROR);
+      if(z->avail_out != 0 && (flush != Z_FINISH || ret == Z_STREAM_END))
+        break;
+      // Should not happen, but don't trust the bound blindly
+      const size_t used = bufsize - z->avail_out;
+      bufsize *= 2;
+      buf = realloc(buf, bufsize);
+      z->next_out = buf + used;
+      z->avail_out = bufsize - used;
+    }
 
-  err = http_resolve_route(hr, 0);
+    mbuf_data_free(mq, md);
+  }
 
-  if(err == 404)
-    err = http_resolve_path(hr);
+  const size_t have = bufsize - z->avail_out;
+  http_zstream_put(hz, coding);
 
-  if(err)
-    http_error(hr, err);
+  mq->mq_size = 0;
+  mbuf_append_prealloc(mq, realloc(buf, have), have);
+  return 0;
 }
 
 
 /**
- *
+ * Transmit a HTTP reply
  */
-static void
-http_dispatch_request(http_request_t *hr)
+int
+http_send_reply(http_request_t *hr, int rc, const char *content,
+		const char *encoding, const char *location, int maxage)
 {
-  char *v, *argv[2];
-  int n;
-  uint8_t authbuf[150];
-  /* Extract authorization */
-  if((v = http_arg_get(&hr->hr_request_headers, "Authorization")) != NULL) {
-    v = mystrdupa(v);
-    if((n = str_tokenize(v, argv, 2, -1)) == 2) {
-
-      if(!strcasecmp(argv[0], "basic")) {
-        n = base64_decode(authbuf, argv[1], sizeof(authbuf) - 1);
-        authbuf[n] = 0;
-        if((n = str_tokenize((char *)authbuf, argv, 2, ':')) == 2) {
-          hr->hr_username = strdup(argv[0]);
-          hr->hr_password = strdup(argv[1]);
-        }
-      }
-    }
-  }
+  const char *rcstr = http_rc2str(rc);
+  const http_server_t *hs = hr->hr_connection->hc_server;
+  http_log(hr, rc, rcstr);
 
-  http_connection_t *hc = hr->hr_connection;
-  http_server_t *hs = hc->hc_server;
-  if(hs->hs_real_ip_header != NULL) {
-    if((v = http_arg_get(&hr->hr_request_headers,
-                         hs->hs_real_ip_header)) != NULL) {
-      hr->hr_peer_addr = strdup(v);
+  if(encoding == NULL && content != NULL &&
+     http_is_compressible(hs, content)) {
+    // Response varies on Accept-Encoding even if we don't compress this
+    // particular one (too small, client doesn't accept it, etc)
+    hr->hr_vary_encoding = 1;
+
+    if(hr->hr_reply.mq_size > 0 &&
+       hr->hr_reply.mq_size >= hs->hs_compress_min_size &&
+       rc != HTTP_STATUS_PARTIAL_CONTENT) {
+      const http_coding_t coding = http_accepted_coding(hr);
+      if(coding != HTTP_CODING_IDENTITY &&
+         !http_compress_mbuf(&hr->hr_reply, coding, hs->hs_compress_level))
+        encoding = coding == HTTP_CODING_GZIP ? "gzip" : "deflate";
     }
   }
 
-  if(hr->hr_peer_addr == NULL) {
-    hr->hr_peer_addr = strdup(hc->hc_peer_addr);
-  }
+  hr->hr_cork_head = !hr->hr_no_output && hr->hr_reply.mq_size > 0;
 
-  if((v = http_arg_get(&hr->hr_request_headers, "Cookie")) != NULL) {
-    v = mystrdupa(v);
-    char *x = strstr(v, PROGNAME".session=");
-    if(x != NULL) {
-      x += strlen(PROGNAME".session=");
-      char *e = strchr(x, ';');
-      if(e != NULL)
-        *e = 0;
-      get_session_cookie(hr, x);
-    }
-  }
+  if(hr->hr_cache_fill != NULL && !http_session_changed(hr))
+    http_cache_store(hr->hr_cache_fill, rc, content, encoding, maxage,
+                     hr->hr_vary_encoding, &hr->hr_response_headers,
+                     &hr->hr_reply);
 
-  if(hr->hr_session_received == NULL)
-    hr->hr_session_received = ntv_create_map();
+  if(http_send_header(hr, rc, rcstr, content, hr->hr_reply.mq_size,
+                      encoding, location, maxage, 0, NULL, NULL))
+    return -1;
 
-  hr->hr_session = ntv_copy(hr->hr_session_received);
+  if(hr->hr_no_output)
+    return 0;
 
-  char *args = strchr(hr->hr_path, '?');
-  if(args != NULL) {
-    *args = 0;
-    hr->hr_args = strdup(args + 1);
-    http_parse_query_args(hr, args + 1);
-  }
+  http_sendq(hr, &hr->hr_reply);
+  return 0;
+}
 
-  // Websocket connection
-  if(hc->hc_ws_path) {
-    int err = websocket_response(hr);
-    if(err) {
-      http_error(hr, err);
-      return;
-    }
 
-    http_log(hr, 101, hc->hc_z_out ? "Websocket upgrade, per-message-deflate"
-             : "Websocket upgrade");
-    hr->hr_keep_alive = 2;
-    return;
-  }
+/**
+ * Streaming responses
+ */
+int
+http_response_begin(http_request_t *hr, int rc, const char *content,
+                    int64_t contentlen, const char *encoding, int maxage)
+{
+  const char *rcstr = http_rc2str(rc);
+  const char *te = NULL;
 
-  // Handle 100-continue stuff
-  if(hr->hr_100_continue_check) {
-    hr->hr_keep_alive = 1;
-    int err = http_resolve_route(hr, 1);
+  hr->hr_response_left = contentlen;
+  mbuf_clear(&hr->hr_reply);
+  mbuf_set_chunk_size(&hr->hr_reply, 16384);
 
-    if(err == 100) {
-      http_send_100_continue(hr);
-      return;
+  if(contentlen < 0 && hr->hr_h2_stream == NULL) {
+    // HTTP/2 has its own framing
+    if(hr->hr_major == 1 && hr->hr_minor >= 1) {
+      hr->hr_chunked = 1;
+      te = "chunked";
+    } else {
+      // HTTP/1.0, response is delimited by connection close
+      hr->hr_keep_alive = 0;
     }
-
-    if(err != 0)
-      http_error(hr, err);
-
-    return;
   }
 
-  // Handle POST/PUT payload
-  if(hr->hr_body && hr->hr_body_size > 0) {
-    /* Parse content-type */
-    v = http_arg_get(&hr->hr_request_headers, "Content-Type");
-    if(v == NULL) {
-      http_err(hr, HTTP_STATUS_BAD_REQUEST, "No Content-Type");
-      return;
-    }
-    v = mystrdupa(v);
-    n = str_tokenize(v, argv, 2, ';');
-    if(n == 0) {
-      http_err(hr, HTTP_STATUS_BAD_REQUEST, "Malformed Content-Type");
-      return;
-    }
-
-    assert(hr->hr_post_message == NULL);
-    if(!strcmp(argv[0], "application/json") &&
-       http_arg_get(&hr->hr_request_headers, "content-encoding") == NULL) {
-      char errbuf[256];
-      hr->hr_post_message = ntv_json_deserialize(hr->hr_body,
-                                                 errbuf, sizeof(errbuf));
-      if(hr->hr_post_message == NULL) {
-        http_err(hr, HTTP_STATUS_BAD_REQUEST, errbuf);
-        return;
-      }
-    }
-  }
-  http_resolve(hr);
+  http_log(hr, rc, rcstr);
+  const int r = http_send_header(hr, rc, rcstr, content, MAX(contentlen, 0),
+                                 encoding, NULL, maxage, NULL, NULL, te);
+  hr->hr_bytes_sent = 0;  // Counted as it's written
+  return r;
 }
 
 
 /**
- *
+ * Send whatever has been collected in hr_reply
  */
-static void
-http_request_destroy(http_request_t *hr)
+static int
+http_response_flush(http_request_t *hr)
 {
-  if(hr->hr_username != NULL) {
-    memset(hr->hr_username, 0, strlen(hr->hr_username));
-    free(hr->hr_username);
-  }
+  http_connection_t *hc = hr->hr_connection;
+  const http_server_t *hs = hc->hc_server;
+  mbuf_t *mq = &hr->hr_reply;
+  const size_t len = mq->mq_size;
 
-  if(hr->hr_password != NULL) {
-    memset(hr->hr_password, 0, strlen(hr->hr_password));
-    free(hr->hr_password);
+  if(len == 0)
+    return 0;
+
+  if(hr->hr_response_left >= 0) {
+    if(len > hr->hr_response_left) {
+      trace(LOG_ERR, "HTTP: %s: Response exceeds announced Content-Length",
+            hr->hr_path);
+      hr->hr_keep_alive = 0;
+      mbuf_clear(mq);
+      return -1;
+    }
+    hr->hr_response_left -= len;
   }
 
-  free(hr->hr_path);
-  free(hr->hr_remain);
-  free(hr->hr_args);
-  http_arg_flush(&hr->hr_request_headers);
-  http_arg_flush(&hr->hr_response_headers);
-  http_arg_flush(&hr->hr_query_args);
-  free(hr->hr_body);
-  free(hr->hr_peer_addr);
+  // Requests served on the asyncio thread can't wait for it to drain
+  // the queue. HTTP/2 streams also wait for their flow control window
+  if(!hr->hr_inline &&
+     (asyncio_sendq_wait(hc->hc_af, hs->hs_send_buffer_size,
+                         hs->hs_send_buffer_size / 2, 30) ||
+      (hr->hr_h2_stream != NULL &&
+       h2_stream_wait(hr, hs->hs_send_buffer_size, 30)))) {
+    mbuf_clear(mq);
+    return -1;
+  }
 
-  ntv_release(hr->hr_post_message);
-  ntv_release(hr->hr_session_received);
-  ntv_release(hr->hr_session);
+  if(hr->hr_method == HTTP_HEAD) {
+    mbuf_clear(mq);
+    return 0;
+  }
 
-  http_connection_t *hc = hr->hr_connection;
+  hr->hr_bytes_sent += len;
 
-  switch(hr->hr_keep_alive) {
-  case 0:
-    asyncio_shutdown(hc->hc_af);
-    // FALLTHRU. We need to reenable so we can catch when the socket closes
-  case 1:
-    asyncio_run_task(http_connection_reenable, hc);
-    break;
-  case 2: // Websocket
-    http_connection_release(hc);
-    break;
+  if(hr->hr_chunked) {
+    char hdr[20];
+    const int hlen = snprintf(hdr, sizeof(hdr), "%zx\r\n", len);
+    mbuf_append(mq, "\r\n", 2);
+    return asyncio_sendq_with_hdr(hc->hc_af, hdr, hlen, mq, 0) ? -1 : 0;
   }
-  mbuf_clear(&hr->hr_reply);
-  free(hr);
-
+  return http_sendq(hr, mq) ? -1 : 0;
 }
 
 
-
 /**
- * Process a request, extract info from headers, dispatch command
+ * Small writes are coalesced in hr_reply so queued data is not dominated
+ * by per-buffer overhead (and so chunks are reasonably sized)
  */
-static void
-http_dispatch_request_task(void *aux)
+#define HTTP_RESPONSE_FLUSH_SIZE 65536
+
+int
+http_response_write(http_request_t *hr, const void *data, size_t len)
 {
-  http_request_t *hr = aux;
-  hr->hr_req_process = asyncio_now();
-  http_dispatch_request(hr);
-  http_request_destroy(hr);
+  mbuf_append(&hr->hr_reply, data, len);
+  if(hr->hr_reply.mq_size < HTTP_RESPONSE_FLUSH_SIZE)
+    return 0;
+  return http_response_flush(hr);
 }
 
 
-
-
-
 /**
- * Delete all arguments associated with a connection
+ *
  */
-void
-http_arg_flush(struct http_arg_list *list)
+int
+http_response_writeq(http_request_t *hr, mbuf_t *mq)
 {
-  http_arg_t *ra;
-  while((ra = TAILQ_FIRST(list)) != NULL) {
-    TAILQ_REMOVE(list, ra, link);
-    free(ra->key);
-    free(ra->val);
-    free(ra);
-  }
+  mbuf_appendq(&hr->hr_reply, mq);
+  if(hr->hr_reply.mq_size < HTTP_RESPONSE_FLUSH_SIZE)
+    return 0;
+  return http_response_flush(hr);
 }
 
 
 /**
- * Find an argument associated with a connection
+ *
  */
-char *
-http_arg_get(struct http_arg_list *list, const char *name)
+int
+http_response_end(http_request_t *hr)
 {
-  http_arg_t *ra;
-  TAILQ_FOREACH(ra, list, link)
-    if(!strcasecmp(ra->key, name))
-      return ra->val;
-  return NULL;
+  if(http_response_flush(hr))
+    return -1;
+
+  if(hr->hr_method == HTTP_HEAD)
+    hr->hr_response_left = 0;
+
+  if(hr->hr_chunked) {
+    hr->hr_chunked = 0;
+    if(hr->hr_method == HTTP_HEAD)
+      return 0;
+    return asyncio_send(hr->hr_connection->hc_af, "0\r\n\r\n", 5, 0) ?
+      -1 : 0;
+  }
+
+  if(hr->hr_response_left > 0) {
+    // Client will wait for the rest, only way out is to close
+    hr->hr_keep_alive = 0;
+    return -1;
+  }
+  return 0;
 }
 
 
@@ -878,685 +1365,5030 @@ http_arg_get(struct http_arg_list *list, const char *name)
  *
  */
 int
-http_arg_get_int(struct http_arg_list *list, const char *name,
-                 int def)
+http_response_sendq(http_request_t *hr, mbuf_t *mq)
 {
-  const char *arg = http_arg_get(list, name);
-  return arg ? atoi(arg) : def;
+  // An empty chunk would end a chunked response
+  if(mq->mq_size == 0)
+    return 0;
+
+  if(hr->hr_method == HTTP_HEAD) {
+    mbuf_clear(mq);
+    return 0;
+  }
+
+  if(hr->hr_response_left >= 0) {
+    if(mq->mq_size > hr->hr_response_left) {
+      trace(LOG_ERR, "HTTP: %s: Response exceeds announced Content-Length",
+            hr->hr_path);
+      hr->hr_keep_alive = 0;
+      mbuf_clear(mq);
+      return -1;
+    }
+    hr->hr_response_left -= mq->mq_size;
+  }
+
+  hr->hr_bytes_sent += mq->mq_size;
+
+  if(hr->hr_chunked) {
+    char hdr[20];
+    const int hlen = snprintf(hdr, sizeof(hdr), "%zx\r\n", mq->mq_size);
+    mbuf_append(mq, "\r\n", 2);
+    return asyncio_sendq_with_hdr(hr->hr_connection->hc_af, hdr, hlen,
+                                  mq, 0) ? -1 : 0;
+  }
+  return http_sendq(hr, mq) ? -1 : 0;
 }
 
 
 /**
- * Set an argument associated with a connection
+ *
  */
-void
-http_arg_set(struct http_arg_list *list, const char *key,
-             const char *val)
+size_t
+http_response_queued(http_request_t *hr)
 {
-  http_arg_t *ra;
-
-  ra = malloc(sizeof(http_arg_t));
-  TAILQ_INSERT_TAIL(list, ra, link);
-  ra->key = strdup(key);
-  ra->val = strdup(val);
+  if(hr->hr_h2_stream != NULL)
+    return h2_stream_queued(hr);
+  return asyncio_sendq_size(hr->hr_connection->hc_af);
 }
 
 
+/**
+ * Pre-rendered response header block. Everything but the protocol version
+ * and the per-request headers (Date, Content-Length, Connection, etc)
+ */
+struct http_response_template {
+  int hrt_status;
+  int hrt_maxage;
+  size_t hrt_len;
+  char hrt_block[0];
+};
+
+
 /**
  *
  */
-static int route_cmp(const http_route_t *a, const http_route_t *b)
+http_response_template_t *
+http_response_template_create(int rc, const char *content,
+                              const char *encoding, int maxage,
+                              const struct http_arg_list *headers)
 {
-  return b->hr_depth - a->hr_depth;
+  const http_arg_t *ra;
+  mbuf_t m;
+  mbuf_init(&m);
+
+  http_append_status(&m, rc, http_rc2str(rc));
+
+  hdr_lit(&m, "Server: "PROGNAME"\r\n");
+
+  // Last-Modified is per request so it's not included here
+  http_append_cache_control(&m, maxage, 0);
+
+  if(encoding != NULL)
+    hdr_str(&m, "Content-Encoding", encoding);
+
+  if(content != NULL)
+    hdr_str(&m, "Content-Type", content);
+
+  if(headers != NULL) {
+    TAILQ_FOREACH(ra, headers, link) {
+      mbuf_append(&m, ra->key, strlen(ra->key));
+      hdr_append_str(&m, ": ", 2, ra->val);
+    }
+  }
+
+  http_response_template_t *hrt =
+    malloc(sizeof(http_response_template_t) + m.mq_size);
+  hrt->hrt_status = rc;
+  hrt->hrt_maxage = maxage;
+  hrt->hrt_len = m.mq_size;
+  mbuf_read(&m, hrt->hrt_block, hrt->hrt_len);
+  return hrt;
 }
 
+
 /**
- * Add a regexp'ed route
+ *
  */
 void
-http_route_add(const char *path, http_callback2_t *callback, int flags)
+http_response_template_destroy(http_response_template_t *hrt)
 {
-  http_route_t *hr = malloc(sizeof(http_route_t));
-  int i;
+  free(hrt);
+}
 
-  int len = strlen(path);
 
-  hr->hr_flags = flags;
-  hr->hr_depth = 0;
+/**
+ * Transmit hr_reply using a pre-rendered header block
+ */
+int
+http_send_reply_template(http_request_t *hr,
+                         const http_response_template_t *hrt)
+{
+  mbuf_t hdrs;
+  time_t now = time(NULL);
 
-  for(i = 0; i < len; i++)
-    if(path[i] == '/')
-      hr->hr_depth++;
+  http_log(hr, hrt->hrt_status, http_rc2str(hrt->hrt_status));
 
-  char *p = malloc(len + 2);
-  p[0] = '^';
-  strcpy(p+1, path);
+  mbuf_init(&hdrs);
+  mbuf_append(&hdrs, http_req_ver_str(hr), 8);
+  mbuf_append(&hdrs, hrt->hrt_block, hrt->hrt_len);
 
-  int rval = regcomp(&hr->hr_reg, p, REG_ICASE | REG_EXTENDED);
-  free(p);
-  if(rval) {
-    char errbuf[256];
-    regerror(rval, &hr->hr_reg, errbuf, sizeof(errbuf));
-    trace(LOG_ALERT, "Failed to compile regex for HTTP route %s -- %s",
-          path, errbuf);
-    exit(1);
+  http_send_common_headers(hr, &hdrs, now);
+
+  if(hrt->hrt_maxage)
+    hdr_str(&hdrs, "Last-Modified", http_date_now(now));
+
+  http_append_length_and_connection(hr, &hdrs, hrt->hrt_status,
+                                    hr->hr_reply.mq_size, 0);
+  http_append_response_headers(hr, &hdrs);
+  hdr_lit(&hdrs, "\r\n");
+
+  hr->hr_cork_head = !hr->hr_no_output && hr->hr_reply.mq_size > 0;
+  http_send_head(hr, hrt->hrt_status, &hdrs);
+
+  if(!hr->hr_no_output)
+    http_sendq(hr, &hr->hr_reply);
+  return 0;
+}
+
+
+/**
+ * Send HTTP error back
+ */
+int
+http_err(http_request_t *hr, int error, const char *str)
+{
+  const char *errtxt;
+  if(str != NULL) {
+    char *x = mystrdupa(str);
+    for(int i = 0; x[i]; i++) {
+      if(x[i] < 32)
+        x[i] = 32;
+    }
+    errtxt = x;
+  } else {
+    errtxt = http_rc2str(error);
   }
 
-  hr->hr_path     = strdup(path);
-  hr->hr_callback = callback;
-  LIST_INSERT_SORTED(&http_routes, hr, hr_link, route_cmp);
+  mbuf_clear(&hr->hr_reply);
+
+  if(error != 304) {
+
+    mbuf_qprintf(&hr->hr_reply,
+                   "<!DOCTYPE HTML PUBLIC \"-//IETF//DTD HTML 2.0//EN\">\r\n"
+                   "<HTML><HEAD>\r\n"
+                   "<TITLE>%d %s</TITLE>\r\n"
+                   "</HEAD><BODY>\r\n"
+                   "<H1>%d %s</H1>\r\n",
+                   error, errtxt, error, errtxt);
+
+    if(str != NULL)
+      mbuf_qprintf(&hr->hr_reply, "<p>%s</p>\r\n", str);
+
+    mbuf_qprintf(&hr->hr_reply, "</BODY></HTML>\r\n");
+  }
+
+  http_log(hr, error, errtxt);
+
+  hr->hr_cork_head = !hr->hr_no_output && hr->hr_reply.mq_size > 0;
+  if(http_send_header(hr, error, str, NULL, hr->hr_reply.mq_size,
+                      NULL, NULL, 0, 0, NULL, NULL))
+    return 0;
+
+  if(!hr->hr_no_output)
+    http_sendq(hr, &hr->hr_reply);
+  return 0;
 }
 
+
 /**
- *
+ * Send HTTP error back
  */
-static int path_cmp(const http_path_t *a, const http_path_t *b)
+void
+http_error(http_request_t *hr, int error)
 {
-  return b->hp_depth - a->hp_depth;
+  http_err(hr, error, NULL);
 }
 
+
 /**
- * Add a callback for a given "virtual path" on our HTTP server
+ * Send an HTTP OK, simple version for text/html
+ */
+int
+http_output_html(http_request_t *hr)
+{
+  return http_send_reply(hr, HTTP_STATUS_OK, "text/html; charset=UTF-8",
+			 NULL, NULL, 0);
+}
+
+/**
+ * Send an HTTP OK, simple version for text/html
+ */
+int
+http_output_content(http_request_t *hr, const char *content)
+{
+  return http_send_reply(hr, HTTP_STATUS_OK, content, NULL, NULL, 0);
+}
+
+
+
+/**
+ * Send an HTTP REDIRECT
  */
 void
-http_path_add(const char *path, void *opaque, http_callback_t *callback)
+http_redirect(http_request_t *hr, const char *location, int status)
 {
-  http_path_t *hp = calloc(1, sizeof(http_path_t));
+  mbuf_clear(&hr->hr_reply);
 
-  hp->hp_len      = strlen(path);
+  mbuf_qprintf(&hr->hr_reply,
+		 "<!DOCTYPE html>\r\n"
+		 "<HTML><HEAD>\r\n"
+		 "<TITLE>Redirect</TITLE>\r\n"
+		 "</HEAD><BODY>\r\n"
+		 "Please follow <a href=\"%s\">%s</a>\r\n"
+		 "</BODY></HTML>\r\n",
+		 location, location);
 
-  for(int i = 0; i < hp->hp_len; i++)
-    if(path[i] == '/')
-      hp->hp_depth++;
+  http_send_reply(hr, status, "text/html", NULL, location, 0);
+}
 
-  hp->hp_path     = strdup(path);
-  hp->hp_opaque   = opaque;
-  hp->hp_callback = callback;
-  LIST_INSERT_SORTED(&http_paths, hp, hp_link, path_cmp);
+
+/**
+ * Resolve URL and invoke handler
+ *
+ * If 'cont' is set we are pre-resolving for a 'Expect: 100-continue'
+ * request
+ *
+ * If this function returns non-zero the conncetion will be terminated
+ *
+ * Normal errors are supposed to be handled without having to disconnection
+ * the connection and thus they are sent inside here using http_error()
+ *
+ */
+static void
+http_resolve(http_request_t *hr)
+{
+  int err;
+
+  err = http_resolve_route(hr, 0);
+
+  if(err == 404 || err == HTTP_STATUS_METHOD_NOT_ALLOWED) {
+    int err2 = http_resolve_path(hr);
+    if(err2 != 404)
+      err = err2;
+  }
+
+  if(err && err != HTTP_STATUS_PENDING)
+    http_error(hr, err);
 }
 
 
 /**
- * Parse arguments of a HTTP GET url, not perfect, but works for us
+ * Admission control
+ *
+ * Per client state (open connections and a request token bucket) is kept
+ * in a hash table keyed on peer address. The table is split in shards
+ * with a lock each so concurrent requests rarely contend. When a shard
+ * is full the least recently used entry without connections is evicted
+ * to make room. If none is found among the first HTTP_LIMIT_EVICT_SCAN
+ * the new client is refused.
+ */
+
+#define HTTP_LIMIT_SHARDS      64
+#define HTTP_LIMIT_HASH_SIZE   64
+#define HTTP_LIMIT_SHARD_MAX   1024
+#define HTTP_LIMIT_EVICT_SCAN  16
+
+typedef struct http_limit_entry {
+  LIST_ENTRY(http_limit_entry) hle_link;
+  TAILQ_ENTRY(http_limit_entry) hle_lru_link;
+  uint32_t hle_hash;
+  int hle_connections;
+  double hle_tokens;
+  int64_t hle_refill;     // Time when hle_tokens was computed
+  char hle_key[0];
+} http_limit_entry_t;
+
+LIST_HEAD(http_limit_entry_list, http_limit_entry);
+TAILQ_HEAD(http_limit_entry_queue, http_limit_entry);
+
+typedef struct http_limit_shard {
+  pthread_mutex_t hls_mutex;
+  int hls_entries;
+  struct http_limit_entry_queue hls_lru;  // Least recently used first
+  struct http_limit_entry_list hls_hash[HTTP_LIMIT_HASH_SIZE];
+} http_limit_shard_t;
+
+
+/**
+ *
+ */
+static http_limit_shard_t *
+http_limit_shard(const http_server_t *hs, uint32_t hash)
+{
+  return &hs->hs_limit_shards[hash % HTTP_LIMIT_SHARDS];
+}
+
+
+/**
+ * Refill token bucket up to now
  */
 static void
-http_parse_query_args(http_request_t *hr, char *args)
+http_limit_refill(const http_server_t *hs, http_limit_entry_t *hle,
+                  int64_t now)
 {
-  char *k, *v;
+  if(now > hle->hle_refill) {
+    hle->hle_tokens += (now - hle->hle_refill) * hs->hs_request_rate / 1e6;
+    if(hle->hle_tokens > hs->hs_request_burst)
+      hle->hle_tokens = hs->hs_request_burst;
+  }
+  hle->hle_refill = now;
+}
 
-  while(args) {
-    k = args;
-    if((args = strchr(args, '=')) == NULL)
-      break;
-    *args++ = 0;
-    v = args;
-    args = strchr(args, '&');
 
-    if(args != NULL)
-      *args++ = 0;
+/**
+ * Free the least recently used entry that has no connections (those are
+ * referenced by the connection). Entries in use are moved to the back
+ * as they're passed. Returns -1 if nothing could be evicted
+ */
+static int
+http_limit_evict(http_limit_shard_t *hls)
+{
+  for(int i = 0; i < HTTP_LIMIT_EVICT_SCAN; i++) {
+    http_limit_entry_t *hle = TAILQ_FIRST(&hls->hls_lru);
+    TAILQ_REMOVE(&hls->hls_lru, hle, hle_lru_link);
+    if(hle->hle_connections) {
+      TAILQ_INSERT_TAIL(&hls->hls_lru, hle, hle_lru_link);
+      continue;
+    }
+    LIST_REMOVE(hle, hle_link);
+    hls->hls_entries--;
+    free(hle);
+    return 0;
+  }
+  return -1;
+}
 
-    http_deescape(k);
-    http_deescape(v);
-    http_arg_set(&hr->hr_query_args, k, v);
+
+/**
+ * Find or create entry. Shard must be locked. Returns NULL if the shard
+ * is full
+ */
+static http_limit_entry_t *
+http_limit_get(const http_server_t *hs, http_limit_shard_t *hls,
+               uint32_t hash, const char *key, int64_t now)
+{
+  http_limit_entry_t *hle;
+  struct http_limit_entry_list *l =
+    &hls->hls_hash[(hash / HTTP_LIMIT_SHARDS) % HTTP_LIMIT_HASH_SIZE];
+
+  LIST_FOREACH(hle, l, hle_link) {
+    if(hle->hle_hash == hash && !strcmp(hle->hle_key, key)) {
+      TAILQ_REMOVE(&hls->hls_lru, hle, hle_lru_link);
+      TAILQ_INSERT_TAIL(&hls->hls_lru, hle, hle_lru_link);
+      return hle;
+    }
+  }
+
+  if(hls->hls_entries >= HTTP_LIMIT_SHARD_MAX && http_limit_evict(hls))
+    return NULL;
+
+  const size_t len = strlen(key);
+  hle = malloc(sizeof(http_limit_entry_t) + len + 1);
+  memcpy(hle->hle_key, key, len + 1);
+  hle->hle_hash = hash;
+  hle->hle_connections = 0;
+  hle->hle_tokens = hs->hs_request_burst;
+  hle->hle_refill = now;
+  LIST_INSERT_HEAD(l, hle, hle_link);
+  TAILQ_INSERT_TAIL(&hls->hls_lru, hle, hle_lru_link);
+  hls->hls_entries++;
+  return hle;
+}
+
+
+/**
+ * Account a new connection from 'peer'. Returns NULL if the peer
+ * already has too many (or too many other peers are connected)
+ */
+static http_limit_entry_t *
+http_limit_connection_add(http_server_t *hs, const char *peer)
+{
+  const uint32_t hash = MurHash3_32(peer, strlen(peer), 0);
+  http_limit_shard_t *hls = http_limit_shard(hs, hash);
+
+  pthread_mutex_lock(&hls->hls_mutex);
+  http_limit_entry_t *hle = http_limit_get(hs, hls, hash, peer,
+                                           asyncio_now());
+  if(hle == NULL || hle->hle_connections >= hs->hs_max_connections_per_ip)
+    hle = NULL;
+  else
+    hle->hle_connections++;
+  pthread_mutex_unlock(&hls->hls_mutex);
+  return hle;
+}
+
+
+/**
+ *
+ */
+static void
+http_limit_connection_remove(http_server_t *hs, http_limit_entry_t *hle)
+{
+  http_limit_shard_t *hls = http_limit_shard(hs, hle->hle_hash);
+  pthread_mutex_lock(&hls->hls_mutex);
+  hle->hle_connections--;
+  pthread_mutex_unlock(&hls->hls_mutex);
+}
+
+
+/**
+ * Take a token from the request's client bucket. If it's empty the
+ * request is shed and replied to with 429 by http_request_admit(),
+ * Retry-After is set to when a token will be available.
+ *
+ * Must be called on the asyncio thread, before the request is queued
+ * so a flood doesn't take up room in the task pools
+ */
+static void
+http_request_ratelimit(http_request_t *hr)
+{
+  http_connection_t *hc = hr->hr_connection;
+  http_server_t *hs = hc->hc_server;
+
+  if(hs->hs_request_rate <= 0 || hr->hr_100_continue_check)
+    return;
+
+  // Same as hr_peer_addr which is not set until http_request_prepare()
+  const char *key = hs->hs_real_ip_header != NULL ?
+    http_req_header(hr, hs->hs_real_ip_header) : NULL;
+  if(key == NULL)
+    key = hc->hc_peer_addr;
+
+  const uint32_t hash = MurHash3_32(key, strlen(key), 0);
+  http_limit_shard_t *hls = http_limit_shard(hs, hash);
+  int retry_after = 0;
+
+  pthread_mutex_lock(&hls->hls_mutex);
+  const int64_t now = asyncio_now();
+  http_limit_entry_t *hle = http_limit_get(hs, hls, hash, key, now);
+  if(hle == NULL) {
+    retry_after = hs->hs_retry_after;
+  } else {
+    http_limit_refill(hs, hle, now);
+    if(hle->hle_tokens >= 1.0)
+      hle->hle_tokens -= 1.0;
+    else
+      retry_after = 1 + (1.0 - hle->hle_tokens) / hs->hs_request_rate;
+  }
+  pthread_mutex_unlock(&hls->hls_mutex);
+
+  if(!retry_after)
+    return;
+
+  char tmp[16];
+  snprintf(tmp, sizeof(tmp), "%d", retry_after);
+  http_arg_set(&hr->hr_response_headers, "Retry-After", tmp);
+  hr->hr_keep_alive = 0;
+  hr->hr_shed = 1;
+  hr->hr_rate_limited = 1;
+}
+
+
+/**
+ * Reply to requests shed by http_request_ratelimit() and
+ * http_request_pool()
+ */
+static int
+http_request_admit(http_request_t *hr)
+{
+  if(!hr->hr_shed)
+    return 0;
+
+  if(hr->hr_rate_limited)
+    return HTTP_STATUS_TOO_MANY_REQUESTS;
+
+  const http_server_t *hs = hr->hr_connection->hc_server;
+  char tmp[16];
+  snprintf(tmp, sizeof(tmp), "%d", hs->hs_retry_after);
+  http_arg_set(&hr->hr_response_headers, "Retry-After", tmp);
+  return HTTP_STATUS_SERVICE_UNAVAILABLE;
+}
+
+
+/**
+ *
+ */
+static void
+http_request_prepare(http_request_t *hr)
+{
+  const char *h;
+  char *v, *argv[2];
+  int n;
+  uint8_t authbuf[150];
+  /* Extract authorization */
+  if((h = http_req_header_id(hr, HTTP_HDR_AUTHORIZATION)) != NULL) {
+    v = mystrdupa(h);
+    if((n = str_tokenize(v, argv, 2, -1)) == 2) {
+
+      if(!strcasecmp(argv[0], "basic")) {
+        n = base64_decode(authbuf, argv[1], sizeof(authbuf) - 1);
+        authbuf[n] = 0;
+        if((n = str_tokenize((char *)authbuf, argv, 2, ':')) == 2) {
+          hr->hr_username = arena_strdup(&hr->hr_arena, argv[0]);
+          hr->hr_password = arena_strdup(&hr->hr_arena, argv[1]);
+        }
+      }
+    }
+  }
+
+  http_connection_t *hc = hr->hr_connection;
+  http_server_t *hs = hc->hc_server;
+  if(hs->hs_real_ip_header != NULL) {
+    if((h = http_req_header(hr, hs->hs_real_ip_header)) != NULL) {
+      hr->hr_peer_addr = arena_strdup(&hr->hr_arena, h);
+    }
+  }
+
+  if(hr->hr_peer_addr == NULL) {
+    hr->hr_peer_addr = arena_strdup(&hr->hr_arena, hc->hc_peer_addr);
+  }
+
+  if((h = http_req_header_id(hr, HTTP_HDR_COOKIE)) != NULL) {
+    v = mystrdupa(h);
+    char *x = strstr(v, PROGNAME".session=");
+    if(x != NULL) {
+      x += strlen(PROGNAME".session=");
+      char *e = strchr(x, ';');
+      if(e != NULL)
+        *e = 0;
+      // Decrypted on first use, see http_session_get()
+      hr->hr_session_cookie = arena_strdup(&hr->hr_arena, x);
+    }
+  }
+
+  char *args = strchr(hr->hr_path, '?');
+  if(args != NULL) {
+    *args = 0;
+    hr->hr_args = arena_strdup(&hr->hr_arena, args + 1);
+    http_parse_query_args(hr, args + 1);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_dispatch_request(http_request_t *hr)
+{
+  const char *h;
+  char *v, *argv[2];
+  int n;
+  http_connection_t *hc = hr->hr_connection;
+
+  http_request_prepare(hr);
+
+  if(!hr->hr_100_continue_check) {
+    int err = http_request_admit(hr);
+    if(err) {
+      http_error(hr, err);
+      return;
+    }
+  }
+
+  // Websocket connection
+  if(hc->hc_ws_path) {
+    int err = websocket_response(hr);
+    if(err) {
+      http_error(hr, err);
+      return;
+    }
+
+    http_log(hr, 101, hc->hc_z_out ? "Websocket upgrade, per-message-deflate"
+             : "Websocket upgrade");
+    hr->hr_keep_alive = 2;
+    return;
+  }
+
+  // Handle 100-continue stuff
+  if(hr->hr_100_continue_check) {
+    hr->hr_keep_alive = 1;
+    int err = http_resolve_route(hr, 1);
+
+    if(err == 100) {
+      http_send_100_continue(hr);
+      return;
+    }
+
+    if(err != 0)
+      http_error(hr, err);
+
+    return;
+  }
+
+  // Handle POST/PUT payload
+  if(hr->hr_body && hr->hr_body_size > 0) {
+    /* Parse content-type */
+    h = http_req_header_id(hr, HTTP_HDR_CONTENT_TYPE);
+    if(h == NULL) {
+      http_err(hr, HTTP_STATUS_BAD_REQUEST, "No Content-Type");
+      return;
+    }
+    v = mystrdupa(h);
+    n = str_tokenize(v, argv, 2, ';');
+    if(n == 0) {
+      http_err(hr, HTTP_STATUS_BAD_REQUEST, "Malformed Content-Type");
+      return;
+    }
+
+    assert(hr->hr_post_message == NULL);
+    if(!strcmp(argv[0], "application/json") &&
+       http_req_header_id(hr, HTTP_HDR_CONTENT_ENCODING) == NULL) {
+      char errbuf[256];
+      hr->hr_post_message = ntv_json_deserialize(hr->hr_body,
+                                                 errbuf, sizeof(errbuf));
+      if(hr->hr_post_message == NULL) {
+        http_err(hr, HTTP_STATUS_BAD_REQUEST, errbuf);
+        return;
+      }
+    } else if(!strcmp(argv[0], "application/x-www-form-urlencoded") &&
+              http_req_header_id(hr, HTTP_HDR_CONTENT_ENCODING) == NULL) {
+      // Parsed from a copy so hr_body is left intact for the route
+      http_parse_query_args(hr, arena_strndup(&hr->hr_arena, hr->hr_body,
+                                              hr->hr_body_size));
+    }
+  }
+  http_resolve(hr);
+}
+
+
+/**
+ * Give back the request's concurrency slot once the route callback has
+ * returned. Deferred requests, SSE subscribers and proxied requests
+ * don't hold a thread after that, so they're not counted for their
+ * whole life and their handler latency is the callback's
+ */
+static void
+http_request_unlimit(http_request_t *hr)
+{
+  if(!hr->hr_limited)
+    return;
+  hr->hr_limited = 0;
+
+  // A streamed body arrives as fast as the client sends it, that's no
+  // handler latency to adjust the limit on
+  const int64_t process = hr->hr_stream_body ? 0 : hr->hr_req_process;
+  http_limiter_release(process ? process - hr->hr_req_received : -1,
+                       process ? asyncio_now() - process : 0);
+}
+
+
+/**
+ * Free what the application added to a request list with http_arg_set(),
+ * entries parsed from the request live in hr_arena
+ */
+static void
+http_request_args_flush(http_request_t *hr, struct http_arg_list *list)
+{
+  http_arg_t *ra;
+  while((ra = TAILQ_FIRST(list)) != NULL) {
+    TAILQ_REMOVE(list, ra, link);
+    if(arena_contains(&hr->hr_arena, ra))
+      continue;
+    free(ra->key);
+    free(ra->val);
+    free(ra);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_request_destroy(http_request_t *hr)
+{
+  if(hr->hr_status) {
+    const int64_t now = asyncio_now();
+
+    // Before hr_rxbuf (which hr_path may point into) is released
+    if(http_accesslog_enabled())
+      http_accesslog_write(hr->hr_method, hr->hr_path,
+                           hr->hr_peer_addr ?:
+                           hr->hr_connection->hc_peer_addr,
+                           hr->hr_status, hr->hr_bytes_sent,
+                           hr->hr_req_received, hr->hr_req_process, now);
+
+    if(http_metrics_enabled)
+      http_metrics_record(hr->hr_metrics_id, hr->hr_status,
+                          hr->hr_body_size, hr->hr_bytes_sent,
+                          hr->hr_req_received, hr->hr_req_process, now);
+  }
+
+  // Never got to the route callback
+  http_request_unlimit(hr);
+
+  if(hr->hr_form != NULL)
+    http_form_destroy(hr);
+
+  if(hr->hr_username != NULL)
+    memset(hr->hr_username, 0, strlen(hr->hr_username));
+
+  if(hr->hr_password != NULL)
+    memset(hr->hr_password, 0, strlen(hr->hr_password));
+
+  http_request_args_flush(hr, &hr->hr_request_headers);
+  http_request_args_flush(hr, &hr->hr_query_args);
+  http_arg_flush(&hr->hr_response_headers);
+  free(hr->hr_body);
+  mbuf_clear(&hr->hr_rxbuf);
+
+  ntv_release(hr->hr_post_message);
+  ntv_release(hr->hr_session_orig);
+  ntv_release(hr->hr_session_copy);
+
+  http_connection_t *hc = hr->hr_connection;
+
+  if(hr->hr_h2_stream != NULL) {
+    h2_request_done(hr);
+    http_connection_release(hc);
+  } else switch(hr->hr_keep_alive) {
+  case 0:
+    hc->hc_shutdown = 1;
+    asyncio_shutdown(hc->hc_af);
+    // FALLTHRU. We need to reenable so we can catch when the socket closes
+  case 1:
+    if(hr->hr_inline) {
+      // We're on the asyncio thread, called from http_server_read()
+      // which will continue with the next request right away
+      http_connection_resume(hc);
+      http_connection_release(hc);
+    } else {
+      if(hr->hr_queued)
+        atomic_dec(&hc->hc_queued);
+      asyncio_run_task(http_connection_reenable, hc);
+    }
+    break;
+  case 2: // Websocket
+    http_connection_release(hc);
+    break;
+  }
+  mbuf_clear(&hr->hr_reply);
+
+  // The request itself lives in the arena so this must be done last
+  arena_t a = hr->hr_arena;
+  arena_clear(&a);
+}
+
+
+/**
+ * Deferred responses, see http_request_defer()
+ *
+ * A deferred request is referenced by the task that dispatched it and
+ * by the deferred state, whoever lets go last destroys it. hd_state
+ * decides who gets to write the response: the producer (resumed), the
+ * timeout or nobody if the client is gone.
+ */
+
+enum {
+  HTTP_DEFER_PENDING,
+  HTTP_DEFER_RESUMED,
+  HTTP_DEFER_TIMEDOUT,
+  HTTP_DEFER_CANCELLED,
+};
+
+typedef struct http_deferred {
+  LIST_ENTRY(http_deferred) hd_link;  // Only touched on asyncio thread
+  http_request_t *hd_request;
+  atomic_t hd_refcount;
+  atomic_t hd_state;
+  int hd_timeout;
+  asyncio_timer_t hd_timer;
+  task_group_t *hd_group;  // Suspended until the request completes
+} http_deferred_t;
+
+
+/**
+ *
+ */
+static void
+http_request_release(http_request_t *hr)
+{
+  http_deferred_t *hd = hr->hr_deferred;
+
+  if(hd == NULL || atomic_dec(&hd->hd_refcount) == 0)
+    http_request_destroy(hr);
+}
+
+
+/**
+ * Must be called on the asyncio thread
+ */
+static void
+http_deferred_done(http_deferred_t *hd, int cancelled)
+{
+  http_request_t *hr = hd->hd_request;
+  void (*fn)(void *opaque, int cancelled) = hr->hr_done_cb;
+
+  if(fn == NULL)
+    return;
+  hr->hr_done_cb = NULL;
+  fn(hr->hr_done_opaque, cancelled);
+}
+
+
+/**
+ *
+ */
+static void
+http_deferred_timeout(void *aux)
+{
+  http_deferred_t *hd = aux;
+
+  if(atomic_cas(&hd->hd_state, HTTP_DEFER_PENDING, HTTP_DEFER_TIMEDOUT))
+    http_error(hd->hd_request, HTTP_STATUS_GATEWAY_TIMEOUT);
+}
+
+
+/**
+ *
+ */
+static void
+http_deferred_arm(void *aux)
+{
+  http_deferred_t *hd = aux;
+  http_connection_t *hc = hd->hd_request->hr_connection;
+
+  LIST_INSERT_HEAD(&hc->hc_deferred, hd, hd_link);
+
+  if(hc->hc_closed) {
+    atomic_cas(&hd->hd_state, HTTP_DEFER_PENDING, HTTP_DEFER_CANCELLED);
+    http_deferred_done(hd, 1);
+  } else if(hd->hd_timeout > 0)
+    asyncio_timer_arm_delta(&hd->hd_timer, hd->hd_timeout * 1000LL);
+}
+
+
+/**
+ *
+ */
+static void
+http_deferred_finish(void *aux)
+{
+  http_deferred_t *hd = aux;
+  task_group_t *tg = hd->hd_group;
+
+  asyncio_timer_disarm(&hd->hd_timer);
+  LIST_REMOVE(hd, hd_link);
+  http_deferred_done(hd, 0);
+
+  // Next pipelined request may only start once this one is done
+  http_request_release(hd->hd_request);
+  if(tg != NULL)
+    task_group_resume(tg);
+}
+
+
+/**
+ *
+ */
+int
+http_request_defer(http_request_t *hr, int timeout_ms)
+{
+  http_connection_t *hc = hr->hr_connection;
+  http_deferred_t *hd = http_req_alloc(hr, sizeof(http_deferred_t));
+
+  memset(hd, 0, sizeof(http_deferred_t));
+  hd->hd_request = hr;
+  atomic_set(&hd->hd_refcount, 2);
+  atomic_set(&hd->hd_state, HTTP_DEFER_PENDING);
+  hd->hd_timeout = timeout_ms;
+  asyncio_timer_init(&hd->hd_timer, http_deferred_timeout, hd);
+
+  if(hr->hr_inline) {
+    // http_server_read() would continue with the next request as soon
+    // as we return, count this one as queued instead so it waits
+    hr->hr_inline = 0;
+    if(hr->hr_h2_stream == NULL) {
+      hr->hr_queued = 1;
+      atomic_inc(&hc->hc_queued);
+      hc->hc_barrier = 1;
+    }
+  } else {
+    hd->hd_group = task_group_suspend();
+  }
+
+  hr->hr_deferred = hd;
+  asyncio_run_task(http_deferred_arm, hd);
+  return HTTP_STATUS_PENDING;
+}
+
+
+/**
+ *
+ */
+void
+http_request_on_done(http_request_t *hr,
+                     void (*fn)(void *opaque, int cancelled), void *opaque)
+{
+  hr->hr_done_cb = fn;
+  hr->hr_done_opaque = opaque;
+}
+
+
+/**
+ *
+ */
+int
+http_request_resume(http_request_t *hr)
+{
+  http_deferred_t *hd = hr->hr_deferred;
+  return atomic_cas(&hd->hd_state, HTTP_DEFER_PENDING,
+                    HTTP_DEFER_RESUMED) ? 0 : -1;
+}
+
+
+/**
+ *
+ */
+void
+http_request_complete(http_request_t *hr, int status)
+{
+  http_deferred_t *hd = hr->hr_deferred;
+
+  if(status && (atomic_cas(&hd->hd_state, HTTP_DEFER_PENDING,
+                           HTTP_DEFER_RESUMED) ||
+                atomic_get(&hd->hd_state) == HTTP_DEFER_RESUMED))
+    http_error(hr, status);
+
+  asyncio_run_task(http_deferred_finish, hd);
+}
+
+
+
+/**
+ * Process a request, extract info from headers, dispatch command
+ */
+static void
+http_dispatch_request_task(void *aux)
+{
+  http_request_t *hr = aux;
+
+  if(hr->hr_connection->hc_shutdown) {
+    // An earlier pipelined request decided to close the connection
+    hr->hr_keep_alive = 0;
+    http_request_destroy(hr);
+    return;
+  }
+
+  hr->hr_req_process = asyncio_now();
+  http_dispatch_request(hr);
+  http_request_unlimit(hr);
+  http_request_release(hr);
+}
+
+
+/**
+ * Streamed request bodies
+ *
+ * The request is created when headers are complete and dispatched to
+ * the task group right away. Body data is queued on the task group as
+ * it arrives and finally the route callback is invoked once the body
+ * is complete. Everything runs on the task group so it's all serialized
+ * and in order.
+ */
+typedef struct http_stream_chunk {
+  http_request_t *hsc_request;
+  mbuf_t hsc_mq;
+} http_stream_chunk_t;
+
+
+/**
+ * Reply with error and close connection. Remaining body is discarded
+ */
+static void
+http_stream_fail(http_request_t *hr, int err)
+{
+  hr->hr_stream_failed = 1;
+  hr->hr_keep_alive = 0;
+  http_error(hr, err);
+  asyncio_shutdown(hr->hr_connection->hc_af);
+}
+
+
+/**
+ *
+ */
+static void
+http_stream_begin_task(void *aux)
+{
+  http_request_t *hr = aux;
+  hr->hr_req_process = asyncio_now();
+
+  http_request_prepare(hr);
+
+  int err = http_request_admit(hr) ?: http_route_bind(hr);
+  if(!err && http_req_header_id(hr, HTTP_HDR_EXPECT) != NULL) {
+    const http_route_t *r = hr->hr_route;
+    if(r->hr_flags & HTTP_ROUTE_HANDLE_100_CONTINUE) {
+      err = r->hr_callback(hr, hr->hr_route_argc, hr->hr_route_argv,
+                           HTTP_ROUTE_HANDLE_100_CONTINUE);
+    } else {
+      err = 100;
+    }
+
+    if(err == 100) {
+      http_send_100_continue(hr);
+      err = 0;
+    }
+  }
+
+  if(err)
+    http_stream_fail(hr, err);
+}
+
+
+/**
+ *
+ */
+static void
+http_stream_resume(void *aux)
+{
+  http_connection_t *hc = aux;
+
+  if(hc->hc_stream_paused && !hc->hc_closed) {
+    hc->hc_stream_paused = 0;
+    hc->hc_read_disabled = 0;
+    asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+    asyncio_enable_read(hc->hc_af);
+  }
+  http_connection_release(hc);
+}
+
+
+/**
+ *
+ */
+static void
+http_stream_chunk_task(void *aux)
+{
+  http_stream_chunk_t *hsc = aux;
+  http_request_t *hr = hsc->hsc_request;
+  http_connection_t *hc = hr->hr_connection;
+  const int len = hsc->hsc_mq.mq_size;
+
+  if(!hr->hr_stream_failed) {
+    hr->hr_body_size += hsc->hsc_mq.mq_size;
+    int err = hr->hr_route->hr_body_callback(hr, &hsc->hsc_mq, 0);
+    if(err)
+      http_stream_fail(hr, err);
+  }
+  mbuf_clear(&hsc->hsc_mq);
+  free(hsc);
+
+  // Resume reading once we've drained below half of the buffer size
+  const int low = hc->hc_server->hs_stream_buffer_size / 2;
+  const int inflight = atomic_add_and_fetch(&hc->hc_stream_inflight, -len);
+  if(inflight <= low && inflight + len > low) {
+    atomic_inc(&hc->hc_refcount);
+    asyncio_run_task(http_stream_resume, hc);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_stream_end_task(void *aux)
+{
+  http_request_t *hr = aux;
+
+  if(!hr->hr_stream_failed) {
+    const http_route_t *r = hr->hr_route;
+    int err = http_form_finish(hr) ?:
+      r->hr_callback(hr, hr->hr_route_argc, hr->hr_route_argv, 0);
+    if(err && err != HTTP_STATUS_PENDING)
+      http_error(hr, err);
+  }
+  http_request_unlimit(hr);
+  http_request_release(hr);
+}
+
+
+/**
+ *
+ */
+static void
+http_stream_abort_task(void *aux)
+{
+  http_request_t *hr = aux;
+
+  if(!hr->hr_stream_failed)
+    hr->hr_route->hr_body_callback(hr, NULL, HTTP_BODY_ABORTED);
+
+  hr->hr_keep_alive = 0;
+  http_request_destroy(hr);
+}
+
+
+/**
+ * Hand over received body data to the task group, returns number of
+ * bytes in flight
+ */
+static int
+http_stream_flush(http_connection_t *hc)
+{
+  const int len = hc->hc_stream_buf.mq_size;
+  if(len == 0)
+    return atomic_get(&hc->hc_stream_inflight);
+
+  http_stream_chunk_t *hsc = malloc(sizeof(http_stream_chunk_t));
+  hsc->hsc_request = hc->hc_stream_request;
+  mbuf_init(&hsc->hsc_mq);
+  mbuf_appendq(&hsc->hsc_mq, &hc->hc_stream_buf);
+
+  const int inflight = atomic_add_and_fetch(&hc->hc_stream_inflight, len);
+  task_run_in_group_pool(http_stream_chunk_task, hsc, hc->hc_task_group,
+                         hc->hc_stream_pool);
+  return inflight;
+}
+
+
+/**
+ *
+ */
+static void
+http_stream_end(http_connection_t *hc, task_fn_t *fn)
+{
+  http_stream_flush(hc);
+  task_run_in_group_pool(fn, hc->hc_stream_request, hc->hc_task_group,
+                         hc->hc_stream_pool);
+  hc->hc_stream_request = NULL;
+  hc->hc_stream_pool = NULL;
+}
+
+
+/**
+ * Find route for a path that still has query args attached. Used on
+ * the asyncio thread to decide how to dispatch the request
+ */
+static const http_route_t *
+http_route_peek0(char *path, int method, http_route_peek_t *hrp)
+{
+  char *q = strchr(path, '?');
+  if(q != NULL)
+    *q = 0;
+
+  hrp->hrp_route = http_route_find(path, method, hrp->hrp_match,
+                                   &hrp->hrp_status);
+  if(q != NULL)
+    *q = '?';
+
+  for(hrp->hrp_argc = 0; hrp->hrp_argc < MAX_ROUTE_MATCHES; hrp->hrp_argc++)
+    if(hrp->hrp_route == NULL || hrp->hrp_match[hrp->hrp_argc].rm_so == -1)
+      break;
+  return hrp->hrp_route;
+}
+
+
+/**
+ * Keep the result with the request so http_resolve_route() and
+ * http_route_bind() needn't search again. Match offsets stay valid as
+ * the path is only ever cut at '?'
+ */
+static void
+http_route_peek_keep(http_request_t *hr, const http_route_peek_t *hrp)
+{
+  const size_t size = offsetof(http_route_peek_t, hrp_match) +
+    sizeof(regmatch_t) * hrp->hrp_argc;
+  hr->hr_route_peek = arena_alloc(&hr->hr_arena, size);
+  memcpy(hr->hr_route_peek, hrp, size);
+}
+
+
+/**
+ *
+ */
+static const http_route_t *
+http_route_peek(http_request_t *hr)
+{
+  http_route_peek_t hrp;
+  http_route_peek0(hr->hr_path, hr->hr_method, &hrp);
+  http_route_peek_keep(hr, &hrp);
+  return hrp.hrp_route;
+}
+
+
+/**
+ * Check if request will end up in a route flagged with
+ * HTTP_ROUTE_NONBLOCKING so it can be served directly on the asyncio
+ * thread
+ */
+static int
+http_request_is_nonblocking(http_request_t *hr, const http_route_t *r)
+{
+  const http_connection_t *hc = hr->hr_connection;
+
+  if(hc->hc_ws_path != NULL ||
+     http_req_header_id(hr, HTTP_HDR_EXPECT) != NULL)
+    return 0;
+
+  return r != NULL && r->hr_flags & HTTP_ROUTE_NONBLOCKING;
+}
+
+
+/**
+ * Task pool to run the request on, NULL for the default pool. Also
+ * decides if the request is to be shed (by the route's pool or the
+ * concurrency limit), it's then replied to with 503 by
+ * http_request_admit()
+ */
+static task_pool_t *
+http_request_pool(http_request_t *hr, const http_route_t *r)
+{
+  task_pool_t *tp = NULL;
+
+  if(hr->hr_shed)
+    return NULL;
+
+  if(r != NULL && r->hr_pool != NULL &&
+     http_pool_select(r->hr_pool, &tp)) {
+    hr->hr_shed = 1;
+    return NULL;
+  }
+
+  if(http_limiter_enabled) {
+    if(http_limiter_acquire(r != NULL ? r->hr_class : HTTP_CLASS_NORMAL)) {
+      hr->hr_shed = 1;
+      return NULL;
+    }
+    hr->hr_limited = 1;
+  }
+  return tp;
+}
+
+
+
+
+
+/**
+ * Delete all arguments associated with a connection
+ */
+void
+http_arg_flush(struct http_arg_list *list)
+{
+  http_arg_t *ra;
+  while((ra = TAILQ_FIRST(list)) != NULL) {
+    TAILQ_REMOVE(list, ra, link);
+    free(ra->key);
+    free(ra->val);
+    free(ra);
+  }
+}
+
+
+/**
+ * Find an argument associated with a connection
+ */
+char *
+http_arg_get(struct http_arg_list *list, const char *name)
+{
+  http_arg_t *ra;
+  TAILQ_FOREACH(ra, list, link)
+    if(!strcasecmp(ra->key, name))
+      return ra->val;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+int
+http_arg_get_int(struct http_arg_list *list, const char *name,
+                 int def)
+{
+  const char *arg = http_arg_get(list, name);
+  return arg ? atoi(arg) : def;
+}
+
+
+static const char *http_header_names[HTTP_HDR_num] = {
+  [HTTP_HDR_ACCEPT]                   = "Accept",
+  [HTTP_HDR_ACCEPT_ENCODING]          = "Accept-Encoding",
+  [HTTP_HDR_AUTHORIZATION]            = "Authorization",
+  [HTTP_HDR_CONNECTION]               = "Connection",
+  [HTTP_HDR_CONTENT_ENCODING]         = "Content-Encoding",
+  [HTTP_HDR_CONTENT_LENGTH]           = "Content-Length",
+  [HTTP_HDR_CONTENT_TYPE]             = "Content-Type",
+  [HTTP_HDR_COOKIE]                   = "Cookie",
+  [HTTP_HDR_EXPECT]                   = "Expect",
+  [HTTP_HDR_HOST]                     = "Host",
+  [HTTP_HDR_IF_MODIFIED_SINCE]        = "If-Modified-Since",
+  [HTTP_HDR_IF_NONE_MATCH]            = "If-None-Match",
+  [HTTP_HDR_ORIGIN]                   = "Origin",
+  [HTTP_HDR_RANGE]                    = "Range",
+  [HTTP_HDR_REFERER]                  = "Referer",
+  [HTTP_HDR_SEC_WEBSOCKET_EXTENSIONS] = "Sec-WebSocket-Extensions",
+  [HTTP_HDR_SEC_WEBSOCKET_KEY]        = "Sec-WebSocket-Key",
+  [HTTP_HDR_SEC_WEBSOCKET_PROTOCOL]   = "Sec-WebSocket-Protocol",
+  [HTTP_HDR_SEC_WEBSOCKET_VERSION]    = "Sec-WebSocket-Version",
+  [HTTP_HDR_TRANSFER_ENCODING]        = "Transfer-Encoding",
+  [HTTP_HDR_UPGRADE]                  = "Upgrade",
+  [HTTP_HDR_USER_AGENT]               = "User-Agent",
+  [HTTP_HDR_X_FORWARDED_FOR]          = "X-Forwarded-For",
+  [HTTP_HDR_X_REAL_IP]                = "X-Real-IP",
+};
+
+static uint32_t http_header_name_hashes[HTTP_HDR_num];
+
+
+/**
+ * FNV-1a over the name with ASCII letters folded to lower case
+ */
+static uint32_t
+http_header_hash(const char *name)
+{
+  uint32_t h = 2166136261U;
+  for(; *name; name++) {
+    uint8_t c = *name;
+    if(c >= 'A' && c <= 'Z')
+      c += 32;
+    h = (h ^ c) * 16777619U;
+  }
+  return h;
+}
+
+
+/**
+ *
+ */
+static void __attribute__((constructor))
+http_header_names_init(void)
+{
+  for(int i = 0; i < HTTP_HDR_num; i++)
+    http_header_name_hashes[i] = http_header_hash(http_header_names[i]);
+}
+
+
+/**
+ * Add a request header to 'list' and index it
+ */
+static void
+http_header_add(arena_t *a, http_header_index_t **hhip,
+                struct http_arg_list *list, char *key, char *val)
+{
+  http_header_index_t *hhi = *hhip;
+  if(hhi == NULL)
+    *hhip = hhi = arena_zalloc(a, sizeof(http_header_index_t));
+
+  http_header_t *hh = arena_alloc(a, sizeof(http_header_t));
+  hh->hh_arg.key = key;
+  hh->hh_arg.val = val;
+  TAILQ_INSERT_TAIL(list, &hh->hh_arg, link);
+
+  const uint32_t h = http_header_hash(key);
+  hh->hh_hash = h;
+  hh->hh_hash_next = NULL;
+
+  // Append to the bucket so lookups return the first occurrence, just
+  // like http_arg_get() does
+  http_header_t **p = &hhi->hhi_hash[h % HTTP_HEADER_HASH_SIZE];
+  while(*p != NULL)
+    p = &(*p)->hh_hash_next;
+  *p = hh;
+
+  for(int i = 0; i < HTTP_HDR_num; i++) {
+    if(http_header_name_hashes[i] == h &&
+       !strcasecmp(key, http_header_names[i])) {
+      if(hhi->hhi_slots[i] == NULL)
+        hhi->hhi_slots[i] = val;
+      break;
+    }
+  }
+}
+
+
+/**
+ *
+ */
+static const char *
+http_header_find(const http_header_index_t *hhi, const char *name)
+{
+  if(hhi == NULL)
+    return NULL;
+
+  const uint32_t h = http_header_hash(name);
+  const http_header_t *hh;
+  for(hh = hhi->hhi_hash[h % HTTP_HEADER_HASH_SIZE]; hh != NULL;
+      hh = hh->hh_hash_next) {
+    if(hh->hh_hash == h && !strcasecmp(hh->hh_arg.key, name))
+      return hh->hh_arg.val;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static const char *
+http_header_slot(const http_header_index_t *hhi, http_header_id_t id)
+{
+  return hhi != NULL ? hhi->hhi_slots[id] : NULL;
+}
+
+
+/**
+ *
+ */
+const char *
+http_req_header(const http_request_t *hr, const char *name)
+{
+  return http_header_find(hr->hr_header_index, name);
+}
+
+
+/**
+ *
+ */
+const char *
+http_req_header_id(const http_request_t *hr, http_header_id_t id)
+{
+  return http_header_slot(hr->hr_header_index, id);
+}
+
+
+/**
+ *
+ */
+void *
+http_req_alloc(http_request_t *hr, size_t size)
+{
+  return arena_alloc(&hr->hr_arena, size);
+}
+
+
+/**
+ *
+ */
+char *
+http_req_strdup(http_request_t *hr, const char *str)
+{
+  return str ? arena_strdup(&hr->hr_arena, str) : NULL;
+}
+
+
+/**
+ * Set an argument associated with a connection
+ */
+void
+http_arg_set(struct http_arg_list *list, const char *key,
+             const char *val)
+{
+  http_arg_t *ra;
+
+  ra = malloc(sizeof(http_arg_t));
+  TAILQ_INSERT_TAIL(list, ra, link);
+  ra->key = strdup(key);
+  ra->val = strdup(val);
+}
+
+
+/**
+ *
+ */
+static int route_cmp(const http_route_t *a, const http_route_t *b)
+{
+  return b->hr_depth - a->hr_depth;
+}
+
+/**
+ * Add a route
+ *
+ * Routes that can be expressed in the radix tree (literals and typed
+ * parameters, see http_router.h) are compiled into it, everything else
+ * is kept as a regexp
+ */
+static http_route_t *
+http_route_add0(const char *path, int method, http_callback2_t *callback,
+                http_body_callback_t *body_callback, int flags)
+{
+  http_route_t *hr = calloc(1, sizeof(http_route_t));
+  int i;
+
+  int len = strlen(path);
+
+  hr->hr_flags = flags;
+  hr->hr_method = method;
+  hr->hr_depth = 0;
+
+  for(i = 0; i < len; i++)
+    if(path[i] == '/')
+      hr->hr_depth++;
+
+  hr->hr_path     = strdup(path);
+  hr->hr_callback = callback;
+  hr->hr_body_callback = body_callback;
+  hr->hr_metrics_id = http_metrics_register(path, method);
+  hr->hr_pool = http_pool_for_route(path);
+  hr->hr_class = http_limiter_class(path);
+  LIST_INSERT_HEAD(&http_all_routes, hr, hr_all_link);
+
+  if(http_route_tree == NULL)
+    http_route_tree = http_router_create(HTTP_ROUTER_ICASE);
+
+  if(!http_router_add(http_route_tree, path, 0, method, hr->hr_depth, hr,
+                      &hr->hr_param_names))
+    return hr;
+
+  char *p = malloc(len + 2);
+  p[0] = '^';
+  strcpy(p+1, path);
+
+  int rval = regcomp(&hr->hr_reg, p, REG_ICASE | REG_EXTENDED);
+  free(p);
+  if(rval) {
+    char errbuf[256];
+    regerror(rval, &hr->hr_reg, errbuf, sizeof(errbuf));
+    trace(LOG_ALERT, "Failed to compile regex for HTTP route %s -- %s",
+          path, errbuf);
+    exit(1);
+  }
+
+  LIST_INSERT_SORTED(&http_routes, hr, hr_link, route_cmp);
+  return hr;
+}
+
+
+/**
+ *
+ */
+void
+http_route_add_method(const char *path, int method,
+                      http_callback2_t *callback, int flags)
+{
+  http_route_add0(path, method, callback, NULL, flags);
+}
+
+
+/**
+ *
+ */
+void
+http_route_add_stream(const char *path, int method,
+                      http_body_callback_t *body_callback,
+                      http_callback2_t *callback, int flags)
+{
+  http_route_add0(path, method, callback, body_callback, flags);
+}
+
+
+/**
+ * Form body being received, see http_route_add_form()
+ */
+typedef struct http_form_file_entry {
+  TAILQ_ENTRY(http_form_file_entry) hffe_link;
+  http_form_file_t hffe_file;
+  int hffe_fd;
+} http_form_file_entry_t;
+
+typedef struct http_form {
+  http_request_t *hf_request;
+  http_multipart_t *hf_multipart;  // NULL for urlencoded bodies
+  mbuf_t hf_value;                 // Field value (or urlencoded body)
+  const char *hf_field;            // Name of field being received
+  http_form_file_entry_t *hf_file; // File being received
+  int hf_max_size;                 // Per field
+  int hf_max_total;                // All fields, or the urlencoded body
+  int hf_max_fields;               // Fields and files
+  int hf_total;
+  int hf_fields;
+  TAILQ_HEAD(, http_form_file_entry) hf_files;
+} http_form_t;
+
+
+/**
+ *
+ */
+static void
+http_query_arg_add(http_request_t *hr, char *key, char *val)
+{
+  http_arg_t *ra = arena_alloc(&hr->hr_arena, sizeof(http_arg_t));
+  TAILQ_INSERT_TAIL(&hr->hr_query_args, ra, link);
+  ra->key = key;
+  ra->val = val;
+}
+
+
+/**
+ *
+ */
+static char *
+http_form_value(http_form_t *hf)
+{
+  const size_t len = hf->hf_value.mq_size;
+  char *v = arena_alloc(&hf->hf_request->hr_arena, len + 1);
+  mbuf_read(&hf->hf_value, v, len);
+  v[len] = 0;
+  return v;
+}
+
+
+/**
+ *
+ */
+static int
+http_form_part_begin(void *opaque, const http_multipart_part_t *hmp)
+{
+  http_form_t *hf = opaque;
+  http_request_t *hr = hf->hf_request;
+  arena_t *a = &hr->hr_arena;
+
+  if(++hf->hf_fields > hf->hf_max_fields)
+    return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+
+  if(hmp->hmp_filename == NULL) {
+    hf->hf_field = arena_strdup(a, hmp->hmp_name);
+    return 0;
+  }
+
+  http_form_file_entry_t *hffe = arena_alloc(a, sizeof(http_form_file_entry_t));
+  memset(hffe, 0, sizeof(http_form_file_entry_t));
+  http_form_file_t *hff = &hffe->hffe_file;
+  hff->hff_name = arena_strdup(a, hmp->hmp_name);
+  hff->hff_filename = arena_strdup(a, hmp->hmp_filename);
+  if(hmp->hmp_content_type != NULL)
+    hff->hff_content_type = arena_strdup(a, hmp->hmp_content_type);
+  hffe->hffe_fd = -1;
+  TAILQ_INSERT_TAIL(&hf->hf_files, hffe, hffe_link);
+  hf->hf_file = hffe;
+
+  http_form_file_callback_t *cb = hr->hr_route->hr_form_callback;
+  if(cb != NULL)
+    return cb(hr, hff, NULL, 0, HTTP_FORM_FILE_BEGIN);
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s-upload-XXXXXX",
+           getenv("TMPDIR") ?: "/tmp", PROGNAME);
+  hffe->hffe_fd = mkstemp(path);
+  if(hffe->hffe_fd == -1) {
+    trace(LOG_ERR, "HTTP: %s: Unable to create %s -- %s",
+          hr->hr_path, path, strerror(errno));
+    return HTTP_STATUS_ISE;
+  }
+  hff->hff_path = arena_strdup(a, path);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+http_form_part_data(void *opaque, const void *data, size_t len)
+{
+  http_form_t *hf = opaque;
+  http_request_t *hr = hf->hf_request;
+  http_form_file_entry_t *hffe = hf->hf_file;
+
+  if(hffe == NULL) {
+    if(hf->hf_value.mq_size + len > hf->hf_max_size ||
+       hf->hf_total + len > hf->hf_max_total)
+      return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+    hf->hf_total += len;
+    mbuf_append(&hf->hf_value, data, len);
+    return 0;
+  }
+
+  hffe->hffe_file.hff_size += len;
+
+  if(hffe->hffe_file.hff_path == NULL)
+    return hr->hr_route->hr_form_callback(hr, &hffe->hffe_file,
+                                          data, len, 0);
+
+  while(len > 0) {
+    ssize_t r = write(hffe->hffe_fd, data, len);
+    if(r < 0) {
+      if(errno == EINTR)
+        continue;
+      trace(LOG_ERR, "HTTP: %s: Unable to write %s -- %s",
+            hr->hr_path, hffe->hffe_file.hff_path, strerror(errno));
+      return HTTP_STATUS_ISE;
+    }
+    data += r;
+    len -= r;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+http_form_part_end(void *opaque)
+{
+  http_form_t *hf = opaque;
+  http_request_t *hr = hf->hf_request;
+  http_form_file_entry_t *hffe = hf->hf_file;
+
+  if(hffe == NULL) {
+    http_query_arg_add(hr, (char *)hf->hf_field, http_form_value(hf));
+    hf->hf_field = NULL;
+    return 0;
+  }
+
+  hf->hf_file = NULL;
+
+  if(hffe->hffe_file.hff_path == NULL)
+    return hr->hr_route->hr_form_callback(hr, &hffe->hffe_file, NULL, 0,
+                                          HTTP_FORM_FILE_END);
+  close(hffe->hffe_fd);
+  hffe->hffe_fd = -1;
+  return 0;
+}
+
+
+static const http_multipart_callbacks_t http_form_callbacks = {
+  .part_begin = http_form_part_begin,
+  .part_data  = http_form_part_data,
+  .part_end   = http_form_part_end,
+};
+
+
+/**
+ * Let the file callback know that a file won't be completed
+ */
+static void
+http_form_abort(http_form_t *hf)
+{
+  http_form_file_entry_t *hffe = hf->hf_file;
+  if(hffe == NULL)
+    return;
+
+  hf->hf_file = NULL;
+  if(hffe->hffe_file.hff_path == NULL) {
+    http_request_t *hr = hf->hf_request;
+    hr->hr_route->hr_form_callback(hr, &hffe->hffe_file, NULL, 0,
+                                   HTTP_FORM_FILE_END |
+                                   HTTP_FORM_FILE_ABORTED);
+  }
+}
+
+
+/**
+ *
+ */
+static http_form_t *
+http_form_create(http_request_t *hr)
+{
+  static const char urlencoded[] = "application/x-www-form-urlencoded";
+  const size_t ulen = strlen(urlencoded);
+
+  const char *ct = http_req_header_id(hr, HTTP_HDR_CONTENT_TYPE);
+  if(ct == NULL ||
+     http_req_header_id(hr, HTTP_HDR_CONTENT_ENCODING) != NULL)
+    return NULL;
+
+  http_form_t *hf = arena_alloc(&hr->hr_arena, sizeof(http_form_t));
+  memset(hf, 0, sizeof(http_form_t));
+  hf->hf_request = hr;
+  const http_server_t *hs = hr->hr_connection->hc_server;
+  hf->hf_max_size = hs->hs_form_field_max;
+  hf->hf_max_total = hs->hs_form_max_size;
+  hf->hf_max_fields = hs->hs_form_max_fields;
+  mbuf_init(&hf->hf_value);
+  TAILQ_INIT(&hf->hf_files);
+
+  hf->hf_multipart = http_multipart_create(ct, &http_form_callbacks, hf);
+  if(hf->hf_multipart == NULL &&
+     (strncasecmp(ct, urlencoded, ulen) ||
+      (ct[ulen] != 0 && ct[ulen] != ';' && ct[ulen] != ' ')))
+    return NULL;
+
+  hr->hr_form = hf;
+  return hf;
+}
+
+
+/**
+ * Body callback of routes added with http_route_add_form()
+ */
+static int
+http_form_body(http_request_t *hr, mbuf_t *mq, int flags)
+{
+  http_form_t *hf = hr->hr_form;
+
+  if(flags & HTTP_BODY_ABORTED) {
+    if(hf != NULL)
+      http_form_abort(hf);
+    return 0;
+  }
+
+  if(hf == NULL && (hf = http_form_create(hr)) == NULL)
+    return HTTP_STATUS_UNSUPPORTED_MEDIA_TYPE;
+
+  if(hf->hf_multipart == NULL) {
+    if(hf->hf_value.mq_size + mq->mq_size > hf->hf_max_total)
+      return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+    mbuf_appendq(&hf->hf_value, mq);
+    return 0;
+  }
+
+  const mbuf_data_t *md;
+  TAILQ_FOREACH(md, &mq->mq_buffers, md_link) {
+    int err = http_multipart_feed(hf->hf_multipart,
+                                  md->md_data + md->md_data_off,
+                                  md->md_data_len - md->md_data_off);
+    if(err) {
+      http_form_abort(hf);
+      return err < 0 ? HTTP_STATUS_BAD_REQUEST : err;
+    }
+  }
+  return 0;
+}
+
+
+/**
+ * Complete body received, called before the route callback
+ */
+static int
+http_form_finish(http_request_t *hr)
+{
+  http_form_t *hf = hr->hr_form;
+  if(hf == NULL)
+    return 0;
+
+  if(hf->hf_multipart == NULL) {
+    char *v = http_form_value(hf);
+    int fields = 1;
+    for(const char *s = v; (s = strchr(s, '&')) != NULL; s++)
+      fields++;
+    if(fields > hf->hf_max_fields)
+      return HTTP_STATUS_PAYLOAD_TOO_LARGE;
+    http_parse_query_args(hr, v);
+    return 0;
+  }
+
+  if(http_multipart_finish(hf->hf_multipart)) {
+    http_form_abort(hf);
+    return HTTP_STATUS_BAD_REQUEST;
+  }
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_form_destroy(http_request_t *hr)
+{
+  http_form_t *hf = hr->hr_form;
+  http_form_file_entry_t *hffe;
+
+  TAILQ_FOREACH(hffe, &hf->hf_files, hffe_link) {
+    if(hffe->hffe_fd != -1)
+      close(hffe->hffe_fd);
+    if(hffe->hffe_file.hff_path != NULL)
+      unlink(hffe->hffe_file.hff_path);
+  }
+
+  if(hf->hf_multipart != NULL)
+    http_multipart_destroy(hf->hf_multipart);
+  mbuf_clear(&hf->hf_value);
+  hr->hr_form = NULL;
+}
+
+
+/**
+ *
+ */
+void
+http_route_add_form(const char *path, int method,
+                    http_form_file_callback_t *file_callback,
+                    http_callback2_t *callback, int flags)
+{
+  http_route_t *hr = http_route_add0(path, method, callback,
+                                     http_form_body, flags);
+  hr->hr_form_callback = file_callback;
+}
+
+
+/**
+ *
+ */
+static int
+http_proxy_callback(http_request_t *hr, int argc, char **argv, int flags)
+{
+  return http_proxy_request(hr->hr_route->hr_proxy, hr);
+}
+
+
+/**
+ *
+ */
+static int
+http_proxy_body_callback(http_request_t *hr, mbuf_t *mq, int flags)
+{
+  return http_proxy_body(hr->hr_route->hr_proxy, hr, mq, flags);
+}
+
+
+/**
+ * Requests without body are sent upstream directly from the asyncio
+ * thread, the response is always received there
+ */
+void
+http_route_add_proxy(const char *path, http_proxy_t *hp, int flags)
+{
+  http_route_t *hr = http_route_add0(path, HTTP_ROUTE_ANY_METHOD,
+                                     http_proxy_callback,
+                                     http_proxy_body_callback,
+                                     flags | HTTP_ROUTE_NONBLOCKING);
+  hr->hr_proxy = hp;
+}
+
+
+/**
+ *
+ */
+const http_form_file_t *
+http_form_file(http_request_t *hr, const char *name)
+{
+  const http_form_t *hf = hr->hr_form;
+  const http_form_file_entry_t *hffe;
+
+  if(hf == NULL)
+    return NULL;
+
+  TAILQ_FOREACH(hffe, &hf->hf_files, hffe_link) {
+    if(!strcmp(hffe->hffe_file.hff_name, name))
+      return &hffe->hffe_file;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+http_route_add(const char *path, http_callback2_t *callback, int flags)
+{
+  http_route_add_method(path, HTTP_ROUTE_ANY_METHOD, callback, flags);
+}
+
+
+/**
+ *
+ */
+void
+http_route_add_cached(const char *path, http_callback2_t *callback,
+                      int flags, int ttl, const char *vary)
+{
+  http_route_t *hr = http_route_add0(path, HTTP_ROUTE_ANY_METHOD, callback,
+                                     NULL, flags);
+  hr->hr_cache = http_cache_policy_create(ttl, vary);
+}
+
+
+/**
+ * Add a callback for a given "virtual path" on our HTTP server
+ */
+void
+http_path_add(const char *path, void *opaque, http_callback_t *callback)
+{
+  http_path_t *hp = calloc(1, sizeof(http_path_t));
+  int depth = 0;
+
+  for(int i = 0; path[i]; i++)
+    if(path[i] == '/')
+      depth++;
+
+  hp->hp_path     = strdup(path);
+  hp->hp_opaque   = opaque;
+  hp->hp_callback = callback;
+  hp->hp_metrics_id = http_metrics_register(path, HTTP_ROUTE_ANY_METHOD);
+
+  if(http_path_tree == NULL)
+    http_path_tree = http_router_create(0);
+
+  http_router_add(http_path_tree, path,
+                  HTTP_ROUTER_LITERAL | HTTP_ROUTER_BOUNDARY,
+                  HTTP_ROUTER_ANY_METHOD, depth, hp, NULL);
+}
+
+
+/**
+ * Parse arguments of a HTTP GET url, not perfect, but works for us
+ */
+static void
+http_parse_query_args(http_request_t *hr, char *args)
+{
+  char *k, *v;
+
+  while(args) {
+    k = args;
+    if((args = strchr(args, '=')) == NULL)
+      break;
+    *args++ = 0;
+    v = args;
+    args = strchr(args, '&');
+
+    if(args != NULL)
+      *args++ = 0;
+
+    http_deescape(k);
+    http_deescape(v);
+    // 'args' lives as long as the request so there's no need to copy
+    http_query_arg_add(hr, k, v);
+  }
+}
+
+
+
+
+/**
+ * Extend a slice with data from the parser
+ */
+static void
+slice_append(http_connection_t *hc, http_slice_t *hs,
+             const char *at, size_t length)
+{
+  if(hs->hs_ptr == NULL && length == 0) {
+    // Empty header value, 'at' points to whatever follows
+    hs->hs_ptr = arena_strdup(&hc->hc_arena, "");
+    hs->hs_len = 0;
+    hs->hs_copied = 1;
+
+  } else if(hs->hs_ptr == NULL) {
+    hs->hs_ptr = (char *)at;
+    hs->hs_len = length;
+    hs->hs_copied = 0;
+    hc->hc_rxbuf_ref = 1;
+
+  } else if(!hs->hs_copied && hs->hs_ptr + hs->hs_len == at) {
+    // Data was appended to the same buffer
+    hs->hs_len += length;
+    hc->hc_rxbuf_ref = 1;
+
+  } else {
+    // Spans multiple buffers, need to copy
+    if(!hs->hs_copied) {
+      hs->hs_ptr = arena_strndup(&hc->hc_arena, hs->hs_ptr, hs->hs_len);
+      hs->hs_copied = 1;
+    }
+    arena_append(&hc->hc_arena, &hs->hs_ptr, at, length);
+    hs->hs_len += length;
+  }
+  hs->hs_at_end = at + length == hc->hc_parse_end;
+}
+
+
+/**
+ * Return the slice as a zero terminated string
+ *
+ * If the byte following the slice has already been consumed by the parser
+ * (it's the delimiter) we just overwrite it, otherwise we copy
+ */
+static char *
+slice_finalize(http_connection_t *hc, http_slice_t *hs)
+{
+  char *r = hs->hs_ptr;
+
+  if(r == NULL)
+    return NULL;
+
+  if(!hs->hs_copied) {
+    char *end = r + hs->hs_len;
+    if(!hs->hs_at_end || end == hc->hc_parse_start)
+      *end = 0;
+    else
+      r = arena_strndup(&hc->hc_arena, r, hs->hs_len);
+  }
+  hs->hs_ptr = NULL;
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+add_current_header(http_connection_t *hc)
+{
+  char *key = slice_finalize(hc, &hc->hc_header_field);
+  char *val = slice_finalize(hc, &hc->hc_header_value);
+
+  if(key != NULL && val != NULL)
+    http_header_add(&hc->hc_arena, &hc->hc_header_index,
+                    &hc->hc_request_headers, key, val);
+}
+
+
+/**
+ *
+ */
+static void
+finalize_url(http_connection_t *hc)
+{
+  if(hc->hc_url.hs_ptr != NULL)
+    hc->hc_path = slice_finalize(hc, &hc->hc_url);
+}
+
+static int
+http_message_begin(http_parser *p)
+{
+  http_connection_t *hc = p->data;
+  hc->hc_in_message = 1;
+  return 0;
+}
+
+static int
+http_url(http_parser *p, const char *at, size_t length)
+{
+  http_connection_t *hc = p->data;
+  slice_append(hc, &hc->hc_url, at, length);
+  return 0;
+}
+
+
+static int
+http_status(http_parser *p, const char *at, size_t length)
+{
+  return 0;
+}
+
+static int
+http_header_field(http_parser *p, const char *at, size_t length)
+{
+  http_connection_t *hc = p->data;
+  finalize_url(hc);
+  if(hc->hc_header_value.hs_ptr != NULL)
+    add_current_header(hc);
+  slice_append(hc, &hc->hc_header_field, at, length);
+  return 0;
+}
+
+static int
+http_header_value(http_parser *p, const char *at, size_t length)
+{
+  http_connection_t *hc = p->data;
+  slice_append(hc, &hc->hc_header_value, at, length);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_create_request(http_connection_t *hc, int continue_check)
+{
+  http_request_t *hr;
+
+  if(continue_check) {
+    // The connection keeps parsing this request so we need our own copy
+    arena_t a;
+    arena_init(&a);
+    hr = arena_zalloc(&a, sizeof(http_request_t));
+    hr->hr_arena = a;
+  } else {
+    hr = arena_zalloc(&hc->hc_arena, sizeof(http_request_t));
+    hr->hr_arena = hc->hc_arena;
+    arena_init(&hc->hc_arena);
+  }
+
+  hr->hr_connection = hc;
+  atomic_inc(&hc->hc_refcount);
+
+  mbuf_init(&hr->hr_reply);
+  mbuf_init(&hr->hr_rxbuf);
+
+  TAILQ_INIT(&hr->hr_query_args);
+  TAILQ_INIT(&hr->hr_response_headers);
+
+  hr->hr_req_received = asyncio_now();
+
+  if(continue_check) {
+    TAILQ_INIT(&hr->hr_request_headers);
+    const http_arg_t *ra;
+    hr->hr_path = arena_strdup(&hr->hr_arena, hc->hc_path);
+     TAILQ_FOREACH(ra, &hc->hc_request_headers, link) {
+       http_header_add(&hr->hr_arena, &hr->hr_header_index,
+                       &hr->hr_request_headers,
+                       arena_strdup(&hr->hr_arena, ra->key),
+                       arena_strdup(&hr->hr_arena, ra->val));
+     }
+     hr->hr_100_continue_check = 1;
+
+  } else {
+
+    hr->hr_keep_alive = http_should_keep_alive(&hc->hc_parser);
+
+    TAILQ_MOVE(&hr->hr_request_headers, &hc->hc_request_headers, link);
+    TAILQ_INIT(&hc->hc_request_headers);
+    hr->hr_header_index = hc->hc_header_index;
+    hc->hc_header_index = NULL;
+    hr->hr_path = hc->hc_path;
+    hc->hc_path = NULL;
+
+    hr->hr_remain = hc->hc_remain;
+    hc->hc_remain = NULL;
+
+    hr->hr_body = hc->hc_body;
+    hc->hc_body = NULL;
+    hc->hc_body_chunked = 0;
+
+    hr->hr_body_size = hc->hc_body_received;
+  }
+
+  hr->hr_method = hc->hc_parser.method;
+  hr->hr_major = hc->hc_parser.http_major;
+  hr->hr_minor = hc->hc_parser.http_minor;
+
+  if(continue_check) {
+    task_run_in_group(http_dispatch_request_task, hr, hc->hc_task_group);
+  } else {
+    // Path and headers may point into the buffer currently being parsed.
+    // http_server_read() dispatches once the buffers have been handed over
+    hc->hc_pending_request = hr;
+    http_parser_pause(&hc->hc_parser, 1);
+  }
+}
+
+static void
+trace_request_headers(http_connection_t *hc)
+{
+  cfg_root(cr);
+  const http_server_t *hs = hc->hc_server;
+  int tracehttp = cfg_get_int(cr, CFG(hs->hs_config_prefix, "trace"), 0);
+  if(!tracehttp)
+    return;
+
+  trace(LOG_DEBUG, "HTTP-IN %s %s", http_method2str(hc->hc_parser.method),
+        hc->hc_path);
+  http_arg_t *ha;
+  TAILQ_FOREACH(ha, &hc->hc_request_headers, link)
+    trace(LOG_DEBUG, "HTTP-IN   %s: %s", ha->key, ha->val);
+}
+
+
+/**
+ *
+ */
+static int
+http_headers_complete(http_parser *p)
+{
+  http_connection_t *hc = p->data;
+  finalize_url(hc);
+  add_current_header(hc);
+
+  trace_request_headers(hc);
+
+  const char *upgrade = http_header_slot(hc->hc_header_index, HTTP_HDR_UPGRADE);
+
+  if(!strcasecmp(upgrade ?: "", "websocket")) {
+    int err = websocket_upgrade(hc);
+    if(!err) {
+      return 2;
+    }
+    return 0;
+  }
+
+  const int has_body = p->flags & F_CHUNKED ||
+    (p->content_length != 0 && p->content_length != UINT64_MAX);
+
+  // Upgrades with a request body are not supported, the request is
+  // then just served over HTTP/1.1
+  if(!strcasecmp(upgrade ?: "", "h2c") && !has_body &&
+     hc->hc_server->hs_http2 && p->http_major == 1 && p->http_minor == 1 &&
+     http_header_find(hc->hc_header_index, "HTTP2-Settings") != NULL)
+    hc->hc_h2_upgrade = 1;
+
+  if(has_body && hc->hc_path != NULL) {
+    http_route_peek_t hrp;
+    const http_route_t *r = http_route_peek0(hc->hc_path, p->method, &hrp);
+    if(r != NULL && r->hr_body_callback != NULL) {
+      // Dispatched by http_server_read() when we return
+      http_create_request(hc, 0);
+      http_route_peek_keep(hc->hc_pending_request, &hrp);
+      hc->hc_stream_request = hc->hc_pending_request;
+      hc->hc_stream_request->hr_stream_body = 1;
+      atomic_set(&hc->hc_stream_inflight, 0);
+      return 0;
+    }
+  }
+
+  const char *expect = http_header_slot(hc->hc_header_index, HTTP_HDR_EXPECT);
+  if(expect != NULL && !strcasecmp(expect, "100-continue")) {
+    http_create_request(hc, 1);
+  }
+
+  if(p->flags & F_CHUNKED) {
+    // Size not known, grow buffer as data arrives
+    assert(hc->hc_body == NULL);
+    hc->hc_body_chunked = 1;
+    hc->hc_body_received = 0;
+    hc->hc_body_size = 0;
+
+  } else if(p->content_length != UINT64_MAX) {
+
+    if(p->content_length > 1024 * 1024 * 1024) {
+      /* Bail out if POST data > 1 GB */
+      return -1;
+    }
+    assert(hc->hc_body == NULL);
+    hc->hc_body = malloc(p->content_length + 1);
+    if(hc->hc_body == NULL)
+      return -1;
+
+    hc->hc_body[p->content_length] = 0;
+    hc->hc_body_received = 0;
+    hc->hc_body_size = p->content_length;
+  }
+  return 0;
+}
+
+static int
+http_body(http_parser *p, const char *at, size_t length)
+{
+  http_connection_t *hc = p->data;
+
+  if(hc->hc_stream_request != NULL) {
+    mbuf_append(&hc->hc_stream_buf, at, length);
+    return 0;
+  }
+
+  if(hc->hc_body_chunked &&
+     hc->hc_body_received + length > hc->hc_body_size) {
+    size_t size = MAX(hc->hc_body_size * 2, 4096);
+    size = MAX(size, hc->hc_body_received + length);
+    if(size > 1024 * 1024 * 1024)
+      return 1;
+    uint8_t *body = realloc(hc->hc_body, size + 1);
+    if(body == NULL)
+      return 1;
+    hc->hc_body = body;
+    hc->hc_body_size = size;
+  }
+
+  if(hc->hc_body == NULL)
+    return 1;
+
+  if(hc->hc_body_received + length > hc->hc_body_size)
+    return 1;
+  memcpy(hc->hc_body + hc->hc_body_received, at, length);
+  hc->hc_body_received += length;
+  hc->hc_body[hc->hc_body_received] = 0;
+  return 0;
+}
+
+static int
+http_message_complete(http_parser *p)
+{
+  http_connection_t *hc = p->data;
+
+  hc->hc_in_message = 0;
+
+  if(hc->hc_stream_request != NULL) {
+    http_stream_end(hc, http_stream_end_task);
+    http_parser_pause(&hc->hc_parser, 1);
+    hc->hc_barrier = 1;
+  } else {
+    http_create_request(hc, 0);
+  }
+
+  // Re-arm timer if we do websocket
+  if(hc->hc_ws_path != NULL) {
+    asyncio_timer_arm_delta(&hc->hc_timer, 20 * 1000000);
+  } else {
+    // Otherwise we disarm, we really don't know how long the request
+    // take to serve so once the request finishes we will re-arm the
+    // timer again
+    asyncio_timer_disarm(&hc->hc_timer);
+    hc->hc_read_disabled = 1;
+  }
+  return 0;
+}
+
+static const http_parser_settings parser_settings = {
+  .on_message_begin    = http_message_begin,
+  .on_url              = http_url,
+  .on_status           = http_status,
+  .on_header_field     = http_header_field,
+  .on_header_value     = http_header_value,
+  .on_headers_complete = http_headers_complete,
+  .on_body             = http_body,
+  .on_message_complete = http_message_complete,
+  //  .on_chunk_header     = http_chunk_header,
+  //  .on_chunk_complete   = http_chunk_complete
+};
+
+
+/**
+ *
+ */
+static int
+http_fast_method(const char *s, size_t len)
+{
+  switch(len) {
+  case 3:
+    if(!memcmp(s, "GET", 3))
+      return HTTP_GET;
+    if(!memcmp(s, "PUT", 3))
+      return HTTP_PUT;
+    break;
+  case 4:
+    if(!memcmp(s, "POST", 4))
+      return HTTP_POST;
+    if(!memcmp(s, "HEAD", 4))
+      return HTTP_HEAD;
+    break;
+  case 5:
+    if(!memcmp(s, "PATCH", 5))
+      return HTTP_PATCH;
+    break;
+  case 6:
+    if(!memcmp(s, "DELETE", 6))
+      return HTTP_DELETE;
+    break;
+  case 7:
+    if(!memcmp(s, "OPTIONS", 7))
+      return HTTP_OPTIONS;
+    break;
+  }
+  return -1;
+}
+
+
+/**
+ * Same flags as http_parser derives from the Connection header,
+ * -1 if it asks for an upgrade
+ */
+static int
+http_fast_connection(const char *s, size_t len)
+{
+  const char *end = s + len;
+  int flags = 0;
+
+  while(s < end) {
+    while(s < end && (*s == ' ' || *s == '\t' || *s == ','))
+      s++;
+    const char *tok = s;
+    while(s < end && *s != ',')
+      s++;
+    const char *tok_end = s;
+    while(tok_end > tok && (tok_end[-1] == ' ' || tok_end[-1] == '\t'))
+      tok_end--;
+
+    const size_t tlen = tok_end - tok;
+    if(tlen == 5 && !strncasecmp(tok, "close", 5))
+      flags |= F_CONNECTION_CLOSE;
+    else if(tlen == 10 && !strncasecmp(tok, "keep-alive", 10))
+      flags |= F_CONNECTION_KEEP_ALIVE;
+    else if(tlen == 7 && !strncasecmp(tok, "upgrade", 7))
+      return -1;
+  }
+  return flags;
+}
+
+
+/**
+ * Fast path for request heads that are complete in the current receive
+ * buffer. The head is scanned in one go by http_head_parse() and then
+ * fed to the same callbacks as the incremental parser uses, and the
+ * parser fields they look at are filled in.
+ *
+ * Anything out of the ordinary (chunked bodies, upgrades, Expect,
+ * uncommon methods, malformed heads) is left to http_parser.
+ * Body bytes are counted down by http_server_read() via hc_body_left.
+ *
+ * Returns number of bytes consumed, 0 if http_parser should deal with
+ * the request or -1 if the connection should be closed
+ */
+static int
+http_fast_head(http_connection_t *hc, const char *buf, size_t len)
+{
+  http_head_t hh;
+
+  const int head_len = http_head_parse(buf, len, &hh);
+  if(head_len <= 0)
+    return 0;
+
+  const int method = http_fast_method(hh.hh_method, hh.hh_method_len);
+  if(method == -1)
+    return 0;
+
+  int flags = 0;
+  uint64_t content_length = UINT64_MAX;
+
+  for(int i = 0; i < hh.hh_num_fields; i++) {
+    const http_head_field_t *hhf = &hh.hh_fields[i];
+    const char *n = hhf->hhf_name;
+
+    switch(hhf->hhf_name_len) {
+    case 6:
+      if(!strncasecmp(n, "Expect", 6))
+        return 0;
+      break;
+    case 7:
+      if(!strncasecmp(n, "Upgrade", 7))
+        return 0;
+      break;
+    case 10:
+      if(!strncasecmp(n, "Connection", 10)) {
+        const int f = http_fast_connection(hhf->hhf_value,
+                                           hhf->hhf_value_len);
+        if(f == -1)
+          return 0;
+        flags |= f;
+      }
+      break;
+    case 14:
+      if(!strncasecmp(n, "Content-Length", 14)) {
+        if(content_length != UINT64_MAX || hhf->hhf_value_len == 0 ||
+           hhf->hhf_value_len > 12)
+          return 0;
+        content_length = 0;
+        for(size_t j = 0; j < hhf->hhf_value_len; j++) {
+          const char c = hhf->hhf_value[j];
+          if(c < '0' || c > '9')
+            return 0;
+          content_length = content_length * 10 + c - '0';
+        }
+      }
+      break;
+    case 17:
+      if(!strncasecmp(n, "Transfer-Encoding", 17))
+        return 0;
+      break;
+    }
+  }
+
+  http_parser *p = &hc->hc_parser;
+  p->method = method;
+  p->http_major = 1;
+  p->http_minor = hh.hh_minor;
+  p->flags = flags;
+  p->content_length = content_length;
+  p->upgrade = 0;
+
+  http_url(p, hh.hh_target, hh.hh_target_len);
+  for(int i = 0; i < hh.hh_num_fields; i++) {
+    const http_head_field_t *hhf = &hh.hh_fields[i];
+    http_header_field(p, hhf->hhf_name, hhf->hhf_name_len);
+    http_header_value(p, hhf->hhf_value, hhf->hhf_value_len);
+  }
+
+  if(http_headers_complete(p))
+    return -1;
+
+  if(content_length == UINT64_MAX || content_length == 0)
+    http_message_complete(p);
+  else
+    hc->hc_body_left = content_length;
+  return head_len;
+}
+
+
+/**
+ *
+ */
+static void
+http_connection_destroy(http_connection_t *hc)
+{
+  http_server_t *hs = hc->hc_server;
+  if(hc->hc_limit != NULL)
+    http_limit_connection_remove(hs, hc->hc_limit);
+  atomic_dec(&hs->hs_connections);
+  http_server_release(hs);
+  async_fd_release(hc->hc_af);
+  if(hc->hc_h2 != NULL)
+    h2_connection_free(hc->hc_h2);
+  arena_clear(&hc->hc_arena);
+  mbuf_clear(&hc->hc_rxbuf);
+  mbuf_clear(&hc->hc_stream_buf);
+  free(hc->hc_body);
+  task_group_destroy(hc->hc_task_group);
+
+  websocket_free(&hc->hc_ws_state);
+  free(hc->hc_peer_addr);
+
+  if(hc->hc_z_out != NULL) {
+    deflateEnd(hc->hc_z_out);
+    free(hc->hc_z_out);
+  }
+
+  if(hc->hc_z_in != NULL) {
+    inflateEnd(hc->hc_z_in);
+    free(hc->hc_z_in);
+  }
+
+  free(hc);
+}
+
+
+/**
+ *
+ */
+static void
+http_connection_release(http_connection_t *hc)
+{
+  if(atomic_dec(&hc->hc_refcount))
+     return;
+
+  http_connection_destroy(hc);
+}
+
+
+/**
+ *
+ */
+static void
+http_connection_shutdown_task(void *aux)
+{
+  http_connection_t *hc = aux;
+
+  if(hc->hc_ws_path != NULL && hc->hc_ws_opaque != NULL)
+    hc->hc_ws_path->wsp_disconnected(hc->hc_ws_opaque, hc->hc_error);
+
+  http_connection_release(hc);
+}
+
+
+/**
+ *
+ */
+static void
+http_connection_close(http_connection_t *hc)
+{
+  hc->hc_closed = 1;
+  asyncio_close(hc->hc_af);
+  asyncio_timer_disarm(&hc->hc_timer);
+
+  // Producers of deferred responses will fail to resume, those that
+  // already have are told with their done callback
+  http_deferred_t *hd;
+  LIST_FOREACH(hd, &hc->hc_deferred, hd_link) {
+    atomic_cas(&hd->hd_state, HTTP_DEFER_PENDING, HTTP_DEFER_CANCELLED);
+    http_deferred_done(hd, 1);
+  }
+
+  if(hc->hc_h2 != NULL)
+    h2_connection_closed(hc);
+
+  if(hc->hc_stream_request != NULL) {
+    // Body callback will see what we got so far and then the abort
+    http_stream_end(hc, http_stream_abort_task);
+  }
+  task_run_in_group(http_connection_shutdown_task, hc, hc->hc_task_group);
+}
+
+
+/**
+ * HTTP/2
+ *
+ * Cleartext only, either with prior knowledge (connection starts with the
+ * client preface) or upgraded from HTTP/1.1 with 'Upgrade: h2c'.
+ *
+ * Frames are parsed on the asyncio thread. Once a stream's request (and
+ * its body) is complete it's turned into a http_request_t and dispatched
+ * just like a HTTP/1 request, except that streams are not serialized on
+ * the connection's task group. Responses are rendered by the HTTP/1 code
+ * and translated: header blocks are HPACK encoded and body data is queued
+ * on the stream and sent as DATA frames as flow control windows permit.
+ *
+ * Everything shared with request threads (streams, windows, output) is
+ * protected by h2_mutex. The HPACK decoder and the header block being
+ * received are only touched by the asyncio thread.
+ */
+
+#define H2_MAX_STREAMS      100
+#define H2_MAX_HEADER_BLOCK (256 * 1024)
+#define H2_MAX_HEADER_LIST  (64 * 1024)
+#define H2_MAX_BODY         (1024 * 1024 * 1024)
+
+typedef struct h2_stream {
+  LIST_ENTRY(h2_stream) h2s_link;
+  uint32_t h2s_id;
+  int64_t h2s_window;
+
+  // Request being received, handed over to the http_request_t
+  arena_t h2s_arena;
+  struct http_arg_list h2s_headers;
+  http_header_index_t *h2s_header_index;
+  size_t h2s_header_bytes;
+  char *h2s_method;
+  char *h2s_path;
+  char *h2s_authority;
+  char *h2s_cookie;
+  uint8_t *h2s_body;
+  size_t h2s_body_size;
+  size_t h2s_body_alloc;
+  int64_t h2s_received;
+
+  mbuf_t h2s_out;  // Response body waiting for window
+
+  uint8_t h2s_regular_seen : 1;
+  uint8_t h2s_bad : 1;
+  uint8_t h2s_dispatched : 1;   // END_STREAM received
+  uint8_t h2s_headers_sent : 1;
+  uint8_t h2s_end_pending : 1;  // Request done, END_STREAM once drained
+  uint8_t h2s_end_sent : 1;
+  uint8_t h2s_reset : 1;
+} h2_stream_t;
+
+
+typedef struct h2_connection {
+  pthread_mutex_t h2_mutex;
+  pthread_cond_t h2_cond;  // Broadcast when output makes progress
+  LIST_HEAD(, h2_stream) h2_streams;
+  int h2_num_streams;
+  uint32_t h2_last_stream_id;
+
+  int64_t h2_window;          // Connection send window
+  int64_t h2_initial_window;  // Peer's SETTINGS_INITIAL_WINDOW_SIZE
+  uint32_t h2_max_frame;      // Peer's SETTINGS_MAX_FRAME_SIZE
+
+  hpack_table_t h2_decoder;
+
+  // Header block being received (HEADERS + CONTINUATION)
+  uint8_t *h2_hblock;
+  size_t h2_hblock_len;
+  uint32_t h2_hblock_stream;  // Set while CONTINUATION is expected
+  int h2_hblock_flags;
+
+  uint8_t h2_frame[HTTP2_DEFAULT_FRAME_SIZE];
+
+  int h2_preface_pending;  // Upgraded, client preface not yet received
+  int h2_goaway;
+  int h2_closed;
+} h2_connection_t;
+
+
+/**
+ *
+ */
+static void
+h2_send_u32(http_connection_t *hc, int type, uint32_t stream_id,
+            uint32_t value)
+{
+  mbuf_t mq;
+  mbuf_init(&mq);
+  http2_frame_u32(&mq, type, stream_id, value);
+  asyncio_sendq(hc->hc_af, &mq, 0);
+}
+
+
+/**
+ *
+ */
+static void
+h2_send_goaway(http_connection_t *hc, int err)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  const uint32_t last = h2->h2_last_stream_id;
+  const uint8_t payload[8] = {
+    last >> 24, last >> 16, last >> 8, last,
+    err >> 24, err >> 16, err >> 8, err
+  };
+  mbuf_t mq;
+  mbuf_init(&mq);
+  http2_frame_header(&mq, sizeof(payload), HTTP2_GOAWAY, 0, 0);
+  mbuf_append(&mq, payload, sizeof(payload));
+  asyncio_sendq(hc->hc_af, &mq, 0);
+  h2->h2_goaway = 1;
+}
+
+
+/**
+ * Must be called with h2_mutex held
+ */
+static h2_stream_t *
+h2_stream_find(h2_connection_t *h2, uint32_t id)
+{
+  h2_stream_t *s;
+  LIST_FOREACH(s, &h2->h2_streams, h2s_link)
+    if(s->h2s_id == id)
+      return s;
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static h2_stream_t *
+h2_stream_create(h2_connection_t *h2, uint32_t id)
+{
+  h2_stream_t *s = calloc(1, sizeof(h2_stream_t));
+  s->h2s_id = id;
+  arena_init(&s->h2s_arena);
+  TAILQ_INIT(&s->h2s_headers);
+  mbuf_init(&s->h2s_out);
+  s->h2s_received = asyncio_now();
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  s->h2s_window = h2->h2_initial_window;
+  LIST_INSERT_HEAD(&h2->h2_streams, s, h2s_link);
+  h2->h2_num_streams++;
+  pthread_mutex_unlock(&h2->h2_mutex);
+  return s;
+}
+
+
+/**
+ * Must be called with h2_mutex held
+ */
+static void
+h2_stream_free(h2_connection_t *h2, h2_stream_t *s)
+{
+  LIST_REMOVE(s, h2s_link);
+  h2->h2_num_streams--;
+  arena_clear(&s->h2s_arena);
+  mbuf_clear(&s->h2s_out);
+  free(s->h2s_body);
+  free(s);
+}
+
+
+/**
+ * Must be called with h2_mutex held. The stream is freed unless a request
+ * still refers to it
+ */
+static void
+h2_stream_reset(http_connection_t *hc, h2_stream_t *s, int err)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+
+  if(err != HTTP2_NO_ERROR)
+    h2_send_u32(hc, HTTP2_RST_STREAM, s->h2s_id, err);
+
+  s->h2s_reset = 1;
+  mbuf_clear(&s->h2s_out);
+  pthread_cond_broadcast(&h2->h2_cond);
+
+  if(!s->h2s_dispatched || s->h2s_end_pending)
+    h2_stream_free(h2, s);
+}
+
+
+/**
+ * Like mbuf_read() but also reads file segments (see mbuf_append_file())
+ * since output can't be sent with sendfile() when it's framed
+ */
+static ssize_t
+h2_read_out(mbuf_t *mq, uint8_t *buf, size_t len)
+{
+  size_t r = 0;
+  mbuf_data_t *md;
+
+  while(r < len && (md = TAILQ_FIRST(&mq->mq_buffers)) != NULL) {
+    size_t c = MIN(md->md_data_len - md->md_data_off, len - r);
+    if(md->md_data == NULL) {
+      const ssize_t n = pread(md->md_fd, buf + r, c, md->md_data_off);
+      if(n <= 0)
+        return -1;
+      c = n;
+    } else {
+      memcpy(buf + r, md->md_data + md->md_data_off, c);
+    }
+    r += c;
+    md->md_data_off += c;
+    mq->mq_size -= c;
+    if(md->md_data_off == md->md_data_len)
+      mbuf_data_free(mq, md);
+  }
+  return r;
+}
+
+
+/**
+ * Send as much queued output as the flow control windows allow.
+ * Must be called with h2_mutex held
+ */
+static void
+h2_flush(http_connection_t *hc)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  h2_stream_t *s, *next;
+  int progress = 0;
+  mbuf_t mq;
+
+  if(h2->h2_closed)
+    return;
+
+  mbuf_init(&mq);
+
+  for(s = LIST_FIRST(&h2->h2_streams); s != NULL; s = next) {
+    next = LIST_NEXT(s, h2s_link);
+    if(s->h2s_reset || s->h2s_end_sent)
+      continue;
+
+    while(s->h2s_out.mq_size > 0 && s->h2s_window > 0 && h2->h2_window > 0) {
+      size_t len = MIN(s->h2s_out.mq_size, HTTP2_DEFAULT_FRAME_SIZE);
+      len = MIN(len, s->h2s_window);
+      len = MIN(len, h2->h2_window);
+
+      uint8_t *data = malloc(len);
+      if(h2_read_out(&s->h2s_out, data, len) != len) {
+        free(data);
+        break;
+      }
+      s->h2s_window -= len;
+      h2->h2_window -= len;
+
+      const int last = s->h2s_end_pending && s->h2s_out.mq_size == 0;
+      http2_frame_header(&mq, len, HTTP2_DATA,
+                         last ? HTTP2_FLAG_END_STREAM : 0, s->h2s_id);
+      mbuf_append_prealloc(&mq, data, len);
+      s->h2s_end_sent = last;
+      progress = 1;
+    }
+
+    if(s->h2s_out.mq_size > 0 && s->h2s_window > 0 && h2->h2_window > 0) {
+      // File read failed
+      h2_stream_reset(hc, s, HTTP2_INTERNAL_ERROR);
+      continue;
+    }
+
+    if(s->h2s_end_pending && !s->h2s_end_sent && s->h2s_out.mq_size == 0) {
+      http2_frame_header(&mq, 0, HTTP2_DATA, HTTP2_FLAG_END_STREAM,
+                         s->h2s_id);
+      s->h2s_end_sent = 1;
+    }
+
+    if(s->h2s_end_sent)
+      h2_stream_free(h2, s);
+  }
+
+  if(mq.mq_size)
+    asyncio_sendq(hc->hc_af, &mq, 0);
+
+  if(progress)
+    pthread_cond_broadcast(&h2->h2_cond);
+}
+
+
+/**
+ * Response body data for a stream
+ */
+static int
+h2_sendq(http_request_t *hr, mbuf_t *mq)
+{
+  http_connection_t *hc = hr->hr_connection;
+  h2_connection_t *h2 = hc->hc_h2;
+  h2_stream_t *s = hr->hr_h2_stream;
+  int r = 0;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  if(s->h2s_reset || h2->h2_closed) {
+    mbuf_clear(mq);
+    r = -1;
+  } else {
+    mbuf_appendq(&s->h2s_out, mq);
+    h2_flush(hc);
+  }
+  pthread_mutex_unlock(&h2->h2_mutex);
+  return r;
+}
+
+
+/**
+ * Translate a HTTP/1 response header block into a HEADERS frame (plus
+ * CONTINUATION frames if it's larger than the peer's max frame size)
+ */
+static int
+h2_send_headers(http_request_t *hr, int rc, mbuf_t *hdrs, int cork)
+{
+  http_connection_t *hc = hr->hr_connection;
+  h2_connection_t *h2 = hc->hc_h2;
+  h2_stream_t *s = hr->hr_h2_stream;
+  mbuf_t hb, mq;
+  int r = 0;
+
+  mbuf_init(&hb);
+  mbuf_init(&mq);
+
+  hpack_encode_status(&hb, rc);
+
+  char *str = mbuf_clear_to_string(hdrs);
+  char *line = strstr(str, "\r\n");  // Skip status line
+  while(line != NULL) {
+    char *name = line + 2;
+    if((line = strstr(name, "\r\n")) == NULL)
+      break;
+    *line = 0;
+    char *value = strchr(name, ':');
+    if(value == NULL)
+      continue;
+    const size_t namelen = value - name;
+    *value++ = 0;
+    while(*value == ' ')
+      value++;
+
+    for(char *p = name; *p; p++)
+      if(*p >= 'A' && *p <= 'Z')
+        *p += 32;
+
+    // Connection specific headers are not allowed in HTTP/2
+    if(!strcmp(name, "connection") || !strcmp(name, "keep-alive") ||
+       !strcmp(name, "transfer-encoding") || !strcmp(name, "upgrade"))
+      continue;
+
+    hpack_encode_header(&hb, name, namelen, value, strlen(value));
+  }
+  free(str);
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  if(s->h2s_reset || h2->h2_closed) {
+    r = -1;
+  } else {
+    int type = HTTP2_HEADERS;
+    do {
+      const size_t len = MIN(hb.mq_size, h2->h2_max_frame);
+      const int end = len == hb.mq_size;
+      http2_frame_header(&mq, len, type, end ? HTTP2_FLAG_END_HEADERS : 0,
+                         s->h2s_id);
+      uint8_t *data = malloc(len);
+      mbuf_read(&hb, data, len);
+      mbuf_append_prealloc(&mq, data, len);
+      type = HTTP2_CONTINUATION;
+    } while(hb.mq_size > 0);
+
+    s->h2s_headers_sent = 1;
+    asyncio_sendq(hc->hc_af, &mq, cork);
+  }
+  pthread_mutex_unlock(&h2->h2_mutex);
+  mbuf_clear(&hb);
+  return r;
+}
+
+
+/**
+ * Block while more than 'high' bytes are waiting for the stream's window
+ */
+static int
+h2_stream_wait(http_request_t *hr, size_t high, int timeout)
+{
+  h2_connection_t *h2 = hr->hr_connection->hc_h2;
+  h2_stream_t *s = hr->hr_h2_stream;
+  struct timespec ts;
+  int r = 0;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  while(!s->h2s_reset && !h2->h2_closed && s->h2s_out.mq_size > high) {
+    if(pthread_cond_timedwait(&h2->h2_cond, &h2->h2_mutex, &ts) ==
+       ETIMEDOUT) {
+      r = -1;
+      break;
+    }
+  }
+  if(s->h2s_reset || h2->h2_closed)
+    r = -1;
+  pthread_mutex_unlock(&h2->h2_mutex);
+  return r;
+}
+
+
+/**
+ * Response data waiting for the flow control window plus what's queued
+ * on the socket (which is shared by all streams)
+ */
+static size_t
+h2_stream_queued(http_request_t *hr)
+{
+  h2_connection_t *h2 = hr->hr_connection->hc_h2;
+  h2_stream_t *s = hr->hr_h2_stream;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  const size_t size = s->h2s_reset || h2->h2_closed ? 0 : s->h2s_out.mq_size;
+  pthread_mutex_unlock(&h2->h2_mutex);
+  return size + asyncio_sendq_size(hr->hr_connection->hc_af);
+}
+
+
+/**
+ * Called when the request is destroyed. The stream lingers until all
+ * output has been sent
+ */
+static void
+h2_request_done(http_request_t *hr)
+{
+  http_connection_t *hc = hr->hr_connection;
+  h2_connection_t *h2 = hc->hc_h2;
+  h2_stream_t *s = hr->hr_h2_stream;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  s->h2s_end_pending = 1;
+  if(s->h2s_reset) {
+    h2_stream_free(h2, s);
+  } else if(!s->h2s_headers_sent || hr->hr_response_left > 0) {
+    // No response or less than announced, only way out is to reset
+    h2_stream_reset(hc, s, HTTP2_INTERNAL_ERROR);
+  } else {
+    h2_flush(hc);
+  }
+  pthread_mutex_unlock(&h2->h2_mutex);
+}
+
+
+/**
+ * Request body for routes added with http_route_add_stream(). It's
+ * buffered like any other body and delivered as a single chunk
+ */
+static void
+h2_stream_body_task(void *aux)
+{
+  http_request_t *hr = aux;
+  hr->hr_req_process = asyncio_now();
+
+  http_request_prepare(hr);
+
+  int err = http_request_admit(hr) ?: http_route_bind(hr);
+  if(!err) {
+    const http_route_t *r = hr->hr_route;
+    mbuf_t mq;
+    mbuf_init(&mq);
+    mbuf_append(&mq, hr->hr_body, hr->hr_body_size);
+    err = r->hr_body_callback(hr, &mq, 0) ?: http_form_finish(hr);
+    mbuf_clear(&mq);
+    if(!err)
+      err = r->hr_callback(hr, hr->hr_route_argc, hr->hr_route_argv, 0);
+  }
+  if(err && err != HTTP_STATUS_PENDING)
+    http_error(hr, err);
+  http_request_unlimit(hr);
+  http_request_release(hr);
+}
+
+
+/**
+ *
+ */
+static void
+h2_request_dispatch(http_request_t *hr)
+{
+  const http_route_t *r = http_route_peek(hr);
+  const int stream_body =
+    r != NULL && r->hr_body_callback != NULL && hr->hr_body_size > 0;
+  task_fn_t *fn =
+    stream_body ? h2_stream_body_task : http_dispatch_request_task;
+
+  http_request_ratelimit(hr);
+  if(!stream_body && !hr->hr_shed &&
+     r != NULL && r->hr_flags & HTTP_ROUTE_NONBLOCKING) {
+    hr->hr_inline = 1;
+    fn(hr);
+  } else {
+    task_pool_t *tp = http_request_pool(hr, r);
+    if(hr->hr_shed) {
+      hr->hr_inline = 1;
+      fn(hr);
+    } else {
+      task_run_in_pool(fn, hr, tp);
+    }
+  }
+}
+
+
+/**
+ * Turn a stream with a complete request into a http_request_t
+ */
+static void
+h2_stream_dispatch(http_connection_t *hc, h2_stream_t *s)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  const int method = str2val(s->h2s_method, HTTP_methodcodes);
+
+  if(method == -1) {
+    pthread_mutex_lock(&h2->h2_mutex);
+    h2_stream_reset(hc, s, HTTP2_PROTOCOL_ERROR);
+    pthread_mutex_unlock(&h2->h2_mutex);
+    return;
+  }
+
+  s->h2s_dispatched = 1;
+
+  http_request_t *hr = arena_zalloc(&s->h2s_arena, sizeof(http_request_t));
+  hr->hr_arena = s->h2s_arena;
+  arena_init(&s->h2s_arena);
+
+  hr->hr_connection = hc;
+  atomic_inc(&hc->hc_refcount);
+
+  mbuf_init(&hr->hr_reply);
+  mbuf_init(&hr->hr_rxbuf);
+  TAILQ_INIT(&hr->hr_query_args);
+  TAILQ_INIT(&hr->hr_response_headers);
+
+  TAILQ_MOVE(&hr->hr_request_headers, &s->h2s_headers, link);
+  hr->hr_header_index = s->h2s_header_index;
+  s->h2s_header_index = NULL;
+
+  if(http_header_find(hr->hr_header_index, "host") == NULL &&
+     s->h2s_authority != NULL)
+    http_header_add(&hr->hr_arena, &hr->hr_header_index,
+                    &hr->hr_request_headers,
+                    arena_strdup(&hr->hr_arena, "host"), s->h2s_authority);
+
+  // Split cookie headers are joined back together, RFC 7540 8.1.2.5
+  if(s->h2s_cookie != NULL)
+    http_header_add(&hr->hr_arena, &hr->hr_header_index,
+                    &hr->hr_request_headers,
+                    arena_strdup(&hr->hr_arena, "cookie"), s->h2s_cookie);
+
+  hr->hr_path = s->h2s_path;
+  hr->hr_method = method;
+  hr->hr_body = s->h2s_body;
+  hr->hr_body_size = s->h2s_body_size;
+  s->h2s_body = NULL;
+
+  hr->hr_req_received = s->h2s_received;
+  hr->hr_major = 2;
+  hr->hr_minor = 0;
+  hr->hr_keep_alive = 1;
+  hr->hr_h2_stream = s;
+
+  h2_request_dispatch(hr);
+}
+
+
+/**
+ *
+ */
+static int
+h2_header_cb(void *opaque, const char *name, size_t namelen,
+             const char *value, size_t valuelen)
+{
+  h2_stream_t *s = opaque;
+  if(s == NULL || s->h2s_bad)
+    return 0;  // Just keeping the decoder in sync
+
+  s->h2s_header_bytes += namelen + valuelen + 32;
+  if(s->h2s_header_bytes > H2_MAX_HEADER_LIST) {
+    s->h2s_bad = 1;
+    return 0;
+  }
+
+  arena_t *a = &s->h2s_arena;
+  char *v = arena_strndup(a, value, valuelen);
+
+  if(namelen > 0 && name[0] == ':') {
+    if(s->h2s_regular_seen)
+      s->h2s_bad = 1;
+    else if(namelen == 7 && !memcmp(name, ":method", 7))
+      s->h2s_method = v;
+    else if(namelen == 5 && !memcmp(name, ":path", 5))
+      s->h2s_path = v;
+    else if(namelen == 10 && !memcmp(name, ":authority", 10))
+      s->h2s_authority = v;
+    else if(!(namelen == 7 && !memcmp(name, ":scheme", 7)))
+      s->h2s_bad = 1;
+    return 0;
+  }
+
+  s->h2s_regular_seen = 1;
+
+  if(namelen == 6 && !memcmp(name, "cookie", 6)) {
+    if(s->h2s_cookie != NULL) {
+      const size_t len = strlen(s->h2s_cookie);
+      char *c = arena_alloc(a, len + 2 + valuelen + 1);
+      memcpy(c, s->h2s_cookie, len);
+      memcpy(c + len, "; ", 2);
+      memcpy(c + len + 2, value, valuelen);
+      c[len + 2 + valuelen] = 0;
+      v = c;
+    }
+    s->h2s_cookie = v;
+    return 0;
+  }
+
+  http_header_add(a, &s->h2s_header_index, &s->h2s_headers,
+                  arena_strndup(a, name, namelen), v);
+  return 0;
+}
+
+
+/**
+ * A complete header block has been received
+ */
+static int
+h2_headers(http_connection_t *hc, uint32_t id, int flags,
+           const uint8_t *data, size_t len)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  h2_stream_t *s = NULL;
+  int err = HTTP2_NO_ERROR;
+
+  if(id > h2->h2_last_stream_id) {
+    h2->h2_last_stream_id = id;
+    if(h2->h2_goaway || h2->h2_num_streams >= H2_MAX_STREAMS) {
+      err = HTTP2_REFUSED_STREAM;
+    } else {
+      s = h2_stream_create(h2, id);
+    }
+
+    // Must be decoded even if refused to keep the table in sync
+    if(hpack_decode(&h2->h2_decoder, data, len, h2_header_cb, s))
+      return HTTP2_COMPRESSION_ERROR;
+
+    if(s != NULL &&
+       (s->h2s_bad || s->h2s_method == NULL || s->h2s_path == NULL))
+      err = HTTP2_PROTOCOL_ERROR;
+
+  } else {
+    // Trailers, they are ignored
+    if(hpack_decode(&h2->h2_decoder, data, len, h2_header_cb, NULL))
+      return HTTP2_COMPRESSION_ERROR;
+
+    pthread_mutex_lock(&h2->h2_mutex);
+    s = h2_stream_find(h2, id);
+    if(s != NULL && s->h2s_dispatched) {
+      h2_stream_reset(hc, s, HTTP2_STREAM_CLOSED);
+      s = NULL;
+    }
+    pthread_mutex_unlock(&h2->h2_mutex);
+
+    if(s == NULL)
+      return 0;
+
+    if(!(flags & HTTP2_FLAG_END_STREAM))
+      err = HTTP2_PROTOCOL_ERROR;
+  }
+
+  if(err != HTTP2_NO_ERROR) {
+    if(s == NULL) {
+      h2_send_u32(hc, HTTP2_RST_STREAM, id, err);
+    } else {
+      pthread_mutex_lock(&h2->h2_mutex);
+      h2_stream_reset(hc, s, err);
+      pthread_mutex_unlock(&h2->h2_mutex);
+    }
+    return 0;
+  }
+
+  if(flags & HTTP2_FLAG_END_STREAM)
+    h2_stream_dispatch(hc, s);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+h2_data(http_connection_t *hc, uint32_t id, int flags,
+        const uint8_t *data, size_t len, size_t framelen)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  mbuf_t mq;
+
+  if(id == 0)
+    return HTTP2_PROTOCOL_ERROR;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  h2_stream_t *s = h2_stream_find(h2, id);
+  if(s != NULL && s->h2s_dispatched) {
+    h2_stream_reset(hc, s, HTTP2_STREAM_CLOSED);
+    s = NULL;
+  }
+  pthread_mutex_unlock(&h2->h2_mutex);
+
+  if(s == NULL && id > h2->h2_last_stream_id)
+    return HTTP2_PROTOCOL_ERROR;  // Idle stream
+
+  // Received data is consumed right away (or discarded) so the windows
+  // are given back immediately. Padding counts too
+  mbuf_init(&mq);
+  if(framelen > 0) {
+    http2_frame_u32(&mq, HTTP2_WINDOW_UPDATE, 0, framelen);
+    if(s != NULL && !(flags & HTTP2_FLAG_END_STREAM))
+      http2_frame_u32(&mq, HTTP2_WINDOW_UPDATE, id, framelen);
+  }
+  asyncio_sendq(hc->hc_af, &mq, 0);
+
+  if(s == NULL)
+    return 0;
+
+  if(s->h2s_body_size + len > H2_MAX_BODY) {
+    pthread_mutex_lock(&h2->h2_mutex);
+    h2_stream_reset(hc, s, HTTP2_CANCEL);
+    pthread_mutex_unlock(&h2->h2_mutex);
+    return 0;
+  }
+
+  if(s->h2s_body_size + len + 1 > s->h2s_body_alloc) {
+    s->h2s_body_alloc = MAX(s->h2s_body_alloc * 2, 4096);
+    s->h2s_body_alloc = MAX(s->h2s_body_alloc, s->h2s_body_size + len + 1);
+    s->h2s_body = realloc(s->h2s_body, s->h2s_body_alloc);
+  }
+  memcpy(s->h2s_body + s->h2s_body_size, data, len);
+  s->h2s_body_size += len;
+  s->h2s_body[s->h2s_body_size] = 0;
+
+  if(flags & HTTP2_FLAG_END_STREAM)
+    h2_stream_dispatch(hc, s);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+h2_settings(http_connection_t *hc, const uint8_t *data, size_t len)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  int err = HTTP2_NO_ERROR;
+  h2_stream_t *s;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  for(; len >= 6; data += 6, len -= 6) {
+    const int id = data[0] << 8 | data[1];
+    const uint32_t v = rd32_be(data + 2);
+
+    switch(id) {
+    case HTTP2_SETTINGS_ENABLE_PUSH:
+      if(v > 1)
+        err = HTTP2_PROTOCOL_ERROR;
+      break;
+
+    case HTTP2_SETTINGS_INITIAL_WINDOW_SIZE:
+      if(v > HTTP2_MAX_WINDOW) {
+        err = HTTP2_FLOW_CONTROL_ERROR;
+        break;
+      }
+      // Applies to all open streams, windows may go negative
+      LIST_FOREACH(s, &h2->h2_streams, h2s_link)
+        s->h2s_window += (int64_t)v - h2->h2_initial_window;
+      h2->h2_initial_window = v;
+      break;
+
+    case HTTP2_SETTINGS_MAX_FRAME_SIZE:
+      if(v < HTTP2_DEFAULT_FRAME_SIZE || v > 0xffffff)
+        err = HTTP2_PROTOCOL_ERROR;
+      else
+        h2->h2_max_frame = v;
+      break;
+    }
+  }
+
+  if(err == HTTP2_NO_ERROR)
+    h2_flush(hc);
+  pthread_mutex_unlock(&h2->h2_mutex);
+  return err;
+}
+
+
+/**
+ *
+ */
+static int
+h2_window_update(http_connection_t *hc, uint32_t id, uint32_t inc)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  int err = HTTP2_NO_ERROR;
+
+  inc &= 0x7fffffff;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  if(id == 0) {
+    if(inc == 0)
+      err = HTTP2_PROTOCOL_ERROR;
+    else if((h2->h2_window += inc) > HTTP2_MAX_WINDOW)
+      err = HTTP2_FLOW_CONTROL_ERROR;
+  } else {
+    h2_stream_t *s = h2_stream_find(h2, id);
+    if(s != NULL) {
+      if(inc == 0)
+        h2_stream_reset(hc, s, HTTP2_PROTOCOL_ERROR);
+      else if((s->h2s_window += inc) > HTTP2_MAX_WINDOW)
+        h2_stream_reset(hc, s, HTTP2_FLOW_CONTROL_ERROR);
+    }
+  }
+
+  if(err == HTTP2_NO_ERROR)
+    h2_flush(hc);
+  pthread_mutex_unlock(&h2->h2_mutex);
+  return err;
+}
+
+
+/**
+ * Returns a connection error or HTTP2_NO_ERROR
+ */
+static int
+h2_frame(http_connection_t *hc, int type, int flags, uint32_t id,
+         const uint8_t *data, size_t len)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  const size_t framelen = len;
+  h2_stream_t *s;
+  mbuf_t mq;
+
+  if(h2->h2_hblock_stream != 0 &&
+     (type != HTTP2_CONTINUATION || id != h2->h2_hblock_stream))
+    return HTTP2_PROTOCOL_ERROR;
+
+  switch(type) {
+  case HTTP2_DATA:
+  case HTTP2_HEADERS:
+    if(flags & HTTP2_FLAG_PADDED) {
+      if(len < 1 || data[0] >= len)
+        return HTTP2_PROTOCOL_ERROR;
+      len -= 1 + data[0];
+      data++;
+    }
+
+    if(type == HTTP2_DATA)
+      return h2_data(hc, id, flags, data, len, framelen);
+
+    if(id == 0 || !(id & 1))
+      return HTTP2_PROTOCOL_ERROR;
+
+    if(flags & HTTP2_FLAG_PRIORITY) {
+      if(len < 5)
+        return HTTP2_PROTOCOL_ERROR;
+      data += 5;
+      len -= 5;
+    }
+
+    h2->h2_hblock_len = 0;
+    h2->h2_hblock_flags = flags;
+    // FALLTHRU
+  case HTTP2_CONTINUATION:
+    if(type == HTTP2_CONTINUATION && h2->h2_hblock_stream == 0)
+      return HTTP2_PROTOCOL_ERROR;
+
+    if(h2->h2_hblock_len + len > H2_MAX_HEADER_BLOCK)
+      return HTTP2_ENHANCE_YOUR_CALM;
+
+    h2->h2_hblock = realloc(h2->h2_hblock, h2->h2_hblock_len + len);
+    memcpy(h2->h2_hblock + h2->h2_hblock_len, data, len);
+    h2->h2_hblock_len += len;
+
+    if(!(flags & HTTP2_FLAG_END_HEADERS)) {
+      h2->h2_hblock_stream = id;
+      return HTTP2_NO_ERROR;
+    }
+    h2->h2_hblock_stream = 0;
+    return h2_headers(hc, id, h2->h2_hblock_flags,
+                      h2->h2_hblock, h2->h2_hblock_len);
+
+  case HTTP2_PRIORITY:
+    if(id == 0)
+      return HTTP2_PROTOCOL_ERROR;
+    return len == 5 ? HTTP2_NO_ERROR : HTTP2_FRAME_SIZE_ERROR;
+
+  case HTTP2_RST_STREAM:
+    if(id == 0 || id > h2->h2_last_stream_id)
+      return HTTP2_PROTOCOL_ERROR;
+    if(len != 4)
+      return HTTP2_FRAME_SIZE_ERROR;
+
+    pthread_mutex_lock(&h2->h2_mutex);
+    s = h2_stream_find(h2, id);
+    if(s != NULL)
+      h2_stream_reset(hc, s, HTTP2_NO_ERROR);
+    pthread_mutex_unlock(&h2->h2_mutex);
+    return HTTP2_NO_ERROR;
+
+  case HTTP2_SETTINGS:
+    if(id != 0)
+      return HTTP2_PROTOCOL_ERROR;
+    if(flags & HTTP2_FLAG_ACK)
+      return len == 0 ? HTTP2_NO_ERROR : HTTP2_FRAME_SIZE_ERROR;
+    if(len % 6)
+      return HTTP2_FRAME_SIZE_ERROR;
+
+    mbuf_init(&mq);
+    http2_frame_header(&mq, 0, HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0);
+    asyncio_sendq(hc->hc_af, &mq, 0);
+    return h2_settings(hc, data, len);
+
+  case HTTP2_PING:
+    if(id != 0)
+      return HTTP2_PROTOCOL_ERROR;
+    if(len != 8)
+      return HTTP2_FRAME_SIZE_ERROR;
+    if(!(flags & HTTP2_FLAG_ACK)) {
+      mbuf_init(&mq);
+      http2_frame_header(&mq, 8, HTTP2_PING, HTTP2_FLAG_ACK, 0);
+      mbuf_append(&mq, data, 8);
+      asyncio_sendq(hc->hc_af, &mq, 0);
+    }
+    return HTTP2_NO_ERROR;
+
+  case HTTP2_GOAWAY:
+    if(id != 0)
+      return HTTP2_PROTOCOL_ERROR;
+    // Streams in progress are finished, we don't expect any new ones
+    return HTTP2_NO_ERROR;
+
+  case HTTP2_WINDOW_UPDATE:
+    if(len != 4)
+      return HTTP2_FRAME_SIZE_ERROR;
+    return h2_window_update(hc, id, rd32_be(data));
+
+  case HTTP2_PUSH_PROMISE:
+    return HTTP2_PROTOCOL_ERROR;
+
+  default:
+    return HTTP2_NO_ERROR;  // Unknown frame types must be ignored
+  }
+}
+
+
+/**
+ *
+ */
+static void
+h2_input(http_connection_t *hc, mbuf_t *mq)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+  uint8_t hdr[HTTP2_FRAME_HEADER_LEN];
+
+  if(h2->h2_goaway) {
+    mbuf_drop(mq, mq->mq_size);
+    return;
+  }
+
+  asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+
+  if(h2->h2_preface_pending) {
+    char preface[HTTP2_PREFACE_LEN];
+    if(mbuf_peek(mq, preface, sizeof(preface)) < sizeof(preface))
+      return;
+    if(memcmp(preface, HTTP2_PREFACE, HTTP2_PREFACE_LEN)) {
+      http_connection_close(hc);
+      return;
+    }
+    mbuf_drop(mq, HTTP2_PREFACE_LEN);
+    h2->h2_preface_pending = 0;
+  }
+
+  while(mbuf_peek(mq, hdr, sizeof(hdr)) == sizeof(hdr)) {
+    const uint32_t len = hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+    int err;
+
+    if(len > HTTP2_DEFAULT_FRAME_SIZE) {
+      err = HTTP2_FRAME_SIZE_ERROR;
+    } else {
+      if(mq->mq_size < sizeof(hdr) + len)
+        return;
+      mbuf_drop(mq, sizeof(hdr));
+      mbuf_read(mq, h2->h2_frame, len);
+      err = h2_frame(hc, hdr[3], hdr[4], rd32_be(hdr + 5) & 0x7fffffff,
+                     h2->h2_frame, len);
+    }
+
+    if(err != HTTP2_NO_ERROR) {
+      trace(LOG_DEBUG, "HTTP/2: %s: Connection error %d",
+            hc->hc_peer_addr, err);
+      h2_send_goaway(hc, err);
+      mbuf_drop(mq, mq->mq_size);
+      asyncio_shutdown(hc->hc_af);
+      return;
+    }
+  }
+}
+
+
+/**
+ * Switch connection to HTTP/2 and send our SETTINGS
+ */
+static void
+h2_connection_start(http_connection_t *hc)
+{
+  static const uint8_t settings[] = {
+    0, HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS,
+    0, HTTP2_SETTINGS_ENABLE_PUSH, 0, 0, 0, 0,
+  };
+
+  h2_connection_t *h2 = calloc(1, sizeof(h2_connection_t));
+  pthread_mutex_init(&h2->h2_mutex, NULL);
+  pthread_cond_init(&h2->h2_cond, NULL);
+  LIST_INIT(&h2->h2_streams);
+  h2->h2_window = HTTP2_DEFAULT_WINDOW;
+  h2->h2_initial_window = HTTP2_DEFAULT_WINDOW;
+  h2->h2_max_frame = HTTP2_DEFAULT_FRAME_SIZE;
+  hpack_table_init(&h2->h2_decoder, 4096);
+  hc->hc_h2 = h2;
+
+  // Frames from many streams are interleaved and each response ends
+  // with a small frame, Nagle would hold those back waiting for ACKs
+  const int val = 1;
+  setsockopt(hc->hc_af->af_fd, IPPROTO_TCP, TCP_NODELAY, &val, sizeof(val));
+
+  mbuf_t mq;
+  mbuf_init(&mq);
+  http2_frame_header(&mq, sizeof(settings), HTTP2_SETTINGS, 0, 0);
+  mbuf_append(&mq, settings, sizeof(settings));
+  asyncio_sendq(hc->hc_af, &mq, 0);
+}
+
+
+/**
+ * Check for the HTTP/2 client preface at start of connection. Returns 1
+ * if found, 0 if more data is needed and -1 if this is HTTP/1
+ */
+static int
+h2_preface_check(http_connection_t *hc, mbuf_t *mq)
+{
+  char buf[HTTP2_PREFACE_LEN];
+
+  if(!hc->hc_server->hs_http2) {
+    hc->hc_proto_checked = 1;
+    return -1;
+  }
+
+  const size_t len = mbuf_peek(mq, buf, sizeof(buf));
+  if(memcmp(buf, HTTP2_PREFACE, len)) {
+    hc->hc_proto_checked = 1;
+    return -1;
+  }
+
+  if(len < HTTP2_PREFACE_LEN)
+    return 0;
+
+  hc->hc_proto_checked = 1;
+  mbuf_drop(mq, HTTP2_PREFACE_LEN);
+  h2_connection_start(hc);
+  return 1;
+}
+
+
+/**
+ * HTTP/1.1 request with 'Upgrade: h2c'. It becomes stream 1
+ */
+static void
+h2_upgrade(http_connection_t *hc, http_request_t *hr)
+{
+  static const char response[] =
+    "HTTP/1.1 101 Switching Protocols\r\n"
+    "Connection: Upgrade\r\n"
+    "Upgrade: h2c\r\n"
+    "\r\n";
+
+  asyncio_send(hc->hc_af, response, sizeof(response) - 1, 0);
+  h2_connection_start(hc);
+
+  h2_connection_t *h2 = hc->hc_h2;
+  h2->h2_preface_pending = 1;
+
+  // Same as a SETTINGS frame but no ACK is sent
+  const char *settings = http_req_header(hr, "HTTP2-Settings");
+  uint8_t buf[256];
+  const int len = base64_decode(buf, settings, sizeof(buf));
+  if(len > 0)
+    h2_settings(hc, buf, len - len % 6);
+
+  h2->h2_last_stream_id = 1;
+  h2_stream_t *s = h2_stream_create(h2, 1);
+  s->h2s_dispatched = 1;
+
+  hr->hr_h2_stream = s;
+  hr->hr_major = 2;
+  hr->hr_minor = 0;
+  hr->hr_keep_alive = 1;
+
+  hc->hc_read_disabled = 0;
+  asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+
+  h2_request_dispatch(hr);
+}
+
+
+/**
+ * Idle connections are closed, after telling the client
+ */
+static void
+h2_timeout(http_connection_t *hc)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  const int busy = !LIST_EMPTY(&h2->h2_streams);
+  pthread_mutex_unlock(&h2->h2_mutex);
+
+  if(busy && !h2->h2_goaway) {
+    asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+  } else if(!h2->h2_goaway) {
+    h2_send_goaway(hc, HTTP2_NO_ERROR);
+    asyncio_shutdown(hc->hc_af);
+    asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+  } else {
+    http_connection_close(hc);
+  }
+}
+
+
+/**
+ * Wake up anyone waiting for output to drain
+ */
+static void
+h2_connection_closed(http_connection_t *hc)
+{
+  h2_connection_t *h2 = hc->hc_h2;
+
+  pthread_mutex_lock(&h2->h2_mutex);
+  h2->h2_closed = 1;
+  pthread_cond_broadcast(&h2->h2_cond);
+  pthread_mutex_unlock(&h2->h2_mutex);
+}
+
+
+/**
+ *
+ */
+static void
+h2_connection_free(h2_connection_t *h2)
+{
+  h2_stream_t *s;
+  while((s = LIST_FIRST(&h2->h2_streams)) != NULL)
+    h2_stream_free(h2, s);
+  hpack_table_free(&h2->h2_decoder);
+  free(h2->h2_hblock);
+  pthread_mutex_destroy(&h2->h2_mutex);
+  pthread_cond_destroy(&h2->h2_cond);
+  free(h2);
+}
+
+
+/**
+ * Hand a request over to the connection's task group
+ */
+static void
+http_request_enqueue(http_connection_t *hc, http_request_t *hr,
+                     task_fn_t *fn, task_pool_t *tp)
+{
+  hr->hr_queued = 1;
+  atomic_inc(&hc->hc_queued);
+  task_run_in_group_pool(fn, hr, hc->hc_task_group, tp);
+}
+
+
+/**
+ * Parsing of pipelined requests continues unless enough of them are
+ * queued already, or the last one must finish before we can go on
+ * (Connection: close, websocket upgrade, streamed body).
+ *
+ * Must be called on the asyncio thread
+ */
+static int
+http_pipeline_ready(http_connection_t *hc)
+{
+  if(hc->hc_closed || hc->hc_stream_paused)
+    return 0;
+
+  const int queued = atomic_get(&hc->hc_queued);
+  if(queued == 0)
+    hc->hc_barrier = 0;
+
+  return !hc->hc_barrier && queued < hc->hc_server->hs_pipeline_depth;
+}
+
+
+/**
+ *
+ */
+static void
+http_server_read(void *opaque, struct mbuf *mq)
+{
+  http_connection_t *hc = opaque;
+  while(hc->hc_ws_path == NULL) {
+
+    if(hc->hc_h2 != NULL) {
+      h2_input(hc, mq);
+      return;
+    }
+
+    if(hc->hc_read_disabled)
+      return;
+
+    if(!hc->hc_proto_checked) {
+      const int r = h2_preface_check(hc, mq);
+      if(r == 0)
+        return;
+      if(r == 1)
+        continue;
+    }
+
+    mbuf_data_t *md = TAILQ_FIRST(&mq->mq_buffers);
+    if(md == NULL)
+      return;
+
+    hc->hc_parse_start = (const void *)md->md_data + md->md_data_off;
+    hc->hc_parse_end   = (const void *)md->md_data + md->md_data_len;
+    const size_t avail = md->md_data_len - md->md_data_off;
+    size_t r;
+
+    if(hc->hc_body_left) {
+      r = MIN(hc->hc_body_left, avail);
+      if(http_body(&hc->hc_parser, hc->hc_parse_start, r)) {
+        http_connection_close(hc);
+        return;
+      }
+      hc->hc_body_left -= r;
+      if(hc->hc_body_left == 0)
+        http_message_complete(&hc->hc_parser);
+
+    } else {
+      const int fr =
+        hc->hc_in_message ? 0 : http_fast_head(hc, hc->hc_parse_start, avail);
+      if(fr < 0) {
+        http_connection_close(hc);
+        return;
+      }
+
+      r = fr ?: http_parser_execute(&hc->hc_parser, &parser_settings,
+                                    hc->hc_parse_start, avail);
+    }
+
+    if(HTTP_PARSER_ERRNO(&hc->hc_parser) == HPE_PAUSED)
+      http_parser_pause(&hc->hc_parser, 0);
+
+    if(hc->hc_rxbuf_ref) {
+      // Buffer is referenced by the request, keep it around
+      mbuf_drop_keep(mq, r, &hc->hc_rxbuf);
+      hc->hc_rxbuf_ref = 0;
+    } else {
+      mbuf_drop(mq, r);
+    }
+
+    http_request_t *hr = hc->hc_pending_request;
+    if(hr != NULL) {
+      hc->hc_pending_request = NULL;
+      mbuf_appendq(&hr->hr_rxbuf, &hc->hc_rxbuf);
+      if(hc->hc_h2_upgrade) {
+        hc->hc_h2_upgrade = 0;
+        h2_upgrade(hc, hr);
+        continue;  // Rest of the input is HTTP/2
+      } else if(hr->hr_stream_body) {
+        // Shed requests are replied to by http_stream_begin_task()
+        http_request_ratelimit(hr);
+        hc->hc_stream_pool =
+          http_request_pool(hr, hr->hr_route_peek->hrp_route);
+        http_request_enqueue(hc, hr, http_stream_begin_task,
+                             hc->hc_stream_pool);
+      } else {
+        const http_route_t *r = http_route_peek(hr);
+        const int queued = atomic_get(&hc->hc_queued);
+        const int nonblocking = http_request_is_nonblocking(hr, r);
+        task_pool_t *tp = NULL;
+
+        http_request_ratelimit(hr);
+        if(queued || !nonblocking)
+          tp = http_request_pool(hr, r);
+
+        if(queued == 0 &&
+           (nonblocking || (hr->hr_shed && !hr->hr_100_continue_check))) {
+          // Only when nothing is queued ahead of us, or we would reply
+          // out of order. Shed requests are cheap to answer as well
+          hr->hr_inline = 1;
+          http_dispatch_request_task(hr);
+        } else {
+          if(hr->hr_keep_alive != 1 || hc->hc_ws_path != NULL)
+            hc->hc_barrier = 1;
+          http_request_enqueue(hc, hr, http_dispatch_request_task, tp);
+          if(http_pipeline_ready(hc))
+            hc->hc_read_disabled = 0;
+        }
+      }
+    }
+
+    if(hc->hc_stream_request != NULL) {
+      const http_server_t *hs = hc->hc_server;
+      if(http_stream_flush(hc) > hs->hs_stream_buffer_size) {
+        // Body callback can't keep up, stop reading from client
+        hc->hc_stream_paused = 1;
+        hc->hc_read_disabled = 1;
+        asyncio_disable_read(hc->hc_af);
+        asyncio_timer_disarm(&hc->hc_timer);
+      } else {
+        asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+      }
+    }
+
+    if(hc->hc_parser.http_errno) {
+      http_connection_close(hc);
+      return;
+    }
+  }
+
+  if(websocket_parse(mq, websocket_packet_input, hc, &hc->hc_ws_state)) {
+    http_connection_close(hc);
+  }
+}
+
+
+
+
+/**
+ *
+ */
+static void
+http_connection_reenable(void *aux)
+{
+  http_connection_t *hc = aux;
+
+  if(!hc->hc_closed) {
+    // Requests still queued can take any amount of time, the timer
+    // is not armed until they're all done
+    if(atomic_get(&hc->hc_queued) == 0)
+      asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+
+    if(hc->hc_read_disabled && http_pipeline_ready(hc)) {
+      hc->hc_read_disabled = 0;
+      // This will make the asyncio socket retry the read callback if
+      // there is data pending
+      asyncio_enable_read(hc->hc_af);
+    }
+  }
+  http_connection_release(hc);
+}
+
+
+/**
+ * Same as above but for requests served inline from http_server_read()
+ */
+static void
+http_connection_resume(http_connection_t *hc)
+{
+  if(!hc->hc_closed) {
+    asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+    hc->hc_read_disabled = 0;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_server_error(void *opaque, int error)
+{
+  http_connection_t *hc = opaque;
+  hc->hc_error = error;
+  http_connection_close(hc);
+}
+
+
+/**
+ *
+ */
+static void
+http_server_timeout(void *aux)
+{
+  http_connection_t *hc = aux;
+
+  if(hc->hc_ws_path != NULL) {
+    websocket_timer(hc);
+  } else if(hc->hc_h2 != NULL) {
+    h2_timeout(hc);
+  } else {
+    http_connection_close(hc);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_server_reject(int fd, int status, int retry_after)
+{
+  char buf[200];
+  const int len =
+    snprintf(buf, sizeof(buf),
+             "HTTP/1.1 %d %s\r\n"
+             "Retry-After: %d\r\n"
+             "Content-Length: 0\r\n"
+             "Connection: close\r\n"
+             "\r\n", status, http_rc2str(status), retry_after);
+
+  // Best effort, a new socket has plenty of room in its send buffer
+  if(send(fd, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL) != len) {}
+}
+
+
+/**
+ *
+ */
+static int
+http_server_accept(void *opaque, int fd, struct sockaddr *peer,
+                   struct sockaddr *self)
+{
+  char tmpbuf[128];
+  http_server_t *hs = opaque;
+  const char *peer_addr = "0.0.0.0";
+  http_limit_entry_t *hle = NULL;
+
+  switch(peer->sa_family) {
+  case AF_INET:
+    if(inet_ntop(AF_INET, &((struct sockaddr_in *)peer)->sin_addr,
+                 tmpbuf, sizeof(tmpbuf)) != NULL)
+      peer_addr = tmpbuf;
+    break;
+  case AF_INET6:
+    if(inet_ntop(AF_INET6, &((struct sockaddr_in6 *)peer)->sin6_addr,
+                 tmpbuf, sizeof(tmpbuf)) != NULL)
+      peer_addr = tmpbuf;
+    break;
+  }
+
+  // Reject before anything is allocated for the connection
+  if(hs->hs_max_connections &&
+     atomic_get(&hs->hs_connections) >= hs->hs_max_connections) {
+    http_server_reject(fd, HTTP_STATUS_SERVICE_UNAVAILABLE,
+                       hs->hs_retry_after);
+    return -1;
+  }
+
+  if(hs->hs_max_connections_per_ip) {
+    hle = http_limit_connection_add(hs, peer_addr);
+    if(hle == NULL) {
+      http_server_reject(fd, HTTP_STATUS_TOO_MANY_REQUESTS,
+                         hs->hs_retry_after);
+      return -1;
+    }
+  }
+
+  atomic_inc(&hs->hs_connections);
+
+  http_connection_t *hc = calloc(1, sizeof(http_connection_t));
+
+  atomic_set(&hc->hc_refcount, 1);
+  TAILQ_INIT(&hc->hc_request_headers);
+  mbuf_init(&hc->hc_rxbuf);
+  mbuf_init(&hc->hc_stream_buf);
+  http_parser_init(&hc->hc_parser, HTTP_REQUEST);
+  hc->hc_parser.data = hc;
+
+  hc->hc_task_group = task_group_create();
+
+  hc->hc_peer_addr = strdup(peer_addr);
+  hc->hc_limit = hle;
+
+  hc->hc_server = hs;
+  atomic_inc(&hs->hs_refcount);
+  hc->hc_af = asyncio_stream_mt(fd, http_server_read, http_server_error, hc);
+
+  asyncio_timer_init(&hc->hc_timer, http_server_timeout, hc);
+  asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+
+  asyncio_enable_read(hc->hc_af);
+
+  return 0;
+}
+
+/**
+ *
+ */
+static void
+http_server_start(void *aux)
+{
+  http_server_t *hs = aux;
+  hs->hs_fd = asyncio_bind(hs->hs_bind_address, hs->hs_port,
+                           http_server_accept, hs);
+
+  if(hs->hs_fd == NULL) {
+    trace(LOG_ERR, "HTTP: Failed to bind %s:%d",
+          hs->hs_bind_address, hs->hs_port);
+  } else {
+    trace(LOG_NOTICE, "HTTP: Listening on %s:%d",
+          hs->hs_bind_address, hs->hs_port);
   }
 }
 
 
 
-static int
-append(char **dst, const char *src, size_t len)
-{
-  size_t curlen = *dst ? strlen(*dst) : 0;
-  char *x = realloc(*dst, curlen + len + 1);
-  if(x == NULL)
-    return -1;
-  memcpy(x + curlen, src, len);
-  x[curlen + len] = 0;
-  *dst = x;
-  return 0;
-}
-
 
 /**
+ * Response compression config, for example:
  *
+ *  "compression": {
+ *    "enabled": 1,
+ *    "minSize": 1024,
+ *    "level": 6,
+ *    "types": ["text/", "application/json"]
+ *  }
  */
 static void
-add_current_header(http_connection_t *hc)
+http_server_init_compression(http_server_t *hs, cfg_t *cr)
 {
-  if(hc->hc_header_field && hc->hc_header_value) {
-    http_arg_t *ra = malloc(sizeof(http_arg_t));
-    TAILQ_INSERT_TAIL(&hc->hc_request_headers, ra, link);
-    ra->key = hc->hc_header_field;
-    ra->val = hc->hc_header_value;
+  const char *prefix = hs->hs_config_prefix;
+
+  if(!cfg_get_int(cr, CFG(prefix, "compression", "enabled"), 1))
+    return;
+
+  hs->hs_compress_min_size =
+    cfg_get_int(cr, CFG(prefix, "compression", "minSize"), 1024);
+  hs->hs_compress_level =
+    cfg_get_int(cr, CFG(prefix, "compression", "level"), 6);
 
+  cfg_t *c = cfg_get_map(cr, prefix);
+  c = c ? cfg_get_map(c, "compression") : NULL;
+  cfg_t *types = c ? cfg_get_list(c, "types") : NULL;
+
+  if(types != NULL) {
+    for(int i = 0; i < cfg_list_length(types); i++) {
+      const char *type = cfg_get_str(types, CFGI(i), NULL);
+      if(type != NULL)
+        strvec_push(&hs->hs_compress_types, type);
+    }
   } else {
-    free(hc->hc_header_field);
-    free(hc->hc_header_value);
+    strvec_push(&hs->hs_compress_types, "text/");
+    strvec_push(&hs->hs_compress_types, "application/json");
+    strvec_push(&hs->hs_compress_types, "application/javascript");
+    strvec_push(&hs->hs_compress_types, "application/xml");
+    strvec_push(&hs->hs_compress_types, "image/svg+xml");
   }
-  hc->hc_header_field = NULL;
-  hc->hc_header_value = NULL;
 }
 
-static int
-http_message_begin(http_parser *p)
-{
-  //  http_connection_t *hc = p->data;
-  return 0;
-}
 
-static int
-http_url(http_parser *p, const char *at, size_t length)
+/**
+ * Admission control config, for example:
+ *
+ *  "limits": {
+ *    "maxConnections": 10000,     // 503 when exceeded
+ *    "maxConnectionsPerIp": 100,  // 429 when exceeded
+ *    "requestRate": 20,           // Requests per second per client
+ *    "requestBurst": 40,
+ *    "retryAfter": 1
+ *  }
+ *
+ * Connections are rejected right after accept with a minimal response.
+ * Requests over the rate get 429 with Retry-After. Request rate is keyed
+ * on the realIpHeader value when configured, the connection cap always
+ * uses the socket peer so it should be left off behind a proxy.
+ * All limits are off (0) by default.
+ */
+static void
+http_server_init_limits(http_server_t *hs, cfg_t *cr)
 {
-  http_connection_t *hc = p->data;
-  return append(&hc->hc_path, at, length);
+  const char *prefix = hs->hs_config_prefix;
+
+  hs->hs_max_connections =
+    cfg_get_int(cr, CFG(prefix, "limits", "maxConnections"), 0);
+  hs->hs_max_connections_per_ip =
+    cfg_get_int(cr, CFG(prefix, "limits", "maxConnectionsPerIp"), 0);
+  hs->hs_request_rate =
+    cfg_get_dbl(cr, CFG(prefix, "limits", "requestRate"), 0);
+  hs->hs_request_burst =
+    cfg_get_dbl(cr, CFG(prefix, "limits", "requestBurst"),
+                MAX(hs->hs_request_rate * 2, 1));
+  hs->hs_retry_after =
+    cfg_get_int(cr, CFG(prefix, "limits", "retryAfter"), 1);
+
+  if(!hs->hs_max_connections_per_ip && hs->hs_request_rate <= 0)
+    return;
+
+  hs->hs_limit_shards = calloc(HTTP_LIMIT_SHARDS, sizeof(http_limit_shard_t));
+  for(int i = 0; i < HTTP_LIMIT_SHARDS; i++) {
+    pthread_mutex_init(&hs->hs_limit_shards[i].hls_mutex, NULL);
+    TAILQ_INIT(&hs->hs_limit_shards[i].hls_lru);
+  }
 }
 
 
-static int
-http_status(http_parser *p, const char *at, size_t length)
-{
-  return 0;
-}
+/**
+ * Pools, concurrency limit and proxies. Each is configured from the
+ * map with its name under the server's config prefix before requests
+ * are served, so what they set up is not locked. The name is also the
+ * key of their JSON metrics
+ */
+static const struct {
+  const char *name;
+  void (*init)(cfg_t *c);
+  void (*prometheus)(mbuf_t *out);
+  ntv_t *(*ntv)(void);
+} http_server_exts[] = {
+  { "pools",       http_pools_init,   http_pools_prometheus,
+    http_pools_ntv },
+  { "concurrency", http_limiter_init, http_limiter_prometheus,
+    http_limiter_ntv },
+  { "proxies",     http_proxies_init, http_proxies_prometheus,
+    http_proxies_ntv },
+};
 
-static int
-http_header_field(http_parser *p, const char *at, size_t length)
-{
-  http_connection_t *hc = p->data;
-  add_current_header(hc);
-  return append(&hc->hc_header_field, at, length);
-}
+#define HTTP_SERVER_EXTS \
+  (sizeof(http_server_exts) / sizeof(http_server_exts[0]))
 
+
+/**
+ * Metrics endpoint, Prometheus text format or JSON with ?format=json
+ */
 static int
-http_header_value(http_parser *p, const char *at, size_t length)
+http_metrics_serve(http_request_t *hr, int argc, char **argv, int flags)
 {
-  http_connection_t *hc = p->data;
-  return append(&hc->hc_header_value, at, length);
+  const char *format = http_arg_get(&hr->hr_query_args, "format");
+
+  if(format != NULL && !strcmp(format, "json")) {
+    ntv_t *m = http_metrics_ntv();
+    for(int i = 0; i < HTTP_SERVER_EXTS; i++)
+      ntv_set_ntv(m, http_server_exts[i].name, http_server_exts[i].ntv());
+    ntv_json_serialize(m, &hr->hr_reply, 1);
+    ntv_release(m);
+    return http_send_reply(hr, 200, "application/json", NULL, NULL, 0);
+  }
+
+  http_metrics_prometheus(&hr->hr_reply);
+  for(int i = 0; i < HTTP_SERVER_EXTS; i++)
+    http_server_exts[i].prometheus(&hr->hr_reply);
+  return http_send_reply(hr, 200, "text/plain; version=0.0.4",
+                         NULL, NULL, 0);
 }
 
 
 /**
+ * Per route metrics are collected when an endpoint is configured:
  *
+ *  "metrics": {
+ *    "path": "/_metrics"
+ *  }
  */
 static void
-http_create_request(http_connection_t *hc, int continue_check)
+http_server_init_metrics(http_server_t *hs, cfg_t *cr)
 {
-  http_request_t *hr = calloc(1, sizeof(http_request_t));
+  const char *path =
+    cfg_get_str(cr, CFG(hs->hs_config_prefix, "metrics", "path"), NULL);
+  if(path == NULL)
+    return;
 
-  hr->hr_connection = hc;
-  atomic_inc(&hc->hc_refcount);
+  http_route_add_method(tsprintf("%s$", path), HTTP_GET,
+                        http_metrics_serve, 0);
+  http_metrics_enabled = 1;
+}
 
-  mbuf_init(&hr->hr_reply);
 
-  TAILQ_INIT(&hr->hr_query_args);
-  TAILQ_INIT(&hr->hr_response_headers);
+/**
+ * Routes added before the pools and the concurrency limit were
+ * configured are bound here, later ones in http_route_add0()
+ */
+static void
+http_server_init_pools(http_server_t *hs, cfg_t *cr)
+{
+  cfg_t *sc = cfg_get_map(cr, hs->hs_config_prefix);
+  for(int i = 0; sc != NULL && i < HTTP_SERVER_EXTS; i++) {
+    cfg_t *c = cfg_get_map(sc, http_server_exts[i].name);
+    if(c != NULL)
+      http_server_exts[i].init(c);
+  }
 
-  hr->hr_req_received = asyncio_now();
+  http_route_t *hr;
+  LIST_FOREACH(hr, &http_all_routes, hr_all_link) {
+    if(hr->hr_pool == NULL)
+      hr->hr_pool = http_pool_for_route(hr->hr_path);
+    hr->hr_class = http_limiter_class(hr->hr_path);
+  }
+}
 
-  if(continue_check) {
-    TAILQ_INIT(&hr->hr_request_headers);
-    const http_arg_t *ra;
-    hr->hr_path = strdup(hc->hc_path);
-     TAILQ_FOREACH(ra, &hc->hc_request_headers, link) {
-       http_arg_set(&hr->hr_request_headers, ra->key, ra->val);
-     }
-     hr->hr_100_continue_check = 1;
 
-  } else {
+/**
+ *  Fire up HTTP server
+ */
+struct http_server *
+http_server_init(const char *config_prefix)
+{
+  cfg_root(cr);
 
-    hr->hr_keep_alive = http_should_keep_alive(&hc->hc_parser);
+  if(config_prefix == NULL)
+    config_prefix = "http";
 
-    TAILQ_MOVE(&hr->hr_request_headers, &hc->hc_request_headers, link);
-    TAILQ_INIT(&hc->hc_request_headers);
-    hr->hr_path = hc->hc_path;
-    hc->hc_path = NULL;
+  http_server_t *hs = calloc(1, sizeof(http_server_t));
+  atomic_set(&hs->hs_refcount, 1);
+  hs->hs_port = cfg_get_int(cr, CFG(config_prefix, "port"), 9000);
+  hs->hs_bind_address =
+    strdup(cfg_get_str(cr, CFG(config_prefix, "bindAddress"), "127.0.0.1"));
 
-    hr->hr_remain = hc->hc_remain;
-    hc->hc_remain = NULL;
+  hs->hs_config_prefix = strdup(config_prefix);
 
-    hr->hr_body = hc->hc_body;
-    hc->hc_body = NULL;
+  const char *real_ip_header =
+    cfg_get_str(cr, CFG(config_prefix, "realIpHeader"), NULL);
+  hs->hs_real_ip_header = real_ip_header ? strdup(real_ip_header) : NULL;
 
-    hr->hr_body_size = hc->hc_body_received;
-  }
+  hs->hs_secure_cookies = cfg_get_int(cr, CFG(config_prefix, "secureCookies"), 0);
 
-  hr->hr_method = hc->hc_parser.method;
-  hr->hr_major = hc->hc_parser.http_major;
-  hr->hr_minor = hc->hc_parser.http_minor;
-  task_run_in_group(http_dispatch_request_task, hr, hc->hc_task_group);
-}
+  hs->hs_stream_buffer_size =
+    cfg_get_int(cr, CFG(config_prefix, "streamBufferSize"), 1024 * 1024);
+  hs->hs_send_buffer_size =
+    cfg_get_int(cr, CFG(config_prefix, "sendBufferSize"), 1024 * 1024);
+  hs->hs_form_field_max =
+    cfg_get_int(cr, CFG(config_prefix, "formFieldMaxSize"), 1024 * 1024);
+  hs->hs_form_max_size =
+    cfg_get_int(cr, CFG(config_prefix, "formMaxSize"), 4 * 1024 * 1024);
+  hs->hs_form_max_fields =
+    cfg_get_int(cr, CFG(config_prefix, "formMaxFields"), 1000);
+
+  // Max number of pipelined requests parsed ahead on a connection
+  hs->hs_pipeline_depth =
+    MAX(cfg_get_int(cr, CFG(config_prefix, "pipelineDepth"), 8), 1);
+
+  // Cleartext HTTP/2 (prior knowledge and h2c upgrade)
+  hs->hs_http2 = cfg_get_int(cr, CFG(config_prefix, "http2"), 1);
+
+  http_server_init_compression(hs, cr);
+  http_server_init_limits(hs, cr);
+  http_server_init_metrics(hs, cr);
+  http_server_init_pools(hs, cr);
+
+  http_cache_init(cfg_get_int(cr, CFG(config_prefix, "cache", "maxSize"),
+                              32 * 1024 * 1024));
+
+  const char *accesslog =
+    cfg_get_str(cr, CFG(config_prefix, "accessLog", "path"), NULL);
+  if(accesslog != NULL &&
+     http_accesslog_init(accesslog,
+                         cfg_get_int(cr, CFG(config_prefix, "accessLog",
+                                             "ringSize"), 4096)))
+    trace(LOG_ERR, "HTTP: Access log disabled");
 
-static void
-trace_request_headers(http_connection_t *hc)
-{
-  cfg_root(cr);
-  const http_server_t *hs = hc->hc_server;
-  int tracehttp = cfg_get_int(cr, CFG(hs->hs_config_prefix, "trace"), 0);
-  if(!tracehttp)
-    return;
+  asyncio_run_task(http_server_start, hs);
 
-  trace(LOG_DEBUG, "HTTP-IN %s %s", http_method2str(hc->hc_parser.method),
-        hc->hc_path);
-  http_arg_t *ha;
-  TAILQ_FOREACH(ha, &hc->hc_request_headers, link)
-    trace(LOG_DEBUG, "HTTP-IN   %s: %s", ha->key, ha->val);
+  return hs;
 }
 
 
+
 /**
+ * Static file serving
  *
+ * Files are served from disk if they exist there, otherwise from the
+ * embedded filebundle with the same path. Disk files are sent with
+ * sendfile() from an open fd that is cached together with the stat()
+ * info, which is revalidated at most once per second. Bundled files are
+ * sent straight from their const data.
  */
-static int
-http_headers_complete(http_parser *p)
-{
-  http_connection_t *hc = p->data;
-  add_current_header(hc);
-
-  trace_request_headers(hc);
 
-  const char *upgrade = http_arg_get(&hc->hc_request_headers, "Upgrade");
+#define STATIC_FILE_HASH_SIZE 256
+#define STATIC_FILE_CACHE_MAX 1024
 
-  if(!strcasecmp(upgrade ?: "", "websocket")) {
-    int err = websocket_upgrade(hc);
-    if(!err) {
-      return 2;
-    }
-    return 0;
-  }
+typedef struct static_file {
+  LIST_ENTRY(static_file) sf_link;
+  atomic_t sf_refcount;
+  char *sf_path;
 
-  const char *expect = http_arg_get(&hc->hc_request_headers, "Expect");
-  if(expect != NULL && !strcasecmp(expect, "100-continue")) {
-    http_create_request(hc, 1);
-  }
+  int sf_fd;                   // -1 for bundled files
+  const uint8_t *sf_data;      // Bundled files
+  void *sf_alloc;              // Inflated copy of compressed bundle entry
+  int64_t sf_size;
 
-  if(p->content_length != UINT64_MAX) {
+  dev_t sf_dev;
+  ino_t sf_ino;
+  time_t sf_mtime;
+  time_t sf_checked;           // Last time stat() was verified
+  time_t sf_gz_checked;        // Last time we found no .gz variant
 
-    if(p->content_length > 1024 * 1024 * 1024) {
-      /* Bail out if POST data > 1 GB */
-      return -1;
-    }
-    assert(hc->hc_body == NULL);
-    hc->hc_body = malloc(p->content_length + 1);
-    if(hc->hc_body == NULL)
-      return -1;
+  struct static_file *sf_gz;   // gzip'ed bundle entry
 
-    hc->hc_body[p->content_length] = 0;
-    hc->hc_body_received = 0;
-    hc->hc_body_size = p->content_length;
-  }
-  return 0;
-}
+  char sf_etag[64];
+} static_file_t;
 
-static int
-http_body(http_parser *p, const char *at, size_t length)
-{
-  http_connection_t *hc = p->data;
-  if(hc->hc_body == NULL)
-    return 1;
+static LIST_HEAD(, static_file) static_files[STATIC_FILE_HASH_SIZE];
+static int static_files_count;
+static pthread_mutex_t static_file_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-  if(hc->hc_body_received + length > hc->hc_body_size)
-    return 1;
-  memcpy(hc->hc_body + hc->hc_body_received, at, length);
-  hc->hc_body_received += length;
-  return 0;
-}
 
-static int
-http_message_complete(http_parser *p)
+/**
+ *
+ */
+static void
+static_file_release(void *opaque)
 {
-  http_connection_t *hc = p->data;
-  http_create_request(hc, 0);
+  static_file_t *sf = opaque;
 
+  if(atomic_dec(&sf->sf_refcount))
+    return;
 
-  // Re-arm timer if we do websocket
-  if(hc->hc_ws_path != NULL) {
-    asyncio_timer_arm_delta(&hc->hc_timer, 20 * 1000000);
-  } else {
-    // Otherwise we disarm, we really don't know how long the request
-    // take to serve so once the request finishes we will re-arm the
-    // timer again
-    asyncio_timer_disarm(&hc->hc_timer);
-    hc->hc_read_disabled = 1;
-  }
-  return 0;
+  if(sf->sf_fd != -1)
+    close(sf->sf_fd);
+  if(sf->sf_gz != NULL)
+    static_file_release(sf->sf_gz);
+  free(sf->sf_alloc);
+  free(sf->sf_path);
+  free(sf);
 }
 
-static const http_parser_settings parser_settings = {
-  .on_message_begin    = http_message_begin,
-  .on_url              = http_url,
-  .on_status           = http_status,
-  .on_header_field     = http_header_field,
-  .on_header_value     = http_header_value,
-  .on_headers_complete = http_headers_complete,
-  .on_body             = http_body,
-  .on_message_complete = http_message_complete,
-  //  .on_chunk_header     = http_chunk_header,
-  //  .on_chunk_complete   = http_chunk_complete
-};
-
 
 /**
  *
  */
-static void
-http_connection_destroy(http_connection_t *hc)
+static static_file_t *
+static_file_create(const char *path)
 {
-  http_server_release(hc->hc_server);
-  async_fd_release(hc->hc_af);
-  free(hc->hc_path);
-  free(hc->hc_remain);
-  free(hc->hc_header_field);
-  free(hc->hc_header_value);
-  task_group_destroy(hc->hc_task_group);
+  static_file_t *sf = calloc(1, sizeof(static_file_t));
+  atomic_set(&sf->sf_refcount, 1);
+  sf->sf_path = strdup(path);
+  sf->sf_fd = -1;
+  return sf;
+}
 
-  websocket_free(&hc->hc_ws_state);
-  free(hc->hc_peer_addr);
 
-  if(hc->hc_z_out != NULL) {
-    deflateEnd(hc->hc_z_out);
-    free(hc->hc_z_out);
-  }
+/**
+ *
+ */
+static static_file_t *
+static_file_open_disk(const char *path, time_t now)
+{
+  struct stat st;
 
-  if(hc->hc_z_in != NULL) {
-    inflateEnd(hc->hc_z_in);
-    free(hc->hc_z_in);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if(fd == -1)
+    return NULL;
+
+  if(fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
   }
 
-  free(hc);
+  static_file_t *sf = static_file_create(path);
+  sf->sf_fd = fd;
+  sf->sf_size = st.st_size;
+  sf->sf_dev = st.st_dev;
+  sf->sf_ino = st.st_ino;
+  sf->sf_mtime = st.st_mtime;
+  sf->sf_checked = now;
+  snprintf(sf->sf_etag, sizeof(sf->sf_etag), "\"%"PRIx64"-%"PRIx64"-%"PRIx64"\"",
+           (uint64_t)st.st_ino, (uint64_t)st.st_mtime, (uint64_t)st.st_size);
+  return sf;
 }
 
 
 /**
  *
  */
-static void
-http_connection_release(http_connection_t *hc)
+static int
+gunzip_buf(void *dst, size_t dstlen, const void *src, size_t srclen)
 {
-  if(atomic_dec(&hc->hc_refcount))
-     return;
+  z_stream z = {};
 
-  http_connection_destroy(hc);
+  if(inflateInit2(&z, 15 + 16) != Z_OK)
+    return -1;
+
+  z.next_in = (void *)src;
+  z.avail_in = srclen;
+  z.next_out = dst;
+  z.avail_out = dstlen;
+
+  const int r = inflate(&z, Z_FINISH);
+  inflateEnd(&z);
+  return r == Z_STREAM_END && z.avail_out == 0 ? 0 : -1;
 }
 
 
 /**
- *
+ * Bundles made with 'mkbundle -z' contain gzip'ed files. The compressed
+ * data is kept as a variant for clients that accept it
  */
-static void
-http_connection_shutdown_task(void *aux)
+static static_file_t *
+static_file_open_bundle(const char *path)
 {
-  http_connection_t *hc = aux;
+  void *data;
+  int size, osize;
 
-  if(hc->hc_ws_path != NULL && hc->hc_ws_opaque != NULL)
-    hc->hc_ws_path->wsp_disconnected(hc->hc_ws_opaque, hc->hc_error);
+  // With filebundle_disk.c this only succeeds if the file exists on disk
+  // in which case we already got it from static_file_open_disk()
+  if(filebundle_load(path, &data, &size, &osize))
+    return NULL;
 
-  http_connection_release(hc);
+  const uint32_t hash = MurHash3_32(data, size, 0);
+  static_file_t *sf = static_file_create(path);
+
+  if(osize == -1) {
+    sf->sf_data = data;
+    sf->sf_size = size;
+  } else {
+    sf->sf_alloc = malloc(osize);
+    if(sf->sf_alloc == NULL || gunzip_buf(sf->sf_alloc, osize, data, size)) {
+      trace(LOG_ERR, "HTTP: Unable to decompress bundled file %s", path);
+      static_file_release(sf);
+      return NULL;
+    }
+    sf->sf_data = sf->sf_alloc;
+    sf->sf_size = osize;
+
+    static_file_t *gz = static_file_create(path);
+    gz->sf_data = data;
+    gz->sf_size = size;
+    snprintf(gz->sf_etag, sizeof(gz->sf_etag), "\"%x-%x-gz\"", hash, size);
+    sf->sf_gz = gz;
+  }
+  snprintf(sf->sf_etag, sizeof(sf->sf_etag), "\"%x-%x\"", hash, size);
+  return sf;
 }
 
 
 /**
- *
+ * Check if file has changed on disk. Must be called with
+ * static_file_mutex held
  */
-static void
-http_connection_close(http_connection_t *hc)
+static int
+static_file_changed(static_file_t *sf, time_t now)
 {
-  hc->hc_closed = 1;
-  asyncio_close(hc->hc_af);
-  asyncio_timer_disarm(&hc->hc_timer);
-  task_run_in_group(http_connection_shutdown_task, hc, hc->hc_task_group);
+  struct stat st;
+
+  if(sf->sf_fd == -1 || sf->sf_checked == now)
+    return 0;
+
+  if(stat(sf->sf_path, &st) ||
+     st.st_dev != sf->sf_dev || st.st_ino != sf->sf_ino ||
+     st.st_size != sf->sf_size || st.st_mtime != sf->sf_mtime)
+    return 1;
+
+  sf->sf_checked = now;
+  return 0;
 }
 
 
 /**
- *
+ * Returns a referenced file or NULL if it does not exist
  */
-static void
-http_server_read(void *opaque, struct mbuf *mq)
+static static_file_t *
+static_file_get(const char *path, time_t now)
 {
-  http_connection_t *hc = opaque;
-  while(hc->hc_ws_path == NULL) {
-
-    if(hc->hc_read_disabled)
-      return;
+  static_file_t *sf, *n;
+  const unsigned int h =
+    MurHash3_32(path, strlen(path), 0) % STATIC_FILE_HASH_SIZE;
 
-    mbuf_data_t *md = TAILQ_FIRST(&mq->mq_buffers);
-    if(md == NULL)
-      return;
+  pthread_mutex_lock(&static_file_mutex);
+  LIST_FOREACH(sf, &static_files[h], sf_link)
+    if(!strcmp(sf->sf_path, path))
+      break;
 
-    size_t r = http_parser_execute(&hc->hc_parser, &parser_settings,
-                                   (const void *)md->md_data + md->md_data_off,
-                                   md->md_data_len - md->md_data_off);
-    mbuf_drop(mq, r);
-    if(hc->hc_parser.http_errno) {
-      http_connection_close(hc);
-      return;
+  if(sf != NULL) {
+    if(!static_file_changed(sf, now)) {
+      atomic_inc(&sf->sf_refcount);
+      pthread_mutex_unlock(&static_file_mutex);
+      return sf;
     }
+    LIST_REMOVE(sf, sf_link);
+    static_files_count--;
+    static_file_release(sf);
   }
+  pthread_mutex_unlock(&static_file_mutex);
 
-  if(websocket_parse(mq, websocket_packet_input, hc, &hc->hc_ws_state)) {
-    http_connection_close(hc);
-  }
-}
+  sf = static_file_open_disk(path, now) ?: static_file_open_bundle(path);
+  if(sf == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&static_file_mutex);
+  LIST_FOREACH(n, &static_files[h], sf_link)
+    if(!strcmp(n->sf_path, path))
+      break;
 
+  if(n != NULL) {
+    // Someone else beat us to it
+    atomic_inc(&n->sf_refcount);
+    pthread_mutex_unlock(&static_file_mutex);
+    static_file_release(sf);
+    return n;
+  }
 
+  if(static_files_count < STATIC_FILE_CACHE_MAX) {
+    LIST_INSERT_HEAD(&static_files[h], sf, sf_link);
+    static_files_count++;
+    atomic_inc(&sf->sf_refcount);
+  }
+  pthread_mutex_unlock(&static_file_mutex);
+  return sf;
+}
 
 
 /**
- *
+ * Precompressed variant, 'path'.gz on disk
  */
-static void
-http_connection_reenable(void *aux)
+static static_file_t *
+static_file_get_gz(static_file_t *sf, time_t now)
 {
-  http_connection_t *hc = aux;
+  if(sf->sf_fd == -1) {
+    if(sf->sf_gz != NULL)
+      atomic_inc(&sf->sf_gz->sf_refcount);
+    return sf->sf_gz;
+  }
 
-  if(!hc->hc_closed) {
-    asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
-    // This will make the asyncio socket retry the read callback if there is
-    // data pending
+  if(sf->sf_gz_checked == now)
+    return NULL;
 
-    if(hc->hc_read_disabled) {
-      hc->hc_read_disabled = 0;
-      asyncio_enable_read(hc->hc_af);
-    }
-  }
-  http_connection_release(hc);
+  char gzpath[PATH_MAX];
+  snprintf(gzpath, sizeof(gzpath), "%s.gz", sf->sf_path);
+
+  static_file_t *gz = static_file_get(gzpath, now);
+  if(gz != NULL && gz->sf_mtime >= sf->sf_mtime)
+    return gz;
+
+  // Missing or older than the original
+  if(gz != NULL)
+    static_file_release(gz);
+  sf->sf_gz_checked = now;
+  return NULL;
 }
 
 
 /**
  *
  */
-static void
-http_server_error(void *opaque, int error)
-{
-  http_connection_t *hc = opaque;
-  hc->hc_error = error;
-  http_connection_close(hc);
-}
+static const struct {
+  const char *ext;
+  const char *type;
+} static_content_types[] = {
+  { "html",  "text/html" },
+  { "htm",   "text/html" },
+  { "css",   "text/css" },
+  { "js",    "application/javascript" },
+  { "mjs",   "application/javascript" },
+  { "json",  "application/json" },
+  { "map",   "application/json" },
+  { "txt",   "text/plain" },
+  { "xml",   "application/xml" },
+  { "svg",   "image/svg+xml" },
+  { "jpeg",  "image/jpeg" },
+  { "jpg",   "image/jpeg" },
+  { "png",   "image/png" },
+  { "gif",   "image/gif" },
+  { "webp",  "image/webp" },
+  { "ico",   "image/x-icon" },
+  { "woff",  "font/woff" },
+  { "woff2", "font/woff2" },
+  { "wasm",  "application/wasm" },
+  { "pdf",   "application/pdf" },
+};
 
 
 /**
  *
  */
-static void
-http_server_timeout(void *aux)
+static const char *
+static_content_type(const char *path)
 {
-  http_connection_t *hc = aux;
+  const char *postfix = strrchr(path, '.');
+  if(postfix == NULL)
+    return NULL;
+  postfix++;
 
-  if(hc->hc_ws_path != NULL) {
-    websocket_timer(hc);
-  } else {
-    http_connection_close(hc);
-  }
+  for(int i = 0; i < ARRAYSIZE(static_content_types); i++)
+    if(!strcasecmp(postfix, static_content_types[i].ext))
+      return static_content_types[i].type;
+  return NULL;
 }
 
 
 /**
- *
+ * Returns 1 if any entity tag in 'list' matches 'etag'
  */
 static int
-http_server_accept(void *opaque, int fd, struct sockaddr *peer,
-                   struct sockaddr *self)
+etag_match(const char *list, const char *etag)
 {
-  char tmpbuf[128];
-  http_server_t *hs = opaque;
-  http_connection_t *hc = calloc(1, sizeof(http_connection_t));
-
-  atomic_set(&hc->hc_refcount, 1);
-  TAILQ_INIT(&hc->hc_request_headers);
-  http_parser_init(&hc->hc_parser, HTTP_REQUEST);
-  hc->hc_parser.data = hc;
-
-  hc->hc_task_group = task_group_create();
-
-  switch(peer->sa_family) {
-  case AF_INET:
-    if(inet_ntop(AF_INET, &((struct sockaddr_in *)peer)->sin_addr,
-                 tmpbuf, sizeof(tmpbuf)) != NULL)
-      hc->hc_peer_addr = strdup(tmpbuf);
-    break;
-  case AF_INET6:
-    if(inet_ntop(AF_INET, &((struct sockaddr_in6 *)peer)->sin6_addr,
-                 tmpbuf, sizeof(tmpbuf)) != NULL)
-      hc->hc_peer_addr = strdup(tmpbuf);
-    break;
+  const size_t len = strlen(etag);
+
+  while(*list) {
+    while(*list == ' ' || *list == '\t' || *list == ',')
+      list++;
+    if(*list == '*')
+      return 1;
+    if(!strncmp(list, "W/", 2))
+      list += 2;
+    if(!strncmp(list, etag, len) &&
+       (list[len] == 0 || list[len] == ',' || list[len] == ' '))
+      return 1;
+    while(*list && *list != ',')
+      list++;
   }
+  return 0;
+}
 
-  if(hc->hc_peer_addr == NULL)
-    hc->hc_peer_addr = strdup("0.0.0.0");
 
-  hc->hc_server = hs;
-  atomic_inc(&hs->hs_refcount);
-  hc->hc_af = asyncio_stream_mt(fd, http_server_read, http_server_error, hc);
+/**
+ * Parse IMF-fixdate, "Sun, 06 Nov 1994 08:49:37 GMT". Returns 0 on
+ * failure. Other (obsolete) formats are not supported, clients just
+ * get the full reply
+ */
+static time_t
+http_parse_date(const char *s)
+{
+  struct tm tm = {};
+  int i;
 
-  asyncio_timer_init(&hc->hc_timer, http_server_timeout, hc);
-  asyncio_timer_arm_delta(&hc->hc_timer, 10 * 1000000);
+  if(strlen(s) != 29 || strcmp(s + 25, " GMT"))
+    return 0;
 
-  asyncio_enable_read(hc->hc_af);
+  for(i = 0; i < 12; i++)
+    if(!strncmp(s + 8, httpmonths[i], 3))
+      break;
+  if(i == 12)
+    return 0;
 
-  return 0;
+  tm.tm_mon  = i;
+  tm.tm_mday = atoi(s + 5);
+  tm.tm_year = atoi(s + 12) - 1900;
+  tm.tm_hour = atoi(s + 17);
+  tm.tm_min  = atoi(s + 20);
+  tm.tm_sec  = atoi(s + 23);
+  return timegm(&tm);
 }
 
+
 /**
- *
+ * Parse single "bytes=" range. Returns 1 if valid, -1 if not
+ * satisfiable and 0 if the header should be ignored
  */
-static void
-http_server_start(void *aux)
+static int
+parse_range(const char *s, int64_t size, int64_t *startp, int64_t *lenp)
 {
-  http_server_t *hs = aux;
-  hs->hs_fd = asyncio_bind(hs->hs_bind_address, hs->hs_port,
-                           http_server_accept, hs);
+  char *end;
+  int64_t start, last;
 
-  if(hs->hs_fd == NULL) {
-    trace(LOG_ERR, "HTTP: Failed to bind %s:%d",
-          hs->hs_bind_address, hs->hs_port);
+  if(strncmp(s, "bytes=", 6) || strchr(s, ',') != NULL)
+    return 0;
+  s += 6;
+
+  if(*s == '-') {
+    // Suffix range, last N bytes
+    int64_t n = strtoll(s + 1, &end, 10);
+    if(end == s + 1 || *end)
+      return 0;
+    if(n == 0 || size == 0)
+      return -1;
+    n = MIN(n, size);
+    *startp = size - n;
+    *lenp = n;
+    return 1;
+  }
+
+  start = strtoll(s, &end, 10);
+  if(end == s || *end != '-' || start < 0)
+    return 0;
+  s = end + 1;
+
+  if(*s == 0) {
+    last = size - 1;
   } else {
-    trace(LOG_NOTICE, "HTTP: Listening on %s:%d",
-          hs->hs_bind_address, hs->hs_port);
+    last = strtoll(s, &end, 10);
+    if(end == s || *end || last < start)
+      return 0;
+    last = MIN(last, size - 1);
   }
-}
 
+  if(start >= size)
+    return -1;
 
+  *startp = start;
+  *lenp = last - start + 1;
+  return 1;
+}
 
 
 /**
- *  Fire up HTTP server
+ *
  */
-struct http_server *
-http_server_init(const char *config_prefix)
+static int
+static_file_send(http_request_t *hr, static_file_t *sf, const char *ct,
+                 time_t now)
 {
-  cfg_root(cr);
+  const char *encoding = NULL;
+  const char *range = NULL;
+  int64_t start = 0;
+  int rc = HTTP_STATUS_OK;
+  static_file_t *rep = sf;
+  const char *h;
+
+  static_file_t *gz = static_file_get_gz(sf, now);
+  if(gz != NULL) {
+    hr->hr_vary_encoding = 1;
+    if(http_accepted_coding(hr) == HTTP_CODING_GZIP) {
+      rep = gz;
+      encoding = "gzip";
+    }
+  }
 
-  if(config_prefix == NULL)
-    config_prefix = "http";
+  int64_t len = rep->sf_size;
 
-  http_server_t *hs = calloc(1, sizeof(http_server_t));
-  atomic_set(&hs->hs_refcount, 1);
-  hs->hs_port = cfg_get_int(cr, CFG(config_prefix, "port"), 9000);
-  hs->hs_bind_address =
-    strdup(cfg_get_str(cr, CFG(config_prefix, "bindAddress"), "127.0.0.1"));
+  http_arg_set(&hr->hr_response_headers, "ETag", rep->sf_etag);
+  if(rep->sf_mtime)
+    http_arg_set(&hr->hr_response_headers, "Last-Modified",
+                 http_mktime(rep->sf_mtime, 0));
 
-  hs->hs_config_prefix = strdup(config_prefix);
+  if((h = http_req_header_id(hr, HTTP_HDR_IF_NONE_MATCH)) != NULL) {
+    if(etag_match(h, rep->sf_etag))
+      rc = HTTP_STATUS_NOT_MODIFIED;
+  } else if((h = http_req_header_id(hr, HTTP_HDR_IF_MODIFIED_SINCE)) != NULL) {
+    const time_t t = http_parse_date(h);
+    if(t && rep->sf_mtime && rep->sf_mtime <= t)
+      rc = HTTP_STATUS_NOT_MODIFIED;
+  }
 
-  const char *real_ip_header =
-    cfg_get_str(cr, CFG(config_prefix, "realIpHeader"), NULL);
-  hs->hs_real_ip_header = real_ip_header ? strdup(real_ip_header) : NULL;
+  if(rc == HTTP_STATUS_NOT_MODIFIED) {
+    http_log(hr, rc, http_rc2str(rc));
+    http_send_header(hr, rc, NULL, NULL, 0, encoding, NULL, 0,
+                     NULL, NULL, NULL);
+    goto done;
+  }
 
-  hs->hs_secure_cookies = cfg_get_int(cr, CFG(config_prefix, "secureCookies"), 0);
+  h = http_req_header_id(hr, HTTP_HDR_RANGE);
+  const char *if_range = http_req_header(hr, "If-Range");
+  if(h != NULL && (if_range == NULL || !strcmp(if_range, rep->sf_etag))) {
+    switch(parse_range(h, rep->sf_size, &start, &len)) {
+    case 1:
+      rc = HTTP_STATUS_PARTIAL_CONTENT;
+      range = tsprintf("bytes %"PRId64"-%"PRId64"/%"PRId64,
+                       start, start + len - 1, rep->sf_size);
+      break;
+    case -1:
+      rc = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+      http_log(hr, rc, http_rc2str(rc));
+      http_send_header(hr, rc, NULL, NULL, 0, NULL, NULL, 0,
+                       tsprintf("bytes */%"PRId64, rep->sf_size), NULL, NULL);
+      goto done;
+    }
+  }
 
-  asyncio_run_task(http_server_start, hs);
+  if(range == NULL)
+    http_arg_set(&hr->hr_response_headers, "Accept-Ranges", "bytes");
+
+  http_log(hr, rc, http_rc2str(rc));
+  http_send_header(hr, rc, NULL, ct ?: "application/octet-stream", len,
+                   encoding, NULL, 0, range, NULL, NULL);
+
+  if(hr->hr_method != HTTP_HEAD && len > 0) {
+    mbuf_t mq;
+    mbuf_init(&mq);
+    atomic_inc(&rep->sf_refcount);
+    if(rep->sf_fd != -1)
+      mbuf_append_file(&mq, rep->sf_fd, start, len, static_file_release, rep);
+    else
+      mbuf_append_external(&mq, rep->sf_data + start, len,
+                           static_file_release, rep);
+    http_sendq(hr, &mq);
+  }
 
-  return hs;
+ done:
+  if(gz != NULL)
+    static_file_release(gz);
+  return 0;
 }
 
 
-
-#if 0
-
 struct bundleserve {
   const char *filepath;
   int send_index_html_on_404;
 };
 
 
-
 /**
  *
  */
 static int
-serve_file(http_connection_t *hc, const char *remain, void *opaque)
+serve_file(http_request_t *hr, const char *remain, void *opaque)
 {
   const struct bundleserve *bs = opaque;
-  char path[1024];
+  char path[PATH_MAX];
+
+  if(hr->hr_method != HTTP_GET && hr->hr_method != HTTP_HEAD)
+    return HTTP_STATUS_METHOD_NOT_ALLOWED;
 
   if(remain == NULL)
     remain = "index.html";
 
-  if(strstr(remain, ".."))
+  char *r = mystrdupa(remain);
+  http_deescape(r);
+
+  if(strstr(r, ".."))
     return 400;
 
-  snprintf(path, sizeof(path), "%s/%s", bs->filepath, remain);
+  snprintf(path, sizeof(path), "%s/%s", bs->filepath, r);
 
-  void *data;
-  int size;
-
-  const char *ct = NULL;
-  const char *postfix = strrchr(remain, '.');
-  if(postfix != NULL) {
-    postfix++;
-    if(!strcmp(postfix, "html")) {
-      ct = "text/html";
-    } else if(!strcmp(postfix, "css")) {
-      ct = "text/css";
-    } else if(!strcmp(postfix, "js")) {
-      ct = "application/javascript";
-    } else if(!strcmp(postfix, "jpeg")) {
-      ct = "image/jpeg";
-    } else if(!strcmp(postfix, "png")) {
-      ct = "image/png";
-    }
-  }
-
-  if(filebundle_load(path, &data, &size, NULL)) {
+  const char *ct = static_content_type(r);
+  const time_t now = time(NULL);
+
+  static_file_t *sf = static_file_get(path, now);
+  if(sf == NULL) {
     if(!bs->send_index_html_on_404 || ct != NULL)
       return 404;
 
-    remain = "index.html";
-    snprintf(path, sizeof(path), "%s/%s", bs->filepath, remain);
-    if(filebundle_load(path, &data, &size, NULL)) {
+    snprintf(path, sizeof(path), "%s/index.html", bs->filepath);
+    ct = "text/html";
+    sf = static_file_get(path, now);
+    if(sf == NULL)
       return 404;
-    }
   }
 
-  mbuf_append(&hc->hc_reply, data, size);
-
-  http_output_content(hc, ct);
-  filebundle_free(data);
-  return 0;
+  int rval = static_file_send(hr, sf, ct, now);
+  static_file_release(sf);
+  return rval;
 }
 
 
 /**
- *
+ * Serve files below 'filebundle' (directory on disk or embedded
+ * filebundle) on 'path'
  */
 void
 http_serve_static(const char *path, const char *filebundle,
@@ -1567,7 +6399,6 @@ http_serve_static(const char *path, const char *filebundle,
   bs->send_index_html_on_404 = send_index_html_on_404;
   http_path_add(path, bs, serve_file);
 }
-#endif
 
 
 #define COOKIE_NONCE_LEN 13
@@ -1575,8 +6406,87 @@ http_serve_static(const char *path, const char *filebundle,
 
 static unsigned char ccm_key[24];
 static int ccm_key_valid;
+static int ccm_key_serial;
 static uint8_t cookie_generation;
 
+/**
+ * Cipher contexts are keyed once and cached per thread. Only the nonce
+ * (and tag when decrypting) is set per cookie
+ */
+typedef struct cookie_cipher {
+  EVP_CIPHER_CTX *cc_enc;
+  EVP_CIPHER_CTX *cc_dec;
+  int cc_serial;
+} cookie_cipher_t;
+
+static pthread_key_t cookie_cipher_key;
+
+
+/**
+ *
+ */
+static void
+cookie_cipher_free(void *aux)
+{
+  cookie_cipher_t *cc = aux;
+  EVP_CIPHER_CTX_free(cc->cc_enc);
+  EVP_CIPHER_CTX_free(cc->cc_dec);
+  free(cc);
+}
+
+
+/**
+ *
+ */
+static void __attribute__((constructor))
+cookie_cipher_init(void)
+{
+  pthread_key_create(&cookie_cipher_key, cookie_cipher_free);
+}
+
+
+/**
+ *
+ */
+static EVP_CIPHER_CTX *
+cookie_cipher_ctx_create(int enc)
+{
+  EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+  EVP_CipherInit_ex(ctx, EVP_aes_192_ccm(), NULL, NULL, NULL, enc);
+  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_IVLEN, COOKIE_NONCE_LEN, NULL);
+  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_TAG, COOKIE_TAG_LEN, NULL);
+  EVP_CipherInit_ex(ctx, NULL, NULL, ccm_key, NULL, enc);
+  return ctx;
+}
+
+
+/**
+ *
+ */
+static cookie_cipher_t *
+cookie_cipher_get(void)
+{
+  cookie_cipher_t *cc = pthread_getspecific(cookie_cipher_key);
+
+  if(cc != NULL && cc->cc_serial == ccm_key_serial)
+    return cc;
+
+  if(cc != NULL) {
+    // Key has changed
+    EVP_CIPHER_CTX_free(cc->cc_enc);
+    EVP_CIPHER_CTX_free(cc->cc_dec);
+  } else {
+    cc = calloc(1, sizeof(cookie_cipher_t));
+    pthread_setspecific(cookie_cipher_key, cc);
+  }
+
+  cc->cc_enc = cookie_cipher_ctx_create(1);
+  cc->cc_dec = cookie_cipher_ctx_create(0);
+  cc->cc_serial = ccm_key_serial;
+  return cc;
+}
+
+
 void
 http_server_init_session_cookie(const char *password, uint8_t generation)
 {
@@ -1591,6 +6501,7 @@ http_server_init_session_cookie(const char *password, uint8_t generation)
     return;
   }
   ccm_key_valid = 1;
+  ccm_key_serial++;
   cookie_generation = generation;
 }
 
@@ -1600,13 +6511,11 @@ http_server_init_session_cookie(const char *password, uint8_t generation)
 static char *
 generate_session_cookie(http_request_t *hr)
 {
-  EVP_CIPHER_CTX *ctx;
-
   char cookie[4000];
   uint8_t cookiebin[3000] = {0};
   int outlen = 0, tmplen;
 
-  if(ntv_is_empty(hr->hr_session))
+  if(ntv_is_empty(hr->hr_session_copy))
     return NULL;
 
   if(!ccm_key_valid)
@@ -1616,7 +6525,7 @@ generate_session_cookie(http_request_t *hr)
 
   mbuf_t binary;
   mbuf_init(&binary);
-  ntv_binary_serialize(hr->hr_session, &binary);
+  ntv_binary_serialize(hr->hr_session_copy, &binary);
 
   if(binary.mq_size > 2500) {
     trace(LOG_ALERT, "Max cookie length exceeded");
@@ -1630,15 +6539,9 @@ generate_session_cookie(http_request_t *hr)
   plaintext[1] = cookie_generation;
   mbuf_read(&binary, plaintext + 2, binary.mq_size);
 
-  ctx = EVP_CIPHER_CTX_new();
-
-  EVP_EncryptInit_ex(ctx, EVP_aes_192_ccm(), NULL, NULL, NULL);
-
-  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_IVLEN, COOKIE_NONCE_LEN, NULL);
-
-  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_TAG, COOKIE_TAG_LEN, NULL);
+  EVP_CIPHER_CTX *ctx = cookie_cipher_get()->cc_enc;
 
-  EVP_EncryptInit_ex(ctx, NULL, NULL, ccm_key, cookiebin);
+  EVP_EncryptInit_ex(ctx, NULL, NULL, NULL, cookiebin);
 
   /* Encrypt plaintext: can only be called once */
   EVP_EncryptUpdate(ctx, cookiebin + COOKIE_NONCE_LEN + COOKIE_TAG_LEN,
@@ -1652,8 +6555,6 @@ generate_session_cookie(http_request_t *hr)
 
   outlen += COOKIE_NONCE_LEN + COOKIE_TAG_LEN;
 
-  EVP_CIPHER_CTX_free(ctx);
-
   if(base64_encode(cookie, sizeof(cookie), cookiebin, outlen)) {
     trace(LOG_ALERT, "Max cookie length exceeded (base64 encoded)");
     return NULL;
@@ -1669,7 +6570,6 @@ generate_session_cookie(http_request_t *hr)
 static void
 get_session_cookie(http_request_t *hr, const char *str)
 {
-  EVP_CIPHER_CTX *ctx;
   int outlen, rv;
 
   if(!ccm_key_valid)
@@ -1687,13 +6587,12 @@ get_session_cookie(http_request_t *hr, const char *str)
   if(binlen < COOKIE_NONCE_LEN + COOKIE_TAG_LEN + 2)
     return;
 
-  ctx = EVP_CIPHER_CTX_new();
-  EVP_DecryptInit_ex(ctx, EVP_aes_192_ccm(), NULL, NULL, NULL);
-  EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_IVLEN, COOKIE_NONCE_LEN, NULL);
+  cookie_cipher_t *cc = cookie_cipher_get();
+  EVP_CIPHER_CTX *ctx = cc->cc_dec;
   EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_CCM_SET_TAG,
                       COOKIE_TAG_LEN, bin + COOKIE_NONCE_LEN);
 
-  EVP_DecryptInit_ex(ctx, NULL, NULL, ccm_key, bin);
+  EVP_DecryptInit_ex(ctx, NULL, NULL, NULL, bin);
 
   uint8_t *plaintext = alloca(len);
 
@@ -1701,9 +6600,12 @@ get_session_cookie(http_request_t *hr, const char *str)
                          bin + COOKIE_NONCE_LEN + COOKIE_TAG_LEN,
                          binlen - COOKIE_NONCE_LEN - COOKIE_TAG_LEN);
 
-  EVP_CIPHER_CTX_free(ctx);
-  if(rv <= 0)
+  if(rv <= 0) {
+    // Context is left in a failed state, start over with a new one
+    EVP_CIPHER_CTX_free(cc->cc_dec);
+    cc->cc_dec = cookie_cipher_ctx_create(0);
     return;
+  }
 
   if(outlen < 2)
     return;
@@ -1711,7 +6613,66 @@ get_session_cookie(http_request_t *hr, const char *str)
   if(plaintext[0] != 0xa0 || plaintext[1] != cookie_generation)
     return;
 
-  hr->hr_session_received = ntv_binary_deserialize(plaintext + 2, outlen - 2);
+  hr->hr_session_orig = ntv_binary_deserialize(plaintext + 2, outlen - 2);
+}
+
+
+/**
+ *
+ */
+static void
+http_session_decode(http_request_t *hr)
+{
+  if(hr->hr_session_decoded)
+    return;
+  hr->hr_session_decoded = 1;
+  if(hr->hr_session_cookie != NULL)
+    get_session_cookie(hr, hr->hr_session_cookie);
+}
+
+
+/**
+ *
+ */
+const ntv_t *
+http_session_get(http_request_t *hr)
+{
+  if(hr->hr_session_copy != NULL)
+    return hr->hr_session_copy;
+
+  http_session_decode(hr);
+  return hr->hr_session_orig;
+}
+
+
+/**
+ *
+ */
+ntv_t *
+http_session_edit(http_request_t *hr)
+{
+  if(hr->hr_session_copy == NULL) {
+    http_session_decode(hr);
+    hr->hr_session_copy = hr->hr_session_orig ?
+      ntv_copy(hr->hr_session_orig) : ntv_create_map();
+  }
+  return hr->hr_session_copy;
+}
+
+
+/**
+ * Only sessions handed out for editing can have changed
+ */
+static int
+http_session_changed(const http_request_t *hr)
+{
+  if(hr->hr_session_copy == NULL)
+    return 0;
+
+  if(hr->hr_session_orig == NULL)
+    return !ntv_is_empty(hr->hr_session_copy);
+
+  return ntv_cmp(hr->hr_session_copy, hr->hr_session_orig);
 }
 
 
@@ -1724,7 +6685,7 @@ websocket_upgrade(http_connection_t *hc)
   LIST_FOREACH(wsp, &websocket_paths, wsp_link) {
     const char *remain = mystrbegins(hc->hc_path, wsp->wsp_path);
     if(remain != NULL) {
-      hc->hc_remain = strdup(remain);
+      hc->hc_remain = arena_strdup(&hc->hc_arena, remain);
       hc->hc_ws_path = wsp;
       return 0;
 
@@ -1743,7 +6704,7 @@ websocket_response(http_request_t *hr)
   http_connection_t *hc = hr->hr_connection;
   const ws_server_path_t *wsp = hc->hc_ws_path;
 
-  const char *k = http_arg_get(&hr->hr_request_headers, "Sec-WebSocket-Key");
+  const char *k = http_req_header_id(hr, HTTP_HDR_SEC_WEBSOCKET_KEY);
 
   if(k == NULL)
     return 400;
@@ -1767,11 +6728,13 @@ websocket_session_start(http_request_t *hr,
   char sig[64];
   uint8_t d[20];
   const char *selected_extension = NULL;
-  char *exts =http_arg_get(&hr->hr_request_headers, "Sec-WebSocket-Extensions");
+  const char *exts_hdr =
+    http_req_header_id(hr, HTTP_HDR_SEC_WEBSOCKET_EXTENSIONS);
+  char *exts = NULL;
 
-  if(exts != NULL && compression_level > 0) {
+  if(exts_hdr != NULL && compression_level > 0) {
     compression_level = MIN(MAX(compression_level, 8), 15);
-    exts = mystrdupa(exts);
+    exts = mystrdupa(exts_hdr);
 
     int per_message_deflate = 0;
 
@@ -1822,7 +6785,7 @@ websocket_session_start(http_request_t *hr,
   }
 
   hc->hc_ws_opaque = opaque;
-  const char *k = http_arg_get(&hr->hr_request_headers, "Sec-WebSocket-Key");
+  const char *k = http_req_header_id(hr, HTTP_HDR_SEC_WEBSOCKET_KEY);
 
   SHA1_Init(&shactx);
   SHA1_Update(&shactx, (const void *)k, strlen(k));
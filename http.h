@@ -27,8 +27,12 @@
 #include "atomic.h"
 #include "http_parser.h"
 #include "task.h"
+#include "arena.h"
 
 struct http_connection;
+struct http_route;
+struct h2_stream;
+struct http_cache_entry;
 struct ntv;
 struct mbuf;
 
@@ -48,26 +52,85 @@ typedef struct http_arg {
 #define HTTP_STATUS_BAD_REQUEST  400
 #define HTTP_STATUS_UNAUTHORIZED 401
 #define HTTP_STATUS_NOT_FOUND    404
+#define HTTP_STATUS_PAYLOAD_TOO_LARGE 413
+#define HTTP_STATUS_UNSUPPORTED_MEDIA_TYPE 415
 #define HTTP_STATUS_ISE          500
-
-
+#define HTTP_STATUS_GATEWAY_TIMEOUT 504
+
+// Returned by a route callback after http_request_defer()
+#define HTTP_STATUS_PENDING      -2
+
+
+/**
+ * Well-known request headers. These are resolved into a slot table while
+ * the request is parsed, see http_req_header_id()
+ */
+typedef enum {
+  HTTP_HDR_ACCEPT,
+  HTTP_HDR_ACCEPT_ENCODING,
+  HTTP_HDR_AUTHORIZATION,
+  HTTP_HDR_CONNECTION,
+  HTTP_HDR_CONTENT_ENCODING,
+  HTTP_HDR_CONTENT_LENGTH,
+  HTTP_HDR_CONTENT_TYPE,
+  HTTP_HDR_COOKIE,
+  HTTP_HDR_EXPECT,
+  HTTP_HDR_HOST,
+  HTTP_HDR_IF_MODIFIED_SINCE,
+  HTTP_HDR_IF_NONE_MATCH,
+  HTTP_HDR_ORIGIN,
+  HTTP_HDR_RANGE,
+  HTTP_HDR_REFERER,
+  HTTP_HDR_SEC_WEBSOCKET_EXTENSIONS,
+  HTTP_HDR_SEC_WEBSOCKET_KEY,
+  HTTP_HDR_SEC_WEBSOCKET_PROTOCOL,
+  HTTP_HDR_SEC_WEBSOCKET_VERSION,
+  HTTP_HDR_TRANSFER_ENCODING,
+  HTTP_HDR_UPGRADE,
+  HTTP_HDR_USER_AGENT,
+  HTTP_HDR_X_FORWARDED_FOR,
+  HTTP_HDR_X_REAL_IP,
+  HTTP_HDR_num,
+} http_header_id_t;
+
+struct http_header_index;
+
+/**
+ * A request and all strings and lists parsed from the client (path,
+ * request headers, query args, credentials, etc) are allocated from
+ * hr_arena or point directly into the receive buffers kept in hr_rxbuf.
+ * They must be treated as read-only. Everything is released at once
+ * when the request is finished.
+ *
+ * hr_request_headers and hr_query_args may still be appended to with
+ * http_arg_set(), entries added that way are freed with the request.
+ * Don't use http_arg_flush() on them. Note that headers added are not visible to
+ * http_req_header() / http_req_header_id().
+ */
 typedef struct http_request {
+  arena_t hr_arena;
   struct http_connection *hr_connection;
   char *hr_path;
   char *hr_remain;
   char *hr_args;
 
   struct http_arg_list hr_request_headers;
+  struct http_header_index *hr_header_index;
 
   struct http_arg_list hr_response_headers;
 
+  // Also fields of form bodies (application/x-www-form-urlencoded or,
+  // for routes added with http_route_add_form(), multipart/form-data)
   struct http_arg_list hr_query_args;
 
   void *hr_body;
   size_t hr_body_size;
   struct ntv *hr_post_message; // For application/json
-  struct ntv *hr_session_received;
-  struct ntv *hr_session;
+  // Private, use http_session_get() / http_session_edit(). Both stay
+  // NULL until the session is accessed as the cookie is decrypted lazily
+  struct ntv *hr_session_orig;
+  struct ntv *hr_session_copy;
+  const char *hr_session_cookie;  // Not yet decrypted
 
   char *hr_peer_addr;
   char *hr_username;
@@ -76,10 +139,25 @@ typedef struct http_request {
 
   mbuf_t hr_reply;
 
+  // Receive buffers referenced by hr_path and hr_request_headers
+  mbuf_t hr_rxbuf;
+
+  // Route being dispatched and its arguments (only valid during callback,
+  // for streamed request bodies valid until the request is finished)
+  const struct http_route *hr_route;
+  int hr_route_argc;
+  char **hr_route_argv;
+  struct http_route_peek *hr_route_peek;  // Private, see http_route_peek()
+
+  void *hr_opaque;  // For use by route callbacks
+
   int64_t hr_req_received;
   int64_t hr_req_process;
 
   int hr_method;
+  int hr_status;           // As logged
+  int hr_metrics_id;       // Route the request is accounted to
+  int64_t hr_bytes_sent;   // Response body
 
   unsigned short hr_major;
   unsigned short hr_minor;
@@ -88,6 +166,35 @@ typedef struct http_request {
   uint8_t hr_secure_cookies : 1;
   uint8_t hr_no_output : 1;
   uint8_t hr_100_continue_check : 1;
+  uint8_t hr_inline : 1;  // Served on the asyncio thread
+  uint8_t hr_stream_body : 1;
+  uint8_t hr_stream_failed : 1;
+  uint8_t hr_vary_encoding : 1;
+  uint8_t hr_chunked : 1;  // Streaming response with chunked encoding
+  uint8_t hr_cork_head : 1; // Response body follows right after header
+  uint8_t hr_session_decoded : 1;
+  uint8_t hr_queued : 1;  // Counted in the connection's pipeline queue
+  uint8_t hr_shed : 1;    // Overloaded, reply 503 (see http_request_pool())
+  uint8_t hr_rate_limited : 1;  // Shed with 429 instead
+
+  // Counted by the concurrency limiter. Not a bitfield as it's cleared
+  // when the route callback returns, a deferred request may be resumed
+  // on another thread by then
+  uint8_t hr_limited;
+
+  int64_t hr_response_left;  // Streaming response bytes left to write
+
+  struct h2_stream *hr_h2_stream;  // Request is a HTTP/2 stream
+
+  struct http_cache_entry *hr_cache_fill;  // Reply is offered to the cache
+
+  struct http_deferred *hr_deferred;  // See http_request_defer()
+
+  // Private, see http_request_on_done()
+  void (*hr_done_cb)(void *opaque, int cancelled);
+  void *hr_done_opaque;
+
+  struct http_form *hr_form;  // See http_route_add_form()
 
 
 } http_request_t;
@@ -106,6 +213,23 @@ int http_arg_get_int(struct http_arg_list *list, const char *name,
 void http_arg_set(struct http_arg_list *list,
                   const char *key, const char *val);
 
+/**
+ * Request header lookup by name (case insensitive) or by well-known id.
+ * Both are constant time, prefer these over http_arg_get() on
+ * hr_request_headers
+ */
+const char *http_req_header(const http_request_t *hr, const char *name);
+
+const char *http_req_header_id(const http_request_t *hr, http_header_id_t id);
+
+/**
+ * Allocate memory that lives as long as the request. There is no need
+ * (and no way) to free it
+ */
+void *http_req_alloc(http_request_t *hr, size_t size);
+
+char *http_req_strdup(http_request_t *hr, const char *str);
+
 void http_error(http_request_t *hc, int error);
 
 int http_err(http_request_t *hc, int error, const char *str);
@@ -127,6 +251,109 @@ int http_send_header(http_request_t *hc, int rc, const char *statustxt,
 int http_send_reply(http_request_t *hc, int rc, const char *content,
                     const char *encoding, const char *location, int maxage);
 
+/**
+ * Pre-rendered response headers for hot routes that always reply with the
+ * same status, content type, caching and extra headers. Only Date,
+ * Content-Length, Connection (and session cookie if changed) are added
+ * per request
+ */
+typedef struct http_response_template http_response_template_t;
+
+http_response_template_t *
+http_response_template_create(int rc, const char *content,
+                              const char *encoding, int maxage,
+                              const struct http_arg_list *headers);
+
+void http_response_template_destroy(http_response_template_t *hrt);
+
+int http_send_reply_template(http_request_t *hr,
+                             const http_response_template_t *hrt);
+
+/**
+ * Streaming responses, for replies that are too large to build in
+ * hr_reply or are produced incrementally (exports, etc).
+ *
+ * If 'contentlen' is -1 the length is not known and the body is sent
+ * with chunked transfer encoding (or delimited by closing the connection
+ * for HTTP/1.0 clients).
+ *
+ * A negative 'maxage' omits Cache-Control so one can be passed in
+ * hr_response_headers instead.
+ *
+ * http_response_write() blocks while more than sendBufferSize (1MB by
+ * default) is queued for the client so memory use is bounded no matter
+ * how slow the client is. It returns -1 if the connection is lost (or
+ * the client has not read anything for 30 seconds) in which case the
+ * producer should give up.
+ *
+ * http_response_end() must be called when done, it returns -1 if less
+ * than the announced Content-Length was written (the connection is
+ * closed after the request since the response is incomplete).
+ */
+int http_response_begin(http_request_t *hr, int rc, const char *content,
+                        int64_t contentlen, const char *encoding, int maxage);
+
+int http_response_write(http_request_t *hr, const void *data, size_t len);
+
+int http_response_writeq(http_request_t *hr, struct mbuf *mq);
+
+int http_response_end(http_request_t *hr);
+
+/**
+ * Queue 'mq' as part of a streaming response without waiting for the
+ * send queue to drain, so it can be used from any thread including the
+ * asyncio thread. Producers that can't block keep an eye on
+ * http_response_queued() instead. Returns -1 if the connection is lost
+ */
+int http_response_sendq(http_request_t *hr, struct mbuf *mq);
+
+// 0 once the connection is lost, so waiting producers move on
+size_t http_response_queued(http_request_t *hr);
+
+/**
+ * Deferred responses, for route callbacks that wait for something else
+ * (a backend, a queue, another request) without holding a thread.
+ *
+ * The callback calls http_request_defer() before handing the request to
+ * anyone else and returns what it returns (HTTP_STATUS_PENDING). A
+ * 'timeout_ms' > 0 answers with 504 if the request has not been resumed
+ * by then (with the resolution of asyncio timers, about 250ms). The
+ * request is kept alive, as is the order of pipelined requests on the
+ * connection, until http_request_complete() is called from any thread.
+ * Route arguments are only valid during the callback so copy what's
+ * needed.
+ *
+ * Before writing the response the producer must call
+ * http_request_resume(). It fails (returns -1) if the request has timed
+ * out (and has been answered with 504 already) or the client has gone
+ * away, in which case nothing must be sent.
+ *
+ * http_request_complete() must always be called exactly once. If
+ * 'status' is non-zero an error is sent just like if it was returned
+ * from a route callback. The request must not be touched afterwards.
+ *
+ * On the asyncio thread (asyncio callbacks and timers) only complete
+ * replies such as http_send_reply() can be sent, streaming responses
+ * wait for the asyncio thread to drain the send queue.
+ */
+int http_request_defer(http_request_t *hr, int timeout_ms);
+
+/**
+ * 'fn' is called once on the asyncio thread when the deferred request
+ * is done. 'cancelled' is set if the client went away first, which is
+ * also reported after http_request_resume() so producers of never
+ * ending responses can let go of the request (and complete it). Else
+ * it's called after http_request_complete(). Must be called before
+ * http_request_defer()
+ */
+void http_request_on_done(http_request_t *hr,
+                          void (*fn)(void *opaque, int cancelled),
+                          void *opaque);
+
+int http_request_resume(http_request_t *hr);
+
+void http_request_complete(http_request_t *hr, int status);
+
 void http_send_raw(http_request_t *hc, const void *data, size_t len);
 
 int http_send_chunk(http_request_t *hc, const void *data, size_t len);
@@ -141,17 +368,163 @@ typedef int (http_callback2_t)(http_request_t *hc, int argc, char **argv,
 
 #define HTTP_ROUTE_HANDLE_100_CONTINUE 0x1
 
+/**
+ * Callback never blocks and is cheap (serving cached data, etc). It's run
+ * directly on the asyncio thread instead of on a worker thread which
+ * saves two thread hand-overs per request. The callback must not wait
+ * for anything that needs the asyncio thread to make progress.
+ *
+ * Requests with 'Expect: 100-continue' and websocket upgrades are always
+ * dispatched on a worker thread.
+ */
+#define HTTP_ROUTE_NONBLOCKING         0x2
+
+#define HTTP_ROUTE_ANY_METHOD -1
+
+/**
+ * 'path' is either a pattern with typed parameters such as
+ *
+ *   /api/user/{id:int}/files/{path:*}
+ *
+ * (see http_router.h for details) or an extended regular expression.
+ * Both are anchored at the start of the path. End with '$' to match
+ * the entire path.
+ */
 void http_route_add(const char *path, http_callback2_t *callback, int flags);
 
+void http_route_add_method(const char *path, int method,
+                           http_callback2_t *callback, int flags);
+
+/**
+ * Same as http_route_add() but GET and HEAD replies are kept in a
+ * micro-cache for 'ttl' milliseconds. The cache key is the path, the
+ * query args and the values of the request headers listed in 'vary'
+ * (comma separated, may be NULL). Requests with an Authorization header
+ * bypass the cache unless it's listed in 'vary'.
+ *
+ * Only 200 replies sent with http_send_reply() that don't set cookies
+ * or change the session are cached. Identical requests that arrive
+ * while the handler runs wait for its reply. Total cache size is set
+ * with http.cache.maxSize (32MB by default).
+ */
+void http_route_add_cached(const char *path, http_callback2_t *callback,
+                           int flags, int ttl, const char *vary);
+
+/**
+ * Request body is delivered in chunks (as received from the client) to
+ * 'body_callback' instead of being buffered in memory. The chunks are
+ * delivered on the request's task group, in order, before 'callback'
+ * is invoked to send the response. hr_route_argv and friends are valid
+ * in all callbacks.
+ *
+ * Data left in 'mq' is discarded when the callback returns. 'flags' has
+ * HTTP_BODY_ABORTED set (and 'mq' is NULL) if the connection is lost
+ * before the body is complete, the request is then finished without
+ * invoking 'callback'.
+ *
+ * If too much data is in flight (streamBufferSize, 1MB by default)
+ * reading from the client is paused until the body callback has
+ * caught up.
+ *
+ * Return 0 to continue or a HTTP status code to reject the request.
+ * The remainder of the body is then discarded, the error is sent
+ * and the connection is closed.
+ *
+ * Only requests with a body are streamed, other requests to the route
+ * are dispatched to 'callback' directly.
+ */
+#define HTTP_BODY_ABORTED 0x1
+
+typedef int (http_body_callback_t)(http_request_t *hr, struct mbuf *mq,
+                                   int flags);
+
+void http_route_add_stream(const char *path, int method,
+                           http_body_callback_t *body_callback,
+                           http_callback2_t *callback, int flags);
+
+
+/**
+ * Form upload route. multipart/form-data and
+ * application/x-www-form-urlencoded bodies are parsed as they are
+ * received (see http_route_add_stream()) and fields are added to
+ * hr_query_args before 'callback' is invoked. Field values are capped
+ * at formFieldMaxSize (1MB by default) and all of them together (or the
+ * urlencoded body) at formMaxSize (4MB). At most formMaxFields (1000)
+ * fields and files are accepted. Forms exceeding any of these are
+ * rejected with 413. Other content types are rejected with 415.
+ *
+ * File parts are never held in memory. If 'file_callback' is NULL they
+ * are written to temporary files (in $TMPDIR) which are removed when
+ * the request is finished, use http_form_file() to find them.
+ *
+ * Otherwise 'file_callback' gets the contents as it arrives: first with
+ * HTTP_FORM_FILE_BEGIN, then once per chunk of data and finally with
+ * HTTP_FORM_FILE_END. If the connection is lost or the request is
+ * rejected in the middle of a file HTTP_FORM_FILE_END |
+ * HTTP_FORM_FILE_ABORTED is passed instead.
+ * Return 0 to continue or a HTTP status code to reject the request.
+ */
+typedef struct http_form_file {
+  const char *hff_name;
+  const char *hff_filename;
+  const char *hff_content_type;  // NULL if not given
+  const char *hff_path;          // Temporary file, NULL with file_callback
+  size_t hff_size;
+} http_form_file_t;
+
+#define HTTP_FORM_FILE_BEGIN   0x1
+#define HTTP_FORM_FILE_END     0x2
+#define HTTP_FORM_FILE_ABORTED 0x4
+
+typedef int (http_form_file_callback_t)(http_request_t *hr,
+                                        const http_form_file_t *hff,
+                                        const void *data, size_t len,
+                                        int flags);
+
+void http_route_add_form(const char *path, int method,
+                         http_form_file_callback_t *file_callback,
+                         http_callback2_t *callback, int flags);
+
+/**
+ * File uploaded as field 'name', NULL if none
+ */
+const http_form_file_t *http_form_file(http_request_t *hr, const char *name);
+
+const char *http_route_arg(http_request_t *hr, const char *name);
+
 struct http_server *http_server_init(const char *config);
 
 int http_access_verify(http_request_t *hc);
 
+/**
+ * Serve files from 'filebundle' (a directory on disk or an embedded
+ * filebundle) below 'path'. Handles conditional requests (ETag,
+ * If-Modified-Since), single byte ranges and serves 'file'.gz instead
+ * of 'file' to clients that accept gzip if it exists.
+ *
+ * If 'send_index_html_on_404' is set, requests for missing paths without
+ * a known file extension get index.html (for client side routing)
+ */
 void http_serve_static(const char *path, const char *filebundle,
                        int send_index_html_on_404);
 
 void http_server_init_session_cookie(const char *password, uint8_t generation);
 
+/**
+ * Session stored in an encrypted cookie. The cookie is decrypted on
+ * first access so requests that don't use the session don't pay for it.
+ *
+ * http_session_get() returns the session for reading, NULL if the client
+ * has none (all ntv getters accept NULL).
+ *
+ * http_session_edit() returns a private copy that may be modified. If it
+ * differs from what the client sent when the reply is sent, an updated
+ * cookie is set (or deleted if the session is empty).
+ */
+const struct ntv *http_session_get(http_request_t *hr);
+
+struct ntv *http_session_edit(http_request_t *hr);
+
 
 
 
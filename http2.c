@@ -0,0 +1,625 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mbuf.h"
+#include "http2.h"
+
+
+/**
+ *
+ */
+void
+http2_frame_header(mbuf_t *out, uint32_t len, int type, int flags,
+                   uint32_t stream_id)
+{
+  const uint8_t hdr[HTTP2_FRAME_HEADER_LEN] = {
+    len >> 16, len >> 8, len, type, flags,
+    (stream_id >> 24) & 0x7f, stream_id >> 16, stream_id >> 8, stream_id
+  };
+  mbuf_append(out, hdr, sizeof(hdr));
+}
+
+
+/**
+ *
+ */
+void
+http2_frame_u32(mbuf_t *out, int type, uint32_t stream_id, uint32_t value)
+{
+  const uint8_t payload[4] = {value >> 24, value >> 16, value >> 8, value};
+  http2_frame_header(out, 4, type, 0, stream_id);
+  mbuf_append(out, payload, sizeof(payload));
+}
+
+
+/**
+ * RFC 7541 Appendix A
+ */
+static const struct {
+  const char *name;
+  const char *value;
+} hpack_static_table[] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+#define HPACK_STATIC_ENTRIES \
+  (sizeof(hpack_static_table) / sizeof(hpack_static_table[0]))
+
+#define HPACK_ENTRY_OVERHEAD 32
+
+
+/**
+ * RFC 7541 Appendix B
+ */
+static const struct {
+  uint32_t code;
+  uint8_t len;
+} hpack_huffman_codes[257] = {
+  {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+  {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+  {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+  {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+  {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+  {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+  {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+  {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+  {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+  {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+  {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+  {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+  {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+  {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+  {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+  {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+  {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+  {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+  {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+  {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+  {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+  {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+  {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+  {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+  {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+  {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+  {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+  {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+  {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+  {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+  {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+  {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+  {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+  {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+  {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+  {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+  {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+  {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+  {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+  {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+  {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+  {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+  {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+  {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+  {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+  {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+  {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+  {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+  {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+  {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+  {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+  {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+  {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+  {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+  {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+  {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+  {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+  {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+  {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+  {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+  {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+  {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+  {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+  {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+  {0x3fffffff, 30},
+};
+
+
+/**
+ * Decoding is done by walking a binary tree one bit at a time. Header
+ * blocks are small so this is not worth anything fancier
+ */
+typedef struct huff_node {
+  int16_t child[2];
+  int16_t sym;
+} huff_node_t;
+
+static huff_node_t huff_tree[513];
+
+
+static void __attribute__((constructor))
+hpack_huffman_init(void)
+{
+  int nodes = 1;
+  huff_tree[0].sym = -1;
+
+  for(int s = 0; s < 257; s++) {
+    const uint32_t code = hpack_huffman_codes[s].code;
+    const int len = hpack_huffman_codes[s].len;
+    int n = 0;
+    for(int i = len - 1; i >= 0; i--) {
+      const int bit = (code >> i) & 1;
+      if(huff_tree[n].child[bit] == 0) {
+        huff_tree[nodes].sym = -1;
+        huff_tree[n].child[bit] = nodes++;
+      }
+      n = huff_tree[n].child[bit];
+    }
+    huff_tree[n].sym = s;
+  }
+}
+
+
+/**
+ *
+ */
+static int
+hpack_huffman_decode(const uint8_t *src, size_t len, char *dst, size_t *outlen)
+{
+  int n = 0;
+  int depth = 0;
+  int ones = 1;
+  size_t o = 0;
+
+  for(size_t i = 0; i < len; i++) {
+    for(int b = 7; b >= 0; b--) {
+      const int bit = (src[i] >> b) & 1;
+      n = huff_tree[n].child[bit];
+      if(n == 0)
+        return -1;
+      depth++;
+      ones &= bit;
+      const int sym = huff_tree[n].sym;
+      if(sym == -1)
+        continue;
+      if(sym == 256)
+        return -1; // EOS must not appear in the string
+      dst[o++] = sym;
+      n = 0;
+      depth = 0;
+      ones = 1;
+    }
+  }
+
+  // Padding must be a prefix of EOS (all ones), and shorter than a byte
+  if(depth > 7 || !ones)
+    return -1;
+  *outlen = o;
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+hpack_int_decode(const uint8_t **pp, const uint8_t *end, int prefix,
+                 uint32_t *out)
+{
+  const uint8_t *p = *pp;
+  if(p == end)
+    return -1;
+
+  const uint32_t mask = (1 << prefix) - 1;
+  uint32_t v = *p++ & mask;
+  if(v == mask) {
+    int shift = 0;
+    while(1) {
+      if(p == end || shift > 21)
+        return -1;
+      const uint8_t b = *p++;
+      v += (b & 0x7f) << shift;
+      shift += 7;
+      if(!(b & 0x80))
+        break;
+    }
+  }
+  *pp = p;
+  *out = v;
+  return 0;
+}
+
+
+/**
+ * Returns a pointer either into the source data or into 'scratch'
+ * which is advanced
+ */
+static const char *
+hpack_string_decode(const uint8_t **pp, const uint8_t *end,
+                    char **scratch, size_t *lenp)
+{
+  const uint8_t *p = *pp;
+  if(p == end)
+    return NULL;
+  const int huffman = *p & 0x80;
+  uint32_t len;
+  if(hpack_int_decode(&p, end, 7, &len))
+    return NULL;
+  if(len > end - p)
+    return NULL;
+
+  const char *r;
+  if(huffman) {
+    r = *scratch;
+    if(hpack_huffman_decode(p, len, *scratch, lenp))
+      return NULL;
+    *scratch += *lenp;
+  } else {
+    r = (const char *)p;
+    *lenp = len;
+  }
+  *pp = p + len;
+  return r;
+}
+
+
+/**
+ *
+ */
+void
+hpack_table_init(hpack_table_t *ht, size_t limit)
+{
+  memset(ht, 0, sizeof(hpack_table_t));
+  ht->ht_max_size = limit;
+  ht->ht_limit = limit;
+}
+
+
+/**
+ *
+ */
+static hpack_entry_t *
+hpack_table_entry(hpack_table_t *ht, int i)
+{
+  return &ht->ht_entries[(ht->ht_first + i) % ht->ht_capacity];
+}
+
+
+/**
+ *
+ */
+static void
+hpack_table_evict(hpack_table_t *ht, size_t size)
+{
+  while(ht->ht_count && ht->ht_size + size > ht->ht_max_size) {
+    hpack_entry_t *he = hpack_table_entry(ht, ht->ht_count - 1);
+    ht->ht_size -= he->he_namelen + he->he_valuelen + HPACK_ENTRY_OVERHEAD;
+    free(he->he_name);
+    free(he->he_value);
+    ht->ht_count--;
+  }
+}
+
+
+/**
+ *
+ */
+void
+hpack_table_free(hpack_table_t *ht)
+{
+  ht->ht_max_size = 0;
+  hpack_table_evict(ht, 0);
+  free(ht->ht_entries);
+  ht->ht_entries = NULL;
+}
+
+
+/**
+ *
+ */
+static void
+hpack_table_insert(hpack_table_t *ht, const char *name, size_t namelen,
+                   const char *value, size_t valuelen)
+{
+  const size_t size = namelen + valuelen + HPACK_ENTRY_OVERHEAD;
+
+  // Copy first, the name might refer to an entry that is about to go
+  char *n = malloc(namelen + 1);
+  memcpy(n, name, namelen);
+  n[namelen] = 0;
+  char *v = malloc(valuelen + 1);
+  memcpy(v, value, valuelen);
+  v[valuelen] = 0;
+
+  hpack_table_evict(ht, size);
+  if(size > ht->ht_max_size) {
+    free(n);
+    free(v);
+    return;
+  }
+
+  if(ht->ht_count == ht->ht_capacity) {
+    const int capacity = ht->ht_capacity ? ht->ht_capacity * 2 : 16;
+    hpack_entry_t *entries = malloc(capacity * sizeof(hpack_entry_t));
+    for(int i = 0; i < ht->ht_count; i++)
+      entries[i] = *hpack_table_entry(ht, i);
+    free(ht->ht_entries);
+    ht->ht_entries = entries;
+    ht->ht_capacity = capacity;
+    ht->ht_first = 0;
+  }
+
+  ht->ht_first = (ht->ht_first + ht->ht_capacity - 1) % ht->ht_capacity;
+  hpack_entry_t *he = &ht->ht_entries[ht->ht_first];
+  he->he_name = n;
+  he->he_namelen = namelen;
+  he->he_value = v;
+  he->he_valuelen = valuelen;
+  ht->ht_count++;
+  ht->ht_size += size;
+}
+
+
+/**
+ *
+ */
+static int
+hpack_table_lookup(hpack_table_t *ht, uint32_t index,
+                   const char **name, size_t *namelen,
+                   const char **value, size_t *valuelen)
+{
+  if(index == 0)
+    return -1;
+
+  if(index <= HPACK_STATIC_ENTRIES) {
+    *name = hpack_static_table[index - 1].name;
+    *namelen = strlen(*name);
+    *value = hpack_static_table[index - 1].value;
+    *valuelen = strlen(*value);
+    return 0;
+  }
+
+  index -= HPACK_STATIC_ENTRIES + 1;
+  if(index >= ht->ht_count)
+    return -1;
+  const hpack_entry_t *he = hpack_table_entry(ht, index);
+  *name = he->he_name;
+  *namelen = he->he_namelen;
+  *value = he->he_value;
+  *valuelen = he->he_valuelen;
+  return 0;
+}
+
+
+/**
+ *
+ */
+int
+hpack_decode(hpack_table_t *ht, const uint8_t *data, size_t len,
+             hpack_header_cb_t *cb, void *opaque)
+{
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  // Huffman coded strings expand at most 8/5
+  char *scratch_base = malloc(len * 2 + 1);
+  int r = 0;
+  int fields = 0;
+
+  while(p < end) {
+    const char *name, *value;
+    size_t namelen, valuelen;
+    uint32_t index;
+    char *scratch = scratch_base;
+    const uint8_t b = *p;
+
+    if(b & 0x80) {
+      // Indexed header field
+      if(hpack_int_decode(&p, end, 7, &index) ||
+         hpack_table_lookup(ht, index, &name, &namelen, &value, &valuelen))
+        goto bad;
+      fields++;
+      if((r = cb(opaque, name, namelen, value, valuelen)) != 0)
+        break;
+      continue;
+    }
+
+    if((b & 0xe0) == 0x20) {
+      // Dynamic table size update, only allowed before the first field
+      if(fields || hpack_int_decode(&p, end, 5, &index) ||
+         index > ht->ht_limit)
+        goto bad;
+      ht->ht_max_size = index;
+      hpack_table_evict(ht, 0);
+      continue;
+    }
+
+    const int incremental = (b & 0xc0) == 0x40;
+    if(hpack_int_decode(&p, end, incremental ? 6 : 4, &index))
+      goto bad;
+
+    if(index) {
+      const char *unused;
+      size_t unusedlen;
+      if(hpack_table_lookup(ht, index, &name, &namelen, &unused, &unusedlen))
+        goto bad;
+    } else {
+      if((name = hpack_string_decode(&p, end, &scratch, &namelen)) == NULL)
+        goto bad;
+    }
+
+    if((value = hpack_string_decode(&p, end, &scratch, &valuelen)) == NULL)
+      goto bad;
+
+    fields++;
+    if((r = cb(opaque, name, namelen, value, valuelen)) != 0)
+      break;
+
+    if(incremental)
+      hpack_table_insert(ht, name, namelen, value, valuelen);
+  }
+  free(scratch_base);
+  return r;
+
+ bad:
+  free(scratch_base);
+  return -1;
+}
+
+
+/**
+ *
+ */
+static void
+hpack_int_encode(mbuf_t *out, uint8_t first, int prefix, uint32_t v)
+{
+  uint8_t buf[8];
+  int o = 0;
+  const uint32_t mask = (1 << prefix) - 1;
+
+  if(v < mask) {
+    buf[o++] = first | v;
+  } else {
+    buf[o++] = first | mask;
+    v -= mask;
+    while(v >= 0x80) {
+      buf[o++] = (v & 0x7f) | 0x80;
+      v >>= 7;
+    }
+    buf[o++] = v;
+  }
+  mbuf_append(out, buf, o);
+}
+
+
+/**
+ *
+ */
+static void
+hpack_string_encode(mbuf_t *out, const char *str, size_t len)
+{
+  hpack_int_encode(out, 0, 7, len);
+  mbuf_append(out, str, len);
+}
+
+
+/**
+ *
+ */
+void
+hpack_encode_status(mbuf_t *out, int status)
+{
+  for(int i = 7; i < 14; i++) {
+    if(atoi(hpack_static_table[i].value) == status) {
+      hpack_int_encode(out, 0x80, 7, i + 1);
+      return;
+    }
+  }
+  char buf[4];
+  snprintf(buf, sizeof(buf), "%03d", status);
+  hpack_int_encode(out, 0, 4, 8);
+  hpack_string_encode(out, buf, 3);
+}
+
+
+/**
+ * Always a literal without indexing, using the static table for the
+ * name if possible
+ */
+void
+hpack_encode_header(mbuf_t *out, const char *name, size_t namelen,
+                    const char *value, size_t valuelen)
+{
+  for(int i = 14; i < HPACK_STATIC_ENTRIES; i++) {
+    const char *n = hpack_static_table[i].name;
+    if(!strncmp(n, name, namelen) && n[namelen] == 0) {
+      hpack_int_encode(out, 0, 4, i + 1);
+      hpack_string_encode(out, value, valuelen);
+      return;
+    }
+  }
+  hpack_int_encode(out, 0, 4, 0);
+  hpack_string_encode(out, name, namelen);
+  hpack_string_encode(out, value, valuelen);
+}
@@ -0,0 +1,146 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct mbuf;
+
+/**
+ * HTTP/2 framing and HPACK header compression (RFC 7540, RFC 7541)
+ *
+ * Only the protocol level bits live here, connection and stream handling
+ * is part of the HTTP server in http.c
+ */
+
+#define HTTP2_PREFACE     "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+
+#define HTTP2_FRAME_HEADER_LEN 9
+#define HTTP2_DEFAULT_FRAME_SIZE 16384
+#define HTTP2_DEFAULT_WINDOW 65535
+#define HTTP2_MAX_WINDOW 0x7fffffff
+
+typedef enum {
+  HTTP2_DATA          = 0,
+  HTTP2_HEADERS       = 1,
+  HTTP2_PRIORITY      = 2,
+  HTTP2_RST_STREAM    = 3,
+  HTTP2_SETTINGS      = 4,
+  HTTP2_PUSH_PROMISE  = 5,
+  HTTP2_PING          = 6,
+  HTTP2_GOAWAY        = 7,
+  HTTP2_WINDOW_UPDATE = 8,
+  HTTP2_CONTINUATION  = 9,
+} http2_frame_type_t;
+
+#define HTTP2_FLAG_END_STREAM  0x1
+#define HTTP2_FLAG_ACK         0x1
+#define HTTP2_FLAG_END_HEADERS 0x4
+#define HTTP2_FLAG_PADDED      0x8
+#define HTTP2_FLAG_PRIORITY    0x20
+
+typedef enum {
+  HTTP2_SETTINGS_HEADER_TABLE_SIZE      = 1,
+  HTTP2_SETTINGS_ENABLE_PUSH            = 2,
+  HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 3,
+  HTTP2_SETTINGS_INITIAL_WINDOW_SIZE    = 4,
+  HTTP2_SETTINGS_MAX_FRAME_SIZE         = 5,
+  HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE   = 6,
+} http2_setting_t;
+
+typedef enum {
+  HTTP2_NO_ERROR            = 0,
+  HTTP2_PROTOCOL_ERROR      = 1,
+  HTTP2_INTERNAL_ERROR      = 2,
+  HTTP2_FLOW_CONTROL_ERROR  = 3,
+  HTTP2_SETTINGS_TIMEOUT    = 4,
+  HTTP2_STREAM_CLOSED       = 5,
+  HTTP2_FRAME_SIZE_ERROR    = 6,
+  HTTP2_REFUSED_STREAM      = 7,
+  HTTP2_CANCEL              = 8,
+  HTTP2_COMPRESSION_ERROR   = 9,
+  HTTP2_ENHANCE_YOUR_CALM   = 11,
+} http2_error_t;
+
+
+/**
+ * Append a frame header to 'out'
+ */
+void http2_frame_header(struct mbuf *out, uint32_t len, int type, int flags,
+                        uint32_t stream_id);
+
+/**
+ * Append a complete frame with a 32 bit payload (WINDOW_UPDATE,
+ * RST_STREAM)
+ */
+void http2_frame_u32(struct mbuf *out, int type, uint32_t stream_id,
+                     uint32_t value);
+
+
+/**
+ * HPACK decoder state, the dynamic table
+ */
+typedef struct hpack_entry {
+  char *he_name;
+  char *he_value;
+  size_t he_namelen;
+  size_t he_valuelen;
+} hpack_entry_t;
+
+typedef struct hpack_table {
+  hpack_entry_t *ht_entries;  // Ring buffer, ht_first is the newest
+  int ht_capacity;
+  int ht_count;
+  int ht_first;
+  size_t ht_size;
+  size_t ht_max_size;         // Current, set by the encoder
+  size_t ht_limit;            // What we've allowed in SETTINGS
+} hpack_table_t;
+
+void hpack_table_init(hpack_table_t *ht, size_t limit);
+
+void hpack_table_free(hpack_table_t *ht);
+
+typedef int (hpack_header_cb_t)(void *opaque,
+                                const char *name, size_t namelen,
+                                const char *value, size_t valuelen);
+
+/**
+ * Decode a complete header block. Returns -1 on compression errors
+ * (the connection must be torn down since the table is out of sync)
+ * or whatever non-zero value the callback returns
+ */
+int hpack_decode(hpack_table_t *ht, const uint8_t *data, size_t len,
+                 hpack_header_cb_t *cb, void *opaque);
+
+/**
+ * Encoding never adds anything to the dynamic table so it needs no state.
+ * Names must be lower case
+ */
+void hpack_encode_status(struct mbuf *out, int status);
+
+void hpack_encode_header(struct mbuf *out, const char *name, size_t namelen,
+                         const char *value, size_t valuelen);
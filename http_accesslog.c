@@ -0,0 +1,331 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "queue.h"
+#include "trace.h"
+#include "http_parser.h"
+#include "http_accesslog.h"
+
+#define ACCESSLOG_PATH_MAX  176
+#define ACCESSLOG_BATCH     64    // Lines per writev()
+#define ACCESSLOG_LINE_MAX  384
+
+typedef struct accesslog_record {
+  int64_t alr_received;   // Wall clock, µs
+  int64_t alr_bytes;
+  int32_t alr_queued;     // From received until processing started, µs
+  int32_t alr_duration;   // Processing, µs
+  uint16_t alr_status;
+  uint8_t alr_method;
+  uint8_t alr_truncated;
+  char alr_peer[48];
+  char alr_path[ACCESSLOG_PATH_MAX];
+} accesslog_record_t;
+
+
+/**
+ * Single producer (the owning thread), single consumer (the writer)
+ */
+typedef struct accesslog_ring {
+  LIST_ENTRY(accesslog_ring) ar_link;
+  unsigned int ar_head;   // Written by producer
+  unsigned int ar_tail;   // Written by consumer
+  int ar_drops;
+  int ar_orphaned;        // Owner thread has exited
+  accesslog_record_t ar_records[0];
+} accesslog_ring_t;
+
+LIST_HEAD(accesslog_ring_list, accesslog_ring);
+
+static struct accesslog_ring_list accesslog_rings;
+static pthread_mutex_t accesslog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t accesslog_key;
+static unsigned int accesslog_ring_size;
+static char *accesslog_path;
+static int accesslog_fd = -1;
+static volatile int accesslog_reopen_pending;
+
+
+/**
+ *
+ */
+int
+http_accesslog_enabled(void)
+{
+  return accesslog_ring_size != 0;
+}
+
+
+/**
+ *
+ */
+void
+http_accesslog_reopen(void)
+{
+  accesslog_reopen_pending = 1;
+}
+
+
+/**
+ * Called when a thread exits, the writer frees the ring once it's drained
+ */
+static void
+accesslog_thread_exit(void *aux)
+{
+  accesslog_ring_t *ar = aux;
+  __atomic_store_n(&ar->ar_orphaned, 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ *
+ */
+static accesslog_ring_t *
+accesslog_ring_get(void)
+{
+  accesslog_ring_t *ar = pthread_getspecific(accesslog_key);
+  if(ar != NULL)
+    return ar;
+
+  ar = calloc(1, sizeof(accesslog_ring_t) +
+              accesslog_ring_size * sizeof(accesslog_record_t));
+  pthread_setspecific(accesslog_key, ar);
+
+  pthread_mutex_lock(&accesslog_mutex);
+  LIST_INSERT_HEAD(&accesslog_rings, ar, ar_link);
+  pthread_mutex_unlock(&accesslog_mutex);
+  return ar;
+}
+
+
+/**
+ *
+ */
+void
+http_accesslog_write(int method, const char *path, const char *peer,
+                     int status, int64_t bytes, int64_t received,
+                     int64_t process, int64_t done)
+{
+  accesslog_ring_t *ar = accesslog_ring_get();
+  const unsigned int head = ar->ar_head;
+  const unsigned int tail = __atomic_load_n(&ar->ar_tail, __ATOMIC_ACQUIRE);
+
+  if(head - tail >= accesslog_ring_size) {
+    __atomic_fetch_add(&ar->ar_drops, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  accesslog_record_t *alr =
+    &ar->ar_records[head & (accesslog_ring_size - 1)];
+
+  alr->alr_received = received;
+  alr->alr_bytes = bytes;
+  alr->alr_queued = process > received ? process - received : 0;
+  alr->alr_duration = done > process ? done - process : 0;
+  alr->alr_status = status;
+  alr->alr_method = method;
+
+  snprintf(alr->alr_peer, sizeof(alr->alr_peer), "%s", peer ?: "-");
+  const size_t len = strlen(path ?: "");
+  alr->alr_truncated = len >= ACCESSLOG_PATH_MAX;
+  memcpy(alr->alr_path, path ?: "", MIN(len + 1, ACCESSLOG_PATH_MAX));
+  alr->alr_path[ACCESSLOG_PATH_MAX - 1] = 0;
+
+  __atomic_store_n(&ar->ar_head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ *
+ */
+static void
+accesslog_open(void)
+{
+  if(accesslog_fd != -1)
+    close(accesslog_fd);
+
+  accesslog_fd = open(accesslog_path,
+                      O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if(accesslog_fd == -1)
+    trace(LOG_ERR, "HTTP: Unable to open access log %s -- %m",
+          accesslog_path);
+}
+
+
+/**
+ *
+ */
+static void
+accesslog_flush(struct iovec *iov, int cnt)
+{
+  if(cnt == 0 || accesslog_fd == -1)
+    return;
+  if(writev(accesslog_fd, iov, cnt) == -1)
+    trace(LOG_ERR, "HTTP: Unable to write access log -- %m");
+}
+
+
+/**
+ * Format time as in common log format. Only done once per second
+ */
+static const char *
+accesslog_time(int64_t us)
+{
+  static time_t cached_time;
+  static char cached_str[40];
+  const time_t t = us / 1000000;
+
+  if(t != cached_time) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(cached_str, sizeof(cached_str), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    cached_time = t;
+  }
+  return cached_str;
+}
+
+
+/**
+ * Format and write all records currently in the ring
+ */
+static void
+accesslog_drain(accesslog_ring_t *ar)
+{
+  static char lines[ACCESSLOG_BATCH][ACCESSLOG_LINE_MAX];
+  struct iovec iov[ACCESSLOG_BATCH];
+  int cnt = 0;
+
+  unsigned int tail = ar->ar_tail;
+  const unsigned int head = __atomic_load_n(&ar->ar_head, __ATOMIC_ACQUIRE);
+
+  for(; tail != head; tail++) {
+    const accesslog_record_t *alr =
+      &ar->ar_records[tail & (accesslog_ring_size - 1)];
+
+    int len = snprintf(lines[cnt], ACCESSLOG_LINE_MAX,
+                       "%s - - [%s] \"%s %s%s\" %d %"PRId64" %d %d\n",
+                       alr->alr_peer,
+                       accesslog_time(alr->alr_received),
+                       http_method_str(alr->alr_method),
+                       alr->alr_path,
+                       alr->alr_truncated ? "..." : "",
+                       alr->alr_status, alr->alr_bytes,
+                       alr->alr_queued, alr->alr_duration);
+    iov[cnt].iov_base = lines[cnt];
+    iov[cnt].iov_len = MIN(len, ACCESSLOG_LINE_MAX - 1);
+    cnt++;
+
+    if(cnt == ACCESSLOG_BATCH) {
+      // Lines are copied out, the slots can be reused
+      __atomic_store_n(&ar->ar_tail, tail + 1, __ATOMIC_RELEASE);
+      accesslog_flush(iov, cnt);
+      cnt = 0;
+    }
+  }
+  __atomic_store_n(&ar->ar_tail, tail, __ATOMIC_RELEASE);
+  accesslog_flush(iov, cnt);
+}
+
+
+/**
+ *
+ */
+static void *
+accesslog_thread(void *aux)
+{
+  accesslog_ring_t *ar, *next;
+
+  while(1) {
+    usleep(100000);
+
+    if(accesslog_reopen_pending) {
+      accesslog_reopen_pending = 0;
+      accesslog_open();
+    }
+
+    pthread_mutex_lock(&accesslog_mutex);
+    for(ar = LIST_FIRST(&accesslog_rings); ar != NULL; ar = next) {
+      next = LIST_NEXT(ar, ar_link);
+
+      const int orphaned =
+        __atomic_load_n(&ar->ar_orphaned, __ATOMIC_ACQUIRE);
+
+      accesslog_drain(ar);
+
+      const int drops =
+        __atomic_exchange_n(&ar->ar_drops, 0, __ATOMIC_RELAXED);
+      if(drops)
+        trace(LOG_WARNING, "HTTP: Access log ring full, %d entries dropped",
+              drops);
+
+      if(orphaned) {
+        LIST_REMOVE(ar, ar_link);
+        free(ar);
+      }
+    }
+    pthread_mutex_unlock(&accesslog_mutex);
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+int
+http_accesslog_init(const char *path, int ring_size)
+{
+  if(accesslog_ring_size)
+    return 0; // Already running, shared by all servers
+
+  accesslog_path = strdup(path);
+  accesslog_open();
+  if(accesslog_fd == -1)
+    return -1;
+
+  unsigned int size = 16;
+  while(size < ring_size)
+    size *= 2;
+
+  pthread_key_create(&accesslog_key, accesslog_thread_exit);
+  accesslog_ring_size = size;
+
+  pthread_t tid;
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&tid, &attr, accesslog_thread, NULL);
+  pthread_attr_destroy(&attr);
+  return 0;
+}
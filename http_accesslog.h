@@ -0,0 +1,50 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Access log
+ *
+ * Requests are written as fixed size records into a ring buffer owned by
+ * the calling thread. A background thread drains all rings, formats the
+ * records and appends them to the log file in batches. Producers never
+ * block or take a lock, if a ring is full the record is dropped and
+ * counted (the writer logs the number of drops).
+ *
+ * http_accesslog_reopen() makes the writer reopen the file, for log
+ * rotation. It's async-signal-safe so it can be called from a SIGHUP
+ * handler.
+ */
+
+int http_accesslog_init(const char *path, int ring_size);
+
+int http_accesslog_enabled(void);
+
+void http_accesslog_write(int method, const char *path, const char *peer,
+                          int status, int64_t bytes, int64_t received,
+                          int64_t process, int64_t done);
+
+void http_accesslog_reopen(void);
@@ -0,0 +1,449 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+
+#include "queue.h"
+#include "atomic.h"
+#include "asyncio.h"
+#include "murmur3.h"
+#include "strvec.h"
+#include "misc.h"
+#include "http.h"
+#include "http_cache.h"
+
+// Each shard has its own lock, LRU list and an equal share of the
+// size limit
+#define HTTP_CACHE_SHARDS    8
+#define HTTP_CACHE_HASH_SIZE 128  // Per shard
+
+// Approximate size of an entry's pre-rendered header block
+#define HTTP_CACHE_HEADER_SIZE 256
+
+// Seconds to wait for another request's fill before running the
+// handler anyway, so a hung handler doesn't pin every waiting thread
+#define HTTP_CACHE_FILL_WAIT 2
+
+struct http_cache_policy {
+  int64_t hcp_ttl;         // µs
+  strvec_t hcp_vary;
+  int hcp_vary_auth;       // Authorization is part of the key
+  int hcp_vary_cookie;     // Cookie is part of the key
+};
+
+
+typedef enum {
+  HCE_FILLING,
+  HCE_VALID,
+  HCE_UNLINKED,
+} hce_state_t;
+
+
+struct http_cache_entry {
+  LIST_ENTRY(http_cache_entry) hce_hash_link;
+  TAILQ_ENTRY(http_cache_entry) hce_lru_link;
+  atomic_t hce_refcount;
+  hce_state_t hce_state;
+  pthread_cond_t hce_cond;  // Signalled when filling is done
+  uint32_t hce_hash;
+  int64_t hce_ttl;
+  int64_t hce_expire;
+  size_t hce_size;   // Accounted against http_cache_max_size
+
+  http_response_template_t *hce_template;
+  void *hce_body;
+  size_t hce_body_size;
+
+  size_t hce_keylen;
+  char hce_key[0];
+};
+
+LIST_HEAD(http_cache_entry_list, http_cache_entry);
+TAILQ_HEAD(http_cache_entry_queue, http_cache_entry);
+
+typedef struct http_cache_shard {
+  pthread_mutex_t hcs_mutex;
+  struct http_cache_entry_list hcs_hash[HTTP_CACHE_HASH_SIZE];
+  struct http_cache_entry_queue hcs_lru;
+  size_t hcs_size;
+} http_cache_shard_t;
+
+static http_cache_shard_t http_cache_shards[HTTP_CACHE_SHARDS];
+static size_t http_cache_shard_max_size = 32 * 1024 * 1024 / HTTP_CACHE_SHARDS;
+
+
+static void __attribute__((constructor))
+http_cache_shards_init(void)
+{
+  for(int i = 0; i < HTTP_CACHE_SHARDS; i++) {
+    pthread_mutex_init(&http_cache_shards[i].hcs_mutex, NULL);
+    TAILQ_INIT(&http_cache_shards[i].hcs_lru);
+  }
+}
+
+
+/**
+ *
+ */
+static http_cache_shard_t *
+http_cache_shard(uint32_t hash)
+{
+  return &http_cache_shards[hash % HTTP_CACHE_SHARDS];
+}
+
+
+/**
+ * Must be called before any requests are served
+ */
+void
+http_cache_init(size_t max_size)
+{
+  http_cache_shard_max_size = max_size / HTTP_CACHE_SHARDS;
+}
+
+
+/**
+ *
+ */
+http_cache_policy_t *
+http_cache_policy_create(int ttl, const char *vary)
+{
+  http_cache_policy_t *hcp = calloc(1, sizeof(http_cache_policy_t));
+  hcp->hcp_ttl = ttl * 1000LL;
+
+  if(vary != NULL) {
+    char *s = strdup(vary);
+    char *argv[32];
+    int argc = str_tokenize(s, argv, 32, ',');
+    for(int i = 0; i < argc; i++) {
+      char *name = argv[i];
+      while(*name == ' ')
+        name++;
+      name[strcspn(name, " ")] = 0;
+      if(!*name)
+        continue;
+      if(!strcasecmp(name, "Authorization"))
+        hcp->hcp_vary_auth = 1;
+      if(!strcasecmp(name, "Cookie"))
+        hcp->hcp_vary_cookie = 1;
+      strvec_push(&hcp->hcp_vary, name);
+    }
+    free(s);
+  }
+  return hcp;
+}
+
+
+/**
+ *
+ */
+static void
+http_cache_entry_release(http_cache_entry_t *hce)
+{
+  if(atomic_dec(&hce->hce_refcount))
+    return;
+  if(hce->hce_template != NULL)
+    http_response_template_destroy(hce->hce_template);
+  pthread_cond_destroy(&hce->hce_cond);
+  free(hce->hce_body);
+  free(hce);
+}
+
+
+/**
+ * Body references handed to mbuf_append_external()
+ */
+static void
+http_cache_body_release(void *opaque)
+{
+  http_cache_entry_release(opaque);
+}
+
+
+/**
+ * Remove from hash (and LRU if valid), drops the cache's reference.
+ * Must be called with the shard locked
+ */
+static void
+http_cache_unlink(http_cache_shard_t *hcs, http_cache_entry_t *hce)
+{
+  LIST_REMOVE(hce, hce_hash_link);
+  if(hce->hce_state == HCE_VALID) {
+    TAILQ_REMOVE(&hcs->hcs_lru, hce, hce_lru_link);
+    hcs->hcs_size -= hce->hce_size;
+  }
+  hce->hce_state = HCE_UNLINKED;
+  http_cache_entry_release(hce);
+}
+
+
+/**
+ *
+ */
+static int
+http_cache_arg_cmp(const void *A, const void *B)
+{
+  const http_arg_t *a = *(const http_arg_t **)A;
+  const http_arg_t *b = *(const http_arg_t **)B;
+  int r = strcmp(a->key, b->key);
+  return r ?: strcmp(a->val ?: "", b->val ?: "");
+}
+
+
+/**
+ * Each component is length prefixed so the key is unambiguous
+ */
+static void
+http_cache_key_add(mbuf_t *m, const char *str)
+{
+  str = str ?: "";
+  mbuf_qprintf(m, "%zd:%s", strlen(str), str);
+}
+
+
+/**
+ *
+ */
+static char *
+http_cache_key(const http_cache_policy_t *hcp, http_request_t *hr,
+               int variant, size_t *lenp)
+{
+  http_arg_t *ra;
+  mbuf_t m;
+  int n = 0;
+
+  mbuf_init(&m);
+  mbuf_qprintf(&m, "%d", variant);
+  http_cache_key_add(&m, hr->hr_path);
+
+  TAILQ_FOREACH(ra, &hr->hr_query_args, link)
+    n++;
+
+  const http_arg_t *args[n];
+  n = 0;
+  TAILQ_FOREACH(ra, &hr->hr_query_args, link)
+    args[n++] = ra;
+  qsort(args, n, sizeof(args[0]), http_cache_arg_cmp);
+
+  mbuf_qprintf(&m, "%d", n);
+  for(int i = 0; i < n; i++) {
+    http_cache_key_add(&m, args[i]->key);
+    http_cache_key_add(&m, args[i]->val);
+  }
+
+  for(int i = 0; i < hcp->hcp_vary.count; i++)
+    http_cache_key_add(&m, http_req_header(hr, strvec_get(&hcp->hcp_vary,
+                                                          i)));
+
+  *lenp = m.mq_size;
+  char *key = http_req_alloc(hr, m.mq_size);
+  mbuf_read(&m, key, m.mq_size);
+  return key;
+}
+
+
+/**
+ *
+ */
+static void
+http_cache_serve(http_request_t *hr, http_cache_entry_t *hce)
+{
+  mbuf_append_external(&hr->hr_reply, hce->hce_body, hce->hce_body_size,
+                       http_cache_body_release, hce);
+  hr->hr_bytes_sent = hce->hce_body_size;
+  http_send_reply_template(hr, hce->hce_template);
+}
+
+
+/**
+ *
+ */
+int
+http_cache_lookup(const http_cache_policy_t *hcp, http_request_t *hr,
+                  int variant, http_cache_entry_t **fillp)
+{
+  http_cache_entry_t *hce;
+  size_t keylen;
+
+  *fillp = NULL;
+
+  // Credentials (or a session) would otherwise leak one client's reply
+  // to others
+  if(!hcp->hcp_vary_auth &&
+     http_req_header_id(hr, HTTP_HDR_AUTHORIZATION) != NULL)
+    return 0;
+  if(!hcp->hcp_vary_cookie &&
+     http_req_header_id(hr, HTTP_HDR_COOKIE) != NULL)
+    return 0;
+
+  const char *key = http_cache_key(hcp, hr, variant, &keylen);
+  const uint32_t hash = MurHash3_32(key, keylen, 0);
+  http_cache_shard_t *hcs = http_cache_shard(hash);
+  struct http_cache_entry_list *bucket =
+    &hcs->hcs_hash[(hash / HTTP_CACHE_SHARDS) % HTTP_CACHE_HASH_SIZE];
+
+  pthread_mutex_lock(&hcs->hcs_mutex);
+
+  while(1) {
+    LIST_FOREACH(hce, bucket, hce_hash_link) {
+      if(hce->hce_hash == hash && hce->hce_keylen == keylen &&
+         !memcmp(hce->hce_key, key, keylen))
+        break;
+    }
+
+    if(hce != NULL && hce->hce_state == HCE_VALID &&
+       hce->hce_expire <= asyncio_now()) {
+      http_cache_unlink(hcs, hce);
+      hce = NULL;
+    }
+
+    if(hce == NULL) {
+      hce = calloc(1, sizeof(http_cache_entry_t) + keylen);
+      atomic_set(&hce->hce_refcount, 2); // Cache and filler
+      hce->hce_state = HCE_FILLING;
+      pthread_cond_init(&hce->hce_cond, NULL);
+      hce->hce_hash = hash;
+      hce->hce_ttl = hcp->hcp_ttl;
+      hce->hce_keylen = keylen;
+      memcpy(hce->hce_key, key, keylen);
+      LIST_INSERT_HEAD(bucket, hce, hce_hash_link);
+      pthread_mutex_unlock(&hcs->hcs_mutex);
+      *fillp = hce;
+      return 0;
+    }
+
+    if(hce->hce_state == HCE_VALID)
+      break;
+
+    if(hr->hr_inline) {
+      // Can't block the asyncio thread, just run the handler
+      pthread_mutex_unlock(&hcs->hcs_mutex);
+      return 0;
+    }
+
+    // Keep the entry around while waiting, the fill may be abandoned and
+    // the entry unlinked. Then look again, it's either valid now or
+    // this request takes over the fill
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += HTTP_CACHE_FILL_WAIT;
+
+    atomic_inc(&hce->hce_refcount);
+    while(hce->hce_state == HCE_FILLING) {
+      if(pthread_cond_timedwait(&hce->hce_cond, &hcs->hcs_mutex,
+                                &ts) == ETIMEDOUT)
+        break;
+    }
+    const int timedout = hce->hce_state == HCE_FILLING;
+    http_cache_entry_release(hce);
+
+    if(timedout) {
+      pthread_mutex_unlock(&hcs->hcs_mutex);
+      return 0;
+    }
+  }
+
+  TAILQ_REMOVE(&hcs->hcs_lru, hce, hce_lru_link);
+  TAILQ_INSERT_TAIL(&hcs->hcs_lru, hce, hce_lru_link);
+  atomic_inc(&hce->hce_refcount);
+  pthread_mutex_unlock(&hcs->hcs_mutex);
+
+  http_cache_serve(hr, hce);
+  return 1;
+}
+
+
+/**
+ * Called from http_send_reply() with the final (possibly compressed)
+ * reply. Entry is published in http_cache_fill_done()
+ */
+void
+http_cache_store(http_cache_entry_t *hce, int status,
+                 const char *content, const char *encoding, int maxage,
+                 int vary_encoding, const struct http_arg_list *headers,
+                 mbuf_t *body)
+{
+  struct http_arg_list extra;
+  const http_arg_t *ra;
+
+  if(status != HTTP_STATUS_OK || hce->hce_template != NULL)
+    return;
+
+  TAILQ_INIT(&extra);
+  TAILQ_FOREACH(ra, headers, link) {
+    if(!strcasecmp(ra->key, "Set-Cookie"))
+      goto out;
+    http_arg_set(&extra, ra->key, ra->val);
+  }
+
+  if(vary_encoding)
+    http_arg_set(&extra, "Vary", "Accept-Encoding");
+
+  hce->hce_template = http_response_template_create(status, content,
+                                                    encoding, maxage, &extra);
+  hce->hce_body_size = body->mq_size;
+  hce->hce_body = malloc(body->mq_size ?: 1);
+  mbuf_peek(body, hce->hce_body, body->mq_size);
+  hce->hce_size = sizeof(http_cache_entry_t) + hce->hce_keylen +
+    hce->hce_body_size + HTTP_CACHE_HEADER_SIZE;
+ out:
+  http_arg_flush(&extra);
+}
+
+
+/**
+ *
+ */
+void
+http_cache_fill_done(http_cache_entry_t *hce)
+{
+  http_cache_shard_t *hcs = http_cache_shard(hce->hce_hash);
+
+  pthread_mutex_lock(&hcs->hcs_mutex);
+
+  if(hce->hce_template != NULL &&
+     hce->hce_size <= http_cache_shard_max_size) {
+    hce->hce_state = HCE_VALID;
+    hce->hce_expire = asyncio_now() + hce->hce_ttl;
+    TAILQ_INSERT_TAIL(&hcs->hcs_lru, hce, hce_lru_link);
+    hcs->hcs_size += hce->hce_size;
+
+    http_cache_entry_t *old;
+    while(hcs->hcs_size > http_cache_shard_max_size &&
+          (old = TAILQ_FIRST(&hcs->hcs_lru)) != hce)
+      http_cache_unlink(hcs, old);
+  } else {
+    // Nothing cacheable, let a waiter have a go
+    http_cache_unlink(hcs, hce);
+  }
+
+  // Only requests for this very entry are woken up
+  pthread_cond_broadcast(&hce->hce_cond);
+  pthread_mutex_unlock(&hcs->hcs_mutex);
+  http_cache_entry_release(hce);
+}
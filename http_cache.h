@@ -0,0 +1,83 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+struct http_request;
+struct http_arg_list;
+struct mbuf;
+
+/**
+ * Micro-cache for GET responses of routes added with
+ * http_route_add_cached()
+ *
+ * Entries are keyed on path, query args (sorted, so argument order does
+ * not matter), the route's vary headers and the accepted content coding.
+ * Only 200 replies sent with http_send_reply() are stored. Hits are sent
+ * with a pre-rendered header block and the body is referenced (not
+ * copied) from the entry.
+ *
+ * Requests with Authorization or Cookie headers bypass the cache unless
+ * the header is listed in the route's vary headers.
+ *
+ * While an entry is being filled, identical requests wait for the
+ * first one to finish instead of invoking the handler. If it does not
+ * produce a cacheable reply one of the waiters takes over the fill. If
+ * it takes more than two seconds the waiters invoke the handler
+ * themselves (without caching the reply).
+ *
+ * Total size of all entries is bounded by http.cache.maxSize, least
+ * recently used entries are evicted first. The cache is split in shards
+ * with a lock each, every shard gets an equal share of maxSize.
+ */
+
+typedef struct http_cache_policy http_cache_policy_t;
+
+typedef struct http_cache_entry http_cache_entry_t;
+
+void http_cache_init(size_t max_size);
+
+/**
+ * 'ttl' in milliseconds, 'vary' is a comma separated list of request
+ * header names or NULL
+ */
+http_cache_policy_t *http_cache_policy_create(int ttl, const char *vary);
+
+/**
+ * Returns 1 if the request was served from the cache. Otherwise 0 is
+ * returned and if '*fillp' is set the caller must invoke the handler,
+ * offer the reply with http_cache_store() and finish with
+ * http_cache_fill_done()
+ */
+int http_cache_lookup(const http_cache_policy_t *hcp,
+                      struct http_request *hr, int variant,
+                      http_cache_entry_t **fillp);
+
+void http_cache_store(http_cache_entry_t *hce, int status,
+                      const char *content, const char *encoding, int maxage,
+                      int vary_encoding, const struct http_arg_list *headers,
+                      struct mbuf *body);
+
+void http_cache_fill_done(http_cache_entry_t *hce);
@@ -0,0 +1,220 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "http_head.h"
+
+/**
+ * RFC 7230 tchar, valid in methods and header names
+ */
+static const uint8_t tchar[256] = {
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,1,0,1,1,1,1,1,0,0,1,1,0,1,1,0,1,1,1,1,1,1,1,1,1,1,0,0,0,0,0,0,
+  0,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,0,0,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,0,1,0,1,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+};
+
+
+/**
+ * Find the first byte that is <= 'limit' or DEL
+ *
+ * This is where the time goes for request targets and header values,
+ * so look at 32 or 16 bytes at a time when the CPU allows. There are
+ * no unsigned byte compares in SSE2/AVX2 but min(v, limit) == v does
+ * the same thing. Bytes >= 0x80 (obs-text) are let through
+ */
+static inline const char *
+find_ctl(const char *p, const char *end, uint8_t limit)
+{
+#ifdef __AVX2__
+  const __m256i l32 = _mm256_set1_epi8(limit);
+  const __m256i d32 = _mm256_set1_epi8(0x7f);
+  while(end - p >= 32) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    const __m256i m =
+      _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, l32), v),
+                      _mm256_cmpeq_epi8(v, d32));
+    const uint32_t bits = _mm256_movemask_epi8(m);
+    if(bits)
+      return p + __builtin_ctz(bits);
+    p += 32;
+  }
+#endif
+#ifdef __SSE2__
+  const __m128i l16 = _mm_set1_epi8(limit);
+  const __m128i d16 = _mm_set1_epi8(0x7f);
+  while(end - p >= 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)p);
+    const __m128i m =
+      _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, l16), v),
+                   _mm_cmpeq_epi8(v, d16));
+    const uint32_t bits = _mm_movemask_epi8(m);
+    if(bits)
+      return p + __builtin_ctz(bits);
+    p += 16;
+  }
+#endif
+  for(; p < end; p++) {
+    const uint8_t c = *p;
+    if(c <= limit || c == 0x7f)
+      break;
+  }
+  return p;
+}
+
+
+/**
+ *
+ */
+static inline const char *
+find_non_token(const char *p, const char *end)
+{
+  while(p < end && tchar[(uint8_t)*p])
+    p++;
+  return p;
+}
+
+
+/**
+ * Length of line ending at 'p', 0 if incomplete, -1 if not a line end
+ */
+static inline int
+eol_len(const char *p, const char *end)
+{
+  if(p == end)
+    return 0;
+  if(*p == '\n')
+    return 1;
+  if(*p != '\r')
+    return -1;
+  if(p + 1 == end)
+    return 0;
+  return p[1] == '\n' ? 2 : -1;
+}
+
+
+/**
+ *
+ */
+int
+http_head_parse(const char *buf, size_t len, http_head_t *hh)
+{
+  const char *p = buf;
+  const char *end = buf + len;
+  int e;
+
+  // Empty lines before the request line should be ignored (RFC 7230 3.5)
+  while(p < end && (*p == '\r' || *p == '\n'))
+    p++;
+
+  // Method
+  hh->hh_method = p;
+  p = find_non_token(p, end);
+  if(p == end)
+    return 0;
+  if(*p != ' ' || p == hh->hh_method)
+    return -1;
+  hh->hh_method_len = p - hh->hh_method;
+  p++;
+
+  // Request target
+  hh->hh_target = p;
+  p = find_ctl(p, end, ' ');
+  if(p == end)
+    return 0;
+  if(*p != ' ' || p == hh->hh_target)
+    return -1;
+  hh->hh_target_len = p - hh->hh_target;
+  p++;
+
+  // Version
+  if(end - p < 8)
+    return 0;
+  if(memcmp(p, "HTTP/1.", 7) || p[7] < '0' || p[7] > '9')
+    return -1;
+  hh->hh_minor = p[7] - '0';
+  p += 8;
+  if((e = eol_len(p, end)) <= 0)
+    return e;
+  p += e;
+
+  // Header fields
+  hh->hh_num_fields = 0;
+  while(1) {
+    if((e = eol_len(p, end)) > 0) {
+      p += e;
+      break;
+    }
+    if(p == end || (*p == '\r' && p + 1 == end))
+      return 0;
+
+    if(hh->hh_num_fields == HTTP_HEAD_MAX_FIELDS)
+      return -1;
+    http_head_field_t *hhf = &hh->hh_fields[hh->hh_num_fields];
+
+    // Also rejects obs-fold, a continuation line starts with whitespace
+    hhf->hhf_name = p;
+    p = find_non_token(p, end);
+    if(p == end)
+      return 0;
+    if(*p != ':' || p == hhf->hhf_name)
+      return -1;
+    hhf->hhf_name_len = p - hhf->hhf_name;
+    p++;
+
+    while(p < end && (*p == ' ' || *p == '\t'))
+      p++;
+
+    hhf->hhf_value = p;
+    while(1) {
+      p = find_ctl(p, end, 0x1f);
+      if(p == end)
+        return 0;
+      if(*p != '\t')
+        break;
+      p++;
+    }
+
+    const char *value_end = p;
+    if((e = eol_len(p, end)) <= 0)
+      return e;
+    p += e;
+
+    while(value_end > hhf->hhf_value &&
+          (value_end[-1] == ' ' || value_end[-1] == '\t'))
+      value_end--;
+    hhf->hhf_value_len = value_end - hhf->hhf_value;
+    hh->hh_num_fields++;
+  }
+  return p - buf;
+}
@@ -0,0 +1,67 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Single pass parser for HTTP/1.x request heads
+ *
+ * Scans a request line and its headers that are complete in one
+ * contiguous buffer and returns slices pointing into that buffer.
+ * Nothing is copied or terminated. Used by the HTTP server as a fast
+ * path in front of the incremental http_parser, which still deals
+ * with heads spanning multiple receive buffers and anything this
+ * parser doesn't accept.
+ */
+
+#define HTTP_HEAD_MAX_FIELDS 64
+
+typedef struct http_head_field {
+  const char *hhf_name;
+  const char *hhf_value;  // Without surrounding whitespace
+  size_t hhf_name_len;
+  size_t hhf_value_len;
+} http_head_field_t;
+
+
+typedef struct http_head {
+  const char *hh_method;
+  const char *hh_target;
+  size_t hh_method_len;
+  size_t hh_target_len;
+  int hh_minor;  // HTTP/1.x
+
+  int hh_num_fields;
+  http_head_field_t hh_fields[HTTP_HEAD_MAX_FIELDS];
+} http_head_t;
+
+
+/**
+ * Returns length of the head including the terminating empty line,
+ * 0 if the head is not complete in 'buf', or -1 if it's malformed or
+ * uses something not supported here (obs-fold, HTTP/0.9, more than
+ * HTTP_HEAD_MAX_FIELDS headers)
+ */
+int http_head_parse(const char *buf, size_t len, http_head_t *hh);
@@ -0,0 +1,255 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <math.h>
+#include <sys/param.h>
+
+#include "cfg.h"
+#include "mbuf.h"
+#include "ntv.h"
+#include "strvec.h"
+#include "trace.h"
+#include "asyncio.h"
+#include "http_limiter.h"
+
+#define HTTP_LIMITER_WINDOW      100000   // usec
+#define HTTP_LIMITER_MAX_WINDOW  1000000  // Even with few samples
+
+static const char *class_names[] = {
+  [HTTP_CLASS_CRITICAL] = "critical",
+  [HTTP_CLASS_NORMAL]   = "normal",
+  [HTTP_CLASS_LOW]      = "low",
+};
+
+#define HTTP_CLASS_num (sizeof(class_names) / sizeof(class_names[0]))
+
+// Share of the limit each class may use
+static const double class_share[HTTP_CLASS_num] = {
+  [HTTP_CLASS_CRITICAL] = 1.0,
+  [HTTP_CLASS_NORMAL]   = 0.9,
+  [HTTP_CLASS_LOW]      = 0.5,
+};
+
+int http_limiter_enabled;
+
+static pthread_mutex_t hl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int hl_limit;
+static int hl_min_limit;
+static int hl_max_limit;
+static int64_t hl_target_delay;
+static double hl_tolerance;
+static strvec_t hl_routes[HTTP_CLASS_num];
+
+static int hl_inflight;
+
+// Current window
+static int64_t hl_window_start;
+static int hl_samples;
+static int64_t hl_queue_delay_sum;
+static int64_t hl_latency_sum;
+static int hl_max_inflight;
+
+static double hl_latency_long;  // Moving average of handler latency
+
+static uint64_t hl_admitted[HTTP_CLASS_num];
+static uint64_t hl_shed[HTTP_CLASS_num];
+
+
+/**
+ *
+ */
+void
+http_limiter_init(cfg_t *c)
+{
+  hl_min_limit = MAX(cfg_get_int(c, CFG("minLimit"), 4), 1);
+  hl_max_limit = MAX(cfg_get_int(c, CFG("maxLimit"), 1024), hl_min_limit);
+  hl_limit = cfg_get_int(c, CFG("initialLimit"), 32);
+  hl_limit = MIN(MAX(hl_limit, hl_min_limit), hl_max_limit);
+  hl_target_delay = cfg_get_int(c, CFG("targetQueueDelay"), 20) * 1000LL;
+  hl_tolerance = cfg_get_dbl(c, CFG("latencyTolerance"), 2.0);
+
+  for(int i = 0; i < HTTP_CLASS_num; i++)
+    cfg_get_strvec(c, class_names[i], &hl_routes[i]);
+
+  hl_window_start = asyncio_now();
+  http_limiter_enabled = 1;
+  trace(LOG_INFO, "HTTP concurrency limit: %d (%d - %d), "
+        "target queue delay %dms", hl_limit, hl_min_limit, hl_max_limit,
+        (int)(hl_target_delay / 1000));
+}
+
+
+/**
+ *
+ */
+int
+http_limiter_class(const char *path)
+{
+  for(int i = 0; i < HTTP_CLASS_num; i++)
+    if(strvec_find(&hl_routes[i], path) >= 0)
+      return i;
+  return HTTP_CLASS_NORMAL;
+}
+
+
+/**
+ *
+ */
+int
+http_limiter_acquire(int cls)
+{
+  int r = 0;
+
+  pthread_mutex_lock(&hl_mutex);
+  const int cap = MAX(hl_limit * class_share[cls], 1);
+  if(hl_inflight >= cap) {
+    hl_shed[cls]++;
+    r = -1;
+  } else {
+    hl_admitted[cls]++;
+    hl_inflight++;
+    hl_max_inflight = MAX(hl_max_inflight, hl_inflight);
+  }
+  pthread_mutex_unlock(&hl_mutex);
+  return r;
+}
+
+
+/**
+ * Called with hl_mutex held
+ */
+static void
+http_limiter_update(int64_t now)
+{
+  const int64_t queue_delay = hl_queue_delay_sum / hl_samples;
+  const double latency = (double)hl_latency_sum / hl_samples;
+
+  if(hl_latency_long == 0)
+    hl_latency_long = latency;
+
+  if(queue_delay > hl_target_delay) {
+    // The further off, the harder we back off
+    const double f = (double)hl_target_delay / queue_delay;
+    hl_limit = MAX(hl_limit * MIN(MAX(f, 0.5), 0.9), hl_min_limit);
+  } else if(latency > hl_latency_long * hl_tolerance) {
+    hl_limit = MAX(hl_limit * 0.9, hl_min_limit);
+  } else if(hl_max_inflight * 2 >= hl_limit)
+    hl_limit = MIN(hl_limit + MAX((int)sqrt(hl_limit), 1), hl_max_limit);
+
+  // Follows slowly so it only catches sudden changes
+  hl_latency_long = hl_latency_long * 0.95 + latency * 0.05;
+
+  hl_window_start = now;
+  hl_samples = 0;
+  hl_queue_delay_sum = 0;
+  hl_latency_sum = 0;
+  hl_max_inflight = hl_inflight;
+}
+
+
+/**
+ *
+ */
+void
+http_limiter_release(int64_t queue_delay, int64_t latency)
+{
+  const int64_t now = asyncio_now();
+
+  pthread_mutex_lock(&hl_mutex);
+  hl_inflight--;
+  if(queue_delay >= 0) {
+    hl_samples++;
+    hl_queue_delay_sum += queue_delay;
+    hl_latency_sum += latency;
+  }
+
+  const int64_t elapsed = now - hl_window_start;
+  if(hl_samples &&
+     ((elapsed >= HTTP_LIMITER_WINDOW && hl_samples >= 10) ||
+      elapsed >= HTTP_LIMITER_MAX_WINDOW))
+    http_limiter_update(now);
+  pthread_mutex_unlock(&hl_mutex);
+}
+
+
+/**
+ *
+ */
+void
+http_limiter_prometheus(mbuf_t *out)
+{
+  if(!http_limiter_enabled)
+    return;
+
+  pthread_mutex_lock(&hl_mutex);
+  mbuf_qprintf(out, "# TYPE http_concurrency_limit gauge\n"
+               "http_concurrency_limit %d\n", hl_limit);
+  mbuf_qprintf(out, "# TYPE http_concurrency_inflight gauge\n"
+               "http_concurrency_inflight %d\n", hl_inflight);
+
+  mbuf_qprintf(out, "# TYPE http_concurrency_admitted_total counter\n");
+  for(int i = 0; i < HTTP_CLASS_num; i++)
+    mbuf_qprintf(out, "http_concurrency_admitted_total{class=\"%s\"} "
+                 "%"PRIu64"\n", class_names[i], hl_admitted[i]);
+
+  mbuf_qprintf(out, "# TYPE http_concurrency_shed_total counter\n");
+  for(int i = 0; i < HTTP_CLASS_num; i++)
+    mbuf_qprintf(out, "http_concurrency_shed_total{class=\"%s\"} "
+                 "%"PRIu64"\n", class_names[i], hl_shed[i]);
+  pthread_mutex_unlock(&hl_mutex);
+}
+
+
+/**
+ *
+ */
+ntv_t *
+http_limiter_ntv(void)
+{
+  if(!http_limiter_enabled)
+    return NULL;
+
+  ntv_t *m = ntv_create_map();
+  ntv_t *admitted = ntv_create_map();
+  ntv_t *shed = ntv_create_map();
+
+  pthread_mutex_lock(&hl_mutex);
+  ntv_set_int(m, "limit", hl_limit);
+  ntv_set_int(m, "inflight", hl_inflight);
+  ntv_set_int64(m, "latencyAverage", hl_latency_long);
+  for(int i = 0; i < HTTP_CLASS_num; i++) {
+    ntv_set_int64(admitted, class_names[i], hl_admitted[i]);
+    ntv_set_int64(shed, class_names[i], hl_shed[i]);
+  }
+  pthread_mutex_unlock(&hl_mutex);
+
+  ntv_set_ntv(m, "admitted", admitted);
+  ntv_set_ntv(m, "shed", shed);
+  return m;
+}
@@ -0,0 +1,85 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+struct htsmsg;
+struct mbuf;
+struct ntv;
+
+/**
+ * Adaptive concurrency limit for requests dispatched to worker threads
+ *
+ * Enabled by configuring http.concurrency:
+ *
+ *  "concurrency": {
+ *    "initialLimit": 32,
+ *    "minLimit": 4,
+ *    "maxLimit": 1024,
+ *    "targetQueueDelay": 20,    // ms
+ *    "latencyTolerance": 2.0,
+ *    "critical": ["/health$"],
+ *    "low": ["/report/{id}$"]
+ *  }
+ *
+ * Requests are counted from when they are queued until they are done.
+ * Every 100ms the limit is adjusted (AIMD) from the requests finished
+ * since last time: if their average queue delay (received until a
+ * thread picked them up) exceeds targetQueueDelay, or their average
+ * handler latency exceeds latencyTolerance times the long term average,
+ * the limit is cut by 10% (or up to half, in proportion to how far the
+ * queue delay is over target). Otherwise it grows by sqrt(limit) as long
+ * as at least half of it is in use.
+ *
+ * Requests over the limit are replied to with 503 and Retry-After right
+ * away. Routes (listed with the same path they were added with) are
+ * assigned a class. Critical routes may use all of the limit, normal
+ * ones 90% and low priority ones 50%, so the latter are shed first.
+ * Nonblocking routes and streamed request bodies are not limited.
+ */
+
+#define HTTP_CLASS_CRITICAL 0
+#define HTTP_CLASS_NORMAL   1
+#define HTTP_CLASS_LOW      2
+
+extern int http_limiter_enabled;
+
+// Called by http_server_init() with the http.concurrency map
+void http_limiter_init(struct htsmsg *c);
+
+int http_limiter_class(const char *path);
+
+/**
+ * Returns -1 if the request should be shed, otherwise
+ * http_limiter_release() must be called when the request is done.
+ * 'queue_delay' is -1 if the request never got to a thread
+ */
+int http_limiter_acquire(int cls);
+
+void http_limiter_release(int64_t queue_delay, int64_t latency);
+
+void http_limiter_prometheus(struct mbuf *out);
+
+struct ntv *http_limiter_ntv(void);
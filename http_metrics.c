@@ -0,0 +1,516 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <alloca.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "queue.h"
+#include "mbuf.h"
+#include "ntv.h"
+#include "http_parser.h"
+#include "http_metrics.h"
+
+#define HTTP_METRICS_MAX_ROUTES 1024
+
+#define HIST_SUB_BITS  3
+#define HIST_SUB       (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS   256    // Up to ~4.7 hours in µs
+
+enum {
+  PHASE_QUEUE,
+  PHASE_HANDLER,
+  PHASE_TOTAL,
+  PHASE_num,
+};
+
+static const char *phase_names[PHASE_num] = {
+  [PHASE_QUEUE]   = "queue",
+  [PHASE_HANDLER] = "handler",
+  [PHASE_TOTAL]   = "total",
+};
+
+typedef struct route_metrics {
+  uint64_t rm_status[5];     // 1xx - 5xx
+  uint64_t rm_bytes_in;
+  uint64_t rm_bytes_out;
+  uint64_t rm_sum[PHASE_num];
+  uint64_t rm_hist[PHASE_num][HIST_BUCKETS];
+} route_metrics_t;
+
+
+/**
+ * Counters for one thread. Only written by the owning thread
+ */
+typedef struct metrics_thread {
+  LIST_ENTRY(metrics_thread) mt_link;
+  route_metrics_t *mt_routes[HTTP_METRICS_MAX_ROUTES];
+} metrics_thread_t;
+
+LIST_HEAD(metrics_thread_list, metrics_thread);
+
+static pthread_mutex_t metrics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_thread_list metrics_threads;
+static pthread_key_t metrics_key;
+
+// Counts from threads that have exited
+static route_metrics_t *metrics_retired[HTTP_METRICS_MAX_ROUTES];
+
+static char *metrics_route_names[HTTP_METRICS_MAX_ROUTES];
+static int metrics_route_methods[HTTP_METRICS_MAX_ROUTES];
+static int metrics_num_routes;
+
+
+// Single writer, readers may see a stale but never a torn value
+#define METRIC_ADD(x, v) \
+  __atomic_store_n(&(x), (x) + (v), __ATOMIC_RELAXED)
+
+#define METRIC_GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+
+/**
+ *
+ */
+static int
+hist_bucket(uint64_t v)
+{
+  if(v < HIST_SUB)
+    return v;
+
+  const int msb = 63 - __builtin_clzll(v);
+  const int idx = (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+    ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+  return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+
+/**
+ * Largest value that ends up in bucket 'idx'
+ */
+static uint64_t
+hist_bucket_max(int idx)
+{
+  if(idx < HIST_SUB)
+    return idx;
+
+  const int shift = idx / HIST_SUB - 1;
+  const uint64_t lower = (uint64_t)(HIST_SUB + idx % HIST_SUB) << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+
+/**
+ *
+ */
+static void
+route_metrics_add(route_metrics_t *dst, const route_metrics_t *src)
+{
+  for(int i = 0; i < 5; i++)
+    dst->rm_status[i] += METRIC_GET(src->rm_status[i]);
+  dst->rm_bytes_in += METRIC_GET(src->rm_bytes_in);
+  dst->rm_bytes_out += METRIC_GET(src->rm_bytes_out);
+  for(int p = 0; p < PHASE_num; p++) {
+    dst->rm_sum[p] += METRIC_GET(src->rm_sum[p]);
+    for(int i = 0; i < HIST_BUCKETS; i++)
+      dst->rm_hist[p][i] += METRIC_GET(src->rm_hist[p][i]);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+metrics_thread_exit(void *aux)
+{
+  metrics_thread_t *mt = aux;
+
+  pthread_mutex_lock(&metrics_mutex);
+  LIST_REMOVE(mt, mt_link);
+  for(int i = 0; i < HTTP_METRICS_MAX_ROUTES; i++) {
+    if(mt->mt_routes[i] == NULL)
+      continue;
+    if(metrics_retired[i] == NULL)
+      metrics_retired[i] = calloc(1, sizeof(route_metrics_t));
+    route_metrics_add(metrics_retired[i], mt->mt_routes[i]);
+    free(mt->mt_routes[i]);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  free(mt);
+}
+
+
+/**
+ *
+ */
+static void __attribute__((constructor))
+http_metrics_init(void)
+{
+  pthread_key_create(&metrics_key, metrics_thread_exit);
+  metrics_route_names[0] = strdup("(unmatched)");
+  metrics_route_methods[0] = -1;
+  metrics_num_routes = 1;
+}
+
+
+/**
+ *
+ */
+int
+http_metrics_register(const char *route, int method)
+{
+  int id = 0;
+
+  pthread_mutex_lock(&metrics_mutex);
+  if(metrics_num_routes < HTTP_METRICS_MAX_ROUTES) {
+    id = metrics_num_routes;
+    metrics_route_names[id] = strdup(route);
+    metrics_route_methods[id] = method;
+    __atomic_store_n(&metrics_num_routes, id + 1, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  return id;
+}
+
+
+/**
+ *
+ */
+static route_metrics_t *
+route_metrics_get(int id)
+{
+  metrics_thread_t *mt = pthread_getspecific(metrics_key);
+
+  if(mt == NULL) {
+    mt = calloc(1, sizeof(metrics_thread_t));
+    pthread_setspecific(metrics_key, mt);
+    pthread_mutex_lock(&metrics_mutex);
+    LIST_INSERT_HEAD(&metrics_threads, mt, mt_link);
+    pthread_mutex_unlock(&metrics_mutex);
+  }
+
+  route_metrics_t *rm = mt->mt_routes[id];
+  if(rm == NULL) {
+    rm = calloc(1, sizeof(route_metrics_t));
+    __atomic_store_n(&mt->mt_routes[id], rm, __ATOMIC_RELEASE);
+  }
+  return rm;
+}
+
+
+/**
+ *
+ */
+void
+http_metrics_record(int id, int status, int64_t bytes_in,
+                    int64_t bytes_out, int64_t received,
+                    int64_t process, int64_t done)
+{
+  if(id < 0 || id >= HTTP_METRICS_MAX_ROUTES)
+    id = 0;
+
+  route_metrics_t *rm = route_metrics_get(id);
+
+  const int class = status / 100 - 1;
+  if(class >= 0 && class < 5)
+    METRIC_ADD(rm->rm_status[class], 1);
+
+  METRIC_ADD(rm->rm_bytes_in, bytes_in > 0 ? bytes_in : 0);
+  METRIC_ADD(rm->rm_bytes_out, bytes_out > 0 ? bytes_out : 0);
+
+  if(process < received)
+    process = received;
+  if(done < process)
+    done = process;
+
+  const uint64_t t[PHASE_num] = {
+    [PHASE_QUEUE]   = process - received,
+    [PHASE_HANDLER] = done - process,
+    [PHASE_TOTAL]   = done - received,
+  };
+
+  for(int p = 0; p < PHASE_num; p++) {
+    METRIC_ADD(rm->rm_sum[p], t[p]);
+    METRIC_ADD(rm->rm_hist[p][hist_bucket(t[p])], 1);
+  }
+}
+
+
+/**
+ * Sum of all threads for route 'id'. Returns number of requests
+ */
+static uint64_t
+route_metrics_collect(route_metrics_t *rm, int id)
+{
+  const metrics_thread_t *mt;
+  memset(rm, 0, sizeof(route_metrics_t));
+
+  LIST_FOREACH(mt, &metrics_threads, mt_link) {
+    const route_metrics_t *src =
+      __atomic_load_n(&mt->mt_routes[id], __ATOMIC_ACQUIRE);
+    if(src != NULL)
+      route_metrics_add(rm, src);
+  }
+  if(metrics_retired[id] != NULL)
+    route_metrics_add(rm, metrics_retired[id]);
+
+  uint64_t count = 0;
+  for(int i = 0; i < HIST_BUCKETS; i++)
+    count += rm->rm_hist[PHASE_TOTAL][i];
+  return count;
+}
+
+
+/**
+ *
+ */
+static uint64_t
+hist_percentile(const uint64_t *hist, uint64_t count, double q)
+{
+  uint64_t rank = count * q;
+  if(rank >= count)
+    rank = count - 1;
+  uint64_t acc = 0;
+
+  for(int i = 0; i < HIST_BUCKETS; i++) {
+    acc += hist[i];
+    if(acc > rank)
+      return hist_bucket_max(i);
+  }
+  return hist_bucket_max(HIST_BUCKETS - 1);
+}
+
+
+/**
+ *
+ */
+static const char *
+method_name(int method)
+{
+  return method < 0 ? "*" : http_method_str(method);
+}
+
+
+/**
+ * Label values are escaped as per the text exposition format
+ */
+static void
+prom_label(mbuf_t *out, const char *route, int method)
+{
+  mbuf_append(out, "{route=\"", 8);
+  for(; *route; route++) {
+    if(*route == '"' || *route == '\\')
+      mbuf_append(out, "\\", 1);
+    mbuf_append(out, route, 1);
+  }
+  mbuf_qprintf(out, "\",method=\"%s\"", method_name(method));
+}
+
+
+// Bucket bounds in the Prometheus output, µs
+static const uint64_t prom_buckets[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000,
+  100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000
+};
+
+
+/**
+ * Snapshot of all routes that have seen requests. Entries for routes
+ * without requests are NULL
+ */
+static route_metrics_t **
+metrics_snapshot(int num_routes, uint64_t *counts)
+{
+  route_metrics_t **all = calloc(num_routes, sizeof(route_metrics_t *));
+
+  pthread_mutex_lock(&metrics_mutex);
+  for(int id = 0; id < num_routes; id++) {
+    route_metrics_t *rm = malloc(sizeof(route_metrics_t));
+    counts[id] = route_metrics_collect(rm, id);
+    if(counts[id])
+      all[id] = rm;
+    else
+      free(rm);
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  return all;
+}
+
+
+/**
+ *
+ */
+static void
+metrics_snapshot_free(route_metrics_t **all, int num_routes)
+{
+  for(int id = 0; id < num_routes; id++)
+    free(all[id]);
+  free(all);
+}
+
+
+/**
+ * Samples of a metric family must be grouped together so each family
+ * is written for all routes before moving on to the next
+ */
+void
+http_metrics_prometheus(mbuf_t *out)
+{
+  const int num_routes =
+    __atomic_load_n(&metrics_num_routes, __ATOMIC_ACQUIRE);
+  uint64_t *counts = alloca(num_routes * sizeof(uint64_t));
+  route_metrics_t **all = metrics_snapshot(num_routes, counts);
+
+  mbuf_qprintf(out, "# TYPE http_requests_total counter\n");
+  for(int id = 0; id < num_routes; id++) {
+    const route_metrics_t *rm = all[id];
+    if(rm == NULL)
+      continue;
+    for(int i = 0; i < 5; i++) {
+      if(rm->rm_status[i] == 0)
+        continue;
+      mbuf_qprintf(out, "http_requests_total");
+      prom_label(out, metrics_route_names[id], metrics_route_methods[id]);
+      mbuf_qprintf(out, ",code=\"%dxx\"} %"PRIu64"\n",
+                   i + 1, rm->rm_status[i]);
+    }
+  }
+
+  mbuf_qprintf(out, "# TYPE http_request_body_bytes_total counter\n");
+  for(int id = 0; id < num_routes; id++) {
+    if(all[id] == NULL)
+      continue;
+    mbuf_qprintf(out, "http_request_body_bytes_total");
+    prom_label(out, metrics_route_names[id], metrics_route_methods[id]);
+    mbuf_qprintf(out, "} %"PRIu64"\n", all[id]->rm_bytes_in);
+  }
+
+  mbuf_qprintf(out, "# TYPE http_response_body_bytes_total counter\n");
+  for(int id = 0; id < num_routes; id++) {
+    if(all[id] == NULL)
+      continue;
+    mbuf_qprintf(out, "http_response_body_bytes_total");
+    prom_label(out, metrics_route_names[id], metrics_route_methods[id]);
+    mbuf_qprintf(out, "} %"PRIu64"\n", all[id]->rm_bytes_out);
+  }
+
+  mbuf_qprintf(out, "# TYPE http_request_duration_seconds histogram\n");
+  for(int id = 0; id < num_routes; id++) {
+    const route_metrics_t *rm = all[id];
+    if(rm == NULL)
+      continue;
+    const char *route = metrics_route_names[id];
+    const int method = metrics_route_methods[id];
+
+    for(int p = 0; p < PHASE_num; p++) {
+      const uint64_t *hist = rm->rm_hist[p];
+      uint64_t acc = 0;
+      int i = 0;
+
+      for(int b = 0; b < sizeof(prom_buckets) / sizeof(prom_buckets[0]);
+          b++) {
+        for(; i < HIST_BUCKETS && hist_bucket_max(i) <= prom_buckets[b]; i++)
+          acc += hist[i];
+        mbuf_qprintf(out, "http_request_duration_seconds_bucket");
+        prom_label(out, route, method);
+        mbuf_qprintf(out, ",phase=\"%s\",le=\"%g\"} %"PRIu64"\n",
+                     phase_names[p], prom_buckets[b] / 1e6, acc);
+      }
+
+      mbuf_qprintf(out, "http_request_duration_seconds_bucket");
+      prom_label(out, route, method);
+      mbuf_qprintf(out, ",phase=\"%s\",le=\"+Inf\"} %"PRIu64"\n",
+                   phase_names[p], counts[id]);
+
+      mbuf_qprintf(out, "http_request_duration_seconds_sum");
+      prom_label(out, route, method);
+      mbuf_qprintf(out, ",phase=\"%s\"} %g\n",
+                   phase_names[p], rm->rm_sum[p] / 1e6);
+
+      mbuf_qprintf(out, "http_request_duration_seconds_count");
+      prom_label(out, route, method);
+      mbuf_qprintf(out, ",phase=\"%s\"} %"PRIu64"\n",
+                   phase_names[p], counts[id]);
+    }
+  }
+
+  metrics_snapshot_free(all, num_routes);
+}
+
+
+/**
+ * Latencies in µs
+ */
+ntv_t *
+http_metrics_ntv(void)
+{
+  const int num_routes =
+    __atomic_load_n(&metrics_num_routes, __ATOMIC_ACQUIRE);
+  uint64_t *counts = alloca(num_routes * sizeof(uint64_t));
+  route_metrics_t **all = metrics_snapshot(num_routes, counts);
+  ntv_t *routes = ntv_create_list();
+
+  for(int id = 0; id < num_routes; id++) {
+    const route_metrics_t *rm = all[id];
+    if(rm == NULL)
+      continue;
+    const uint64_t count = counts[id];
+
+    ntv_t *r = ntv_create_map();
+    ntv_set_str(r, "route", metrics_route_names[id]);
+    ntv_set_str(r, "method", method_name(metrics_route_methods[id]));
+    ntv_set_int64(r, "requests", count);
+
+    ntv_t *status = ntv_create_map();
+    for(int i = 0; i < 5; i++) {
+      char key[4] = {'1' + i, 'x', 'x', 0};
+      ntv_set_int64(status, key, rm->rm_status[i]);
+    }
+    ntv_set_ntv(r, "status", status);
+    ntv_set_int64(r, "bytesIn", rm->rm_bytes_in);
+    ntv_set_int64(r, "bytesOut", rm->rm_bytes_out);
+
+    ntv_t *latency = ntv_create_map();
+    for(int p = 0; p < PHASE_num; p++) {
+      const uint64_t *hist = rm->rm_hist[p];
+      ntv_t *l = ntv_create_map();
+      ntv_set_int64(l, "mean", rm->rm_sum[p] / count);
+      ntv_set_int64(l, "p50", hist_percentile(hist, count, 0.5));
+      ntv_set_int64(l, "p90", hist_percentile(hist, count, 0.9));
+      ntv_set_int64(l, "p99", hist_percentile(hist, count, 0.99));
+      ntv_set_int64(l, "p999", hist_percentile(hist, count, 0.999));
+      ntv_set_int64(l, "max", hist_percentile(hist, count, 1.0));
+      ntv_set_ntv(latency, phase_names[p], l);
+    }
+    ntv_set_ntv(r, "latency", latency);
+    ntv_set_ntv(routes, NULL, r);
+  }
+
+  metrics_snapshot_free(all, num_routes);
+
+  ntv_t *m = ntv_create_map();
+  ntv_set_ntv(m, "routes", routes);
+  return m;
+}
@@ -0,0 +1,53 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stdint.h>
+
+struct mbuf;
+struct ntv;
+
+/**
+ * Per route request metrics
+ *
+ * Each route registers a metrics id. Completed requests are recorded in
+ * per-thread counters and log-linear latency histograms (8 buckets per
+ * power of two, so ~12% resolution) that only the owning thread writes
+ * to, readers sum over all threads without locking the writers out.
+ *
+ * Latency is split in queue time (received until processing started),
+ * handler time (processing until done) and total.
+ *
+ * Id 0 is used for requests that don't match any route.
+ */
+
+int http_metrics_register(const char *route, int method);
+
+void http_metrics_record(int id, int status, int64_t bytes_in,
+                         int64_t bytes_out, int64_t received,
+                         int64_t process, int64_t done);
+
+void http_metrics_prometheus(struct mbuf *out);
+
+struct ntv *http_metrics_ntv(void);
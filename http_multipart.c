@@ -0,0 +1,369 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/param.h>
+
+#include "http_multipart.h"
+
+#define HTTP_MULTIPART_MAX_BOUNDARY 70    // RFC 2046
+#define HTTP_MULTIPART_MAX_HEADERS  8192
+#define HTTP_MULTIPART_MAX_PADDING  256
+
+typedef enum {
+  HM_PREAMBLE,
+  HM_BOUNDARY,   // Delimiter seen, close delimiter or CRLF follows
+  HM_HEADERS,
+  HM_DATA,
+  HM_EPILOGUE,
+  HM_ERROR,
+} http_multipart_state_t;
+
+struct http_multipart {
+  http_multipart_state_t hm_state;
+  const http_multipart_callbacks_t *hm_callbacks;
+  void *hm_opaque;
+
+  // Input left over from the previous feed, at most a partial
+  // delimiter in HM_DATA or the headers of a part in HM_HEADERS
+  char *hm_buf;
+  size_t hm_len;
+  size_t hm_size;
+
+  size_t hm_delim_len;
+  char hm_delim[4 + HTTP_MULTIPART_MAX_BOUNDARY + 1];  // CRLF--boundary
+};
+
+
+/**
+ * Value of a parameter in a header such as
+ * Content-Disposition: form-data; name="foo"; filename="bar.txt"
+ *
+ * 'hdr' is modified in place, returned string points into it
+ */
+static char *
+header_param(char *hdr, const char *param)
+{
+  const size_t plen = strlen(param);
+  char *s = hdr;
+
+  while((s = strchr(s, ';')) != NULL) {
+    s++;
+    s += strspn(s, " \t");
+    if(strncasecmp(s, param, plen) || s[plen] != '=')
+      continue;
+    s += plen + 1;
+    if(*s == '"') {
+      char *d = ++s, *r = s;
+      for(; *r && *r != '"'; r++) {
+        if(*r == '\\' && r[1])
+          r++;
+        *d++ = *r;
+      }
+      *d = 0;
+    } else {
+      s[strcspn(s, "; \t")] = 0;
+    }
+    return s;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+http_multipart_t *
+http_multipart_create(const char *content_type,
+                      const http_multipart_callbacks_t *callbacks,
+                      void *opaque)
+{
+  if(strncasecmp(content_type, "multipart/form-data", 19) ||
+     (content_type[19] != ';' && content_type[19] != ' '))
+    return NULL;
+
+  char *ct = strdupa(content_type);
+  const char *boundary = header_param(ct, "boundary");
+  if(boundary == NULL || !*boundary ||
+     strlen(boundary) > HTTP_MULTIPART_MAX_BOUNDARY)
+    return NULL;
+
+  http_multipart_t *hm = calloc(1, sizeof(http_multipart_t));
+  hm->hm_callbacks = callbacks;
+  hm->hm_opaque = opaque;
+  hm->hm_delim_len = snprintf(hm->hm_delim, sizeof(hm->hm_delim),
+                              "\r\n--%s", boundary);
+
+  // The first delimiter is not preceded by CRLF unless there is a
+  // preamble, pretend there always is one
+  hm->hm_size = hm->hm_delim_len * 2;
+  hm->hm_buf = malloc(hm->hm_size);
+  memcpy(hm->hm_buf, "\r\n", 2);
+  hm->hm_len = 2;
+  return hm;
+}
+
+
+/**
+ *
+ */
+void
+http_multipart_destroy(http_multipart_t *hm)
+{
+  free(hm->hm_buf);
+  free(hm);
+}
+
+
+/**
+ *
+ */
+static int
+http_multipart_headers(http_multipart_t *hm, char *hdrs)
+{
+  http_multipart_part_t hmp = {};
+  char *line, *next;
+
+  for(line = hdrs; *line; line = next) {
+    next = strstr(line, "\r\n");
+    if(next != NULL) {
+      *next = 0;
+      next += 2;
+    } else {
+      next = line + strlen(line);
+    }
+
+    char *value = strchr(line, ':');
+    if(value == NULL)
+      return -1;
+    *value++ = 0;
+    value += strspn(value, " \t");
+
+    if(!strcasecmp(line, "content-disposition")) {
+      if(strncasecmp(value, "form-data", 9))
+        return -1;
+      // header_param() terminates the value it finds, so use a copy
+      hmp.hmp_filename = header_param(strdupa(value), "filename");
+      hmp.hmp_name = header_param(value, "name");
+    } else if(!strcasecmp(line, "content-type")) {
+      hmp.hmp_content_type = value;
+    }
+  }
+
+  if(hmp.hmp_name == NULL)
+    return -1;
+
+  return hm->hm_callbacks->part_begin(hm->hm_opaque, &hmp);
+}
+
+
+/**
+ * Consume as much of 'buf' as possible, the number of bytes used is
+ * returned in 'usedp'. 'buf' is not modified. Returns -1 if malformed
+ * or a callback's error
+ */
+static int
+http_multipart_process(http_multipart_t *hm, const char *data, size_t size,
+                       size_t *usedp)
+{
+  const http_multipart_callbacks_t *cb = hm->hm_callbacks;
+  size_t used = 0;
+  int r = 0;
+
+  while(!r && used < size) {
+    const char *buf = data + used;
+    const size_t len = size - used;
+
+    switch(hm->hm_state) {
+    case HM_PREAMBLE:
+    case HM_DATA: {
+      const char *d = memmem(buf, len, hm->hm_delim, hm->hm_delim_len);
+      size_t avail;
+      if(d != NULL) {
+        avail = d - buf;
+      } else if(len >= hm->hm_delim_len) {
+        // Keep what could be the start of a delimiter
+        avail = len - (hm->hm_delim_len - 1);
+      } else {
+        goto out;
+      }
+
+      if(hm->hm_state == HM_DATA && avail)
+        r = cb->part_data(hm->hm_opaque, buf, avail);
+      used += avail;
+
+      if(d == NULL)
+        goto out;
+
+      if(!r && hm->hm_state == HM_DATA)
+        r = cb->part_end(hm->hm_opaque);
+      used += hm->hm_delim_len;
+      hm->hm_state = HM_BOUNDARY;
+      break;
+    }
+
+    case HM_BOUNDARY: {
+      if(len < 2)
+        goto out;
+      if(buf[0] == '-' && buf[1] == '-') {
+        hm->hm_state = HM_EPILOGUE;
+        used += 2;
+        break;
+      }
+      // Transport padding, then CRLF
+      size_t pad = 0;
+      while(pad < len && (buf[pad] == ' ' || buf[pad] == '\t'))
+        pad++;
+      if(pad + 2 > len) {
+        if(len > HTTP_MULTIPART_MAX_PADDING)
+          return -1;
+        goto out;
+      }
+      if(buf[pad] != '\r' || buf[pad + 1] != '\n')
+        return -1;
+      used += pad + 2;
+      hm->hm_state = HM_HEADERS;
+      break;
+    }
+
+    case HM_HEADERS: {
+      if(len >= 2 && buf[0] == '\r' && buf[1] == '\n') {
+        // No headers at all, can't tell what the part is
+        return -1;
+      }
+      const char *e = memmem(buf, len, "\r\n\r\n", 4);
+      if(e == NULL) {
+        if(len > HTTP_MULTIPART_MAX_HEADERS)
+          return -1;
+        goto out;
+      }
+      const size_t hlen = e - buf;
+      if(hlen > HTTP_MULTIPART_MAX_HEADERS || memchr(buf, 0, hlen))
+        return -1;
+      // Parsed in place, so work on a copy
+      char hdrs[HTTP_MULTIPART_MAX_HEADERS + 1];
+      memcpy(hdrs, buf, hlen);
+      hdrs[hlen] = 0;
+      r = http_multipart_headers(hm, hdrs);
+      used += hlen + 4;
+      hm->hm_state = HM_DATA;
+      break;
+    }
+
+    case HM_EPILOGUE:
+      used = size;
+      break;
+
+    case HM_ERROR:
+      return -1;
+    }
+  }
+ out:
+  *usedp = used;
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+http_multipart_append(http_multipart_t *hm, const char *data, size_t len)
+{
+  if(hm->hm_len + len > hm->hm_size) {
+    hm->hm_size = hm->hm_len + len;
+    hm->hm_buf = realloc(hm->hm_buf, hm->hm_size);
+  }
+  memcpy(hm->hm_buf + hm->hm_len, data, len);
+  hm->hm_len += len;
+}
+
+
+/**
+ * Input is scanned where it is, only what can't be consumed yet (such
+ * as the start of a delimiter at the end of 'data') is copied. Such a
+ * leftover is completed with a few bytes of the next input, once it has
+ * been consumed scanning continues in the caller's buffer
+ */
+int
+http_multipart_feed(http_multipart_t *hm, const void *data, size_t len)
+{
+  const char *src = data;
+  size_t used;
+  int r;
+
+  if(hm->hm_state == HM_ERROR)
+    return -1;
+
+  while(len > 0) {
+    if(hm->hm_len == 0) {
+      r = http_multipart_process(hm, src, len, &used);
+      if(r)
+        goto bad;
+      http_multipart_append(hm, src + used, len - used);
+      return 0;
+    }
+
+    // A partial delimiter is always completed by hm_delim_len more bytes
+    const size_t prev = hm->hm_len;
+    const size_t chunk = MIN(len, hm->hm_state == HM_DATA ||
+                             hm->hm_state == HM_PREAMBLE ?
+                             hm->hm_delim_len : 512);
+    http_multipart_append(hm, src, chunk);
+
+    r = http_multipart_process(hm, hm->hm_buf, hm->hm_len, &used);
+    if(r)
+      goto bad;
+
+    if(used >= prev) {
+      // Leftover consumed, rescan the rest of the chunk from 'src'
+      hm->hm_len = 0;
+      src += used - prev;
+      len -= used - prev;
+    } else {
+      hm->hm_len -= used;
+      memmove(hm->hm_buf, hm->hm_buf + used, hm->hm_len);
+      src += chunk;
+      len -= chunk;
+    }
+  }
+  return 0;
+
+ bad:
+  hm->hm_state = HM_ERROR;
+  return r;
+}
+
+
+/**
+ *
+ */
+int
+http_multipart_finish(http_multipart_t *hm)
+{
+  return hm->hm_state == HM_EPILOGUE ? 0 : -1;
+}
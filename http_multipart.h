@@ -0,0 +1,72 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * Incremental multipart/form-data parser (RFC 7578)
+ *
+ * Body data is fed as it arrives, in pieces of any size. Part payloads
+ * are passed on as they're found and never buffered beyond what's
+ * needed to tell them apart from the boundary.
+ *
+ * The callbacks return 0 to continue, anything else aborts parsing and
+ * is returned from http_multipart_feed().
+ */
+
+typedef struct http_multipart http_multipart_t;
+
+typedef struct http_multipart_part {
+  const char *hmp_name;
+  const char *hmp_filename;      // NULL unless it's a file
+  const char *hmp_content_type;  // NULL if not given
+} http_multipart_part_t;
+
+typedef struct http_multipart_callbacks {
+  int (*part_begin)(void *opaque, const http_multipart_part_t *hmp);
+  int (*part_data)(void *opaque, const void *data, size_t len);
+  int (*part_end)(void *opaque);
+} http_multipart_callbacks_t;
+
+/**
+ * Returns NULL if 'content_type' is not multipart/form-data or lacks
+ * a boundary
+ */
+http_multipart_t *
+http_multipart_create(const char *content_type,
+                      const http_multipart_callbacks_t *callbacks,
+                      void *opaque);
+
+/**
+ * Returns 0, -1 if the body is malformed or a callback's return value
+ */
+int http_multipart_feed(http_multipart_t *hm, const void *data, size_t len);
+
+/**
+ * Returns -1 if the final boundary was not seen
+ */
+int http_multipart_finish(http_multipart_t *hm);
+
+void http_multipart_destroy(http_multipart_t *hm);
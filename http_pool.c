@@ -0,0 +1,281 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+#include "queue.h"
+#include "cfg.h"
+#include "mbuf.h"
+#include "ntv.h"
+#include "strvec.h"
+#include "task.h"
+#include "trace.h"
+#include "http_pool.h"
+
+typedef enum {
+  HTTP_POOL_QUEUE,
+  HTTP_POOL_SHED,
+  HTTP_POOL_BORROW,
+} http_pool_overflow_t;
+
+static const char *overflow_names[] = {
+  [HTTP_POOL_QUEUE]  = "queue",
+  [HTTP_POOL_SHED]   = "shed",
+  [HTTP_POOL_BORROW] = "borrow",
+};
+
+struct http_pool {
+  LIST_ENTRY(http_pool) hp_link;
+  char *hp_name;
+  task_pool_t *hp_task_pool;
+  int hp_queue_size;
+  http_pool_overflow_t hp_overflow;
+  strvec_t hp_routes;
+
+  // Times the overflow policy applied, updated with __atomic ops
+  uint64_t hp_overflows;
+};
+
+static LIST_HEAD(, http_pool) http_pools;
+
+
+/**
+ *
+ */
+static http_pool_t *
+http_pool_find(const char *name)
+{
+  http_pool_t *hp;
+  LIST_FOREACH(hp, &http_pools, hp_link) {
+    if(!strcmp(hp->hp_name, name))
+      return hp;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+static http_pool_overflow_t
+http_pool_overflow_parse(const char *name, const char *str)
+{
+  for(int i = 0; i < sizeof(overflow_names) / sizeof(overflow_names[0]); i++)
+    if(!strcmp(str, overflow_names[i]))
+      return i;
+
+  trace(LOG_WARNING, "HTTP pool %s: Unknown overflow policy '%s', "
+        "using 'queue'", name, str);
+  return HTTP_POOL_QUEUE;
+}
+
+
+/**
+ *
+ */
+void
+http_pools_init(cfg_t *c)
+{
+  htsmsg_field_t *f;
+  HTSMSG_FOREACH(f, c) {
+    cfg_t *pc = htsmsg_get_map_by_field(f);
+    if(pc == NULL || f->hmf_name == NULL || http_pool_find(f->hmf_name))
+      continue;
+
+    http_pool_t *hp = calloc(1, sizeof(http_pool_t));
+    hp->hp_name = strdup(f->hmf_name);
+    hp->hp_queue_size = cfg_get_int(pc, CFG("queueSize"), 32);
+    hp->hp_overflow =
+      http_pool_overflow_parse(hp->hp_name,
+                               cfg_get_str(pc, CFG("overflow"), "queue"));
+
+    const int threads = cfg_get_int(pc, CFG("threads"), 4);
+    hp->hp_task_pool = task_pool_create(hp->hp_name, threads);
+
+    cfg_get_strvec(pc, "routes", &hp->hp_routes);
+
+    LIST_INSERT_HEAD(&http_pools, hp, hp_link);
+    trace(LOG_INFO, "HTTP pool %s: %d threads, queue %d, overflow %s, "
+          "%zd routes", hp->hp_name, threads, hp->hp_queue_size,
+          overflow_names[hp->hp_overflow], hp->hp_routes.count);
+  }
+}
+
+
+/**
+ *
+ */
+http_pool_t *
+http_pool_for_route(const char *path)
+{
+  http_pool_t *hp;
+  LIST_FOREACH(hp, &http_pools, hp_link) {
+    if(strvec_find(&hp->hp_routes, path) >= 0)
+      return hp;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+int
+http_pool_select(http_pool_t *hp, task_pool_t **tpp)
+{
+  *tpp = hp->hp_task_pool;
+
+  if(task_pool_queued(hp->hp_task_pool) < hp->hp_queue_size)
+    return 0;
+
+  __atomic_add_fetch(&hp->hp_overflows, 1, __ATOMIC_RELAXED);
+
+  switch(hp->hp_overflow) {
+  case HTTP_POOL_QUEUE:
+    break;
+  case HTTP_POOL_SHED:
+    return -1;
+  case HTTP_POOL_BORROW:
+    *tpp = NULL;
+    break;
+  }
+  return 0;
+}
+
+
+/**
+ * Stats for the default pool first, it has no http_pool_t
+ */
+static int
+http_pools_snapshot(task_pool_stats_t **statsp, http_pool_t ***poolsp)
+{
+  http_pool_t *hp;
+  int num_pools = 1;
+  LIST_FOREACH(hp, &http_pools, hp_link)
+    num_pools++;
+
+  task_pool_stats_t *stats = malloc(num_pools * sizeof(task_pool_stats_t));
+  http_pool_t **pools = malloc(num_pools * sizeof(http_pool_t *));
+
+  pools[0] = NULL;
+  task_pool_get_stats(NULL, &stats[0]);
+  int i = 1;
+  LIST_FOREACH(hp, &http_pools, hp_link) {
+    pools[i] = hp;
+    task_pool_get_stats(hp->hp_task_pool, &stats[i]);
+    i++;
+  }
+  *statsp = stats;
+  *poolsp = pools;
+  return num_pools;
+}
+
+
+/**
+ *
+ */
+void
+http_pools_prometheus(mbuf_t *out)
+{
+  static const struct {
+    const char *name;
+    size_t offset;
+  } gauges[] = {
+    { "http_pool_threads_max",  offsetof(task_pool_stats_t, tps_max_threads) },
+    { "http_pool_threads",      offsetof(task_pool_stats_t, tps_threads) },
+    { "http_pool_threads_busy", offsetof(task_pool_stats_t, tps_busy) },
+    { "http_pool_queued",       offsetof(task_pool_stats_t, tps_queued) },
+  };
+
+  task_pool_stats_t *stats;
+  http_pool_t **pools;
+  const int num_pools = http_pools_snapshot(&stats, &pools);
+
+  for(int g = 0; g < sizeof(gauges) / sizeof(gauges[0]); g++) {
+    mbuf_qprintf(out, "# TYPE %s gauge\n", gauges[g].name);
+    for(int i = 0; i < num_pools; i++)
+      mbuf_qprintf(out, "%s{pool=\"%s\"} %d\n", gauges[g].name,
+                   stats[i].tps_name,
+                   *(const int *)((const char *)&stats[i] + gauges[g].offset));
+  }
+
+  mbuf_qprintf(out, "# TYPE http_pool_tasks_total counter\n");
+  for(int i = 0; i < num_pools; i++)
+    mbuf_qprintf(out, "http_pool_tasks_total{pool=\"%s\"} %"PRIu64"\n",
+                 stats[i].tps_name, stats[i].tps_executed);
+
+  mbuf_qprintf(out, "# TYPE http_pool_overflows_total counter\n");
+  for(int i = 1; i < num_pools; i++)
+    mbuf_qprintf(out, "http_pool_overflows_total{pool=\"%s\",policy=\"%s\"} "
+                 "%"PRIu64"\n", stats[i].tps_name,
+                 overflow_names[pools[i]->hp_overflow],
+                 __atomic_load_n(&pools[i]->hp_overflows, __ATOMIC_RELAXED));
+  free(stats);
+  free(pools);
+}
+
+
+/**
+ *
+ */
+static ntv_t *
+http_pool_ntv(const http_pool_t *hp, const task_pool_t *tp)
+{
+  task_pool_stats_t tps;
+  task_pool_get_stats(tp, &tps);
+
+  ntv_t *p = ntv_create_map();
+  ntv_set_str(p, "name", tps.tps_name);
+  ntv_set_int(p, "maxThreads", tps.tps_max_threads);
+  ntv_set_int(p, "threads", tps.tps_threads);
+  ntv_set_int(p, "busy", tps.tps_busy);
+  ntv_set_int(p, "queued", tps.tps_queued);
+  ntv_set_int64(p, "tasks", tps.tps_executed);
+  if(hp != NULL) {
+    ntv_set_int(p, "queueSize", hp->hp_queue_size);
+    ntv_set_str(p, "overflow", overflow_names[hp->hp_overflow]);
+    ntv_set_int64(p, "overflows",
+                  __atomic_load_n(&hp->hp_overflows, __ATOMIC_RELAXED));
+  }
+  return p;
+}
+
+
+/**
+ *
+ */
+ntv_t *
+http_pools_ntv(void)
+{
+  ntv_t *list = ntv_create_list();
+  ntv_set_ntv(list, NULL, http_pool_ntv(NULL, NULL));
+
+  const http_pool_t *hp;
+  LIST_FOREACH(hp, &http_pools, hp_link)
+    ntv_set_ntv(list, NULL, http_pool_ntv(hp, hp->hp_task_pool));
+  return list;
+}
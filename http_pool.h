@@ -0,0 +1,70 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+struct htsmsg;
+struct mbuf;
+struct ntv;
+struct task_pool;
+
+/**
+ * Bulkheads, routes running on their own task pools
+ *
+ * Pools are configured under http.pools, keyed on name:
+ *
+ *  "pools": {
+ *    "reports": {
+ *      "threads": 4,         // Max threads
+ *      "queueSize": 32,      // Waiting requests before overflow
+ *      "overflow": "shed",   // "queue", "shed" or "borrow"
+ *      "routes": ["/report/{id}$"]
+ *    }
+ *  }
+ *
+ * Routes are listed with the same path they were added with. Other
+ * routes run on the default task pool.
+ *
+ * Once 'queueSize' requests are waiting for a thread the overflow
+ * policy applies: "queue" keeps queueing (only counted), "shed" replies
+ * 503 with Retry-After and "borrow" runs the request on the default
+ * pool instead.
+ */
+
+typedef struct http_pool http_pool_t;
+
+// Called by http_server_init() with the http.pools map
+void http_pools_init(struct htsmsg *c);
+
+// NULL if the route is not assigned to a pool
+http_pool_t *http_pool_for_route(const char *path);
+
+/**
+ * Pool to run the next request on (NULL is the default pool). Returns
+ * -1 if the request should be shed
+ */
+int http_pool_select(http_pool_t *hp, struct task_pool **tpp);
+
+void http_pools_prometheus(struct mbuf *out);
+
+struct ntv *http_pools_ntv(void);
@@ -0,0 +1,1606 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <sys/param.h>
+
+#include "queue.h"
+#include "atomic.h"
+#include "asyncio.h"
+#include "cfg.h"
+#include "mbuf.h"
+#include "misc.h"
+#include "ntv.h"
+#include "sock.h"
+#include "strvec.h"
+#include "trace.h"
+#include "http.h"
+#include "http_proxy.h"
+
+// Idle connections are expired and health checks are started this often
+#define HTTP_PROXY_TICK 1000000
+
+// Upstreams out of rotation are retried after this long without checks
+#define HTTP_PROXY_RETRY 10000000
+
+// How often a paused response checks if the client has caught up
+#define HTTP_PROXY_PAUSE_POLL 10000
+
+typedef enum {
+  HTTP_PROXY_ROUNDROBIN,
+  HTTP_PROXY_LEASTCONN,
+} http_proxy_balance_t;
+
+static const char *balance_names[] = {
+  [HTTP_PROXY_ROUNDROBIN] = "roundrobin",
+  [HTTP_PROXY_LEASTCONN]  = "leastconn",
+};
+
+LIST_HEAD(http_proxy_conn_list, http_proxy_conn);
+
+typedef struct http_upstream {
+  struct http_proxy *us_proxy;
+  char *us_name;
+  struct sockaddr_storage us_addr;
+  socklen_t us_addrlen;
+
+  // Protected by hp_mutex
+  struct http_proxy_conn_list us_idle;
+  int us_num_idle;
+
+  int us_healthy;
+
+  // Only accessed on the asyncio thread
+  int us_fails;   // In a row
+  int us_passes;  // Health checks in a row, while unhealthy
+  int64_t us_retry;
+  int64_t us_next_check;
+  struct http_proxy_conn *us_check;
+
+  // Updated from any thread
+  atomic_t us_inflight;
+  uint64_t us_requests;
+  uint64_t us_failures;
+} http_upstream_t;
+
+struct http_proxy {
+  LIST_ENTRY(http_proxy) hp_link;
+  char *hp_name;
+  pthread_mutex_t hp_mutex;
+
+  http_upstream_t *hp_upstreams;
+  int hp_num_upstreams;
+  http_proxy_balance_t hp_balance;
+  unsigned int hp_rr;
+
+  char *hp_strip_prefix;
+  char *hp_host;
+  struct http_arg_list hp_request_headers;
+  struct http_arg_list hp_response_headers;
+
+  int hp_keepalive;
+  int64_t hp_idle_timeout;
+  int64_t hp_connect_timeout;
+  int64_t hp_timeout;
+  size_t hp_buffer_size;
+
+  char *hp_check_path;
+  int64_t hp_check_interval;
+  int64_t hp_check_timeout;
+  int hp_unhealthy;
+  int hp_healthy;
+
+  asyncio_timer_t hp_timer;
+};
+
+/**
+ * Connection to an upstream. Owned by either the idle list, a request
+ * being sent (on the request's thread) or the response being received
+ * (on the asyncio thread). The socket itself holds a reference until
+ * it's closed, which is always done on the asyncio thread
+ */
+typedef struct http_proxy_conn {
+  LIST_ENTRY(http_proxy_conn) hpc_link;
+  atomic_t hpc_refcount;
+  http_upstream_t *hpc_upstream;
+  async_fd_t *hpc_af;
+  asyncio_timer_t hpc_timer;
+  http_parser hpc_parser;
+
+  // Below only accessed on the asyncio thread
+  struct http_proxy_req *hpc_request;  // Response being received
+  int64_t hpc_last_read;
+  int64_t hpc_idle_since;  // Protected by hp_mutex
+  int hpc_served;          // Responses received
+
+  // Response headers as they're parsed
+  mbuf_t hpc_field;
+  mbuf_t hpc_value;
+  struct http_arg_list hpc_headers;
+  char *hpc_content_type;
+  char *hpc_content_encoding;
+  char *hpc_connection;    // Options from the Connection header
+
+  uint8_t hpc_idle : 1;       // Protected by hp_mutex
+  uint8_t hpc_closed : 1;
+  uint8_t hpc_connected : 1;
+  uint8_t hpc_paused : 1;     // Waiting for the client to catch up
+  uint8_t hpc_check : 1;      // Health check connection
+  uint8_t hpc_received : 1;   // Got something of the current response
+  uint8_t hpc_complete : 1;   // Current response is complete
+  uint8_t hpc_informational : 1;
+  uint8_t hpc_eof : 1;        // Upstream has closed its end
+} http_proxy_conn_t;
+
+typedef struct http_proxy_req {
+  http_request_t *hpr_request;
+  http_proxy_t *hpr_proxy;
+  http_proxy_conn_t *hpr_conn;
+  http_upstream_t *hpr_upstream;
+
+  // Request head, kept for retries of requests without body
+  char *hpr_head;
+  size_t hpr_head_len;
+
+  uint8_t hpr_chunked : 1;   // Request body sent with chunked encoding
+  uint8_t hpr_retried : 1;
+  uint8_t hpr_started : 1;   // Response has been started
+} http_proxy_req_t;
+
+static LIST_HEAD(, http_proxy) http_proxies;
+
+static http_parser_settings http_proxy_parser_settings;
+
+static http_parser_settings http_proxy_check_settings;
+
+static void http_proxy_conn_read(void *opaque, mbuf_t *mq);
+
+static void http_proxy_conn_error(void *opaque, int error);
+
+
+/**
+ * Hop-by-hop headers and headers generated by the server itself
+ */
+static int
+http_proxy_skip_header(const char *name, int response)
+{
+  static const char *hop_by_hop[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+    "Transfer-Encoding", "Upgrade", "Content-Length", NULL
+  };
+  static const char *request[] = {
+    "Expect", "Proxy-Authorization", NULL
+  };
+  static const char *response_[] = {
+    "Date", "Server", NULL
+  };
+
+  for(int i = 0; hop_by_hop[i] != NULL; i++)
+    if(!strcasecmp(name, hop_by_hop[i]))
+      return 1;
+
+  const char **v = response ? response_ : request;
+  for(int i = 0; v[i] != NULL; i++)
+    if(!strcasecmp(name, v[i]))
+      return 1;
+  return 0;
+}
+
+
+/**
+ * Headers named in a Connection header are hop-by-hop as well
+ * (RFC 7230 section 6.1)
+ */
+static int
+http_proxy_connection_option(const char *connection, const char *name)
+{
+  if(connection == NULL)
+    return 0;
+
+  const size_t len = strlen(name);
+  const char *s = connection;
+  while(*s) {
+    s += strspn(s, " \t,");
+    const size_t n = strcspn(s, " \t,");
+    if(n == len && !strncasecmp(s, name, len))
+      return 1;
+    s += n;
+  }
+  return 0;
+}
+
+
+/**
+ * Header replaced (or removed) by configuration
+ */
+static int
+http_proxy_rewritten(struct http_arg_list *list, const char *name)
+{
+  const http_arg_t *ra;
+  TAILQ_FOREACH(ra, list, link) {
+    if(!strcasecmp(ra->key, name))
+      return 1;
+  }
+  return 0;
+}
+
+
+/**
+ * Connections
+ */
+
+static void
+http_proxy_conn_release(http_proxy_conn_t *hpc)
+{
+  if(atomic_dec(&hpc->hpc_refcount))
+    return;
+
+  asyncio_timer_disarm(&hpc->hpc_timer);
+  async_fd_release(hpc->hpc_af);
+  http_arg_flush(&hpc->hpc_headers);
+  mbuf_clear(&hpc->hpc_field);
+  mbuf_clear(&hpc->hpc_value);
+  free(hpc->hpc_content_type);
+  free(hpc->hpc_content_encoding);
+  free(hpc->hpc_connection);
+  free(hpc);
+}
+
+
+/**
+ * Must be called on the asyncio thread, drops the socket's reference
+ */
+static void
+http_proxy_conn_close(http_proxy_conn_t *hpc)
+{
+  if(hpc->hpc_closed)
+    return;
+  hpc->hpc_closed = 1;
+  asyncio_timer_disarm(&hpc->hpc_timer);
+  // Events for the socket may already have been collected by epoll
+  asyncio_detach(hpc->hpc_af);
+  asyncio_close(hpc->hpc_af);
+  http_proxy_conn_release(hpc);
+}
+
+
+/**
+ * Runs on the asyncio thread once the connection has been created
+ */
+static void
+http_proxy_conn_start(void *aux)
+{
+  http_proxy_conn_t *hpc = aux;
+  const http_proxy_t *hp = hpc->hpc_upstream->us_proxy;
+
+  if(!hpc->hpc_closed) {
+    asyncio_enable_read(hpc->hpc_af);
+    if(!hpc->hpc_connected && asyncio_is_connected(hpc->hpc_af))
+      hpc->hpc_connected = 1;
+    if(!hpc->hpc_connected)
+      asyncio_timer_arm_delta(&hpc->hpc_timer, hp->hp_connect_timeout);
+  }
+  http_proxy_conn_release(hpc);
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_conn_timer(void *opaque)
+{
+  http_proxy_conn_t *hpc = opaque;
+  const http_proxy_t *hp = hpc->hpc_upstream->us_proxy;
+  const int64_t now = asyncio_now();
+
+  if(!hpc->hpc_connected) {
+    if(!asyncio_is_connected(hpc->hpc_af)) {
+      http_proxy_conn_error(hpc, ETIMEDOUT);
+      return;
+    }
+    hpc->hpc_connected = 1;
+  }
+
+  http_proxy_req_t *hpr = hpc->hpc_request;
+  if(hpr == NULL)
+    return;  // Request is still being sent (or it's idle)
+
+  if(hpc->hpc_paused) {
+    if(http_response_queued(hpr->hpr_request) > hp->hp_buffer_size / 2) {
+      asyncio_timer_arm_delta(&hpc->hpc_timer, HTTP_PROXY_PAUSE_POLL);
+      return;
+    }
+    hpc->hpc_paused = 0;
+    hpc->hpc_last_read = now;
+    asyncio_timer_arm_delta(&hpc->hpc_timer, hp->hp_timeout);
+    // Delivers whatever is already buffered
+    asyncio_enable_read(hpc->hpc_af);
+    return;
+  }
+
+  const int64_t idle = now - hpc->hpc_last_read;
+  if(idle >= hp->hp_timeout) {
+    http_proxy_conn_error(hpc, ETIMEDOUT);
+    return;
+  }
+  asyncio_timer_arm_delta(&hpc->hpc_timer, hp->hp_timeout - idle);
+}
+
+
+/**
+ * Can be called from any thread. The connection comes with a reference
+ * for the caller
+ */
+static http_proxy_conn_t *
+http_proxy_conn_create(http_upstream_t *us)
+{
+  const int fd = libsvc_socket(us->us_addr.ss_family, SOCK_STREAM, 0);
+  if(fd == -1) {
+    trace(LOG_ERR, "HTTP proxy %s: Unable to create socket -- %s",
+          us->us_proxy->hp_name, strerror(errno));
+    return NULL;
+  }
+
+  http_proxy_conn_t *hpc = calloc(1, sizeof(http_proxy_conn_t));
+  atomic_set(&hpc->hpc_refcount, 3);  // Caller, socket, start task
+  hpc->hpc_upstream = us;
+  mbuf_init(&hpc->hpc_field);
+  mbuf_init(&hpc->hpc_value);
+  TAILQ_INIT(&hpc->hpc_headers);
+  http_parser_init(&hpc->hpc_parser, HTTP_RESPONSE);
+  hpc->hpc_parser.data = hpc;
+  asyncio_timer_init(&hpc->hpc_timer, http_proxy_conn_timer, hpc);
+
+  // Sets the socket non-blocking, data queued before the connection
+  // is established is sent once it is
+  hpc->hpc_af = asyncio_stream_mt(fd, http_proxy_conn_read,
+                                  http_proxy_conn_error, hpc);
+
+  if(connect(fd, (struct sockaddr *)&us->us_addr, us->us_addrlen) == 0)
+    hpc->hpc_connected = 1;
+  else if(errno != EINPROGRESS)
+    trace(LOG_WARNING, "HTTP proxy %s: Unable to connect to %s -- %s",
+          us->us_proxy->hp_name, us->us_name, strerror(errno));
+  // Failed connects are reported to http_proxy_conn_error() once the
+  // socket is polled
+
+  asyncio_run_task(http_proxy_conn_start, hpc);
+  return hpc;
+}
+
+
+/**
+ * Health
+ */
+
+static void
+http_proxy_upstream_set_healthy(http_upstream_t *us, int healthy)
+{
+  if(us->us_healthy == healthy)
+    return;
+  us->us_healthy = healthy;
+  us->us_passes = 0;
+  trace(healthy ? LOG_INFO : LOG_WARNING, "HTTP proxy %s: Upstream %s is %s",
+        us->us_proxy->hp_name, us->us_name, healthy ? "healthy" : "down");
+}
+
+
+/**
+ * Asyncio thread
+ */
+static void
+http_proxy_upstream_failed(http_upstream_t *us)
+{
+  const http_proxy_t *hp = us->us_proxy;
+
+  us->us_passes = 0;
+  if(++us->us_fails < hp->hp_unhealthy)
+    return;
+
+  if(us->us_healthy && hp->hp_check_path == NULL)
+    us->us_retry = asyncio_now() + HTTP_PROXY_RETRY;
+  http_proxy_upstream_set_healthy(us, 0);
+}
+
+
+/**
+ * Asyncio thread
+ */
+static void
+http_proxy_upstream_ok(http_upstream_t *us)
+{
+  us->us_fails = 0;
+}
+
+
+/**
+ * Health check finished, 'status' is 0 if it failed
+ */
+static void
+http_proxy_check_done(http_proxy_conn_t *hpc, int status)
+{
+  http_upstream_t *us = hpc->hpc_upstream;
+  const http_proxy_t *hp = us->us_proxy;
+
+  us->us_check = NULL;
+  http_proxy_conn_close(hpc);
+  http_proxy_conn_release(hpc);
+
+  if(status < 200 || status >= 400) {
+    http_proxy_upstream_failed(us);
+    return;
+  }
+
+  http_proxy_upstream_ok(us);
+  if(!us->us_healthy && ++us->us_passes >= hp->hp_healthy)
+    http_proxy_upstream_set_healthy(us, 1);
+}
+
+
+/**
+ *
+ */
+static int
+http_proxy_check_headers(http_parser *p)
+{
+  http_proxy_conn_t *hpc = p->data;
+  hpc->hpc_complete = 1;
+  http_parser_pause(p, 1);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_check_start(http_upstream_t *us)
+{
+  http_proxy_t *hp = us->us_proxy;
+  http_proxy_conn_t *hpc = http_proxy_conn_create(us);
+  if(hpc == NULL)
+    return;
+
+  hpc->hpc_check = 1;
+  hpc->hpc_idle_since = asyncio_now();  // Used as start time
+  us->us_check = hpc;
+
+  mbuf_t q;
+  mbuf_init(&q);
+  mbuf_qprintf(&q, "GET %s HTTP/1.1\r\nHost: %s\r\n"
+               "User-Agent: "PROGNAME"\r\nConnection: close\r\n\r\n",
+               hp->hp_check_path, hp->hp_host ?: us->us_name);
+  asyncio_sendq(hpc->hpc_af, &q, 0);
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_check_read(http_proxy_conn_t *hpc, mbuf_t *mq)
+{
+  mbuf_data_t *md;
+
+  while((md = TAILQ_FIRST(&mq->mq_buffers)) != NULL) {
+    const size_t r =
+      http_parser_execute(&hpc->hpc_parser, &http_proxy_check_settings,
+                          (const void *)md->md_data + md->md_data_off,
+                          md->md_data_len - md->md_data_off);
+    if(hpc->hpc_complete) {
+      http_proxy_check_done(hpc, hpc->hpc_parser.status_code);
+      return;
+    }
+    if(HTTP_PARSER_ERRNO(&hpc->hpc_parser) != HPE_OK) {
+      http_proxy_check_done(hpc, 0);
+      return;
+    }
+    mbuf_drop(mq, r);
+  }
+}
+
+
+/**
+ * Expire idle connections, run health checks
+ */
+static void
+http_proxy_tick(void *opaque)
+{
+  http_proxy_t *hp = opaque;
+  const int64_t now = asyncio_now();
+  struct http_proxy_conn_list expired;
+  http_proxy_conn_t *hpc, *next;
+
+  LIST_INIT(&expired);
+
+  pthread_mutex_lock(&hp->hp_mutex);
+  for(int i = 0; i < hp->hp_num_upstreams; i++) {
+    http_upstream_t *us = &hp->hp_upstreams[i];
+    for(hpc = LIST_FIRST(&us->us_idle); hpc != NULL; hpc = next) {
+      next = LIST_NEXT(hpc, hpc_link);
+      if(now - hpc->hpc_idle_since < hp->hp_idle_timeout)
+        continue;
+      LIST_REMOVE(hpc, hpc_link);
+      hpc->hpc_idle = 0;
+      us->us_num_idle--;
+      LIST_INSERT_HEAD(&expired, hpc, hpc_link);
+    }
+  }
+  pthread_mutex_unlock(&hp->hp_mutex);
+
+  while((hpc = LIST_FIRST(&expired)) != NULL) {
+    LIST_REMOVE(hpc, hpc_link);
+    http_proxy_conn_close(hpc);
+    http_proxy_conn_release(hpc);
+  }
+
+  for(int i = 0; i < hp->hp_num_upstreams; i++) {
+    http_upstream_t *us = &hp->hp_upstreams[i];
+
+    if(hp->hp_check_path == NULL) {
+      if(!us->us_healthy && now >= us->us_retry) {
+        // Let traffic decide
+        us->us_fails = hp->hp_unhealthy - 1;
+        http_proxy_upstream_set_healthy(us, 1);
+      }
+      continue;
+    }
+
+    if(us->us_check != NULL) {
+      if(now - us->us_check->hpc_idle_since > hp->hp_check_timeout)
+        http_proxy_check_done(us->us_check, 0);
+      continue;
+    }
+
+    if(now >= us->us_next_check) {
+      us->us_next_check = now + hp->hp_check_interval;
+      http_proxy_check_start(us);
+    }
+  }
+
+  asyncio_timer_arm_delta(&hp->hp_timer, HTTP_PROXY_TICK);
+}
+
+
+/**
+ * Pick an upstream and a connection to it. Can be called from any
+ * thread
+ */
+static http_proxy_conn_t *
+http_proxy_conn_get(http_proxy_t *hp, int reuse)
+{
+  http_upstream_t *us = NULL;
+  http_proxy_conn_t *hpc = NULL;
+
+  pthread_mutex_lock(&hp->hp_mutex);
+
+  if(hp->hp_balance == HTTP_PROXY_LEASTCONN) {
+    int best = INT32_MAX;
+    // Start at a rotating offset so ties are spread out
+    const unsigned int o = hp->hp_rr++;
+    for(int i = 0; i < hp->hp_num_upstreams; i++) {
+      http_upstream_t *c = &hp->hp_upstreams[(o + i) % hp->hp_num_upstreams];
+      const int inflight = atomic_get(&c->us_inflight);
+      if(c->us_healthy && inflight < best) {
+        best = inflight;
+        us = c;
+      }
+    }
+  } else {
+    for(int i = 0; i < hp->hp_num_upstreams; i++) {
+      http_upstream_t *c =
+        &hp->hp_upstreams[hp->hp_rr++ % hp->hp_num_upstreams];
+      if(c->us_healthy) {
+        us = c;
+        break;
+      }
+    }
+  }
+
+  if(us != NULL && reuse) {
+    // Most recently used first, so surplus connections expire
+    hpc = LIST_FIRST(&us->us_idle);
+    if(hpc != NULL) {
+      LIST_REMOVE(hpc, hpc_link);
+      hpc->hpc_idle = 0;
+      us->us_num_idle--;
+    }
+  }
+
+  pthread_mutex_unlock(&hp->hp_mutex);
+
+  if(us == NULL)
+    return NULL;
+
+  if(hpc == NULL)
+    hpc = http_proxy_conn_create(us);
+  if(hpc != NULL) {
+    atomic_inc(&us->us_inflight);
+    __atomic_add_fetch(&us->us_requests, 1, __ATOMIC_RELAXED);
+  }
+  return hpc;
+}
+
+
+/**
+ * Response finished, keep the connection around if possible. Asyncio
+ * thread
+ */
+static void
+http_proxy_conn_done(http_proxy_conn_t *hpc, int reusable)
+{
+  http_upstream_t *us = hpc->hpc_upstream;
+  http_proxy_t *hp = us->us_proxy;
+
+  hpc->hpc_request = NULL;
+  hpc->hpc_served++;
+  hpc->hpc_paused = 0;
+  hpc->hpc_received = 0;
+  hpc->hpc_complete = 0;
+  atomic_dec(&us->us_inflight);
+
+  if(reusable && !hpc->hpc_closed && !hpc->hpc_eof) {
+    asyncio_timer_disarm(&hpc->hpc_timer);
+    http_parser_init(&hpc->hpc_parser, HTTP_RESPONSE);
+    hpc->hpc_parser.data = hpc;
+
+    pthread_mutex_lock(&hp->hp_mutex);
+    if(us->us_num_idle < hp->hp_keepalive) {
+      hpc->hpc_idle = 1;
+      hpc->hpc_idle_since = asyncio_now();
+      LIST_INSERT_HEAD(&us->us_idle, hpc, hpc_link);
+      us->us_num_idle++;
+      hpc = NULL;
+    }
+    pthread_mutex_unlock(&hp->hp_mutex);
+    if(hpc == NULL)
+      return;
+  }
+
+  http_proxy_conn_close(hpc);
+  http_proxy_conn_release(hpc);
+}
+
+
+/**
+ * Request side
+ */
+
+/**
+ * Build the request head sent upstream
+ */
+static void
+http_proxy_build_head(http_proxy_t *hp, http_request_t *hr, mbuf_t *q,
+                      int body)
+{
+  const char *path = hr->hr_path;
+  const http_arg_t *ra;
+
+  if(hp->hp_strip_prefix != NULL) {
+    const size_t len = strlen(hp->hp_strip_prefix);
+    if(!strncmp(path, hp->hp_strip_prefix, len))
+      path += len;
+  }
+
+  mbuf_qprintf(q, "%s %s%s%s%s HTTP/1.1\r\n",
+               http_method_str(hr->hr_method),
+               *path == '/' ? "" : "/", path,
+               hr->hr_args != NULL ? "?" : "", hr->hr_args ?: "");
+
+  const char *host = http_req_header_id(hr, HTTP_HDR_HOST);
+  mbuf_qprintf(q, "Host: %s\r\n", hp->hp_host ?: host ?: "localhost");
+
+  const char *connection = http_req_header_id(hr, HTTP_HDR_CONNECTION);
+  const char *xff = NULL;
+  TAILQ_FOREACH(ra, &hr->hr_request_headers, link) {
+    if(!strcasecmp(ra->key, "Host") ||
+       http_proxy_skip_header(ra->key, 0) ||
+       http_proxy_connection_option(connection, ra->key) ||
+       http_proxy_rewritten(&hp->hp_request_headers, ra->key))
+      continue;
+    if(!strcasecmp(ra->key, "X-Forwarded-For")) {
+      xff = ra->val;
+      continue;
+    }
+    if(!strcasecmp(ra->key, "X-Forwarded-Host"))
+      continue;
+    mbuf_qprintf(q, "%s: %s\r\n", ra->key, ra->val);
+  }
+
+  TAILQ_FOREACH(ra, &hp->hp_request_headers, link) {
+    if(*ra->val)
+      mbuf_qprintf(q, "%s: %s\r\n", ra->key, ra->val);
+  }
+
+  const char *peer = hr->hr_peer_addr;
+  if(xff != NULL)
+    mbuf_qprintf(q, "X-Forwarded-For: %s, %s\r\n", xff, peer);
+  else
+    mbuf_qprintf(q, "X-Forwarded-For: %s\r\n", peer);
+  if(host != NULL)
+    mbuf_qprintf(q, "X-Forwarded-Host: %s\r\n", host);
+
+  const char *cl = http_req_header_id(hr, HTTP_HDR_CONTENT_LENGTH);
+  if(cl != NULL && (body || hr->hr_h2_stream == NULL))
+    mbuf_qprintf(q, "Content-Length: %s\r\n", cl);
+  else if(body)
+    mbuf_qprintf(q, "Transfer-Encoding: chunked\r\n");
+
+  if(hp->hp_keepalive == 0)
+    mbuf_qprintf(q, "Connection: close\r\n");
+  mbuf_append(q, "\r\n", 2);
+}
+
+
+/**
+ * Connect and send the request head. Returns NULL if no upstream is
+ * available
+ */
+static http_proxy_req_t *
+http_proxy_begin(http_proxy_t *hp, http_request_t *hr, int body)
+{
+  http_proxy_conn_t *hpc = http_proxy_conn_get(hp, 1);
+  if(hpc == NULL) {
+    trace(LOG_WARNING, "HTTP proxy %s: %s: No upstream available",
+          hp->hp_name, hr->hr_path);
+    return NULL;
+  }
+
+  http_proxy_req_t *hpr = http_req_alloc(hr, sizeof(http_proxy_req_t));
+  memset(hpr, 0, sizeof(http_proxy_req_t));
+  hpr->hpr_request = hr;
+  hpr->hpr_proxy = hp;
+  hpr->hpr_conn = hpc;
+  hpr->hpr_upstream = hpc->hpc_upstream;
+
+  mbuf_t q;
+  mbuf_init(&q);
+  http_proxy_build_head(hp, hr, &q, body);
+
+  hpr->hpr_chunked = body && http_req_header_id(hr, HTTP_HDR_CONTENT_LENGTH)
+    == NULL;
+
+  if(!body) {
+    hpr->hpr_head_len = q.mq_size;
+    hpr->hpr_head = http_req_alloc(hr, q.mq_size);
+    mbuf_peek(&q, hpr->hpr_head, q.mq_size);
+  }
+
+  // If this fails the error is picked up when the response is awaited
+  asyncio_sendq(hpc->hpc_af, &q, 0);
+  return hpr;
+}
+
+
+/**
+ * Give up on a request before its response has been handed over to
+ * the asyncio thread
+ */
+static void
+http_proxy_abort_task(void *aux)
+{
+  http_proxy_conn_t *hpc = aux;
+  atomic_dec(&hpc->hpc_upstream->us_inflight);
+  http_proxy_conn_close(hpc);
+  http_proxy_conn_release(hpc);
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_abort(http_proxy_req_t *hpr)
+{
+  asyncio_run_task(http_proxy_abort_task, hpr->hpr_conn);
+  hpr->hpr_conn = NULL;
+}
+
+
+/**
+ * Body callback, runs on the request's task group
+ */
+int
+http_proxy_body(http_proxy_t *hp, http_request_t *hr, mbuf_t *mq,
+                int flags)
+{
+  http_proxy_req_t *hpr = hr->hr_opaque;
+
+  if(flags & HTTP_BODY_ABORTED) {
+    if(hpr != NULL && hpr->hpr_conn != NULL)
+      http_proxy_abort(hpr);
+    return 0;
+  }
+
+  if(hpr == NULL) {
+    hpr = http_proxy_begin(hp, hr, 1);
+    if(hpr == NULL)
+      return HTTP_STATUS_BAD_GATEWAY;
+    hr->hr_opaque = hpr;
+  }
+
+  async_fd_t *af = hpr->hpr_conn->hpc_af;
+  int err;
+
+  if(hpr->hpr_chunked) {
+    char hdr[20];
+    const int hlen = snprintf(hdr, sizeof(hdr), "%zx\r\n", mq->mq_size);
+    mbuf_append(mq, "\r\n", 2);
+    err = asyncio_sendq_with_hdr(af, hdr, hlen, mq, 0);
+  } else {
+    err = asyncio_sendq(af, mq, 0);
+  }
+
+  // Reading from the client is paused while we wait here
+  if(err || asyncio_sendq_wait(af, hp->hp_buffer_size,
+                               hp->hp_buffer_size / 2,
+                               hp->hp_timeout / 1000000)) {
+    trace(LOG_WARNING, "HTTP proxy %s: %s: Upstream %s failed while "
+          "sending request body", hp->hp_name, hr->hr_path,
+          hpr->hpr_upstream->us_name);
+    http_proxy_abort(hpr);
+    return HTTP_STATUS_BAD_GATEWAY;
+  }
+  return 0;
+}
+
+
+/**
+ * Response side, on the asyncio thread
+ */
+
+/**
+ * Something went wrong with the connection. Retry, reply with an error
+ * or cut the response short
+ */
+static void
+http_proxy_fail(http_proxy_conn_t *hpc, int error)
+{
+  http_proxy_req_t *hpr = hpc->hpc_request;
+  http_request_t *hr = hpr->hpr_request;
+  http_upstream_t *us = hpc->hpc_upstream;
+  http_proxy_t *hp = us->us_proxy;
+  const int received = hpc->hpc_received;
+  const int reused = hpc->hpc_served > 0;
+  const int connected = hpc->hpc_connected;
+
+  http_proxy_conn_close(hpc);
+  http_proxy_conn_done(hpc, 0);
+
+  if(!received && (!reused || error == ETIMEDOUT)) {
+    // A keepalive connection closed by the upstream says nothing
+    __atomic_add_fetch(&us->us_failures, 1, __ATOMIC_RELAXED);
+    http_proxy_upstream_failed(us);
+  }
+
+  if(!received && (reused || !connected) && hpr->hpr_head != NULL &&
+     !hpr->hpr_retried && error != ETIMEDOUT &&
+     hr->hr_method != HTTP_POST && hr->hr_method != HTTP_PATCH) {
+    // Upstream closed the keepalive connection as we picked it or the
+    // connection was never established, either way it's safe to retry
+    http_proxy_conn_t *n = http_proxy_conn_get(hp, 0);
+    if(n != NULL) {
+      if(!reused)
+        trace(LOG_WARNING, "HTTP proxy %s: %s: Unable to connect to %s "
+              "-- %s, retrying with %s", hp->hp_name, hr->hr_path,
+              us->us_name, strerror(error), n->hpc_upstream->us_name);
+      hpr->hpr_retried = 1;
+      hpr->hpr_conn = n;
+      hpr->hpr_upstream = n->hpc_upstream;
+      n->hpc_request = hpr;
+      n->hpc_last_read = asyncio_now();
+      // The timer moves on to the response timeout once connected.
+      // http_proxy_conn_start() may not have run yet so always arm it
+      asyncio_timer_arm_delta(&n->hpc_timer, n->hpc_connected ?
+                              hp->hp_timeout : hp->hp_connect_timeout);
+      asyncio_send(n->hpc_af, hpr->hpr_head, hpr->hpr_head_len, 0);
+      return;
+    }
+  }
+
+  trace(LOG_WARNING, "HTTP proxy %s: %s: Upstream %s %s -- %s",
+        hp->hp_name, hr->hr_path, us->us_name,
+        received ? "failed during response" : "failed",
+        strerror(error));
+
+  if(hpr->hpr_started) {
+    // Response is incomplete, the client can only tell if we close
+    hr->hr_keep_alive = 0;
+    http_request_complete(hr, 0);
+  } else if(received) {
+    http_request_complete(hr, HTTP_STATUS_BAD_GATEWAY);
+  } else {
+    http_request_complete(hr, error == ETIMEDOUT ?
+                          HTTP_STATUS_GATEWAY_TIMEOUT :
+                          HTTP_STATUS_BAD_GATEWAY);
+  }
+}
+
+
+/**
+ * Request has been sent, from now on the response is handled here
+ */
+static void
+http_proxy_response_start(void *aux)
+{
+  http_proxy_req_t *hpr = aux;
+  http_proxy_conn_t *hpc = hpr->hpr_conn;
+  const http_proxy_t *hp = hpr->hpr_proxy;
+
+  hpc->hpc_request = hpr;
+  hpc->hpc_last_read = asyncio_now();
+
+  if(hpc->hpc_closed) {
+    http_proxy_fail(hpc, ECONNRESET);
+    return;
+  }
+
+  if(hpc->hpc_connected)
+    asyncio_timer_arm_delta(&hpc->hpc_timer, hp->hp_timeout);
+
+  asyncio_redeliver(hpc->hpc_af);
+}
+
+
+/**
+ * Route callback, once the request body (if any) has been sent
+ */
+int
+http_proxy_request(http_proxy_t *hp, http_request_t *hr)
+{
+  http_proxy_req_t *hpr = hr->hr_opaque;
+
+  if(hpr == NULL) {
+    hpr = http_proxy_begin(hp, hr, 0);
+    if(hpr == NULL)
+      return HTTP_STATUS_BAD_GATEWAY;
+  } else if(hpr->hpr_chunked) {
+    if(asyncio_send(hpr->hpr_conn->hpc_af, "0\r\n\r\n", 5, 0)) {
+      http_proxy_abort(hpr);
+      return HTTP_STATUS_BAD_GATEWAY;
+    }
+  }
+
+  const int r = http_request_defer(hr, 0);
+  asyncio_run_task(http_proxy_response_start, hpr);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_header_flush(http_proxy_conn_t *hpc)
+{
+  if(hpc->hpc_field.mq_size == 0)
+    return;
+
+  const http_proxy_t *hp = hpc->hpc_upstream->us_proxy;
+  char *field = mbuf_clear_to_string(&hpc->hpc_field);
+  char *value = mbuf_clear_to_string(&hpc->hpc_value);
+
+  if(!strcasecmp(field, "Connection")) {
+    // Applied once all headers are in, it may come after those it names
+    if(hpc->hpc_connection != NULL) {
+      char *s = fmt("%s, %s", hpc->hpc_connection, value);
+      free(hpc->hpc_connection);
+      hpc->hpc_connection = s;
+    } else {
+      hpc->hpc_connection = value;
+      value = NULL;
+    }
+  } else if(!strcasecmp(field, "Content-Type")) {
+    free(hpc->hpc_content_type);
+    hpc->hpc_content_type = value;
+    value = NULL;
+  } else if(!strcasecmp(field, "Content-Encoding")) {
+    free(hpc->hpc_content_encoding);
+    hpc->hpc_content_encoding = value;
+    value = NULL;
+  } else if(!http_proxy_skip_header(field, 1) &&
+            !http_proxy_rewritten((struct http_arg_list *)
+                                  &hp->hp_response_headers, field)) {
+    http_arg_set(&hpc->hpc_headers, field, value);
+  }
+  free(field);
+  free(value);
+}
+
+
+/**
+ *
+ */
+static int
+http_proxy_header_field(http_parser *p, const char *at, size_t length)
+{
+  http_proxy_conn_t *hpc = p->data;
+  if(hpc->hpc_value.mq_size)
+    http_proxy_header_flush(hpc);
+  mbuf_append(&hpc->hpc_field, at, length);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static int
+http_proxy_header_value(http_parser *p, const char *at, size_t length)
+{
+  http_proxy_conn_t *hpc = p->data;
+  mbuf_append(&hpc->hpc_value, at, length);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_headers_reset(http_proxy_conn_t *hpc)
+{
+  mbuf_clear(&hpc->hpc_field);
+  mbuf_clear(&hpc->hpc_value);
+  http_arg_flush(&hpc->hpc_headers);
+  free(hpc->hpc_content_type);
+  free(hpc->hpc_content_encoding);
+  free(hpc->hpc_connection);
+  hpc->hpc_content_type = NULL;
+  hpc->hpc_content_encoding = NULL;
+  hpc->hpc_connection = NULL;
+}
+
+
+/**
+ *
+ */
+static int
+http_proxy_headers_complete(http_parser *p)
+{
+  http_proxy_conn_t *hpc = p->data;
+  http_proxy_req_t *hpr = hpc->hpc_request;
+  http_request_t *hr = hpr->hpr_request;
+  const http_proxy_t *hp = hpr->hpr_proxy;
+  const int status = p->status_code;
+
+  http_proxy_header_flush(hpc);
+
+  if(status < 200) {
+    // Interim response (103 Early Hints etc), wait for the real one
+    hpc->hpc_informational = 1;
+    http_proxy_headers_reset(hpc);
+    return 0;
+  }
+
+  http_proxy_upstream_ok(hpc->hpc_upstream);
+
+  if(http_request_resume(hr)) {
+    // Client is gone
+    http_proxy_headers_reset(hpc);
+    return -1;
+  }
+
+  // Options named by Connection stay behind and are freed below
+  http_arg_t *ra, *next;
+  for(ra = TAILQ_FIRST(&hpc->hpc_headers); ra != NULL; ra = next) {
+    next = TAILQ_NEXT(ra, link);
+    if(http_proxy_connection_option(hpc->hpc_connection, ra->key))
+      continue;
+    TAILQ_REMOVE(&hpc->hpc_headers, ra, link);
+    TAILQ_INSERT_TAIL(&hr->hr_response_headers, ra, link);
+  }
+  TAILQ_FOREACH(ra, &hp->hp_response_headers, link) {
+    if(*ra->val)
+      http_arg_set(&hr->hr_response_headers, ra->key, ra->val);
+  }
+
+  const int64_t len = p->flags & F_CONTENTLENGTH ? p->content_length :
+    status == HTTP_STATUS_NO_CONTENT ? 0 : -1;
+
+  hpr->hpr_started = 1;
+  http_response_begin(hr, status, hpc->hpc_content_type, len,
+                      hpc->hpc_content_encoding, -1);
+  http_proxy_headers_reset(hpc);
+
+  // Response to HEAD has no body no matter what it says
+  return hr->hr_method == HTTP_HEAD;
+}
+
+
+/**
+ *
+ */
+static int
+http_proxy_body_data(http_parser *p, const char *at, size_t length)
+{
+  http_proxy_conn_t *hpc = p->data;
+  http_request_t *hr = hpc->hpc_request->hpr_request;
+
+  mbuf_t mq;
+  mbuf_init(&mq);
+  mbuf_append(&mq, at, length);
+  return http_response_sendq(hr, &mq) ? -1 : 0;
+}
+
+
+/**
+ *
+ */
+static int
+http_proxy_message_complete(http_parser *p)
+{
+  http_proxy_conn_t *hpc = p->data;
+
+  if(hpc->hpc_informational) {
+    hpc->hpc_informational = 0;
+    return 0;
+  }
+  hpc->hpc_complete = 1;
+  http_parser_pause(p, 1);
+  return 0;
+}
+
+
+/**
+ * Response complete (or the client went away)
+ */
+static void
+http_proxy_response_done(http_proxy_conn_t *hpc, int reusable)
+{
+  http_proxy_req_t *hpr = hpc->hpc_request;
+  http_request_t *hr = hpr->hpr_request;
+
+  if(hpr->hpr_started && reusable)
+    http_response_end(hr);  // Nothing is buffered so it won't block
+  else if(hpr->hpr_started)
+    hr->hr_keep_alive = 0;
+
+  http_proxy_conn_done(hpc, reusable);
+  http_request_complete(hr, 0);
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_conn_read(void *opaque, mbuf_t *mq)
+{
+  http_proxy_conn_t *hpc = opaque;
+  mbuf_data_t *md;
+
+  if(hpc == NULL)
+    return;
+
+  if(hpc->hpc_check) {
+    http_proxy_check_read(hpc, mq);
+    return;
+  }
+
+  http_proxy_req_t *hpr = hpc->hpc_request;
+  if(hpr == NULL) {
+    // While idle the upstream has no business sending anything. Else
+    // the request is still being sent, hold on to it until then
+    if(hpc->hpc_idle)
+      http_proxy_conn_error(hpc, EPROTO);
+    return;
+  }
+
+  const http_proxy_t *hp = hpr->hpr_proxy;
+  hpc->hpc_last_read = asyncio_now();
+  hpc->hpc_connected = 1;
+
+  while((md = TAILQ_FIRST(&mq->mq_buffers)) != NULL) {
+    hpc->hpc_received = 1;
+    const size_t r =
+      http_parser_execute(&hpc->hpc_parser, &http_proxy_parser_settings,
+                          (const void *)md->md_data + md->md_data_off,
+                          md->md_data_len - md->md_data_off);
+
+    const enum http_errno err = HTTP_PARSER_ERRNO(&hpc->hpc_parser);
+    if(err != HPE_OK && err != HPE_PAUSED) {
+      if(hpr->hpr_started && err == HPE_CB_body) {
+        // Client is gone
+        http_proxy_response_done(hpc, 0);
+      } else if(err == HPE_CB_headers_complete) {
+        http_proxy_response_done(hpc, 0);
+      } else {
+        trace(LOG_WARNING, "HTTP proxy %s: %s: Bad response from %s -- %s",
+              hp->hp_name, hpr->hpr_request->hr_path,
+              hpc->hpc_upstream->us_name, http_errno_description(err));
+        http_proxy_fail(hpc, EPROTO);
+      }
+      return;
+    }
+
+    mbuf_drop(mq, r);
+
+    if(hpc->hpc_complete) {
+      // Anything after the response is a protocol violation
+      http_proxy_response_done(hpc, mq->mq_size == 0 &&
+                               http_should_keep_alive(&hpc->hpc_parser));
+      return;
+    }
+  }
+
+  if(hpr->hpr_started &&
+     http_response_queued(hpr->hpr_request) > hp->hp_buffer_size) {
+    // Client is slow, stop reading from upstream until it catches up
+    asyncio_disable_read(hpc->hpc_af);
+    hpc->hpc_paused = 1;
+    asyncio_timer_arm_delta(&hpc->hpc_timer, HTTP_PROXY_PAUSE_POLL);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_conn_error(void *opaque, int error)
+{
+  http_proxy_conn_t *hpc = opaque;
+
+  if(hpc == NULL)
+    return;
+
+  if(hpc->hpc_check) {
+    http_proxy_check_done(hpc, 0);
+    return;
+  }
+
+  http_proxy_req_t *hpr = hpc->hpc_request;
+  if(hpr != NULL && error == ECONNRESET && !hpc->hpc_paused) {
+    // Upstream closed, what it sent before that still counts
+    atomic_inc(&hpc->hpc_refcount);
+    hpc->hpc_eof = 1;
+    asyncio_redeliver(hpc->hpc_af);
+
+    if(hpc->hpc_request == hpr && !hpc->hpc_closed) {
+      // Responses without length end when the connection is closed
+      if(hpc->hpc_received)
+        http_parser_execute(&hpc->hpc_parser, &http_proxy_parser_settings,
+                            NULL, 0);
+      if(hpc->hpc_complete)
+        http_proxy_response_done(hpc, 0);
+      else
+        http_proxy_fail(hpc, error);
+    }
+    http_proxy_conn_release(hpc);
+    return;
+  }
+
+  if(hpr != NULL) {
+    http_proxy_fail(hpc, error);
+    return;
+  }
+
+  http_proxy_t *hp = hpc->hpc_upstream->us_proxy;
+  pthread_mutex_lock(&hp->hp_mutex);
+  const int idle = hpc->hpc_idle;
+  if(idle) {
+    LIST_REMOVE(hpc, hpc_link);
+    hpc->hpc_idle = 0;
+    hpc->hpc_upstream->us_num_idle--;
+  }
+  pthread_mutex_unlock(&hp->hp_mutex);
+
+  // If the request is still being sent the failure is noticed when
+  // sending or when the response is awaited
+  http_proxy_conn_close(hpc);
+  if(idle)
+    http_proxy_conn_release(hpc);
+}
+
+
+/**
+ * Setup
+ */
+
+/**
+ *
+ */
+static int
+http_upstream_init(http_proxy_t *hp, http_upstream_t *us, const char *name)
+{
+  char *host = mystrdupa(name);
+  const char *port = "80";
+  char *colon = strrchr(host, ':');
+  if(colon != NULL && strchr(host, ']') < colon) {
+    *colon = 0;
+    port = colon + 1;
+  }
+  if(*host == '[') {
+    host++;
+    host[strcspn(host, "]")] = 0;
+  }
+
+  struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+  struct addrinfo *ai;
+  const int r = getaddrinfo(host, port, &hints, &ai);
+  if(r) {
+    trace(LOG_ERR, "HTTP proxy %s: Unable to resolve upstream %s -- %s",
+          hp->hp_name, name, gai_strerror(r));
+    return -1;
+  }
+
+  us->us_proxy = hp;
+  us->us_name = strdup(name);
+  memcpy(&us->us_addr, ai->ai_addr, ai->ai_addrlen);
+  us->us_addrlen = ai->ai_addrlen;
+  us->us_healthy = 1;
+  LIST_INIT(&us->us_idle);
+  freeaddrinfo(ai);
+  return 0;
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_headers_init(struct http_arg_list *list, cfg_t *c)
+{
+  TAILQ_INIT(list);
+  if(c == NULL)
+    return;
+
+  htsmsg_field_t *f;
+  HTSMSG_FOREACH(f, c) {
+    const char *value = htsmsg_field_get_string(f);
+    if(f->hmf_name != NULL && value != NULL)
+      http_arg_set(list, f->hmf_name, value);
+  }
+}
+
+
+/**
+ *
+ */
+static void
+http_proxy_start(void *aux)
+{
+  http_proxy_t *hp = aux;
+  asyncio_timer_init(&hp->hp_timer, http_proxy_tick, hp);
+  asyncio_timer_arm_delta(&hp->hp_timer, HTTP_PROXY_TICK);
+}
+
+
+/**
+ *
+ */
+static http_proxy_t *
+http_proxy_create(const char *name, cfg_t *pc)
+{
+  cfg_t *upstreams = cfg_get_list(pc, "upstreams");
+  const int num = upstreams != NULL ? cfg_list_length(upstreams) : 0;
+  if(num == 0) {
+    trace(LOG_ERR, "HTTP proxy %s: No upstreams configured", name);
+    return NULL;
+  }
+
+  http_proxy_t *hp = calloc(1, sizeof(http_proxy_t));
+  hp->hp_name = strdup(name);
+  pthread_mutex_init(&hp->hp_mutex, NULL);
+  hp->hp_upstreams = calloc(num, sizeof(http_upstream_t));
+
+  for(int i = 0; i < num; i++) {
+    const char *us = cfg_get_str(upstreams, CFGI(i), NULL);
+    if(us != NULL &&
+       !http_upstream_init(hp, &hp->hp_upstreams[hp->hp_num_upstreams], us))
+      hp->hp_num_upstreams++;
+  }
+
+  const char *balance = cfg_get_str(pc, CFG("balance"), "roundrobin");
+  hp->hp_balance = HTTP_PROXY_ROUNDROBIN;
+  if(!strcmp(balance, balance_names[HTTP_PROXY_LEASTCONN]))
+    hp->hp_balance = HTTP_PROXY_LEASTCONN;
+  else if(strcmp(balance, balance_names[HTTP_PROXY_ROUNDROBIN]))
+    trace(LOG_WARNING, "HTTP proxy %s: Unknown balance '%s', "
+          "using 'roundrobin'", name, balance);
+
+  const char *strip = cfg_get_str(pc, CFG("stripPrefix"), NULL);
+  hp->hp_strip_prefix = strip ? strdup(strip) : NULL;
+  const char *host = cfg_get_str(pc, CFG("host"), NULL);
+  hp->hp_host = host ? strdup(host) : NULL;
+
+  http_proxy_headers_init(&hp->hp_request_headers,
+                          cfg_get_map(pc, "requestHeaders"));
+  http_proxy_headers_init(&hp->hp_response_headers,
+                          cfg_get_map(pc, "responseHeaders"));
+
+  hp->hp_keepalive = cfg_get_int(pc, CFG("keepalive"), 16);
+  hp->hp_idle_timeout =
+    cfg_get_int(pc, CFG("idleTimeout"), 60) * 1000000LL;
+  hp->hp_connect_timeout =
+    cfg_get_int(pc, CFG("connectTimeout"), 2000) * 1000LL;
+  hp->hp_timeout = cfg_get_int(pc, CFG("timeout"), 30000) * 1000LL;
+  hp->hp_buffer_size = cfg_get_int(pc, CFG("bufferSize"), 1024 * 1024);
+
+  const char *check_path =
+    cfg_get_str(pc, CFG("healthCheck", "path"), NULL);
+  hp->hp_check_path = check_path ? strdup(check_path) : NULL;
+  hp->hp_check_interval =
+    cfg_get_int(pc, CFG("healthCheck", "interval"), 5) * 1000000LL;
+  hp->hp_check_timeout =
+    cfg_get_int(pc, CFG("healthCheck", "timeout"), 2000) * 1000LL;
+  hp->hp_unhealthy = MAX(cfg_get_int(pc, CFG("healthCheck", "unhealthy"),
+                                     3), 1);
+  hp->hp_healthy = MAX(cfg_get_int(pc, CFG("healthCheck", "healthy"), 2), 1);
+
+  asyncio_run_task(http_proxy_start, hp);
+  return hp;
+}
+
+
+/**
+ *
+ */
+http_proxy_t *
+http_proxy_find(const char *name)
+{
+  http_proxy_t *hp;
+  LIST_FOREACH(hp, &http_proxies, hp_link) {
+    if(!strcmp(hp->hp_name, name))
+      return hp;
+  }
+  return NULL;
+}
+
+
+/**
+ *
+ */
+void
+http_proxies_init(cfg_t *c)
+{
+  http_parser_settings_init(&http_proxy_parser_settings);
+  http_proxy_parser_settings.on_header_field = http_proxy_header_field;
+  http_proxy_parser_settings.on_header_value = http_proxy_header_value;
+  http_proxy_parser_settings.on_headers_complete =
+    http_proxy_headers_complete;
+  http_proxy_parser_settings.on_body = http_proxy_body_data;
+  http_proxy_parser_settings.on_message_complete =
+    http_proxy_message_complete;
+
+  http_parser_settings_init(&http_proxy_check_settings);
+  http_proxy_check_settings.on_headers_complete = http_proxy_check_headers;
+
+  htsmsg_field_t *f;
+  HTSMSG_FOREACH(f, c) {
+    cfg_t *pc = htsmsg_get_map_by_field(f);
+    if(pc == NULL || f->hmf_name == NULL || http_proxy_find(f->hmf_name))
+      continue;
+
+    http_proxy_t *hp = http_proxy_create(f->hmf_name, pc);
+    if(hp == NULL)
+      continue;
+    LIST_INSERT_HEAD(&http_proxies, hp, hp_link);
+
+    scoped_strvec(routes);
+    cfg_get_strvec(pc, "routes", &routes);
+    for(int i = 0; i < routes.count; i++)
+      http_route_add_proxy(strvec_get(&routes, i), hp, 0);
+
+    trace(LOG_INFO, "HTTP proxy %s: %d upstreams (%s), %zd routes",
+          hp->hp_name, hp->hp_num_upstreams, balance_names[hp->hp_balance],
+          routes.count);
+  }
+}
+
+
+/**
+ * Metrics
+ */
+
+void
+http_proxies_prometheus(mbuf_t *out)
+{
+  static const char *names[] = {
+    "requests_total", "failures_total", "inflight", "idle", "healthy"
+  };
+  http_proxy_t *hp;
+
+  if(LIST_FIRST(&http_proxies) == NULL)
+    return;
+
+  for(int m = 0; m < 5; m++) {
+    mbuf_qprintf(out, "# TYPE http_proxy_upstream_%s %s\n", names[m],
+                 m < 2 ? "counter" : "gauge");
+
+    LIST_FOREACH(hp, &http_proxies, hp_link) {
+      pthread_mutex_lock(&hp->hp_mutex);
+      for(int i = 0; i < hp->hp_num_upstreams; i++) {
+        const http_upstream_t *us = &hp->hp_upstreams[i];
+        uint64_t v;
+        switch(m) {
+        case 0:
+          v = __atomic_load_n(&us->us_requests, __ATOMIC_RELAXED);
+          break;
+        case 1:
+          v = __atomic_load_n(&us->us_failures, __ATOMIC_RELAXED);
+          break;
+        case 2:
+          v = atomic_get(&us->us_inflight);
+          break;
+        case 3:
+          v = us->us_num_idle;
+          break;
+        default:
+          v = us->us_healthy;
+          break;
+        }
+        mbuf_qprintf(out, "http_proxy_upstream_%s{proxy=\"%s\","
+                     "upstream=\"%s\"} %"PRIu64"\n", names[m],
+                     hp->hp_name, us->us_name, v);
+      }
+      pthread_mutex_unlock(&hp->hp_mutex);
+    }
+  }
+}
+
+
+/**
+ *
+ */
+ntv_t *
+http_proxies_ntv(void)
+{
+  http_proxy_t *hp;
+
+  if(LIST_FIRST(&http_proxies) == NULL)
+    return NULL;
+
+  ntv_t *m = ntv_create_map();
+  LIST_FOREACH(hp, &http_proxies, hp_link) {
+    ntv_t *p = ntv_create_map();
+    pthread_mutex_lock(&hp->hp_mutex);
+    for(int i = 0; i < hp->hp_num_upstreams; i++) {
+      const http_upstream_t *us = &hp->hp_upstreams[i];
+      ntv_t *u = ntv_create_map();
+      ntv_set_int64(u, "requests",
+                    __atomic_load_n(&us->us_requests, __ATOMIC_RELAXED));
+      ntv_set_int64(u, "failures",
+                    __atomic_load_n(&us->us_failures, __ATOMIC_RELAXED));
+      ntv_set_int(u, "inflight", atomic_get(&us->us_inflight));
+      ntv_set_int(u, "idle", us->us_num_idle);
+      ntv_set_int(u, "healthy", us->us_healthy);
+      ntv_set_ntv(p, us->us_name, u);
+    }
+    pthread_mutex_unlock(&hp->hp_mutex);
+    ntv_set_ntv(m, hp->hp_name, p);
+  }
+  return m;
+}
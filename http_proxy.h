@@ -0,0 +1,109 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+struct htsmsg;
+struct mbuf;
+struct ntv;
+
+/**
+ * Reverse proxy, routes forwarded to upstream HTTP/1.1 servers
+ *
+ * Proxies are configured under http.proxies, keyed on name:
+ *
+ *  "proxies": {
+ *    "api": {
+ *      "routes": ["/api"],
+ *      "upstreams": ["10.0.0.1:8080", "10.0.0.2:8080"],
+ *      "balance": "roundrobin",     // or "leastconn"
+ *      "stripPrefix": "/api",       // Removed from the upstream path
+ *      "host": "api.internal",      // Host header, default is client's
+ *      "requestHeaders": {"X-Api-Key": "secret", "Cookie": ""},
+ *      "responseHeaders": {"Server": ""},
+ *      "keepalive": 16,             // Idle connections per upstream
+ *      "idleTimeout": 60,           // s
+ *      "connectTimeout": 2000,      // ms
+ *      "timeout": 30000,            // ms without data from upstream
+ *      "bufferSize": 1048576,       // Bytes queued in either direction
+ *      "healthCheck": {
+ *        "path": "/health",
+ *        "interval": 5,             // s
+ *        "timeout": 2000,           // ms
+ *        "unhealthy": 3,            // Failures before taken out
+ *        "healthy": 2               // Passes before put back
+ *      }
+ *    }
+ *  }
+ *
+ * Requests are sent over pooled keepalive connections owned by the
+ * asyncio thread, no thread is held while waiting for the upstream.
+ * Request bodies are streamed to the upstream as they arrive (with
+ * backpressure on the client once bufferSize is queued) and responses
+ * are streamed back the same way. Hop-by-hop headers are dropped,
+ * X-Forwarded-For and X-Forwarded-Host are added. Headers listed in
+ * requestHeaders / responseHeaders replace the ones passed on, an empty
+ * value removes the header.
+ *
+ * Upstreams failing 'unhealthy' times in a row (connection errors,
+ * timeouts or failed health checks) are taken out of rotation. With a
+ * healthCheck they're put back after 'healthy' passed checks, otherwise
+ * they are retried after 10 seconds. If all upstreams are out requests
+ * are replied to with 502.
+ *
+ * Requests without body (other than POST and PATCH) are retried once
+ * on another connection if they fail before anything has been received
+ * on a reused keepalive connection (the upstream closed it while idle)
+ * or on a connection that was never established.
+ */
+
+typedef struct http_proxy http_proxy_t;
+
+/**
+ * Called by http_server_init() with the http.proxies map. Routes
+ * listed in the configuration are added
+ */
+void http_proxies_init(struct htsmsg *c);
+
+// NULL if there is no proxy configured with that name
+http_proxy_t *http_proxy_find(const char *name);
+
+/**
+ * Forward requests to 'path' to 'hp'. Request bodies are streamed
+ * (see http_route_add_stream())
+ */
+void http_route_add_proxy(const char *path, http_proxy_t *hp, int flags);
+
+void http_proxies_prometheus(struct mbuf *out);
+
+struct ntv *http_proxies_ntv(void);
+
+/**
+ * Route callbacks, used by http_route_add_proxy()
+ */
+struct http_request;
+
+int http_proxy_request(http_proxy_t *hp, struct http_request *hr);
+
+int http_proxy_body(http_proxy_t *hp, struct http_request *hr,
+                    struct mbuf *mq, int flags);
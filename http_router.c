@@ -0,0 +1,550 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "http_router.h"
+#include "strvec.h"
+#include "misc.h"
+
+#define PARAM_INT  0
+#define PARAM_STR  1
+#define PARAM_REST 2
+#define NUM_PARAM_TYPES 3
+
+#define MODE_EXACT    0
+#define MODE_PREFIX   1
+#define MODE_BOUNDARY 2
+
+#define REGEX_SPECIALS ".[]()*+?{}|^$\\"
+
+typedef struct http_router_entry {
+  struct http_router_entry *hre_next;
+  void *hre_opaque;
+  int hre_method;
+  int hre_depth;
+  int hre_mode;
+} http_router_entry_t;
+
+
+typedef struct http_router_node {
+  char *hrn_label;
+  int hrn_label_len;
+
+  // Literal children, sorted on first character of label
+  int hrn_num_children;
+  struct http_router_node **hrn_children;
+
+  struct http_router_node *hrn_params[NUM_PARAM_TYPES];
+
+  http_router_entry_t *hrn_entries;
+} http_router_node_t;
+
+
+struct http_router {
+  http_router_node_t rt_root;
+  int rt_flags;
+};
+
+
+typedef struct pattern_token {
+  int pt_param; // -1 for literal, otherwise PARAM_*
+  const char *pt_str;
+  int pt_len;
+} pattern_token_t;
+
+
+/**
+ *
+ */
+http_router_t *
+http_router_create(int flags)
+{
+  http_router_t *rt = calloc(1, sizeof(http_router_t));
+  rt->rt_flags = flags;
+  return rt;
+}
+
+
+/**
+ * Returns number of characters consumed if 's' starts with a parameter
+ */
+static int
+parse_param(const char *s, int *typep, const char **namep, int *namelenp)
+{
+  static const struct {
+    const char *re;
+    int type;
+  } groups[] = {
+    { "([^/]+)",  PARAM_STR },
+    { "([0-9]+)", PARAM_INT },
+    { "(.*)",     PARAM_REST },
+  };
+
+  if(*s == '{') {
+    const char *n = s + 1;
+    int l = 0;
+    if(!isalpha((unsigned char)n[0]) && n[0] != '_')
+      return 0;
+
+    while(isalnum((unsigned char)n[l]) || n[l] == '_')
+      l++;
+
+    const char *t = n + l;
+    int type = PARAM_STR;
+
+    if(*t == ':') {
+      t++;
+      if(!strncmp(t, "int}", 4)) {
+        type = PARAM_INT;
+        t += 3;
+      } else if(!strncmp(t, "str}", 4)) {
+        t += 3;
+      } else if(!strncmp(t, "*}", 2)) {
+        type = PARAM_REST;
+        t += 1;
+      } else {
+        return 0;
+      }
+    }
+    if(*t != '}')
+      return 0;
+
+    *typep = type;
+    *namep = n;
+    *namelenp = l;
+    return t + 1 - s;
+  }
+
+  for(int i = 0; i < ARRAYSIZE(groups); i++) {
+    const char *e = mystrbegins(s, groups[i].re);
+    if(e == NULL)
+      continue;
+
+    // If something else follows, the regex engine could backtrack into
+    // the subexpression and we would not match the same thing
+    if(*e && *e != '$' && *e != '/')
+      return 0;
+
+    *typep = groups[i].type;
+    *namep = "";
+    *namelenp = 0;
+    return e - s;
+  }
+  return 0;
+}
+
+
+/**
+ * Split pattern into literals and parameters
+ *
+ * Literal strings are unescaped into 'buf' which must be at least
+ * as large as the pattern
+ *
+ * Returns number of tokens or -1 if the pattern needs a regex engine
+ */
+static int
+pattern_tokenize(const char *s, int flags, int icase, char *buf,
+                 pattern_token_t *tokens, int *modep)
+{
+  int num_tokens = 0;
+  pattern_token_t *lit = NULL;
+
+  *modep = flags & HTTP_ROUTER_BOUNDARY ? MODE_BOUNDARY : MODE_PREFIX;
+
+  while(*s) {
+    int c = *s;
+
+    if(!(flags & HTTP_ROUTER_LITERAL)) {
+      int type, namelen, len;
+      const char *name;
+
+      if(c == '\\') {
+        if(s[1] == 0 || strchr(REGEX_SPECIALS, s[1]) == NULL)
+          return -1;
+        c = s[1];
+        s++;
+
+      } else if(c == '$') {
+        if(s[1])
+          return -1;
+        *modep = MODE_EXACT;
+        break;
+
+      } else if((len = parse_param(s, &type, &name, &namelen)) != 0) {
+        s += len;
+
+        if(type == PARAM_REST && *s && strcmp(s, "$"))
+          return -1;
+
+        if(type == PARAM_STR && *s && *s != '/' && *s != '$')
+          return -1; // Would never match
+
+        pattern_token_t *t = &tokens[num_tokens++];
+        t->pt_param = type;
+        t->pt_str = name;
+        t->pt_len = namelen;
+        lit = NULL;
+        continue;
+
+      } else if(strchr(REGEX_SPECIALS, c) != NULL) {
+        return -1;
+      }
+    }
+
+    if(lit == NULL) {
+      lit = &tokens[num_tokens++];
+      lit->pt_param = -1;
+      lit->pt_str = buf;
+      lit->pt_len = 0;
+    }
+    *buf++ = icase ? tolower((unsigned char)c) : c;
+    lit->pt_len++;
+    s++;
+  }
+  return num_tokens;
+}
+
+
+/**
+ *
+ */
+static int
+node_find_child(const http_router_node_t *n, char c)
+{
+  int lo = 0, hi = n->hrn_num_children;
+  while(lo < hi) {
+    const int mid = (lo + hi) / 2;
+    const char x = n->hrn_children[mid]->hrn_label[0];
+    if(x == c)
+      return mid;
+    if(x < c)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return -lo - 1;
+}
+
+
+/**
+ *
+ */
+static http_router_node_t *
+node_create(const char *label, int len)
+{
+  http_router_node_t *n = calloc(1, sizeof(http_router_node_t));
+  n->hrn_label = malloc(len + 1);
+  memcpy(n->hrn_label, label, len);
+  n->hrn_label[len] = 0;
+  n->hrn_label_len = len;
+  return n;
+}
+
+
+/**
+ *
+ */
+static http_router_node_t *
+node_insert_literal(http_router_node_t *n, const char *s, int len)
+{
+  while(len > 0) {
+    int idx = node_find_child(n, s[0]);
+
+    if(idx < 0) {
+      idx = -idx - 1;
+      http_router_node_t *c = node_create(s, len);
+      n->hrn_children = realloc(n->hrn_children,
+                                sizeof(n->hrn_children[0]) *
+                                (n->hrn_num_children + 1));
+      memmove(n->hrn_children + idx + 1, n->hrn_children + idx,
+              sizeof(n->hrn_children[0]) * (n->hrn_num_children - idx));
+      n->hrn_children[idx] = c;
+      n->hrn_num_children++;
+      return c;
+    }
+
+    http_router_node_t *c = n->hrn_children[idx];
+    int common = 1;
+    while(common < len && common < c->hrn_label_len &&
+          c->hrn_label[common] == s[common])
+      common++;
+
+    if(common < c->hrn_label_len) {
+      // Split edge
+      http_router_node_t *mid = node_create(c->hrn_label, common);
+      mid->hrn_children = malloc(sizeof(mid->hrn_children[0]));
+      mid->hrn_children[0] = c;
+      mid->hrn_num_children = 1;
+
+      c->hrn_label_len -= common;
+      memmove(c->hrn_label, c->hrn_label + common, c->hrn_label_len + 1);
+      n->hrn_children[idx] = mid;
+      c = mid;
+    }
+    s += common;
+    len -= common;
+    n = c;
+  }
+  return n;
+}
+
+
+/**
+ *
+ */
+int
+http_router_add(http_router_t *rt, const char *pattern, int flags,
+                int method, int depth, void *opaque, strvec_t *names)
+{
+  const size_t len = strlen(pattern);
+  char buf[len + 1];
+  pattern_token_t tokens[len + 1];
+  int mode;
+
+  const int num_tokens = pattern_tokenize(pattern, flags,
+                                          rt->rt_flags & HTTP_ROUTER_ICASE,
+                                          buf, tokens, &mode);
+  if(num_tokens < 0)
+    return -1;
+
+  int num_params = 0;
+  for(int i = 0; i < num_tokens; i++) {
+    if(tokens[i].pt_param != -1)
+      num_params++;
+  }
+  if(num_params > HTTP_ROUTER_MAX_PARAMS)
+    return -1;
+
+  http_router_node_t *n = &rt->rt_root;
+
+  for(int i = 0; i < num_tokens; i++) {
+    const pattern_token_t *t = &tokens[i];
+    if(t->pt_param == -1) {
+      n = node_insert_literal(n, t->pt_str, t->pt_len);
+      continue;
+    }
+
+    if(n->hrn_params[t->pt_param] == NULL)
+      n->hrn_params[t->pt_param] = calloc(1, sizeof(http_router_node_t));
+    n = n->hrn_params[t->pt_param];
+
+    if(names != NULL)
+      strvec_push_alloced(names, strndup(t->pt_str, t->pt_len));
+  }
+
+  http_router_entry_t *e = calloc(1, sizeof(http_router_entry_t)), **p;
+  e->hre_opaque = opaque;
+  e->hre_method = method;
+  e->hre_depth  = depth;
+  e->hre_mode   = mode;
+
+  for(p = &n->hrn_entries; *p != NULL; p = &(*p)->hre_next) {}
+  *p = e;
+  return 0;
+}
+
+
+
+typedef struct router_lookup {
+  const char *rl_path;
+  int rl_method;
+  int rl_icase;
+  int rl_method_mismatch;
+
+  int rl_num_params;
+  regmatch_t rl_params[HTTP_ROUTER_MAX_PARAMS];
+
+  const http_router_entry_t *rl_best;
+  int rl_best_len;
+  regmatch_t *rl_match;
+  int rl_max_match;
+} router_lookup_t;
+
+
+/**
+ * Deeper patterns win, then exact matches, then longest match
+ */
+static int
+entry_is_better(const router_lookup_t *rl, const http_router_entry_t *e,
+                int len)
+{
+  const http_router_entry_t *b = rl->rl_best;
+  if(b == NULL)
+    return 1;
+  if(e->hre_depth != b->hre_depth)
+    return e->hre_depth > b->hre_depth;
+
+  const int e_exact = e->hre_mode == MODE_EXACT;
+  const int b_exact = b->hre_mode == MODE_EXACT;
+  if(e_exact != b_exact)
+    return e_exact;
+  return len > rl->rl_best_len;
+}
+
+
+/**
+ *
+ */
+static void
+router_match_entries(router_lookup_t *rl, const http_router_node_t *n,
+                     const char *s)
+{
+  const http_router_entry_t *e;
+  const int len = s - rl->rl_path;
+
+  for(e = n->hrn_entries; e != NULL; e = e->hre_next) {
+    switch(e->hre_mode) {
+    case MODE_EXACT:
+      if(*s)
+        continue;
+      break;
+    case MODE_BOUNDARY:
+      if(*s && *s != '/' && *s != '?')
+        continue;
+      break;
+    }
+
+    if(e->hre_method != HTTP_ROUTER_ANY_METHOD &&
+       e->hre_method != rl->rl_method) {
+      rl->rl_method_mismatch = 1;
+      continue;
+    }
+
+    if(!entry_is_better(rl, e, len))
+      continue;
+
+    rl->rl_best = e;
+    rl->rl_best_len = len;
+
+    if(rl->rl_max_match == 0)
+      continue;
+
+    regmatch_t *m = rl->rl_match;
+    m[0].rm_so = 0;
+    m[0].rm_eo = len;
+    int i;
+    for(i = 1; i <= rl->rl_num_params && i < rl->rl_max_match; i++)
+      m[i] = rl->rl_params[i - 1];
+    if(i < rl->rl_max_match)
+      m[i].rm_so = m[i].rm_eo = -1;
+  }
+}
+
+
+/**
+ *
+ */
+static void
+router_match(router_lookup_t *rl, const http_router_node_t *n, const char *s)
+{
+  if(n->hrn_entries != NULL)
+    router_match_entries(rl, n, s);
+
+  if(*s) {
+    const char c = rl->rl_icase ? tolower((unsigned char)*s) : *s;
+    const int idx = node_find_child(n, c);
+    if(idx >= 0) {
+      const http_router_node_t *cn = n->hrn_children[idx];
+      int i;
+      for(i = 1; i < cn->hrn_label_len; i++) {
+        const char x = rl->rl_icase ? tolower((unsigned char)s[i]) : s[i];
+        if(x != cn->hrn_label[i])
+          break;
+      }
+      if(i == cn->hrn_label_len)
+        router_match(rl, cn, s + i);
+    }
+  }
+
+  if(rl->rl_num_params == HTTP_ROUTER_MAX_PARAMS)
+    return;
+
+  for(int i = 0; i < NUM_PARAM_TYPES; i++) {
+    const http_router_node_t *p = n->hrn_params[i];
+    size_t len;
+    if(p == NULL)
+      continue;
+
+    switch(i) {
+    case PARAM_INT:
+      len = strspn(s, "0123456789");
+      break;
+    case PARAM_STR:
+      len = strcspn(s, "/");
+      break;
+    default:
+      len = strlen(s);
+      break;
+    }
+
+    if(len == 0 && i != PARAM_REST)
+      continue;
+
+    regmatch_t *m = &rl->rl_params[rl->rl_num_params++];
+    m->rm_so = s - rl->rl_path;
+    m->rm_eo = m->rm_so + len;
+    router_match(rl, p, s + len);
+    rl->rl_num_params--;
+  }
+}
+
+
+/**
+ *
+ */
+void *
+http_router_lookup(const http_router_t *rt, const char *path, int method,
+                   regmatch_t *match, int max_match,
+                   int *depthp, int *statusp)
+{
+  router_lookup_t rl;
+
+  rl.rl_path = path;
+  rl.rl_method = method;
+  rl.rl_method_mismatch = 0;
+  rl.rl_num_params = 0;
+  rl.rl_best = NULL;
+  rl.rl_best_len = 0;
+  rl.rl_match = match;
+  rl.rl_max_match = max_match;
+
+  if(rt != NULL) {
+    rl.rl_icase = rt->rt_flags & HTTP_ROUTER_ICASE;
+    router_match(&rl, &rt->rt_root, path);
+  }
+
+  if(rl.rl_best == NULL) {
+    if(depthp != NULL)
+      *depthp = -1;
+    if(statusp != NULL)
+      *statusp = rl.rl_method_mismatch ? 405 : 404;
+    return NULL;
+  }
+
+  if(depthp != NULL)
+    *depthp = rl.rl_best->hre_depth;
+  return rl.rl_best->hre_opaque;
+}
@@ -0,0 +1,91 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+#include <regex.h>
+
+struct strvec;
+
+/**
+ * Compiled radix tree for HTTP request paths
+ *
+ * Patterns consist of literal characters and typed parameters:
+ *
+ *   {name}       One or more characters up to the next '/'
+ *   {name:str}   Same as above
+ *   {name:int}   One or more decimal digits
+ *   {name:*}     Rest of the path (possibly empty), must be last
+ *
+ * The regex subexpressions "([^/]+)", "([0-9]+)" and a trailing "(.*)" are
+ * accepted as unnamed parameters when they are followed by '/', '$' or end
+ * of pattern since they then match exactly the same thing.
+ *
+ * A pattern ending with '$' must match the entire path. Otherwise it
+ * matches as a prefix (or at a path boundary, see below).
+ */
+
+typedef struct http_router http_router_t;
+
+#define HTTP_ROUTER_ANY_METHOD     -1
+
+#define HTTP_ROUTER_MAX_PARAMS     31
+
+// Unanchored patterns match only if followed by '/', '?' or end of path
+#define HTTP_ROUTER_BOUNDARY       0x1
+
+// Pattern is a plain string, no parameters or escapes
+#define HTTP_ROUTER_LITERAL        0x2
+
+// Match literal characters case insensitively
+#define HTTP_ROUTER_ICASE          0x4
+
+http_router_t *http_router_create(int flags);
+
+/**
+ * Returns 0 if pattern was added, -1 if it can't be represented in the tree
+ * (ie, it needs a real regex engine)
+ *
+ * If 'names' is non-NULL the name of each parameter is pushed to it
+ * (empty string for unnamed parameters)
+ */
+int http_router_add(http_router_t *rt, const char *pattern, int flags,
+                    int method, int depth, void *opaque,
+                    struct strvec *names);
+
+/**
+ * Find the most specific match for 'path'
+ *
+ * 'match' is filled in the same way as regexec() does: match[0] spans
+ * the matched part of the path and match[1..n] each parameter. The entry
+ * after the last parameter has rm_so set to -1 (if there is room)
+ *
+ * If nothing matches NULL is returned and *statusp (if non-NULL) is set
+ * to 405 if the path matched but not for the given method, 404 otherwise
+ *
+ * No memory is allocated during lookup
+ */
+void *http_router_lookup(const http_router_t *rt, const char *path,
+                         int method, regmatch_t *match, int max_match,
+                         int *depthp, int *statusp);
@@ -0,0 +1,478 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "atomic.h"
+#include "asyncio.h"
+#include "murmur3.h"
+#include "mbuf.h"
+#include "ntv.h"
+#include "http.h"
+#include "http_sse.h"
+
+#define HTTP_SSE_HASH_SIZE 256
+
+// Subscribers are checked for heartbeats and coalesced events this often
+#define HTTP_SSE_TICK 1000000
+
+/**
+ * An event serialized into its event:/data: form, shared by all
+ * subscribers it's queued to
+ */
+typedef struct http_sse_frame {
+  atomic_t hsf_refcount;
+  size_t hsf_size;
+  char hsf_data[0];
+} http_sse_frame_t;
+
+/**
+ * Freed by http_sse_done() once the request is done, after it has been
+ * dropped from its topic
+ */
+typedef struct http_sse_subscriber {
+  LIST_ENTRY(http_sse_subscriber) hss_link;
+  http_request_t *hss_request;  // NULL once dropped
+  struct http_sse_hub *hss_hub;
+  struct http_sse_topic *hss_topic;
+  http_sse_frame_t *hss_pending;  // Latest event while over watermark
+  int64_t hss_last_send;
+} http_sse_subscriber_t;
+
+typedef struct http_sse_topic {
+  LIST_ENTRY(http_sse_topic) hst_link;
+  LIST_HEAD(, http_sse_subscriber) hst_subscribers;
+  int hst_num_subscribers;
+  char hst_name[0];
+} http_sse_topic_t;
+
+LIST_HEAD(http_sse_topic_list, http_sse_topic);
+
+struct http_sse_hub {
+  pthread_mutex_t hsh_mutex;
+  struct http_sse_topic_list hsh_topics[HTTP_SSE_HASH_SIZE];
+  int64_t hsh_heartbeat;
+  size_t hsh_high_watermark;
+  int hsh_slow_policy;
+  asyncio_timer_t hsh_timer;
+};
+
+static const char http_sse_heartbeat_data[] = ":\n\n";
+
+
+/**
+ *
+ */
+static void
+http_sse_frame_release(void *opaque)
+{
+  http_sse_frame_t *hsf = opaque;
+  if(atomic_dec(&hsf->hsf_refcount))
+    return;
+  free(hsf);
+}
+
+
+/**
+ *
+ */
+static http_sse_frame_t *
+http_sse_frame_create(mbuf_t *mq)
+{
+  http_sse_frame_t *hsf = malloc(sizeof(http_sse_frame_t) + mq->mq_size);
+  atomic_set(&hsf->hsf_refcount, 1);
+  hsf->hsf_size = mq->mq_size;
+  mbuf_read(mq, hsf->hsf_data, hsf->hsf_size);
+  return hsf;
+}
+
+
+/**
+ *
+ */
+static struct http_sse_topic_list *
+http_sse_bucket(http_sse_hub_t *hub, const char *topic)
+{
+  const uint32_t hash = MurHash3_32(topic, strlen(topic), 0);
+  return &hub->hsh_topics[hash & (HTTP_SSE_HASH_SIZE - 1)];
+}
+
+
+/**
+ * Must be called with hsh_mutex held
+ */
+static http_sse_topic_t *
+http_sse_topic_find(http_sse_hub_t *hub, const char *topic, int create)
+{
+  struct http_sse_topic_list *bucket = http_sse_bucket(hub, topic);
+  http_sse_topic_t *hst;
+
+  LIST_FOREACH(hst, bucket, hst_link) {
+    if(!strcmp(hst->hst_name, topic))
+      return hst;
+  }
+  if(!create)
+    return NULL;
+
+  const size_t len = strlen(topic);
+  hst = calloc(1, sizeof(http_sse_topic_t) + len + 1);
+  memcpy(hst->hst_name, topic, len + 1);
+  LIST_INSERT_HEAD(bucket, hst, hst_link);
+  return hst;
+}
+
+
+/**
+ * Topics are not freed when a subscriber is dropped since that may
+ * happen while we loop over them. Must be called with hsh_mutex held
+ */
+static void
+http_sse_topic_gc(http_sse_topic_t *hst)
+{
+  if(hst->hst_num_subscribers)
+    return;
+  LIST_REMOVE(hst, hst_link);
+  free(hst);
+}
+
+
+/**
+ * Must be called with hsh_mutex held
+ */
+static void
+http_sse_drop(http_sse_topic_t *hst, http_sse_subscriber_t *hss)
+{
+  http_request_t *hr = hss->hss_request;
+
+  LIST_REMOVE(hss, hss_link);
+  hst->hst_num_subscribers--;
+  if(hss->hss_pending != NULL)
+    http_sse_frame_release(hss->hss_pending);
+  hss->hss_pending = NULL;
+  hss->hss_request = NULL;
+
+  // The response never ends so the connection can't be reused
+  hr->hr_keep_alive = 0;
+  http_request_complete(hr, 0);
+}
+
+
+/**
+ *
+ */
+static int
+http_sse_write(http_sse_subscriber_t *hss, const void *data, size_t size,
+               http_sse_frame_t *hsf)
+{
+  mbuf_t mq;
+  mbuf_init(&mq);
+  if(hsf != NULL)
+    atomic_inc(&hsf->hsf_refcount);
+  mbuf_append_external(&mq, data, size,
+                       hsf != NULL ? http_sse_frame_release : NULL, hsf);
+  hss->hss_last_send = asyncio_now();
+  return http_response_sendq(hss->hss_request, &mq);
+}
+
+
+/**
+ * Returns -1 if the subscriber should be dropped. Must be called with
+ * hsh_mutex held
+ */
+static int
+http_sse_send(http_sse_hub_t *hub, http_sse_subscriber_t *hss,
+              http_sse_frame_t *hsf)
+{
+  if(http_response_queued(hss->hss_request) > hub->hsh_high_watermark) {
+    if(hub->hsh_slow_policy == HTTP_SSE_SLOW_DROP)
+      return -1;
+
+    atomic_inc(&hsf->hsf_refcount);
+    if(hss->hss_pending != NULL)
+      http_sse_frame_release(hss->hss_pending);
+    hss->hss_pending = hsf;
+    return 0;
+  }
+
+  // Anything coalesced is superseded by this one
+  if(hss->hss_pending != NULL) {
+    http_sse_frame_release(hss->hss_pending);
+    hss->hss_pending = NULL;
+  }
+  return http_sse_write(hss, hsf->hsf_data, hsf->hsf_size, hsf);
+}
+
+
+/**
+ * Heartbeats and delivery of coalesced events, on the asyncio thread
+ */
+static void
+http_sse_tick(void *aux)
+{
+  http_sse_hub_t *hub = aux;
+  const int64_t now = asyncio_now();
+
+  pthread_mutex_lock(&hub->hsh_mutex);
+
+  for(int i = 0; i < HTTP_SSE_HASH_SIZE; i++) {
+    http_sse_topic_t *hst, *hst_next;
+    for(hst = LIST_FIRST(&hub->hsh_topics[i]); hst != NULL; hst = hst_next) {
+      hst_next = LIST_NEXT(hst, hst_link);
+
+      http_sse_subscriber_t *hss, *hss_next;
+      for(hss = LIST_FIRST(&hst->hst_subscribers); hss != NULL;
+          hss = hss_next) {
+        hss_next = LIST_NEXT(hss, hss_link);
+        int err = 0;
+
+        if(hss->hss_pending != NULL) {
+          if(http_response_queued(hss->hss_request) <=
+             hub->hsh_high_watermark / 2) {
+            http_sse_frame_t *hsf = hss->hss_pending;
+            hss->hss_pending = NULL;
+            err = http_sse_write(hss, hsf->hsf_data, hsf->hsf_size, hsf);
+            http_sse_frame_release(hsf);
+          }
+        } else if(now - hss->hss_last_send >= hub->hsh_heartbeat) {
+          err = http_sse_write(hss, http_sse_heartbeat_data,
+                               sizeof(http_sse_heartbeat_data) - 1, NULL);
+        }
+
+        if(err)
+          http_sse_drop(hst, hss);
+      }
+      http_sse_topic_gc(hst);
+    }
+  }
+
+  pthread_mutex_unlock(&hub->hsh_mutex);
+  asyncio_timer_arm_delta(&hub->hsh_timer, HTTP_SSE_TICK);
+}
+
+
+/**
+ *
+ */
+static void
+http_sse_hub_start(void *aux)
+{
+  http_sse_hub_t *hub = aux;
+  asyncio_timer_arm_delta(&hub->hsh_timer, HTTP_SSE_TICK);
+}
+
+
+/**
+ *
+ */
+http_sse_hub_t *
+http_sse_hub_create(int heartbeat, size_t high_watermark, int slow_policy)
+{
+  http_sse_hub_t *hub = calloc(1, sizeof(http_sse_hub_t));
+  pthread_mutex_init(&hub->hsh_mutex, NULL);
+  hub->hsh_heartbeat = heartbeat * 1000000LL;
+  hub->hsh_high_watermark = high_watermark;
+  hub->hsh_slow_policy = slow_policy;
+  asyncio_timer_init(&hub->hsh_timer, http_sse_tick, hub);
+  asyncio_run_task(http_sse_hub_start, hub);
+  return hub;
+}
+
+
+/**
+ * Request is done, on the asyncio thread. If the client went away the
+ * subscriber is still in its topic
+ */
+static void
+http_sse_done(void *opaque, int cancelled)
+{
+  http_sse_subscriber_t *hss = opaque;
+  http_sse_hub_t *hub = hss->hss_hub;
+
+  pthread_mutex_lock(&hub->hsh_mutex);
+  if(hss->hss_request != NULL) {
+    http_sse_topic_t *hst = hss->hss_topic;
+    http_sse_drop(hst, hss);
+    http_sse_topic_gc(hst);
+  }
+  pthread_mutex_unlock(&hub->hsh_mutex);
+  free(hss);
+}
+
+
+/**
+ *
+ */
+int
+http_sse_subscribe(http_request_t *hr, http_sse_hub_t *hub,
+                   const char *topic)
+{
+  http_arg_set(&hr->hr_response_headers, "X-Accel-Buffering", "no");
+  if(http_response_begin(hr, 200, "text/event-stream", -1, NULL, 0))
+    return 0;
+
+  http_sse_subscriber_t *hss = calloc(1, sizeof(http_sse_subscriber_t));
+  hss->hss_request = hr;
+  hss->hss_hub = hub;
+  hss->hss_last_send = asyncio_now();
+
+  // Held until the subscriber is in its topic, so http_sse_done() (if
+  // the client is already gone) finds it there
+  pthread_mutex_lock(&hub->hsh_mutex);
+  http_request_on_done(hr, http_sse_done, hss);
+  const int r = http_request_defer(hr, 0);
+  // Nothing else will write to the response from now on
+  http_request_resume(hr);
+
+  http_sse_topic_t *hst = http_sse_topic_find(hub, topic, 1);
+  hss->hss_topic = hst;
+  LIST_INSERT_HEAD(&hst->hst_subscribers, hss, hss_link);
+  hst->hst_num_subscribers++;
+  pthread_mutex_unlock(&hub->hsh_mutex);
+  return r;
+}
+
+
+/**
+ *
+ */
+static void
+http_sse_publish_frame(http_sse_hub_t *hub, const char *topic, mbuf_t *mq)
+{
+  http_sse_frame_t *hsf = http_sse_frame_create(mq);
+
+  pthread_mutex_lock(&hub->hsh_mutex);
+  http_sse_topic_t *hst = http_sse_topic_find(hub, topic, 0);
+  if(hst != NULL) {
+    http_sse_subscriber_t *hss, *next;
+    for(hss = LIST_FIRST(&hst->hst_subscribers); hss != NULL; hss = next) {
+      next = LIST_NEXT(hss, hss_link);
+      if(http_sse_send(hub, hss, hsf))
+        http_sse_drop(hst, hss);
+    }
+    http_sse_topic_gc(hst);
+  }
+  pthread_mutex_unlock(&hub->hsh_mutex);
+
+  http_sse_frame_release(hsf);
+}
+
+
+/**
+ * Don't serialize anything nobody will see
+ */
+static int
+http_sse_has_subscribers(http_sse_hub_t *hub, const char *topic)
+{
+  pthread_mutex_lock(&hub->hsh_mutex);
+  const int r = http_sse_topic_find(hub, topic, 0) != NULL;
+  pthread_mutex_unlock(&hub->hsh_mutex);
+  return r;
+}
+
+
+/**
+ * CR and LF are stripped, they would end the event: line and let the
+ * rest of the name pass as fields of its own
+ */
+static void
+http_sse_append_event(mbuf_t *mq, const char *event)
+{
+  if(event == NULL)
+    return;
+
+  mbuf_append(mq, "event: ", 7);
+  while(*event) {
+    const size_t len = strcspn(event, "\r\n");
+    mbuf_append(mq, event, len);
+    event += len;
+    if(*event)
+      event++;
+  }
+  mbuf_append(mq, "\n", 1);
+}
+
+
+/**
+ *
+ */
+void
+http_sse_publish(http_sse_hub_t *hub, const char *topic,
+                 const char *event, const ntv_t *data)
+{
+  if(!http_sse_has_subscribers(hub, topic))
+    return;
+
+  mbuf_t mq;
+  mbuf_init(&mq);
+  http_sse_append_event(&mq, event);
+  mbuf_append(&mq, "data: ", 6);
+  ntv_json_serialize(data, &mq, 0);
+  mbuf_append(&mq, "\n\n", 2);
+  http_sse_publish_frame(hub, topic, &mq);
+}
+
+
+/**
+ *
+ */
+void
+http_sse_publish_text(http_sse_hub_t *hub, const char *topic,
+                      const char *event, const char *text)
+{
+  if(!http_sse_has_subscribers(hub, topic))
+    return;
+
+  mbuf_t mq;
+  mbuf_init(&mq);
+  http_sse_append_event(&mq, event);
+
+  while(1) {
+    const size_t len = strcspn(text, "\r\n");
+    mbuf_append(&mq, "data: ", 6);
+    mbuf_append(&mq, text, len);
+    mbuf_append(&mq, "\n", 1);
+    text += len;
+    if(*text == 0)
+      break;
+    text += text[0] == '\r' && text[1] == '\n' ? 2 : 1;
+  }
+  mbuf_append(&mq, "\n", 1);
+  http_sse_publish_frame(hub, topic, &mq);
+}
+
+
+/**
+ *
+ */
+int
+http_sse_subscribers(http_sse_hub_t *hub, const char *topic)
+{
+  pthread_mutex_lock(&hub->hsh_mutex);
+  const http_sse_topic_t *hst = http_sse_topic_find(hub, topic, 0);
+  const int r = hst != NULL ? hst->hst_num_subscribers : 0;
+  pthread_mutex_unlock(&hub->hsh_mutex);
+  return r;
+}
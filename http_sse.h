@@ -0,0 +1,79 @@
+/******************************************************************************
+* Copyright (C) 2008 - 2014 Andreas Öman
+*
+* Permission is hereby granted, free of charge, to any person obtaining
+* a copy of this software and associated documentation files (the
+* "Software"), to deal in the Software without restriction, including
+* without limitation the rights to use, copy, modify, merge, publish,
+* distribute, sublicense, and/or sell copies of the Software, and to
+* permit persons to whom the Software is furnished to do so, subject to
+* the following conditions:
+*
+* The above copyright notice and this permission notice shall be
+* included in all copies or substantial portions of the Software.
+*
+* THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+* EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+* MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+* IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY
+* CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT,
+* TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE
+* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+******************************************************************************/
+
+#pragma once
+
+#include <stddef.h>
+
+struct ntv;
+struct http_request;
+
+/**
+ * Server-Sent Events
+ *
+ * A hub keeps subscribers (requests answered with a never ending
+ * text/event-stream response) by topic. A published event is serialized
+ * once and the same buffer is queued to every subscriber of the topic.
+ *
+ * A comment line is sent to subscribers that have not received anything
+ * for 'heartbeat' seconds so proxies don't time out the connection and
+ * so clients that are gone are noticed.
+ *
+ * Subscribers with more than 'high_watermark' bytes queued are slow. With
+ * HTTP_SSE_SLOW_DROP they are disconnected (clients reconnect by
+ * themselves), with HTTP_SSE_SLOW_COALESCE only the latest event is kept
+ * and sent once the queue is down to half the watermark.
+ *
+ * Hubs live forever.
+ */
+
+typedef struct http_sse_hub http_sse_hub_t;
+
+#define HTTP_SSE_SLOW_DROP     0
+#define HTTP_SSE_SLOW_COALESCE 1
+
+http_sse_hub_t *http_sse_hub_create(int heartbeat, size_t high_watermark,
+                                    int slow_policy);
+
+/**
+ * Called from a route callback, return what it returns. The response
+ * is started and the request is deferred (see http_request_defer())
+ * until the subscriber is dropped, which also happens as soon as the
+ * client goes away
+ */
+int http_sse_subscribe(struct http_request *hr, http_sse_hub_t *hub,
+                       const char *topic);
+
+/**
+ * 'event' may be NULL for the default 'message' event, any CR and LF
+ * in it are stripped. 'data' is sent as JSON. Can be called from any
+ * thread
+ */
+void http_sse_publish(http_sse_hub_t *hub, const char *topic,
+                      const char *event, const struct ntv *data);
+
+// Each line of 'text' is sent as a data: line
+void http_sse_publish_text(http_sse_hub_t *hub, const char *topic,
+                           const char *event, const char *text);
+
+int http_sse_subscribers(http_sse_hub_t *hub, const char *topic);
@@ -58,7 +58,10 @@ void
 mbuf_data_free(mbuf_t *mq, mbuf_data_t *md)
 {
   TAILQ_REMOVE(&mq->mq_buffers, md, md_link);
-  free(md->md_data);
+  if(md->md_release != NULL)
+    md->md_release(md->md_opaque);
+  else
+    free(md->md_data);
   free(md);
 }
 
@@ -108,6 +111,7 @@ mbuf_append(mbuf_t *mq, const void *buf, size_t len)
   md->md_data_size = c;
   md->md_data_len = len;
   md->md_data_off = 0;
+  md->md_release = NULL;
   memcpy(md->md_data, buf, len);
 }
 
@@ -128,6 +132,75 @@ mbuf_append_prealloc(mbuf_t *mq, void *buf, size_t len)
   md->md_data_size = len;
   md->md_data_len = len;
   md->md_data_off = 0;
+  md->md_release = NULL;
+}
+
+
+/**
+ *
+ */
+static void
+mbuf_release_nop(void *opaque)
+{
+}
+
+
+/**
+ *
+ */
+void
+mbuf_append_external(mbuf_t *mq, const void *buf, size_t len,
+                     void (*release)(void *opaque), void *opaque)
+{
+  mbuf_data_t *md;
+
+  mq->mq_size += len;
+
+  md = malloc(sizeof(mbuf_data_t));
+  TAILQ_INSERT_TAIL(&mq->mq_buffers, md, md_link);
+
+  // Never written to, md_data_size == md_data_len leaves no room for
+  // mbuf_append() to fill
+  md->md_data = (void *)buf;
+  md->md_data_size = len;
+  md->md_data_len = len;
+  md->md_data_off = 0;
+  md->md_release = release ?: mbuf_release_nop;
+  md->md_opaque = opaque;
+}
+
+
+/**
+ *
+ */
+void
+mbuf_append_file(mbuf_t *mq, int fd, int64_t offset, int64_t len,
+                 void (*release)(void *opaque), void *opaque)
+{
+  // Keep segments well below INT_MAX, mbuf_drop() and friends use int
+  const int64_t maxseg = 1024 * 1024 * 1024;
+
+  if(len == 0 && release != NULL)
+    release(opaque);
+
+  while(len > 0) {
+    const int64_t seg = MIN(len, maxseg);
+    mbuf_data_t *md = malloc(sizeof(mbuf_data_t));
+    TAILQ_INSERT_TAIL(&mq->mq_buffers, md, md_link);
+
+    md->md_data = NULL;
+    md->md_fd = fd;
+    md->md_data_off = offset;
+    md->md_data_len = offset + seg;
+    md->md_data_size = md->md_data_len;
+    // Segments are consumed in order so only the last one releases
+    md->md_release = len == seg && release ? release : mbuf_release_nop;
+    md->md_opaque = opaque;
+
+    mq->mq_size += seg;
+    offset += seg;
+    len -= seg;
+  }
 }
 
 /**
@@ -278,6 +351,49 @@ mbuf_drop(mbuf_t *mq, size_t len)
 }
 
 
+/**
+ * Same as mbuf_drop() but instead of being freed the buffers are moved to
+ * 'keep' so pointers into them stay valid. Data not dropped from the last
+ * buffer is copied to a new buffer which is left at the head of 'mq'
+ */
+size_t
+mbuf_drop_keep(mbuf_t *mq, size_t len, mbuf_t *keep)
+{
+  size_t r = 0;
+  int c;
+  mbuf_data_t *md;
+
+  while(len > 0) {
+    md = TAILQ_FIRST(&mq->mq_buffers);
+    if(md == NULL)
+      break;
+
+    c = MIN(md->md_data_len - md->md_data_off, len);
+    len -= c;
+    md->md_data_off += c;
+    mq->mq_size -= c;
+    r += c;
+
+    TAILQ_REMOVE(&mq->mq_buffers, md, md_link);
+
+    if(md->md_data_off < md->md_data_len) {
+      const size_t remain = md->md_data_len - md->md_data_off;
+      mbuf_data_t *n = malloc(sizeof(mbuf_data_t));
+      TAILQ_INSERT_HEAD(&mq->mq_buffers, n, md_link);
+      n->md_data_size = MAX(remain, mq->mq_alloc_size);
+      n->md_data = malloc(n->md_data_size);
+      n->md_data_len = remain;
+      n->md_data_off = 0;
+      n->md_release = NULL;
+      memcpy(n->md_data, md->md_data + md->md_data_off, remain);
+      md->md_data_len = md->md_data_off;
+    }
+    TAILQ_INSERT_TAIL(&keep->mq_buffers, md, md_link);
+  }
+  return r;
+}
+
+
 /**
  *
  */
@@ -512,6 +628,7 @@ mbuf_pullup(mbuf_t *mq, size_t bytes)
   md->md_data_size = bytes;
   md->md_data_len = bytes;
   md->md_data_off = 0;
+  md->md_release = NULL;
   mq->mq_size += bytes;
   return data;
 }
@@ -38,6 +38,9 @@ typedef struct mbuf_data {
   size_t md_data_size; /* Size of allocation hb_data */
   size_t md_data_len;  /* Number of valid bytes from hd_data */
   size_t md_data_off;  /* Offset in data, used for partial reads */
+  void (*md_release)(void *opaque); /* Set for external data */
+  void *md_opaque;
+  int md_fd;           /* File segment if md_data is NULL, see below */
 } mbuf_data_t;
 
 typedef struct mbuf {
@@ -68,6 +71,27 @@ void mbuf_append(mbuf_t *m, const void *buf, size_t len);
 
 void mbuf_append_prealloc(mbuf_t *m, void *buf, size_t len);
 
+/**
+ * Reference 'len' bytes at 'buf' without copying. 'release' is called
+ * with 'opaque' once the data has been consumed. If 'release' is NULL
+ * the data must stay valid forever (const data, etc)
+ */
+void mbuf_append_external(mbuf_t *m, const void *buf, size_t len,
+                          void (*release)(void *opaque), void *opaque);
+
+/**
+ * Reference 'len' bytes of file 'fd' starting at 'offset'. The data is
+ * sent with sendfile() when the mbuf is passed to asyncio_sendq(), that
+ * is also the only thing that can consume such buffers. 'release' is
+ * called with 'opaque' once all of it has been sent (or dropped), the fd
+ * must stay open until then.
+ *
+ * For file segments md_data is NULL and md_data_off / md_data_len are
+ * offsets in the file.
+ */
+void mbuf_append_file(mbuf_t *m, int fd, int64_t offset, int64_t len,
+                      void (*release)(void *opaque), void *opaque);
+
 size_t mbuf_read(mbuf_t *m, void *buf, size_t len);
 
 size_t mbuf_peek(mbuf_t *m, void *buf, size_t len);
@@ -78,6 +102,8 @@ size_t mbuf_drop(mbuf_t *m, size_t len);
 
 size_t mbuf_drop_tail(mbuf_t *mq, size_t len);
 
+size_t mbuf_drop_keep(mbuf_t *mq, size_t len, mbuf_t *keep);
+
 int mbuf_find(mbuf_t *m, uint8_t v);
 
 void mbuf_appendq(mbuf_t *m, mbuf_t *src);
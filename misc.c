@@ -708,6 +708,101 @@ static const char *months[12] = {
 };
 
 
+static const char digits2[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/**
+ * Format 'v' as decimal into 'dst' (which must have room for at least
+ * 20 chars). Returns number of characters written, no terminator is added
+ */
+int
+fmt_u64(char *dst, uint64_t v)
+{
+  char tmp[20];
+  char *p = tmp + sizeof(tmp);
+
+  while(v >= 100) {
+    const int i = (v % 100) * 2;
+    v /= 100;
+    *--p = digits2[i + 1];
+    *--p = digits2[i];
+  }
+  if(v >= 10) {
+    *--p = digits2[v * 2 + 1];
+    *--p = digits2[v * 2];
+  } else {
+    *--p = '0' + v;
+  }
+
+  const int len = tmp + sizeof(tmp) - p;
+  memcpy(dst, p, len);
+  return len;
+}
+
+
+/**
+ * Same as above but signed, 'dst' must have room for 21 chars
+ */
+int
+fmt_s64(char *dst, int64_t v)
+{
+  if(v < 0) {
+    *dst = '-';
+    return 1 + fmt_u64(dst + 1, -(uint64_t)v);
+  }
+  return fmt_u64(dst, v);
+}
+
+
+/**
+ *
+ */
+static void
+put2digits(char *dst, int v)
+{
+  memcpy(dst, digits2 + v * 2, 2);
+}
+
+
+/**
+ * Format 't' as an IMF-fixdate (RFC 7231), the date format used by HTTP,
+ * into 'dst' which must have room for 30 chars, including the terminator
+ */
+void
+fmt_IMF_fixdate(char *dst, time_t t)
+{
+  struct tm tm0, *tm;
+
+  tm = gmtime_r(&t, &tm0);
+
+  memcpy(dst, days[tm->tm_wday], 3);
+  dst[3] = ',';
+  dst[4] = ' ';
+  put2digits(dst + 5, tm->tm_mday);
+  dst[7] = ' ';
+  memcpy(dst + 8, months[tm->tm_mon], 3);
+  dst[11] = ' ';
+  put2digits(dst + 12, (tm->tm_year + 1900) / 100 % 100);
+  put2digits(dst + 14, (tm->tm_year + 1900) % 100);
+  dst[16] = ' ';
+  put2digits(dst + 17, tm->tm_hour);
+  dst[19] = ':';
+  put2digits(dst + 20, tm->tm_min);
+  dst[22] = ':';
+  put2digits(dst + 23, tm->tm_sec);
+  memcpy(dst + 25, " GMT", 5);
+}
+
+
 /**
  *
  */
@@ -110,6 +110,12 @@ void bin2hex(char *dst, size_t dstlen, const uint8_t *src, size_t srclen);
 char *bin2str(const void *src, size_t len);
 
 const char *time_to_RFC_1123(time_t t);
+
+void fmt_IMF_fixdate(char *dst, time_t t);
+
+int fmt_u64(char *dst, uint64_t v);
+
+int fmt_s64(char *dst, int64_t v);
 #if 0
 void strvec_addp(char ***str, const char *v);
 
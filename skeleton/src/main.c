@@ -15,6 +15,7 @@
 
 #ifdef WITH_HTTP_SERVER
 #include "libsvc/http.h"
+#include "libsvc/http_accesslog.h"
 #endif
 
 #ifdef WITH_CTRLSOCK
@@ -131,6 +132,9 @@ main(int argc, char **argv)
     if(reload) {
       reload = 0;
       cfg_load(NULL, NULL, 0);
+#ifdef WITH_HTTP_SERVER
+      http_accesslog_reopen();
+#endif
     }
     pause();
   }
@@ -17,6 +17,7 @@ libsvc_SRCS += \
 	cfg.c \
 	cmd.c \
 	talloc.c \
+	arena.c \
 	memstream.c \
 	sock.c \
 	ntv.c \
@@ -47,6 +48,7 @@ libsvc_INCS += \
 	cfg.h \
 	cmd.h \
 	talloc.h \
+	arena.h \
 	memstream.h \
 	sock.h \
 	intvec.h \
@@ -113,8 +115,8 @@ endif
 ##############################################################
 
 ifeq (${WITH_HTTP_SERVER},yes)
-libsvc_SRCS    += http.c http_parser.c websocket.c
-libsvc_INCS    += http.h http_parser.h websocket.h
+libsvc_SRCS    += http.c http_parser.c http_head.c http_router.c http_accesslog.c http_metrics.c http2.c http_cache.c http_pool.c http_limiter.c http_sse.c http_multipart.c http_proxy.c websocket.c
+libsvc_INCS    += http.h http_parser.h http_head.h http_router.h http_accesslog.h http_metrics.h http2.h http_cache.h http_pool.h http_limiter.h http_sse.h http_multipart.h http_proxy.h websocket.h
 WITH_ASYNCIO   := yes
 CFLAGS += -DWITH_HTTP_SERVER
 LDFLAGS += -lz
@@ -22,8 +22,10 @@
 ******************************************************************************/
 
 #include <stdlib.h>
+#include <string.h>
 #include <pthread.h>
 #include <sys/queue.h>
+#include <sys/param.h>
 #include <assert.h>
 #include "task.h"
 #include "atomic.h"
@@ -34,18 +36,42 @@
 
 
 LIST_HEAD(task_thread_list, task_thread);
+LIST_HEAD(task_pool_list, task_pool);
 TAILQ_HEAD(task_queue, task);
 TAILQ_HEAD(task_group_queue, task_group);
 
 typedef struct task_thread {
   LIST_ENTRY(task_thread) link;
   pthread_t tid;
+  struct task_pool *pool;
 } task_thread_t;
 
 struct task_group {
   atomic_t tg_refcount;
   struct task_queue tg_tasks;
   TAILQ_ENTRY(task_group) tg_link;
+  int tg_running;    // First task is executing
+  int tg_suspended;  // See task_group_suspend()
+};
+
+
+/**
+ * A set of threads with its own queue. Tasks in a group may be spread
+ * over several pools, the group is queued on the pool of its first
+ * task, so it still executes in order.
+ */
+struct task_pool {
+  LIST_ENTRY(task_pool) tp_link;
+  const char *tp_name;
+  struct task_queue tp_tasks;
+  struct task_group_queue tp_groups;
+  struct task_thread_list tp_threads;
+  pthread_cond_t tp_cond;
+  unsigned int tp_max_threads;
+  unsigned int tp_num_threads;
+  unsigned int tp_num_threads_avail;
+  unsigned int tp_queued;  // Tasks waiting for a thread
+  uint64_t tp_executed;
 };
 
 
@@ -54,17 +80,32 @@ typedef struct task {
   task_fn_t *t_fn;
   void *t_opaque;
   task_group_t *t_group;
+  task_pool_t *t_pool;
 } task_t;
 
 
-static struct task_queue tasks = TAILQ_HEAD_INITIALIZER(tasks);
-static struct task_group_queue task_groups =TAILQ_HEAD_INITIALIZER(task_groups);
-static unsigned int num_task_threads;
-static unsigned int num_task_threads_avail;
+static task_pool_t task_pool_default = {
+  .tp_name = "default",
+  .tp_tasks = TAILQ_HEAD_INITIALIZER(task_pool_default.tp_tasks),
+  .tp_groups = TAILQ_HEAD_INITIALIZER(task_pool_default.tp_groups),
+  .tp_cond = PTHREAD_COND_INITIALIZER,
+  .tp_max_threads = MAX_TASK_THREADS,
+};
+
+static struct task_pool_list task_pools = LIST_HEAD_INITIALIZER(task_pools);
 static pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
 static int task_sys_running = 1;
-static struct task_thread_list task_threads;
+static __thread task_group_t *task_current_group;
+
+
+/**
+ *
+ */
+static void __attribute__((constructor))
+task_pools_init(void)
+{
+  LIST_INSERT_HEAD(&task_pools, &task_pool_default, tp_link);
+}
 
 /**
  *
@@ -79,6 +120,38 @@ task_group_release(task_group_t *tg)
 }
 
 
+static void task_schedule(task_pool_t *tp);
+
+/**
+ * First task in group is done, move on to the next one
+ *
+ * 'current' is the pool of the thread calling us, which will pick up
+ * more work itself so no need to wake anyone there
+ */
+static void
+task_group_advance(task_group_t *tg, task_pool_t *current)
+{
+  task_t *t = TAILQ_FIRST(&tg->tg_tasks);
+
+  // Note that we remove _after_ execution because we don't want
+  // any newly inserted task in this group to cause the group
+  // to activate (ie, get inserted in tp_groups)
+  TAILQ_REMOVE(&tg->tg_tasks, t, t_link);
+  free(t);
+
+  if((t = TAILQ_FIRST(&tg->tg_tasks)) != NULL) {
+    // Still more tasks to work on in this group
+    // Reinsert group at tail to maintain fairness between groups
+    TAILQ_INSERT_TAIL(&t->t_pool->tp_groups, tg, tg_link);
+    if(t->t_pool != current && task_sys_running)
+      task_schedule(t->t_pool);
+  }
+
+  // Decrease refcount owned by task
+  task_group_release(tg);
+}
+
+
 /**
  *
  */
@@ -86,64 +159,63 @@ static void *
 task_thread(void *aux)
 {
   task_thread_t *tt = aux;
+  task_pool_t *tp = tt->pool;
   task_t *t;
   task_group_t *tg;
 
   pthread_mutex_lock(&task_mutex);
   while(task_sys_running) {
-    t = TAILQ_FIRST(&tasks);
-    tg = TAILQ_FIRST(&task_groups);
+    t = TAILQ_FIRST(&tp->tp_tasks);
+    tg = TAILQ_FIRST(&tp->tp_groups);
 
     if(t == NULL && tg == NULL) {
-      if(num_task_threads_avail >= MAX_IDLE_TASK_THREADS)
+      if(tp->tp_num_threads_avail >= MAX_IDLE_TASK_THREADS)
         break;
 
-      num_task_threads_avail++;
-      pthread_cond_wait(&task_cond, &task_mutex);
-      num_task_threads_avail--;
+      tp->tp_num_threads_avail++;
+      pthread_cond_wait(&tp->tp_cond, &task_mutex);
+      tp->tp_num_threads_avail--;
       continue;
     }
 
     if(t != NULL) {
-      TAILQ_REMOVE(&tasks, t, t_link);
+      TAILQ_REMOVE(&tp->tp_tasks, t, t_link);
+      tp->tp_queued--;
+      tp->tp_executed++;
       pthread_mutex_unlock(&task_mutex);
       t->t_fn(t->t_opaque);
       free(t);
       talloc_cleanup();
       pthread_mutex_lock(&task_mutex);
       // Released lock, must recheck for task groups
-      tg = TAILQ_FIRST(&task_groups);
+      tg = TAILQ_FIRST(&tp->tp_groups);
     }
 
     if(tg != NULL) {
       // Remove task group while processing as we don't want anyone
       // else to dispatch from this group
-      TAILQ_REMOVE(&task_groups, tg, tg_link);
+      TAILQ_REMOVE(&tp->tp_groups, tg, tg_link);
 
       t = TAILQ_FIRST(&tg->tg_tasks);
+      tp->tp_queued--;
+      tp->tp_executed++;
+      tg->tg_running = 1;
       pthread_mutex_unlock(&task_mutex);
+      task_current_group = tg;
       t->t_fn(t->t_opaque);
+      task_current_group = NULL;
       talloc_cleanup();
       pthread_mutex_lock(&task_mutex);
+      tg->tg_running = 0;
 
-      // Note that we remove _after_ execution because we don't want
-      // any newly inserted task in this group to cause the group
-      // to activate (ie, get inserted in task_groups)
-      TAILQ_REMOVE(&tg->tg_tasks, t, t_link);
-      free(t);
-
-      if(TAILQ_FIRST(&tg->tg_tasks) != NULL) {
-        // Still more tasks to work on in this group
-        // Reinsert group at tail to maintain fairness between groups
-        TAILQ_INSERT_TAIL(&task_groups, tg, tg_link);
-      }
-
-      // Decrease refcount owned by task
-      task_group_release(tg);
+      // A suspended group is left with the finished task first so
+      // nothing else activates it, task_group_resume() advances it
+      if(!tg->tg_suspended)
+        task_group_advance(tg, tp);
     }
   }
 
-  num_task_threads--;
+  tp->tp_num_threads--;
 
   if(task_sys_running) {
     pthread_detach(tt->tid);
@@ -159,13 +231,14 @@ task_thread(void *aux)
  *
  */
 static void
-task_launch_thread(void)
+task_launch_thread(task_pool_t *tp)
 {
   assert(task_sys_running != 0);
-  num_task_threads++;
+  tp->tp_num_threads++;
 
   task_thread_t *tt = calloc(1, sizeof(task_thread_t));
-  LIST_INSERT_HEAD(&task_threads, tt, link);
+  tt->pool = tp;
+  LIST_INSERT_HEAD(&tp->tp_threads, tt, link);
   pthread_create(&tt->tid, NULL, task_thread, tt);
 }
 
@@ -174,34 +247,96 @@ task_launch_thread(void)
  *
  */
 static void
-task_schedule()
+task_schedule(task_pool_t *tp)
 {
-  if(num_task_threads_avail > 0) {
-    pthread_cond_signal(&task_cond);
+  if(tp->tp_num_threads_avail > 0) {
+    pthread_cond_signal(&tp->tp_cond);
   } else {
-    if(num_task_threads < MAX_TASK_THREADS) {
-      task_launch_thread();
+    if(tp->tp_num_threads < tp->tp_max_threads) {
+      task_launch_thread(tp);
     }
   }
 }
 
 
+/**
+ *
+ */
+task_pool_t *
+task_pool_create(const char *name, int max_threads)
+{
+  task_pool_t *tp = calloc(1, sizeof(task_pool_t));
+  tp->tp_name = strdup(name);
+  tp->tp_max_threads = MAX(max_threads, 1);
+  TAILQ_INIT(&tp->tp_tasks);
+  TAILQ_INIT(&tp->tp_groups);
+  pthread_cond_init(&tp->tp_cond, NULL);
+
+  pthread_mutex_lock(&task_mutex);
+  LIST_INSERT_HEAD(&task_pools, tp, tp_link);
+  pthread_mutex_unlock(&task_mutex);
+  return tp;
+}
+
+
+/**
+ *
+ */
+int
+task_pool_queued(const task_pool_t *tp)
+{
+  tp = tp ?: &task_pool_default;
+  return __atomic_load_n(&tp->tp_queued, __ATOMIC_RELAXED);
+}
+
+
 /**
  *
  */
 void
-task_run(task_fn_t *fn, void *opaque)
+task_pool_get_stats(const task_pool_t *tp, task_pool_stats_t *tps)
+{
+  tp = tp ?: &task_pool_default;
+  pthread_mutex_lock(&task_mutex);
+  tps->tps_name = tp->tp_name;
+  tps->tps_max_threads = tp->tp_max_threads;
+  tps->tps_threads = tp->tp_num_threads;
+  tps->tps_busy = tp->tp_num_threads - tp->tp_num_threads_avail;
+  tps->tps_queued = tp->tp_queued;
+  tps->tps_executed = tp->tp_executed;
+  pthread_mutex_unlock(&task_mutex);
+}
+
+
+/**
+ *
+ */
+void
+task_run_in_pool(task_fn_t *fn, void *opaque, task_pool_t *tp)
 {
   task_t *t = calloc(1, sizeof(task_t));
   t->t_fn = fn;
   t->t_opaque = opaque;
+  t->t_pool = tp ?: &task_pool_default;
   pthread_mutex_lock(&task_mutex);
-  TAILQ_INSERT_TAIL(&tasks, t, t_link);
-  task_schedule();
+  TAILQ_INSERT_TAIL(&t->t_pool->tp_tasks, t, t_link);
+  t->t_pool->tp_queued++;
+  if(task_sys_running)
+    task_schedule(t->t_pool);
   pthread_mutex_unlock(&task_mutex);
 }
 
 
+/**
+ *
+ */
+void
+task_run(task_fn_t *fn, void *opaque)
+{
+  task_run_in_pool(fn, opaque, NULL);
+}
+
+
 
 /**
  *
@@ -230,29 +365,77 @@ task_group_destroy(task_group_t *tg)
  *
  */
 void
-task_run_in_group(task_fn_t *fn, void *opaque, task_group_t *tg)
+task_run_in_group_pool(task_fn_t *fn, void *opaque, task_group_t *tg,
+                       task_pool_t *tp)
 {
   task_t *t = calloc(1, sizeof(task_t));
   t->t_fn = fn;
   t->t_opaque = opaque;
+  t->t_pool = tp ?: &task_pool_default;
   pthread_mutex_lock(&task_mutex);
+  t->t_pool->tp_queued++;
 
   if(task_sys_running) {
     t->t_group = tg;
     atomic_inc(&tg->tg_refcount);
 
-    if(TAILQ_FIRST(&tg->tg_tasks) == NULL)
-      TAILQ_INSERT_TAIL(&task_groups, tg, tg_link);
+    if(TAILQ_FIRST(&tg->tg_tasks) == NULL) {
+      TAILQ_INSERT_TAIL(&t->t_pool->tp_groups, tg, tg_link);
+      task_schedule(t->t_pool);
+    }
 
     TAILQ_INSERT_TAIL(&tg->tg_tasks, t, t_link);
-    task_schedule();
   } else {
-    TAILQ_INSERT_TAIL(&tasks, t, t_link);
+    TAILQ_INSERT_TAIL(&t->t_pool->tp_tasks, t, t_link);
   }
   pthread_mutex_unlock(&task_mutex);
 }
 
 
+/**
+ *
+ */
+void
+task_run_in_group(task_fn_t *fn, void *opaque, task_group_t *tg)
+{
+  task_run_in_group_pool(fn, opaque, tg, NULL);
+}
+
+
+/**
+ *
+ */
+task_group_t *
+task_group_suspend(void)
+{
+  task_group_t *tg = task_current_group;
+  if(tg == NULL)
+    return NULL;
+
+  atomic_inc(&tg->tg_refcount);
+  pthread_mutex_lock(&task_mutex);
+  tg->tg_suspended++;
+  pthread_mutex_unlock(&task_mutex);
+  return tg;
+}
+
+
+/**
+ *
+ */
+void
+task_group_resume(task_group_t *tg)
+{
+  pthread_mutex_lock(&task_mutex);
+  assert(tg->tg_suspended > 0);
+  tg->tg_suspended--;
+  if(!tg->tg_suspended && !tg->tg_running)
+    task_group_advance(tg, NULL);
+  pthread_mutex_unlock(&task_mutex);
+  task_group_release(tg);
+}
+
+
 /**
  *
  */
@@ -260,17 +443,21 @@ void
 task_stop(void)
 {
   task_thread_t *tt;
+  task_pool_t *tp;
 
   pthread_mutex_lock(&task_mutex);
   task_sys_running = 0;
-  pthread_cond_broadcast(&task_cond);
 
-  while((tt = LIST_FIRST(&task_threads)) != NULL) {
-    LIST_REMOVE(tt, link);
-    pthread_mutex_unlock(&task_mutex);
-    pthread_join(tt->tid, NULL);
-    pthread_mutex_lock(&task_mutex);
-    free(tt);
+  LIST_FOREACH(tp, &task_pools, tp_link) {
+    pthread_cond_broadcast(&tp->tp_cond);
+
+    while((tt = LIST_FIRST(&tp->tp_threads)) != NULL) {
+      LIST_REMOVE(tt, link);
+      pthread_mutex_unlock(&task_mutex);
+      pthread_join(tt->tid, NULL);
+      pthread_mutex_lock(&task_mutex);
+      free(tt);
+    }
   }
   pthread_mutex_unlock(&task_mutex);
 }
@@ -23,9 +23,12 @@
 
 #pragma once
 
+#include <stdint.h>
 
 typedef struct task_group task_group_t;
 
+typedef struct task_pool task_pool_t;
+
 typedef void (task_fn_t)(void *opaque);
 
 void task_run(task_fn_t *fn, void *opaque);
@@ -36,4 +39,43 @@ void task_group_destroy(task_group_t *tg);
 
 void task_run_in_group(task_fn_t *fn, void *opaque, task_group_t *tg);
 
+/**
+ * Called from a task running in a group. The next task in the group is
+ * not started until task_group_resume(), which may be called from any
+ * thread, also before the current task has returned. Returns NULL if
+ * the calling task is not in a group.
+ */
+task_group_t *task_group_suspend(void);
+
+void task_group_resume(task_group_t *tg);
+
+/**
+ * Separate pools of threads, so work that may block for a long time
+ * can't starve everything else. The functions below take NULL for
+ * the default pool used by task_run() and task_run_in_group().
+ *
+ * Tasks in a group still execute in order even if they are queued
+ * on different pools.
+ */
+task_pool_t *task_pool_create(const char *name, int max_threads);
+
+void task_run_in_pool(task_fn_t *fn, void *opaque, task_pool_t *tp);
+
+void task_run_in_group_pool(task_fn_t *fn, void *opaque, task_group_t *tg,
+                            task_pool_t *tp);
+
+// Number of tasks waiting for a thread
+int task_pool_queued(const task_pool_t *tp);
+
+typedef struct task_pool_stats {
+  const char *tps_name;
+  int tps_max_threads;
+  int tps_threads;
+  int tps_busy;
+  int tps_queued;
+  uint64_t tps_executed;
+} task_pool_stats_t;
+
+void task_pool_get_stats(const task_pool_t *tp, task_pool_stats_t *tps);
+
 void task_stop(void);
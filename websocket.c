@@ -21,6 +21,16 @@
 * SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 ******************************************************************************/
 #include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include "mbuf.h"
 #include "websocket.h"
@@ -75,6 +85,87 @@ websocket_append_hdr(mbuf_t *q, int opcode, size_t len)
 }
 
 
+/**
+ * The mask is applied 16 or 32 bytes at a time with whatever vector unit
+ * we're built for, the rest 8 bytes at a time. The loops are multiples
+ * of 4 bytes so the mask never has to be realigned inside a call
+ */
+uint32_t
+websocket_unmask(uint8_t *dst, const uint8_t *src, size_t len,
+                 uint32_t mask)
+{
+  size_t i = 0;
+
+#if defined(__AVX2__)
+  const __m256i m256 = _mm256_set1_epi32(mask);
+  for(; i + 32 <= len; i += 32) {
+    const __m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+    _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(v, m256));
+  }
+#endif
+
+#if defined(__SSE2__)
+  const __m128i m128 = _mm_set1_epi32(mask);
+  for(; i + 16 <= len; i += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, m128));
+  }
+#elif defined(__ARM_NEON)
+  const uint8x16_t m128 = vreinterpretq_u8_u32(vdupq_n_u32(mask));
+  for(; i + 16 <= len; i += 16)
+    vst1q_u8(dst + i, veorq_u8(vld1q_u8(src + i), m128));
+#endif
+
+  const uint64_t m64 = (uint64_t)mask << 32 | mask;
+  for(; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, src + i, sizeof(v));
+    v ^= m64;
+    memcpy(dst + i, &v, sizeof(v));
+  }
+
+  const uint8_t *m = (const uint8_t *)&mask;
+  for(; i < len; i++)
+    dst[i] = src[i] ^ m[i & 3];
+
+  // Realign so the next byte starts with the right mask byte
+  const int shift = (len & 3) * 8;
+  if(shift == 0)
+    return mask;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return mask >> shift | mask << (32 - shift);
+#else
+  return mask << shift | mask >> (32 - shift);
+#endif
+}
+
+
+/**
+ * mbuf_read() with the mask applied as the payload is copied out
+ */
+static void
+websocket_read_payload(mbuf_t *q, uint8_t *dst, size_t len,
+                       const uint8_t *m)
+{
+  if(m == NULL) {
+    mbuf_read(q, dst, len);
+    return;
+  }
+
+  uint32_t mask;
+  memcpy(&mask, m, sizeof(mask));
+
+  while(len > 0) {
+    mbuf_data_t *md = TAILQ_FIRST(&q->mq_buffers);
+    const size_t c = MIN(md->md_data_len - md->md_data_off, len);
+    mask = websocket_unmask(dst, md->md_data + md->md_data_off, c, mask);
+    dst += c;
+    len -= c;
+    mbuf_drop(q, c);
+  }
+}
+
+
 /**
  *
  */
@@ -129,8 +220,7 @@ websocket_parse(mbuf_t *q,
       if(p == NULL)
         return 1;
 
-      mbuf_read(q, p, len);
-      if(m != NULL) for(int i = 0; i < len; i++) p[i] ^= m[i&3];
+      websocket_read_payload(q, p, len, m);
 
       int err = cb(opaque, opcode, &p, len, 0);
       free(p);
@@ -150,9 +240,7 @@ websocket_parse(mbuf_t *q,
 
     uint8_t *d = ws->packet + ws->packet_size;
     d[len] = 0;
-    mbuf_read(q, d, len);
-
-    if(m != NULL) for(int i = 0; i < len; i++) d[i] ^= m[i&3];
+    websocket_read_payload(q, d, len, m);
 
     if(opcode != 0) {
       ws->opcode = opcode;
@@ -44,6 +44,15 @@ void websocket_append_hdr(struct mbuf *q, int opcode, size_t len);
 
 void websocket_free(websocket_state_t *state);
 
+/**
+ * XOR 'len' bytes of 'src' with the 4 byte frame 'mask' (as loaded from
+ * the frame with memcpy) and write them to 'dst', which may be the same
+ * as 'src'. Returns the mask to use for the bytes that follow so a
+ * payload can be processed in pieces.
+ */
+uint32_t websocket_unmask(uint8_t *dst, const uint8_t *src, size_t len,
+                          uint32_t mask);
+
 /**
  * Return-values
  *  0 - Not enough data in input buffer, call again when more is available
@@ -12,6 +12,7 @@
 
 #include "dial.h"
 #include "websocket_client.h"
+#include "websocket.h"
 #include "atomic.h"
 #include "sock.h"
 #include "misc.h"
@@ -90,14 +91,13 @@ static void
 wsc_write_buf(ws_client_t *wsc, int opcode, const void *data, size_t len)
 {
   uint8_t *buf = malloc(len);
-  memcpy(buf, data, len);
 
   pthread_mutex_lock(&wsc->wsc_sendq_mutex);
   if(!wsc->wsc_zombie) {
     wsc_append_header(wsc, opcode, len);
 
-    for(int i = 0; i < len; i++)
-      buf[i] ^= wsc->wsc_mask.u8[i & 3];
+    // Masked as it's copied
+    websocket_unmask(buf, data, len, wsc->wsc_mask.u32);
 
     htsbuf_append_prealloc(&wsc->wsc_sendq, buf, len);
   } else {
@@ -154,9 +154,9 @@ wsc_read(ws_client_t *wsc, struct htsbuf_queue *hq)
     d[len] = 0;
 
     if(m != NULL) {
-      int i;
-      for(i = 0; i < len; i++)
-        d[i] ^= m[i&3];
+      uint32_t mask;
+      memcpy(&mask, m, sizeof(mask));
+      websocket_unmask(d, d, len, mask);
     }
 
     if(opcode == 9) {